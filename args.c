@@ -2,16 +2,161 @@
  * @author Vadim Goncearenco (xgonce00)
  */
 
-#include "base.h"
+#include "libdns.h"
 #include "args.h"
 
 #define MIN_PORT 0
 #define MAX_PORT 65535
 
 typedef struct {
-    bool r, x, _6, s, p;
+    bool r, x, _6, q, s, p, f, mem, snap, tcp, tls, ca, timeout, tries, deadline, uring, adaptive, axfr, ixfr, o, pcap, records, threads, dnssec, anchor;
 } flags_t;
 
+// Long options are handled as single letter flags that can not be typed
+typedef struct {
+    const char* name;
+    char flag;
+} long_opt_t;
+
+static const long_opt_t long_opts[] = {
+    { "mem-limit", 'M' },
+    { "snapshot", 'S' },
+    { "tcp", 'T' },
+    { "tls", 'L' },
+    { "tls-ca", 'C' },
+    { "timeout", 'W' },
+    { "tries", 'N' },
+    { "deadline", 'D' },
+    { "io-uring", 'U' },
+    { "adaptive", 'A' },
+    { "axfr", 'X' },
+    { "ixfr", 'I' },
+    { "pcap", 'P' },
+    { "records", 'R' },
+    { "threads", 'J' },
+    { "dnssec", 'V' },
+    { "trust-anchor", 'K' },
+};
+
+static char parse_long_opt(const char* name)
+{
+    for (size_t i = 0; i < sizeof(long_opts) / sizeof(long_opts[0]); ++i) {
+        if (strcmp(name, long_opts[i].name) == 0) {
+            return long_opts[i].flag;
+        }
+    }
+    fprintf(stderr, "Unknown option: --%s\n", name);
+    return '\0';
+}
+
+// Copy the argument into a fixed size buffer of args_t
+static int copy_arg(char* dst, size_t dst_size, const char* src, const char* what)
+{
+    size_t len = strlen(src);
+    if (len >= dst_size) {
+        fprintf(stderr, "%s is too long: %s\n", what, src);
+        return 1;
+    }
+    memcpy(dst, src, len + 1);
+    return 0;
+}
+
+// Split the comma separated list of servers given to -s
+static int parse_servers(const char* list, args_t* outa)
+{
+    const char* start = list;
+    while (true) {
+        const char* end = strchr(start, ',');
+        size_t len = end != NULL ? (size_t)(end - start) : strlen(start);
+        if (len == 0) {
+            fprintf(stderr, "Empty server name in: %s\n", list);
+            return 1;
+        }
+        if (outa->n_servers == MAX_SERVERS) {
+            fprintf(stderr, "At most %d servers can be given.\n", MAX_SERVERS);
+            return 1;
+        }
+        if (len >= MAX_DOMAIN_STR_LEN) {
+            fprintf(stderr, "Server name is too long: %s\n", list);
+            return 1;
+        }
+        memcpy(outa->server_names[outa->n_servers], start, len);
+        outa->server_names[outa->n_servers][len] = '\0';
+        ++outa->n_servers;
+
+        if (end == NULL) {
+            return 0;
+        }
+        start = end + 1;
+    }
+}
+
+// Split the comma separated list of types given to -q
+static int parse_types(const char* list, args_t* outa)
+{
+    const char* start = list;
+    while (true) {
+        const char* end = strchr(start, ',');
+        size_t len = end != NULL ? (size_t)(end - start) : strlen(start);
+        char name[16];
+        if (len == 0 || len >= sizeof(name)) {
+            fprintf(stderr, "Invalid query type in: %s\n", list);
+            return 1;
+        }
+        memcpy(name, start, len);
+        name[len] = '\0';
+
+        uint16_t type = dns_record_type_from_str(name);
+        if (type == 0) {
+            fprintf(stderr, "Unknown query type: %s\n", name);
+            return 1;
+        }
+        for (int i = 0; i < outa->n_query_types; ++i) {
+            if (outa->query_types[i] == type) {
+                fprintf(stderr, "Duplicated query type: %s\n", name);
+                return 1;
+            }
+        }
+        if (outa->n_query_types == MAX_QUERY_TYPES) {
+            fprintf(stderr, "At most %d query types can be given.\n", MAX_QUERY_TYPES);
+            return 1;
+        }
+        outa->query_types[outa->n_query_types++] = type;
+
+        if (end == NULL) {
+            return 0;
+        }
+        start = end + 1;
+    }
+}
+
+// Serial number of the zone the client has, any 32 bit value
+static int parse_serial(const char* a, uint32_t* out)
+{
+    char* end = NULL;
+    errno = 0;
+    unsigned long value = strtoul(a, &end, 10);
+    if (end == a || *end != '\0' || a[0] == '-' || errno == ERANGE || value > UINT32_MAX) {
+        fprintf(stderr, "Invalid serial: %s\n", a);
+        return 1;
+    }
+    *out = (uint32_t)value;
+    return 0;
+}
+
+// Positive number of milliseconds, tries, megabytes or threads
+static int parse_positive(const char* a, const char* what, int* out)
+{
+    char* end = NULL;
+    long value = strtol(a, &end, 10);
+    if (end == a || *end != '\0' || value <= 0 || value > INT_MAX) {
+        fprintf(stderr, "Invalid %s: %s\n", what, a);
+        return 1;
+    }
+    *out = (int)value;
+    return 0;
+}
+
 int parse_args(int argc, char** argv, args_t* outa) 
 {
     flags_t flags;
@@ -27,6 +172,9 @@ int parse_args(int argc, char** argv, args_t* outa)
         
         if (c == '-') {
             flag = a[1];
+            if (flag == '-') { // --long-option
+                flag = parse_long_opt(a + 2);
+            }
 
             switch (flag)
             {
@@ -54,6 +202,13 @@ int parse_args(int argc, char** argv, args_t* outa)
                 outa->query_type = T_AAAA;
                 flags._6 = true;
                 break;
+            case 'q': // -q
+                if (flags.q) {
+                    fprintf(stderr, "Duplicated flag: -%c\n", flag);
+                    return 1; // Duplicated flag
+                }
+                flags.q = true;
+                break;
             case 's': // -s
                 if (flags.s) {
                     fprintf(stderr, "Duplicated flag: -%c\n", flag);
@@ -71,6 +226,148 @@ int parse_args(int argc, char** argv, args_t* outa)
                     return 1;
                 }
                 break;
+            case 'f': // -f
+                if (flags.f) {
+                    fprintf(stderr, "Duplicated flag: -%c\n", flag);
+                    return 1; // Duplicated flag
+                }
+                flags.f = true;
+                break;
+            case 'M': // --mem-limit
+                if (flags.mem) {
+                    fprintf(stderr, "Duplicated flag: --mem-limit\n");
+                    return 1; // Duplicated flag
+                }
+                flags.mem = true;
+                break;
+            case 'S': // --snapshot
+                if (flags.snap) {
+                    fprintf(stderr, "Duplicated flag: --snapshot\n");
+                    return 1; // Duplicated flag
+                }
+                flags.snap = true;
+                break;
+            case 'T': // --tcp
+                if (flags.tcp) {
+                    fprintf(stderr, "Duplicated flag: --tcp\n");
+                    return 1; // Duplicated flag
+                }
+                outa->transport = TRANSPORT_TCP;
+                flags.tcp = true;
+                break;
+            case 'L': // --tls
+                if (flags.tls) {
+                    fprintf(stderr, "Duplicated flag: --tls\n");
+                    return 1; // Duplicated flag
+                }
+                outa->transport = TRANSPORT_TLS;
+                flags.tls = true;
+                break;
+            case 'C': // --tls-ca
+                if (flags.ca) {
+                    fprintf(stderr, "Duplicated flag: --tls-ca\n");
+                    return 1; // Duplicated flag
+                }
+                flags.ca = true;
+                break;
+            case 'W': // --timeout
+                if (flags.timeout) {
+                    fprintf(stderr, "Duplicated flag: --timeout\n");
+                    return 1; // Duplicated flag
+                }
+                flags.timeout = true;
+                break;
+            case 'N': // --tries
+                if (flags.tries) {
+                    fprintf(stderr, "Duplicated flag: --tries\n");
+                    return 1; // Duplicated flag
+                }
+                flags.tries = true;
+                break;
+            case 'D': // --deadline
+                if (flags.deadline) {
+                    fprintf(stderr, "Duplicated flag: --deadline\n");
+                    return 1; // Duplicated flag
+                }
+                flags.deadline = true;
+                break;
+            case 'U': // --io-uring
+                if (flags.uring) {
+                    fprintf(stderr, "Duplicated flag: --io-uring\n");
+                    return 1; // Duplicated flag
+                }
+                outa->io_uring = true;
+                flags.uring = true;
+                break;
+            case 'A': // --adaptive
+                if (flags.adaptive) {
+                    fprintf(stderr, "Duplicated flag: --adaptive\n");
+                    return 1; // Duplicated flag
+                }
+                outa->adaptive = true;
+                flags.adaptive = true;
+                break;
+            case 'X': // --axfr
+                if (flags.axfr) {
+                    fprintf(stderr, "Duplicated flag: --axfr\n");
+                    return 1; // Duplicated flag
+                }
+                outa->xfr = true;
+                flags.axfr = true;
+                break;
+            case 'I': // --ixfr
+                if (flags.ixfr) {
+                    fprintf(stderr, "Duplicated flag: --ixfr\n");
+                    return 1; // Duplicated flag
+                }
+                outa->xfr = true;
+                outa->ixfr = true;
+                flags.ixfr = true;
+                break;
+            case 'P': // --pcap
+                if (flags.pcap) {
+                    fprintf(stderr, "Duplicated flag: --pcap\n");
+                    return 1; // Duplicated flag
+                }
+                flags.pcap = true;
+                break;
+            case 'R': // --records
+                if (flags.records) {
+                    fprintf(stderr, "Duplicated flag: --records\n");
+                    return 1; // Duplicated flag
+                }
+                outa->pcap_records = true;
+                flags.records = true;
+                break;
+            case 'J': // --threads
+                if (flags.threads) {
+                    fprintf(stderr, "Duplicated flag: --threads\n");
+                    return 1; // Duplicated flag
+                }
+                flags.threads = true;
+                break;
+            case 'V': // --dnssec
+                if (flags.dnssec) {
+                    fprintf(stderr, "Duplicated flag: --dnssec\n");
+                    return 1; // Duplicated flag
+                }
+                outa->dnssec = true;
+                flags.dnssec = true;
+                break;
+            case 'K': // --trust-anchor
+                if (flags.anchor) {
+                    fprintf(stderr, "Duplicated flag: --trust-anchor\n");
+                    return 1; // Duplicated flag
+                }
+                flags.anchor = true;
+                break;
+            case 'o': // -o
+                if (flags.o) {
+                    fprintf(stderr, "Duplicated flag: -%c\n", flag);
+                    return 1; // Duplicated flag
+                }
+                flags.o = true;
+                break;
             case 'h': // -h
                 return -1;
                 break;
@@ -80,10 +377,14 @@ int parse_args(int argc, char** argv, args_t* outa)
         } else {
             if (flag == 's') { // If last flag was -s
                 if (!server_set) {
-                    memcpy(outa->server_name, a, strlen(a));
+                    if (parse_servers(a, outa) != 0) {
+                        return 1;
+                    }
                     server_set = true;
                 } else {
-                    memcpy(outa->address_str, a, strlen(a));
+                    if (copy_arg(outa->address_str, MAX_DOMAIN_STR_LEN, a, "Domain name") != 0) {
+                        return 1;
+                    }
                     address_set = true;
                 }
             } else if (flag == 'p') { // If last flag was -p
@@ -96,20 +397,169 @@ int parse_args(int argc, char** argv, args_t* outa)
                     fprintf(stderr, "Port must be in range %d-%d.\n", MIN_PORT, MAX_PORT);
                     return 1;
                 }
-                memcpy(outa->port_str, a, strlen(a));
+                if (copy_arg(outa->port_str, MAX_PORT_STR_LEN, a, "Port") != 0) {
+                    return 1;
+                }
+                outa->port_set = true;
+            } else if (flag == 'q') { // If last flag was -q
+                if (parse_types(a, outa) != 0) {
+                    return 1;
+                }
+                flag = '\0';
+            } else if (flag == 'f') { // If last flag was -f
+                outa->input_path = a;
+                flag = '\0';
+            } else if (flag == 'M') { // If last flag was --mem-limit
+                int mb = 0;
+                if (parse_positive(a, "memory limit", &mb) != 0) {
+                    return 1;
+                }
+                outa->mem_limit_mb = mb;
+                flag = '\0';
+            } else if (flag == 'S') { // If last flag was --snapshot
+                outa->snapshot_path = a;
+                flag = '\0';
+            } else if (flag == 'C') { // If last flag was --tls-ca
+                outa->tls_ca_path = a;
+                flag = '\0';
+            } else if (flag == 'W') { // If last flag was --timeout
+                if (parse_positive(a, "timeout", &outa->timeout_ms) != 0) {
+                    return 1;
+                }
+                flag = '\0';
+            } else if (flag == 'N') { // If last flag was --tries
+                if (parse_positive(a, "number of tries", &outa->tries) != 0) {
+                    return 1;
+                }
+                flag = '\0';
+            } else if (flag == 'D') { // If last flag was --deadline
+                if (parse_positive(a, "deadline", &outa->deadline_ms) != 0) {
+                    return 1;
+                }
+                flag = '\0';
+            } else if (flag == 'I') { // If last flag was --ixfr
+                if (parse_serial(a, &outa->ixfr_serial) != 0) {
+                    return 1;
+                }
+                flag = '\0';
+            } else if (flag == 'P') { // If last flag was --pcap
+                outa->pcap_path = a;
+                flag = '\0';
+            } else if (flag == 'J') { // If last flag was --threads
+                if (parse_positive(a, "number of threads", &outa->threads) != 0) {
+                    return 1;
+                }
+                flag = '\0';
+            } else if (flag == 'K') { // If last flag was --trust-anchor
+                outa->trust_anchor_path = a;
+                flag = '\0';
+            } else if (flag == 'o') { // If last flag was -o
+                outa->output_path = a;
+                flag = '\0';
             }
         }
     }
 
-    if (!server_set || !address_set) { // mandatory options not set
+    // Offline analysis of a capture, nothing is sent
+    if (flags.pcap) {
+        if (server_set || address_set || outa->input_path != NULL || outa->xfr || flags.dnssec || flags.anchor) {
+            fprintf(stderr, "Flag '--pcap' can not be combined with a server, domain name, '-f', a zone transfer or '--dnssec'.\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    if (flags.records || flags.threads) {
+        fprintf(stderr, "Flags '--records' and '--threads' require '--pcap'.\n");
+        return 1;
+    }
+
+    if (!server_set || (!address_set && outa->input_path == NULL)) { // mandatory options not set
         fprintf(stderr, "DNS server and domain name must always be specified.\n");
         return 1;
     }
 
+    if (flags.tcp && flags.tls) {
+        fprintf(stderr, "Invalid combination of flags '--tcp' and '--tls'.\n");
+        return 1;
+    }
+
+    if (flags.ca && !flags.tls) {
+        fprintf(stderr, "Flag '--tls-ca' requires '--tls'.\n");
+        return 1;
+    }
+
+    if (flags.uring && flags.tls) {
+        fprintf(stderr, "Invalid combination of flags '--io-uring' and '--tls'.\n");
+        return 1;
+    }
+
+    if (outa->snapshot_path != NULL && outa->input_path == NULL) {
+        fprintf(stderr, "Snapshot can only be used with an input file.\n");
+        return 1;
+    }
+
+    if (address_set && outa->input_path != NULL) {
+        fprintf(stderr, "Domain name and input file can not be combined.\n");
+        return 1;
+    }
+
     if (flags.x && flags._6) { //
         fprintf(stderr, "Invalid combination of flags '-x' and '-6'.\n");
         return 1;
     }
+
+    if (flags.q && (flags.x || flags._6)) {
+        fprintf(stderr, "Flag '-q' can not be combined with '-x' or '-6'.\n");
+        return 1;
+    }
+
+    // The domain list gives the type on every line
+    if (flags.q && outa->input_path != NULL) {
+        fprintf(stderr, "Flag '-q' can not be combined with '-f', give the type on the lines instead.\n");
+        return 1;
+    }
+
+    if (flags.axfr && flags.ixfr) {
+        fprintf(stderr, "Invalid combination of flags '--axfr' and '--ixfr'.\n");
+        return 1;
+    }
+
+    // A zone transfer is a single TCP or TLS exchange with its own output
+    if (outa->xfr && (outa->input_path != NULL || flags.q || flags.x || flags._6)) {
+        fprintf(stderr, "Zone transfer can not be combined with '-f', '-q', '-x' or '-6'.\n");
+        return 1;
+    }
+
+    if (outa->xfr && (flags.uring || flags.adaptive)) {
+        fprintf(stderr, "Zone transfer can not be combined with '--io-uring' or '--adaptive'.\n");
+        return 1;
+    }
+
+    if (outa->xfr && outa->transport == TRANSPORT_UDP) { // RFC 5936, AXFR is never sent over UDP
+        outa->transport = TRANSPORT_TCP;
+    }
+
+    if (flags.anchor && !flags.dnssec) {
+        fprintf(stderr, "Flag '--trust-anchor' requires '--dnssec'.\n");
+        return 1;
+    }
+
+    // Validation is done between the receiving and the caller, the io_uring loop has no place for it
+    if (flags.dnssec && (outa->xfr || flags.uring)) {
+        fprintf(stderr, "Flag '--dnssec' can not be combined with a zone transfer or '--io-uring'.\n");
+        return 1;
+    }
+
+    if (flags.o && !outa->xfr) {
+        fprintf(stderr, "Flag '-o' requires '--axfr', '--ixfr' or '--pcap'.\n");
+        return 1;
+    }
+
+    if (!flags.q) {
+        outa->query_types[0] = outa->query_type;
+        outa->n_query_types = 1;
+    }
     
     return 0;
 }
@@ -14,10 +14,33 @@
 typedef struct {
     bool recursion_desired;
     uint16_t query_type;
-    unsigned char server_name[MAX_DOMAIN_STR_LEN];
+    uint16_t query_types[MAX_QUERY_TYPES]; // Asked together for the name, only query_type if -q is not given
+    int n_query_types;
+    char server_names[MAX_SERVERS][MAX_DOMAIN_STR_LEN]; // Tried in this order
+    int n_servers;
     uint16_t port;
     char port_str[MAX_PORT_STR_LEN];
+    bool port_set;
     char address_str[MAX_DOMAIN_STR_LEN];
+    const char* input_path; // Domain list to resolve instead of address_str
+    size_t mem_limit_mb; // Memory available for the domain list
+    const char* snapshot_path; // Results of the previous run of the domain list
+    transport_t transport;
+    const char* tls_ca_path; // Certificates to trust instead of the system ones
+    int timeout_ms; // Wait for the answer to one try
+    int tries; // Sends of a query before it is given up
+    int deadline_ms; // Bound on the whole lookup including retries, 0 if none
+    bool io_uring; // Use the io_uring backend if the kernel supports it
+    bool adaptive; // Congestion window per server instead of the fixed window
+    bool xfr; // Transfer the zone address_str instead of a query
+    bool ixfr; // Incremental transfer from ixfr_serial
+    uint32_t ixfr_serial;
+    const char* output_path; // Transferred zone or capture analysis, stdout if not set
+    const char* pcap_path; // Capture to analyze offline instead of any query
+    bool pcap_records; // Print the decoded messages instead of the statistics
+    int threads; // Decoding the capture, 0 for every CPU
+    bool dnssec; // Validate the answers up to a trust anchor
+    const char* trust_anchor_path; // DS records to trust instead of the root keys
 } args_t;
 
 
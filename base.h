@@ -5,13 +5,15 @@
 #ifndef __BASE_H__
 #define __BASE_H__
 
-#define _POSIX_C_SOURCE 200112L // Required for 'getaddrinfo' and other...
+#define _POSIX_C_SOURCE 200809L // Required for 'getaddrinfo', 'open_memstream' and other...
 
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h> // fclose
@@ -22,6 +24,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h> // for timeval
+#include <time.h> // for timespec
 #include <netdb.h>
 
 #ifdef DEBUG
@@ -36,6 +39,12 @@
 
 #define DEFAULT_PORT 53
 
+#define DEFAULT_TIMEOUT_MS 2000 // How long to wait for the answer to one try
+#define DEFAULT_TRIES 3 // Tries of a query, every try goes to the next server
+
+#define MAX_SERVERS 3 // Servers of -s tried in turn
+#define MAX_QUERY_TYPES 8 // Types of -q asked together
+
 
 #define T_A 1 // Ipv4 record
 #define T_CNAME 5 // Canonical Name record
@@ -44,6 +53,13 @@
 #define T_SOA 6 // Start of authority zone
 #define T_PTR 12 // Domain name pointer
 #define T_MX 15 // Mail server
+#define T_TXT 16 // Text strings
+#define T_OPT 41 // EDNS0 pseudo-record (RFC 6891)
+#define T_DS 43 // Delegation signer
+#define T_RRSIG 46 // Signature of a record set
+#define T_NSEC 47 // Next secure record
+#define T_DNSKEY 48 // Public key of a zone
+#define T_NSEC3 50 // Hashed next secure record
 
 typedef unsigned char uchar;
 
@@ -52,7 +68,15 @@ typedef unsigned char uchar;
     dns - DNS resolver \n\
     \n\
     SYNOPSIS\n\
-        dns [-r] [-x|-6] -s server [-p port] domain|address\n\
+        dns [-r] [-x|-6|-q type[,type...]] [--tcp|--tls [--tls-ca file]] [--timeout ms] [--tries N]\n\
+            [--deadline ms] [--io-uring] [--adaptive] [--dnssec [--trust-anchor file]]\n\
+            -s server[,server...] [-p port] domain|address\n\
+        dns [-r] [-x|-6] [--tcp|--tls [--tls-ca file]] [--timeout ms] [--tries N] [--deadline ms]\n\
+            [--io-uring] [--adaptive] [--dnssec [--trust-anchor file]] -s server[,server...] [-p port]\n\
+            -f file [--mem-limit MB] [--snapshot file]\n\
+        dns --axfr|--ixfr serial [--tls [--tls-ca file]] [--timeout ms] -s server[,server...] [-p port]\n\
+            [-o file] zone\n\
+        dns --pcap file [--records] [--threads N] [-o file]\n\
         dns -h\n\
     \n\
     DESCRIPTION\n\
@@ -73,11 +97,94 @@ typedef unsigned char uchar;
         -6\n\
             Send AAAA query to receive IPv6 address.\n\
         \n\
-        -s server\n\
-            DNS server domain name or IPv4/IPv6 address to send a query to.\n\
+        -q type[,type...]\n\
+            Ask for all the types (e.g. A,AAAA,MX) at once, the answers are printed\n\
+            as one result in the order of the types.\n\
+        \n\
+        -s server[,server...]\n\
+            DNS server domain name or IPv4/IPv6 address to send a query to. Up to 3\n\
+            comma separated servers, every try of a query goes to the next one.\n\
         \n\
         -p port\n\
-            Port to use when querying the DNS server. Default is 53.\n\
+            Port to use when querying the DNS server. Default is 53, 853 with --tls.\n\
+        \n\
+        --tcp\n\
+            Send the queries over TCP. Up to 4 connections are kept open and\n\
+            queries are pipelined on them.\n\
+        \n\
+        --tls\n\
+            DNS over TLS, connections as with --tcp. The server certificate must\n\
+            be issued for the server name or address, connections opened later\n\
+            resume the TLS session of the first one.\n\
+        \n\
+        --tls-ca file\n\
+            Trust the certificates of the PEM file instead of the system ones.\n\
+        \n\
+        --timeout ms\n\
+            How long to wait for the answer to one try (default 2000).\n\
+        \n\
+        --tries N\n\
+            Tries of a query before it is given up (default 3).\n\
+        \n\
+        --deadline ms\n\
+            Upper bound on one query from its first try, waiting, retries and\n\
+            switching to the next server included (default timeout * tries).\n\
+        \n\
+        --io-uring\n\
+            Send and receive through io_uring (UDP and --tcp), many queries per\n\
+            system call. Falls back to poll() if the kernel does not support it.\n\
+        \n\
+        --adaptive\n\
+            Congestion control instead of the fixed 64 queries in flight. The window\n\
+            of every server grows while answers come back in time and is halved on\n\
+            a timeout, REFUSED or a growing RTT. Refused queries are asked again.\n\
+            The window over time is printed to stderr at exit.\n\
+        \n\
+        --dnssec\n\
+            Validate the answers (RFC 4035) from the root trust anchor down. Keys\n\
+            of every zone are fetched once and verified by worker threads, secure\n\
+            answers are marked Authenticated, bogus ones fail as SERVFAIL.\n\
+            Not with --io-uring or a zone transfer.\n\
+        \n\
+        --trust-anchor file\n\
+            DS records ('owner [ttl] [IN] DS tag algorithm digest-type digest', one\n\
+            per line) to trust instead of the built-in keys of the root.\n\
+        \n\
+        -f file\n\
+            Resolve every name of the file, one 'name [type]' per line. Names are\n\
+            normalized and every unique (name, type) pair is asked only once, the\n\
+            result is printed for every line in the order of the file.\n\
+        \n\
+        --mem-limit MB\n\
+            Memory available for the -f file (default 256). Larger files are\n\
+            split into temporary files and resolved part by part.\n\
+        \n\
+        --snapshot file\n\
+            Change detection for the -f file. Only pairs whose TTL has run out since\n\
+            the previous run are asked again and only changed records are printed.\n\
+            The snapshot is then replaced with the new results.\n\
+        \n\
+        --axfr\n\
+            Transfer the whole zone (over TCP, or TLS with --tls) and write it in\n\
+            master file format, one record per line, while it is received.\n\
+        \n\
+        --ixfr serial\n\
+            Transfer only the changes since the serial, removed records start\n\
+            with '-' and added ones with '+'. Servers may send the whole zone.\n\
+        \n\
+        --pcap file\n\
+            Decode the DNS messages (UDP and TCP port 53) of a pcap or pcapng\n\
+            capture and print statistics: top query names, query types, response\n\
+            codes, response sizes and query to response latency.\n\
+        \n\
+        --records\n\
+            Print every message of the capture with its records instead.\n\
+        \n\
+        --threads N\n\
+            Threads decoding the capture (default one per CPU).\n\
+        \n\
+        -o file\n\
+            Write the transferred zone or the analysis to the file instead of stdout.\n\
         \n\
         -h\n\
             Print help and exit.\n\
@@ -3,17 +3,19 @@
  */
 
 #include "base.h"
+#include "libdns.h"
 #include "args.h"
-#include "dns_packet.h"
+#include "dns_print.h"
+#include "dns_batch.h"
+#include "dns_xfr.h"
+#include "dns_pcap.h"
 
-int sock_fd = -1;
+dns_resolver_t resolver;
 
 // Correctly terminates the program with the given exit code
 void terminate(int code) 
 {
-    if (sock_fd >= 0) {
-        close(sock_fd);
-    }
+    dns_resolver_free(&resolver);
     exit(code);
 }   
 
@@ -30,59 +32,147 @@ void print_help()
     printf("\n" HELP_MESSAGE);
 }
 
-int create_socket(bool ip_type4) 
+// Lookup given on the command line, all of its types are asked at once
+typedef struct {
+    const char* name;
+    const uint16_t* qtypes;
+    int n_qtypes;
+    int sent;
+    dns_result_t results[MAX_QUERY_TYPES]; // Kept until all types are answered
+    bool ok[MAX_QUERY_TYPES];
+    char qstr[MAX_NAME_STR_LEN];
+    int ret;
+} single_query_t;
+
+static int single_next(void* ctx, size_t* index, const char** name, uint16_t* qtype)
 {
-    // Create socket
-    sock_fd = socket(ip_type4 ? AF_INET : AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    single_query_t* sq = ctx;
+    if (sq->sent == sq->n_qtypes) {
+        return 0;
+    }
+    *index = sq->sent;
+    *name = sq->name;
+    *qtype = sq->qtypes[sq->sent++];
+    return 1;
+}
 
-    if (sock_fd < 0) {
-        perror("Failed creatng socket.");
-        return 1;
+static void single_done(void* ctx, dns_lookup_t* l)
+{
+    single_query_t* sq = ctx;
+    if (sq->n_qtypes == 1) {
+        sq->ret = dns_lookup_print(stdout, stderr, l);
+        return;
     }
 
-    // Set socket timeout just in case
-    struct timeval timeout;      
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
-    
-    if (setsockopt (sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        perror("setsockopt failed\n");
-        return 1;
+    // Printed together once every type is done, failures are reported per type
+    const char* type = dns_record_type_to_str(l->qtype);
+    if (l->status == QUERY_BAD_NAME) {
+        if (l->index == 0) {
+            fprintf(stderr, "Error: Invalid query name %s.\n", l->qstr);
+        }
+        sq->ret = 1;
+        return;
     }
+    strcpy(sq->qstr, l->qstr);
 
-    if (setsockopt (sock_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
-        perror("setsockopt failed\n");
-        return 1;
+    if (l->status == QUERY_TIMEOUT) {
+        fprintf(stderr, "Error: %s: No answer received.\n", type);
+        sq->ret = 1;
+    } else if (l->status == QUERY_SEND_FAILED) {
+        fprintf(stderr, "Error: %s: Query could not be sent.\n", type);
+        sq->ret = 1;
+    } else if (l->status == QUERY_MALFORMED) {
+        fprintf(stderr, "Error: %s: Malformed response.\n", type);
+        sq->ret = 1;
+    } else if (l->result.header.rcode != 0) {
+        fprintf(stderr, "Error: %s: %s\n", type, dns_rcode_to_str(l->result.header.rcode));
+        sq->ret = 1;
+    } else {
+        sq->results[l->index] = l->result;
+        sq->ok[l->index] = true;
+        l->result.records = NULL; // Kept until all types are answered
     }
-    return 0;
 }
 
-int get_server_address(serv_addr_t* serv, const char* server_name, uint16_t server_port)
+// Transfer the zone from the first server that starts sending it
+static int run_xfr(const args_t* args, const dns_engine_t* engine)
 {
-    // Attempt to parse the address as IPv4
-    if (inet_pton(AF_INET , (char*)server_name, &serv->addr_ip4.sin_addr) == 1) {
-        serv->ipv4 = true;
-        serv->addr_ip4.sin_family = AF_INET;
-        serv->addr_ip4.sin_port = htons(server_port);
-    } else if (inet_pton(AF_INET6, (char*)server_name, &serv->addr_ip6.sin6_addr) == 1) {
-        serv->ipv4 = false;
-        serv->addr_ip6.sin6_family = AF_INET6;
-        serv->addr_ip6.sin6_port = htons(server_port);
-    } else {
-        // Convert server name to IP address using getaddrinfo()
-        if (dns_domain_to_ip((char*)server_name, serv) != 0) {
+    FILE* out = stdout;
+    if (args->output_path != NULL) {
+        out = fopen(args->output_path, "w");
+        if (out == NULL) {
+            perror("Output file can not be opened");
             return 1;
         }
+    }
+    setvbuf(out, NULL, _IOFBF, XFR_OUT_BUF_SIZE);
+
+    dns_xfr_opts_t opts = { args->address_str, args->ixfr, args->ixfr_serial, args->timeout_ms };
+    dns_xfr_stats_t stats;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-        if (serv->ipv4) {
-            serv->addr_ip4.sin_port = htons(server_port);
-        } else {
-            serv->addr_ip6.sin6_port = htons(server_port);
+    int ret = 1;
+    for (int i = 0; i < engine->n_servers && ret != 0; ++i) {
+        ret = dns_xfr_run(engine->servers[i].streams, &opts, out, &stats);
+        if (stats.messages > 0) { // Part of the zone may be written already
+            break;
         }
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (out != stdout && fclose(out) != 0) {
+        perror("Writing the zone failed");
+        ret = 1;
+    }
+    if (ret != 0) {
+        return ret;
+    }
+
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (stats.up_to_date) {
+        fprintf(stderr, "Zone %s is up to date (serial %u).\n", args->address_str, stats.serial);
+    } else {
+        fprintf(stderr, "Zone %s serial %u%s: %lu records, %lu messages, %llu bytes in %.0f ms.\n",
+                args->address_str, stats.serial, stats.full ? " (full transfer)" : "",
+                stats.records, stats.messages, stats.bytes, ms);
+    }
     return 0;
 }
 
+// Decode a capture instead of sending anything
+static int run_pcap(const args_t* args)
+{
+    FILE* out = stdout;
+    if (args->output_path != NULL) {
+        out = fopen(args->output_path, "w");
+        if (out == NULL) {
+            perror("Output file can not be opened");
+            return 1;
+        }
+    }
+
+    dns_pcap_opts_t opts = { args->pcap_path, args->pcap_records, args->threads };
+    int ret = dns_pcap_run(&opts, out);
+    if (out != stdout && fclose(out) != 0) {
+        perror("Writing the output failed");
+        ret = 1;
+    }
+    return ret;
+}
+
+void print_drop_stats()
+{
+    const dns_pending_table_t* pending = &resolver.pending;
+    unsigned long dropped = dns_pending_dropped_total(pending);
+    if (dropped > 0) {
+        fprintf(stderr, "Warning: Dropped %lu unmatched datagram(s) "
+            "(format: %lu, id: %lu, source: %lu, question: %lu).\n", dropped,
+            pending->dropped.bad_format, pending->dropped.bad_id,
+            pending->dropped.bad_source, pending->dropped.bad_question);
+    }
+}
+
 int main(int argc, char* argv[]) 
 {
     #ifdef DEBUG
@@ -93,6 +183,7 @@ int main(int argc, char* argv[])
     signal(SIGINT , signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGQUIT, signal_handler);
+    signal(SIGPIPE, SIG_IGN); // Writing to a connection the server closed is handled where it happens
 
     // Parse arguments
     args_t args;
@@ -102,6 +193,9 @@ int main(int argc, char* argv[])
     args.port = DEFAULT_PORT;
     args.port_str[0] = '5';
     args.port_str[1] = '3';
+    args.mem_limit_mb = DEFAULT_MEM_LIMIT_MB;
+    args.timeout_ms = DEFAULT_TIMEOUT_MS;
+    args.tries = DEFAULT_TRIES;
 
     int ret = parse_args(argc, argv, &args);
     if (ret > 0) {
@@ -112,27 +206,75 @@ int main(int argc, char* argv[])
         terminate(0);
     }
 
-    serv_addr_t serv;
-    memset(&serv, 0, sizeof(serv_addr_t));
+    if (args.pcap_path != NULL) {
+        terminate(run_pcap(&args));
+    }
 
-    if (get_server_address(&serv, (const char*)args.server_name, args.port) != 0) {
-        terminate(1);
+    dns_resolver_opts_t ropts;
+    memset(&ropts, 0, sizeof(dns_resolver_opts_t));
+    for (int i = 0; i < args.n_servers; ++i) {
+        ropts.servers[i] = args.server_names[i];
     }
-    
-    if (create_socket(serv.ipv4) != 0) {
+    ropts.n_servers = args.n_servers;
+    ropts.port = args.port_set ? args.port : 0;
+    ropts.transport = args.transport;
+    ropts.tls_ca_path = args.tls_ca_path;
+    ropts.recursion_desired = args.recursion_desired;
+    ropts.timeout_ms = args.timeout_ms;
+    ropts.tries = args.tries;
+    ropts.deadline_ms = args.deadline_ms;
+    ropts.adaptive = args.adaptive;
+    ropts.io_uring = args.io_uring;
+    ropts.dnssec = args.dnssec;
+    ropts.trust_anchor_path = args.trust_anchor_path;
+    ropts.err = stderr;
+    if (dns_resolver_init(&resolver, &ropts) != 0) {
         terminate(1);
     }
 
-    // Send DNS query
-    if (dns_send_question(sock_fd, serv, args.address_str, args.recursion_desired, args.query_type) != 0) {
-        terminate(1);
-    }
+    if (args.xfr) {
+        ret = run_xfr(&args, &resolver.engine);
+    } else if (args.input_path != NULL) {
+        // Resolve the whole domain list
+        dns_batch_opts_t opts = { args.input_path, args.query_type, args.mem_limit_mb << 20, args.snapshot_path };
+        ret = dns_batch_run(&resolver.engine, &opts, stdout);
+    } else {
+        // Send DNS query from a random socket of the pool and receive all DNS answers
+        single_query_t sq;
+        memset(&sq, 0, sizeof(single_query_t));
+        sq.name = args.address_str;
+        sq.qtypes = args.query_types;
+        sq.n_qtypes = args.n_query_types;
+        ret = dns_resolve_many(&resolver, single_next, single_done, &sq) != 0 ? 1 : sq.ret;
 
-    // Receive all DNS answers
-    if (dns_receive_answers(sock_fd, serv) != 0) {
-        terminate(1);
+        if (sq.n_qtypes > 1) {
+            if (sq.qstr[0] != '\0') {
+                dns_print_merged(stdout, sq.qstr, sq.qtypes, sq.results, sq.ok, sq.n_qtypes);
+            }
+            for (int i = 0; i < sq.n_qtypes; ++i) {
+                dns_free_result(&sq.results[i]);
+            }
+        }
     }
 
-    terminate(0);
+    print_drop_stats();
+    if (resolver.validator != NULL) {
+        dns_validator_stats_t st;
+        dns_validator_stats(resolver.validator, &st);
+        fprintf(stderr, "DNSSEC: %lu secure, %lu insecure, %lu bogus; %lu zones, %lu chain queries, "
+                "%lu signatures verified.\n", st.secure, st.insecure, st.bogus, st.zones, st.chain_queries,
+                st.signatures);
+    }
+    for (int i = 0; args.adaptive && i < args.n_servers; ++i) {
+        dns_cc_print(stderr, &resolver.ccs[i], args.server_names[i]);
+    }
+#if VERBOSE == 1
+    if (args.transport == TRANSPORT_TLS) {
+        for (int i = 0; i < args.n_servers; ++i) {
+            printf("%s: TLS handshakes: %lu, resumed: %lu\n", args.server_names[i],
+                resolver.streams[i].handshakes, resolver.streams[i].resumed);
+        }
+    }
+#endif
+    terminate(ret);
 }
-
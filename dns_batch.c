@@ -0,0 +1,542 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_cc.h"
+#include "dns_engine.h"
+#include "dns_dnssec.h"
+#include "libdns.h"
+#include "dns_print.h"
+#include "dns_input.h"
+#include "dns_dedup.h"
+#include "dns_snapshot.h"
+#include "dns_batch.h"
+
+#include <sys/resource.h>
+
+// State shared by all partitions in the change detection mode
+typedef struct {
+    dns_snapshot_t old;
+    dns_snapshot_writer_t writer;
+    time_t now;
+    size_t pairs; // Statistics
+    size_t asked;
+    size_t changed;
+} dns_batch_snap_t;
+
+// Partition of the input, resolved independently of the others
+typedef struct {
+    dns_input_t* in;
+    dns_dedup_t set;
+    char** texts; // Formatted result (or changes) of every unique pair
+    size_t next_unique;
+
+    dns_batch_snap_t* snap; // NULL unless detecting changes
+    const uchar** olds; // Entry of every unique pair in the old snapshot
+    uchar** blobs; // New entry of every unique pair that was asked again
+} dns_batch_part_t;
+
+// Framed output of a partition waiting to be merged
+typedef struct {
+    const char* data;
+    size_t size;
+    size_t pos;
+    uint64_t line_no;
+} dns_batch_merge_t;
+
+#define FRAME_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint32_t))
+
+static int dns_batch_next(void* ctx, size_t* index, const char** name, uint16_t* qtype)
+{
+    dns_batch_part_t* part = ctx;
+
+    while (part->next_unique < part->set.count) {
+        size_t i = part->next_unique++;
+        const dns_dedup_entry_t* e = &part->set.entries[i];
+        if (part->snap != NULL && part->olds[i] != NULL) {
+            dns_snapshot_entry_t old;
+            dns_snapshot_decode(part->olds[i], &old);
+            if (old.expires > part->snap->now) { // Still valid, nothing could have changed
+                continue;
+            }
+        }
+        *index = i;
+        *name = dns_dedup_name(&part->set, i);
+        *qtype = e->qtype;
+        return 1;
+    }
+    return 0;
+}
+
+// Remember the new result and describe how it differs from the old one
+static void dns_batch_done_snap(dns_batch_part_t* part, const dns_query_t* q, dns_query_status_t status,
+                                const uchar* pkt, size_t pkt_len)
+{
+    ++part->snap->asked;
+
+    // A failed query says nothing about a change, the old entry is kept
+    dns_result_t res;
+    if (status != QUERY_OK || dns_parse_response(pkt, pkt_len, &res) != 0) {
+        return;
+    }
+    uchar* blob = dns_snapshot_encode(dns_dedup_name(&part->set, q->index), q->pend.qtype, &res, part->snap->now);
+    dns_free_result(&res);
+    if (blob == NULL) {
+        return;
+    }
+    part->blobs[q->index] = blob;
+
+    char* text = NULL;
+    size_t text_len = 0;
+    FILE* f = open_memstream(&text, &text_len);
+    if (f == NULL) {
+        perror("open_memstream failed");
+        return;
+    }
+    int changed = dns_snapshot_diff(f, part->olds[q->index], blob);
+    fclose(f);
+    if (changed) {
+        part->texts[q->index] = text;
+        ++part->snap->changed;
+    } else {
+        free(text);
+    }
+}
+
+static void dns_batch_done(void* ctx, const dns_query_t* q, dns_query_status_t status,
+                           const uchar* pkt, size_t pkt_len)
+{
+    dns_batch_part_t* part = ctx;
+
+    if (part->snap != NULL) {
+        dns_batch_done_snap(part, q, status, pkt, pkt_len);
+        return;
+    }
+
+    char* text = NULL;
+    size_t text_len = 0;
+    FILE* f = open_memstream(&text, &text_len);
+    if (f == NULL) {
+        perror("open_memstream failed");
+        return;
+    }
+    dns_lookup_t l;
+    dns_lookup_fill(&l, q, status, pkt, pkt_len);
+    dns_lookup_print(f, f, &l);
+    dns_lookup_free(&l);
+    fclose(f);
+    part->texts[q->index] = text;
+}
+
+static int dns_batch_write(FILE* out, bool framed, uint64_t line_no, const char* text)
+{
+    if (text == NULL) {
+        text = "Error: Out of memory.\n";
+    }
+    if (framed) {
+        uint32_t len = strlen(text);
+        if (fwrite(&line_no, sizeof(uint64_t), 1, out) != 1 ||
+            fwrite(&len, sizeof(uint32_t), 1, out) != 1 ||
+            fwrite(text, 1, len, out) != len) {
+            perror("Failed writing temporary file");
+            return 1;
+        }
+    } else if (fputs(text, out) == EOF) {
+        perror("Failed writing output");
+        return 1;
+    }
+    return 0;
+}
+
+// Resolve the unique pairs of the partition, then fan the results
+// out to every line of the partition in the original order
+static int dns_batch_run_part(dns_engine_t* e, dns_input_t* in, FILE* out, bool framed, dns_batch_snap_t* snap)
+{
+    dns_batch_part_t part;
+    memset(&part, 0, sizeof(dns_batch_part_t));
+    part.in = in;
+    part.snap = snap;
+
+    if (dns_dedup_init(&part.set, stderr) != 0) {
+        return 1;
+    }
+
+    int ret = 1;
+    dns_input_entry_t entry;
+    while (dns_input_next(in, &entry)) {
+        if (dns_dedup_insert(&part.set, entry.name, entry.name_len, entry.qtype) < 0) {
+            goto cleanup;
+        }
+    }
+
+#if VERBOSE == 1
+    fprintf(stderr, "Resolving %zu unique names.\n", part.set.count);
+#endif
+
+    part.texts = calloc(part.set.count + 1, sizeof(char*));
+    if (part.texts == NULL) {
+        perror("calloc failed");
+        goto cleanup;
+    }
+
+    if (snap != NULL) {
+        part.olds = calloc(part.set.count + 1, sizeof(uchar*));
+        part.blobs = calloc(part.set.count + 1, sizeof(uchar*));
+        if (part.olds == NULL || part.blobs == NULL) {
+            perror("calloc failed");
+            goto cleanup;
+        }
+        for (size_t i = 0; i < part.set.count; ++i) {
+            const dns_dedup_entry_t* d = &part.set.entries[i];
+            part.olds[i] = dns_snapshot_find(&snap->old, dns_dedup_name(&part.set, i), d->name_len, d->qtype);
+        }
+        snap->pairs += part.set.count;
+    }
+
+    e->next = dns_batch_next;
+    e->done = dns_batch_done;
+    e->ctx = &part;
+    if (dns_engine_run(e) != 0) {
+        goto cleanup;
+    }
+
+    if (snap != NULL) {
+        // Print the changes and carry the unchanged entries over to the new snapshot
+        for (size_t i = 0; i < part.set.count; ++i) {
+            if (part.texts[i] != NULL && fputs(part.texts[i], out) == EOF) {
+                perror("Failed writing output");
+                goto cleanup;
+            }
+            const uchar* blob = part.blobs[i] != NULL ? part.blobs[i] : part.olds[i];
+            if (blob != NULL && dns_snapshot_writer_add(&snap->writer, blob) != 0) {
+                goto cleanup;
+            }
+        }
+        ret = 0;
+        goto cleanup;
+    }
+
+    dns_input_rewind(in);
+    while (dns_input_next(in, &entry)) {
+        long idx = dns_dedup_find(&part.set, entry.name, entry.name_len, entry.qtype);
+        if (dns_batch_write(out, framed, entry.line_no, part.texts[idx]) != 0) {
+            goto cleanup;
+        }
+    }
+    ret = 0;
+
+cleanup:
+    if (part.texts != NULL) {
+        for (size_t i = 0; i < part.set.count; ++i) {
+            free(part.texts[i]);
+        }
+        free(part.texts);
+    }
+    if (part.blobs != NULL) {
+        for (size_t i = 0; i < part.set.count; ++i) {
+            free(part.blobs[i]);
+        }
+        free(part.blobs);
+    }
+    free(part.olds);
+    dns_dedup_free(&part.set);
+    return ret;
+}
+
+// Read the line number of the next frame, returns 0 at the end
+static int dns_batch_merge_peek(dns_batch_merge_t* m)
+{
+    if (m->pos + FRAME_HEADER_SIZE > m->size) {
+        return 0;
+    }
+    memcpy(&m->line_no, m->data + m->pos, sizeof(uint64_t));
+    return 1;
+}
+
+static void dns_batch_heap_down(dns_batch_merge_t* src, int* heap, int n, int i)
+{
+    while (true) {
+        int l = 2*i + 1, r = l + 1, min = i;
+        if (l < n && src[heap[l]].line_no < src[heap[min]].line_no) {
+            min = l;
+        }
+        if (r < n && src[heap[r]].line_no < src[heap[min]].line_no) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+        int tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+// Every partition output is sorted by line number, k-way merge them into out.
+// The outputs lie one after another in frames, partition i between ends[i - 1]
+// and ends[i]. A framed out keeps the frames for the merge above it.
+static int dns_batch_merge(FILE* frames, const size_t* ends, int n_parts, FILE* out, bool framed)
+{
+    dns_batch_merge_t* src = calloc(n_parts, sizeof(dns_batch_merge_t));
+    int* heap = calloc(n_parts, sizeof(int));
+    if (src == NULL || heap == NULL) {
+        perror("calloc failed");
+        free(src);
+        free(heap);
+        return 1;
+    }
+
+    dns_input_t map; // Only used to map the file
+    if (dns_input_open_spill(&map, frames) != 0) {
+        free(src);
+        free(heap);
+        return 1;
+    }
+
+    int ret = 0;
+    int n = 0;
+    for (int i = 0; i < n_parts; ++i) {
+        size_t start = i > 0 ? ends[i - 1] : 0;
+        src[i].data = map.data + start;
+        src[i].size = ends[i] - start;
+        if (dns_batch_merge_peek(&src[i])) {
+            heap[n++] = i;
+        }
+    }
+
+    for (int i = n/2 - 1; i >= 0; --i) {
+        dns_batch_heap_down(src, heap, n, i);
+    }
+
+    size_t skip = framed ? 0 : FRAME_HEADER_SIZE;
+    while (n > 0) {
+        dns_batch_merge_t* m = &src[heap[0]];
+        uint32_t len;
+        memcpy(&len, m->data + m->pos + sizeof(uint64_t), sizeof(uint32_t));
+        if (m->pos + FRAME_HEADER_SIZE + len > m->size) {
+            fprintf(stderr, "Error: Truncated temporary file.\n");
+            ret = 1;
+            break;
+        }
+        size_t n_bytes = FRAME_HEADER_SIZE + len - skip;
+        if (fwrite(m->data + m->pos + skip, 1, n_bytes, out) != n_bytes) {
+            perror(framed ? "Failed writing temporary file" : "Failed writing output");
+            ret = 1;
+            break;
+        }
+        m->pos += FRAME_HEADER_SIZE + len;
+
+        if (!dns_batch_merge_peek(m)) {
+            heap[0] = heap[--n];
+        }
+        dns_batch_heap_down(src, heap, n, 0);
+    }
+
+    dns_input_close(&map);
+    free(src);
+    free(heap);
+    return ret;
+}
+
+// Temporary files open at once, no more than descriptors left to spare. The
+// spill files of a split and the runs of the new snapshot are open at the
+// same time, with a snapshot each of them gets half.
+static size_t dns_batch_max_files(bool snap)
+{
+    size_t max_files = BATCH_MAX_PARTITIONS;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        size_t spare = rl.rlim_cur > BATCH_RESERVED_FDS + 2 ? rl.rlim_cur - BATCH_RESERVED_FDS : 2;
+        max_files = spare < max_files ? spare : max_files;
+    }
+    return snap ? max_files / 2 : max_files;
+}
+
+// Partitions for an input of size bytes, all spill files of a split are open at once
+static int dns_batch_n_parts(size_t size, size_t mem_limit, bool snap)
+{
+    // Assume the worst case of all names being unique
+    size_t n_parts = size * BATCH_MEM_FACTOR / mem_limit + 1;
+
+    size_t max_parts = dns_batch_max_files(snap);
+    if (max_parts < 2) {
+        max_parts = 2;
+    }
+    return n_parts > max_parts ? max_parts : n_parts;
+}
+
+// Split the input into partitions by hash, so equal pairs end up in the same one.
+// Partitions split again use the hash bits above the ones of the split before.
+static int dns_batch_spill(dns_input_t* in, FILE** spills, int n_parts, uint64_t div)
+{
+    dns_input_entry_t entry;
+    while (dns_input_next(in, &entry)) {
+        // The low bits of the hash pick the slot in the set, use the high ones here
+        uint64_t h = dns_dedup_hash(entry.name, entry.name_len, entry.qtype);
+        if (dns_input_write_spill(spills[(h >> 32) / div % n_parts], &entry) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Resolve the input partition by partition. A partition still too large for
+// the limit, as the number of partitions is bounded by the descriptors, is
+// split again the same way. Framed output is written for the merge above.
+static int dns_batch_run_spilled(dns_engine_t* e, dns_input_t* in, int n_parts, uint64_t div,
+                                 size_t mem_limit, FILE* out, bool framed, dns_batch_snap_t* snap)
+{
+    FILE** spills = calloc(n_parts, sizeof(FILE*));
+    dns_input_t* part_ins = calloc(n_parts, sizeof(dns_input_t));
+    size_t* ends = calloc(n_parts, sizeof(size_t));
+    if (spills == NULL || part_ins == NULL || ends == NULL) {
+        perror("calloc failed");
+        free(spills);
+        free(part_ins);
+        free(ends);
+        return 1;
+    }
+
+    // Large buffered writes, but all buffers together stay within a quarter of the limit
+    size_t buf_size = mem_limit / 4 / n_parts;
+    buf_size = buf_size < BUFSIZ ? BUFSIZ : buf_size > BATCH_SPILL_BUF_SIZE ? BATCH_SPILL_BUF_SIZE : buf_size;
+
+    int ret = 1;
+    FILE* frames = NULL; // Outputs of all partitions one after another
+    for (int i = 0; i < n_parts; ++i) {
+        spills[i] = tmpfile();
+        if (spills[i] == NULL) {
+            perror("Failed creating temporary file");
+            goto cleanup;
+        }
+        setvbuf(spills[i], NULL, _IOFBF, buf_size);
+    }
+
+    size_t in_size = in->size;
+    if (dns_batch_spill(in, spills, n_parts, div) != 0) {
+        goto cleanup;
+    }
+    dns_input_close(in); // The input is not needed anymore
+
+    // The mappings stay valid, only the descriptors are given back
+    for (int i = 0; i < n_parts; ++i) {
+        if (dns_input_open_spill(&part_ins[i], spills[i]) != 0) {
+            goto cleanup;
+        }
+        fclose(spills[i]); // Deletes the file once unmapped
+        spills[i] = NULL;
+    }
+
+    // Changes are printed in no particular order, they need no merging
+    if (snap == NULL) {
+        frames = tmpfile();
+        if (frames == NULL) {
+            perror("Failed creating temporary file");
+            goto cleanup;
+        }
+        setvbuf(frames, NULL, _IOFBF, buf_size * n_parts > BATCH_SPILL_BUF_SIZE ? BATCH_SPILL_BUF_SIZE : buf_size * n_parts);
+    }
+
+    for (int i = 0; i < n_parts; ++i) {
+        dns_input_t* part_in = &part_ins[i];
+        FILE* part_out = snap != NULL ? out : frames;
+        int part_ret;
+        // Split again unless all of the input went to this partition, then it would again
+        if (part_in->size * BATCH_MEM_FACTOR > mem_limit && part_in->size < in_size &&
+            div <= UINT32_MAX / n_parts) {
+            int n_sub = dns_batch_n_parts(part_in->size, mem_limit, snap != NULL);
+            part_ret = dns_batch_run_spilled(e, part_in, n_sub, div * n_parts, mem_limit,
+                                             part_out, snap == NULL, snap);
+        } else {
+            part_ret = dns_batch_run_part(e, part_in, part_out, snap == NULL, snap);
+        }
+        dns_input_close(part_in);
+        if (part_ret != 0) {
+            goto cleanup;
+        }
+        if (frames != NULL) {
+            long end = ftell(frames);
+            if (end < 0) {
+                perror("ftell failed");
+                goto cleanup;
+            }
+            ends[i] = end;
+        }
+    }
+
+    ret = snap != NULL ? 0 : dns_batch_merge(frames, ends, n_parts, out, framed);
+
+cleanup:
+    for (int i = 0; i < n_parts; ++i) {
+        if (spills[i] != NULL) {
+            fclose(spills[i]);
+        }
+        dns_input_close(&part_ins[i]);
+    }
+    if (frames != NULL) {
+        fclose(frames);
+    }
+    free(spills);
+    free(part_ins);
+    free(ends);
+    return ret;
+}
+
+int dns_batch_run(dns_engine_t* e, const dns_batch_opts_t* opts, FILE* out)
+{
+    dns_batch_snap_t snap;
+    dns_batch_snap_t* snap_ptr = NULL;
+    if (opts->snapshot_path != NULL) {
+        memset(&snap, 0, sizeof(dns_batch_snap_t));
+        if (dns_snapshot_load(&snap.old, opts->snapshot_path) != 0) {
+            return 1;
+        }
+        dns_snapshot_writer_init(&snap.writer, opts->mem_limit / 4, dns_batch_max_files(true));
+        snap.now = time(NULL);
+        snap_ptr = &snap;
+    }
+
+    dns_input_t in;
+    if (dns_input_open_file(&in, opts->path, opts->default_qtype) != 0) {
+        if (snap_ptr != NULL) {
+            dns_snapshot_close(&snap.old);
+        }
+        return 1;
+    }
+
+    int n_parts = dns_batch_n_parts(in.size, opts->mem_limit, snap_ptr != NULL);
+
+#if VERBOSE == 1
+    fprintf(stderr, "Input of %zu bytes, %d partition(s).\n", in.size, n_parts);
+#endif
+
+    int ret;
+    if (n_parts == 1) {
+        ret = dns_batch_run_part(e, &in, out, false, snap_ptr);
+    } else {
+        ret = dns_batch_run_spilled(e, &in, n_parts, 1, opts->mem_limit, out, false, snap_ptr);
+    }
+    dns_input_close(&in);
+
+    if (snap_ptr != NULL) {
+        // The old snapshot must stay mapped until its entries are carried over
+        if (ret == 0) {
+            ret = dns_snapshot_writer_finish(&snap.writer, opts->snapshot_path);
+        }
+        if (ret == 0) {
+            fprintf(stderr, "Snapshot: %zu pairs, %zu asked again, %zu changed.\n",
+                snap.pairs, snap.asked, snap.changed);
+        }
+        dns_snapshot_writer_free(&snap.writer);
+        dns_snapshot_close(&snap.old);
+    }
+    // The other lines were answered, but the list is not all right
+    return ret == 0 && in.malformed > 0 ? 1 : ret;
+}
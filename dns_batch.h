@@ -0,0 +1,32 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_BATCH_H__
+#define __DNS_BATCH_H__
+
+#define DEFAULT_MEM_LIMIT_MB 256
+// Worst case memory needed per byte of input (every name unique):
+// the set entry, its slots and the formatted result
+#define BATCH_MEM_FACTOR 12
+#define BATCH_MAX_PARTITIONS 1024
+#define BATCH_RESERVED_FDS 64 // Descriptors left to the sockets and the rest when spilling
+#define BATCH_SPILL_BUF_SIZE (1 << 20) // Buffer of all spill files together
+
+typedef struct {
+    const char* path; // Domain list
+    uint16_t default_qtype;
+    size_t mem_limit; // Bytes
+    const char* snapshot_path; // Print only changes against this snapshot if set
+} dns_batch_opts_t;
+
+// Resolve every name of the input file once per (name, type) pair and print
+// the result for every input line in the input order. If the input does not
+// fit into mem_limit, it is split into partitions kept in temporary files.
+//
+// With a snapshot, only pairs whose TTL has run out since the previous run are
+// asked again, only the records that changed are printed and the snapshot is
+// replaced with the new results.
+int dns_batch_run(dns_engine_t* e, const dns_batch_opts_t* opts, FILE* out);
+
+#endif // !__DNS_BATCH_H__
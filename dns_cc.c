@@ -0,0 +1,141 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_cc.h"
+
+static double dns_cc_ms(const struct timespec* from, const struct timespec* to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static void dns_cc_add_ms(struct timespec* t, double ms)
+{
+    long ns = (long)(ms * 1e6);
+    t->tv_sec += ns / 1000000000L;
+    t->tv_nsec += ns % 1000000000L;
+    if (t->tv_nsec >= 1000000000L) {
+        t->tv_sec += 1;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+void dns_cc_init(dns_cc_t* cc, int max_window)
+{
+    memset(cc, 0, sizeof(dns_cc_t));
+    cc->max_window = max_window;
+    cc->cwnd = CC_INITIAL_WINDOW < max_window ? CC_INITIAL_WINDOW : max_window;
+    cc->ssthresh = max_window;
+
+    clock_gettime(CLOCK_MONOTONIC, &cc->start);
+    cc->interval_ms = CC_HISTORY_INTERVAL_MS;
+    cc->next_sample = cc->start;
+    dns_cc_add_ms(&cc->next_sample, cc->interval_ms);
+    cc->hold_until = cc->start;
+}
+
+int dns_cc_window(const dns_cc_t* cc)
+{
+    return (int)cc->cwnd;
+}
+
+int dns_cc_room(const dns_cc_t* cc)
+{
+    int room = dns_cc_window(cc) - cc->in_flight;
+    return room > 0 ? room : 0;
+}
+
+// Multiplicative decrease, once per RTT
+static void dns_cc_cut(dns_cc_t* cc, const struct timespec* now)
+{
+    if (dns_cc_ms(&cc->hold_until, now) < 0) {
+        return;
+    }
+    cc->cwnd /= 2;
+    if (cc->cwnd < 1) {
+        cc->cwnd = 1;
+    }
+    cc->ssthresh = cc->cwnd;
+    ++cc->cuts;
+
+    cc->hold_until = *now;
+    dns_cc_add_ms(&cc->hold_until, cc->srtt_ms > 1 ? cc->srtt_ms : 1);
+}
+
+void dns_cc_answer(dns_cc_t* cc, double rtt_ms, bool refused, const struct timespec* now)
+{
+    ++cc->answers;
+    ++cc->current.answers;
+
+    if (refused) { // Rate limited by the server
+        ++cc->refused;
+        ++cc->current.losses;
+        dns_cc_cut(cc, now);
+        return;
+    }
+
+    if (cc->srtt_ms == 0) {
+        cc->srtt_ms = cc->min_rtt_ms = rtt_ms;
+    } else {
+        cc->srtt_ms += (rtt_ms - cc->srtt_ms) / 8;
+        if (rtt_ms < cc->min_rtt_ms) {
+            cc->min_rtt_ms = rtt_ms;
+        }
+    }
+
+    // Queries wait in a queue somewhere on the way, more of them would only wait longer
+    if (cc->srtt_ms > cc->min_rtt_ms * CC_RTT_INFLATION + CC_RTT_SLACK_MS) {
+        if (dns_cc_ms(&cc->hold_until, now) >= 0) {
+            ++cc->inflated;
+        }
+        dns_cc_cut(cc, now);
+        return;
+    }
+
+    // Additive increase
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += 1;
+    } else {
+        cc->cwnd += 1 / cc->cwnd;
+    }
+    if (cc->cwnd > cc->max_window) {
+        cc->cwnd = cc->max_window;
+    }
+}
+
+void dns_cc_timeout(dns_cc_t* cc, const struct timespec* now)
+{
+    ++cc->timeouts;
+    ++cc->current.losses;
+    dns_cc_cut(cc, now);
+}
+
+void dns_cc_tick(dns_cc_t* cc, const struct timespec* now)
+{
+    while (dns_cc_ms(&cc->next_sample, now) >= 0) {
+        if (cc->n_history == CC_HISTORY) {
+            // Keep the whole run, at half the resolution
+            for (int i = 0; i < CC_HISTORY / 2; ++i) {
+                dns_cc_sample_t* a = &cc->history[2 * i];
+                dns_cc_sample_t* b = &cc->history[2 * i + 1];
+                cc->history[i].window = b->window;
+                cc->history[i].srtt_ms = b->srtt_ms;
+                cc->history[i].answers = a->answers + b->answers;
+                cc->history[i].losses = a->losses + b->losses;
+            }
+            cc->n_history = CC_HISTORY / 2;
+            cc->interval_ms *= 2;
+
+            // The current interval is now only half over
+            dns_cc_add_ms(&cc->next_sample, cc->interval_ms / 2);
+            continue;
+        }
+
+        cc->current.window = dns_cc_window(cc);
+        cc->current.srtt_ms = cc->srtt_ms;
+        cc->history[cc->n_history++] = cc->current;
+        memset(&cc->current, 0, sizeof(dns_cc_sample_t));
+        dns_cc_add_ms(&cc->next_sample, cc->interval_ms);
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_CC_H__
+#define __DNS_CC_H__
+
+#include <time.h>
+
+#define CC_MAX_WINDOW 1024 // Queries in flight per server at most
+#define CC_INITIAL_WINDOW 4
+#define CC_RTT_INFLATION 2.0 // Smoothed RTT above this many times the lowest one means queueing
+#define CC_RTT_SLACK_MS 5.0 // Added to the bound, RTTs on a LAN double from noise alone
+#define CC_HISTORY 32 // Rows of the window over time, merged pairwise when full
+#define CC_HISTORY_INTERVAL_MS 50 // First interval of the history
+
+// One interval of the window over time
+typedef struct {
+    int window; // At the end of the interval
+    double srtt_ms;
+    unsigned answers;
+    unsigned losses; // Timeouts and REFUSED
+} dns_cc_sample_t;
+
+// AIMD congestion window of one server. The window grows by one per answer
+// until the first loss (slow start), then by one per window of answers. A
+// timeout, REFUSED or an inflated RTT halves it, at most once per RTT.
+typedef struct {
+    double cwnd;
+    double ssthresh;
+    int max_window;
+    int in_flight;
+
+    double srtt_ms; // Smoothed RTT (RFC 6298), 0 before the first answer
+    double min_rtt_ms;
+    struct timespec hold_until; // No other cut before then, the losses are of the same episode
+
+    unsigned long answers;
+    unsigned long timeouts;
+    unsigned long refused;
+    unsigned long inflated; // Cuts caused by the RTT
+    unsigned long cuts;
+
+    struct timespec start;
+    struct timespec next_sample;
+    int interval_ms;
+    int n_history;
+    dns_cc_sample_t history[CC_HISTORY];
+    dns_cc_sample_t current;
+} dns_cc_t;
+
+void dns_cc_init(dns_cc_t* cc, int max_window);
+
+// Whole queries the window currently allows in flight
+int dns_cc_window(const dns_cc_t* cc);
+
+// Free room of the window, 0 if no other query may be sent
+int dns_cc_room(const dns_cc_t* cc);
+
+// Answer to a try sent rtt_ms ago
+void dns_cc_answer(dns_cc_t* cc, double rtt_ms, bool refused, const struct timespec* now);
+
+// A try was not answered in time
+void dns_cc_timeout(dns_cc_t* cc, const struct timespec* now);
+
+// Close the current interval of the history if it is over
+void dns_cc_tick(dns_cc_t* cc, const struct timespec* now);
+
+#endif // !__DNS_CC_H__
@@ -0,0 +1,164 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_dedup.h"
+#include "dns_error.h"
+
+// 64 bit FNV-1a
+uint64_t dns_dedup_hash(const char* name, size_t name_len, uint16_t qtype)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < name_len; ++i) {
+        h ^= (uchar)name[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= qtype;
+    h *= 1099511628211ULL;
+    h ^= h >> 29; // FNV mixes the low bits poorly
+    return h;
+}
+
+int dns_dedup_init(dns_dedup_t* d, FILE* err)
+{
+    memset(d, 0, sizeof(dns_dedup_t));
+    d->err = err;
+    d->cap = DEDUP_MIN_CAPACITY;
+    d->slots = calloc(d->cap, sizeof(uint32_t));
+    if (d->slots == NULL) {
+        dns_perror(err, "calloc failed");
+        return 1;
+    }
+    return 0;
+}
+
+void dns_dedup_free(dns_dedup_t* d)
+{
+    free(d->slots);
+    free(d->entries);
+    free(d->arena);
+    memset(d, 0, sizeof(dns_dedup_t));
+}
+
+static bool dns_dedup_equal(const dns_dedup_t* d, const dns_dedup_entry_t* e,
+                            uint64_t hash, const char* name, size_t name_len, uint16_t qtype)
+{
+    return e->hash == hash && e->qtype == qtype && e->name_len == name_len &&
+        memcmp(d->arena + e->name_off, name, name_len) == 0;
+}
+
+// Slot holding the pair or the empty slot where it belongs
+static size_t dns_dedup_probe(const dns_dedup_t* d, uint64_t hash, const char* name, size_t name_len, uint16_t qtype)
+{
+    size_t mask = d->cap - 1;
+    size_t i = hash & mask;
+    while (d->slots[i] != 0) {
+        const dns_dedup_entry_t* e = &d->entries[d->slots[i] - 1];
+        if (dns_dedup_equal(d, e, hash, name, name_len, qtype)) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int dns_dedup_grow(dns_dedup_t* d)
+{
+    size_t cap = d->cap * 2;
+    uint32_t* slots = calloc(cap, sizeof(uint32_t));
+    if (slots == NULL) {
+        dns_perror(d->err, "calloc failed");
+        return 1;
+    }
+
+    // Hashes are stored with the entries, no need to rehash the names
+    for (size_t idx = 0; idx < d->count; ++idx) {
+        size_t i = d->entries[idx].hash & (cap - 1);
+        while (slots[i] != 0) {
+            i = (i + 1) & (cap - 1);
+        }
+        slots[i] = idx + 1;
+    }
+
+    free(d->slots);
+    d->slots = slots;
+    d->cap = cap;
+    return 0;
+}
+
+static void* dns_dedup_reserve(FILE* err, void* ptr, size_t* cap, size_t need, size_t elem_size)
+{
+    if (need <= *cap) {
+        return ptr;
+    }
+    size_t new_cap = *cap ? *cap : 256;
+    while (new_cap < need) {
+        new_cap *= 2;
+    }
+    void* p = realloc(ptr, new_cap * elem_size);
+    if (p == NULL) {
+        dns_perror(err, "realloc failed");
+        return NULL;
+    }
+    *cap = new_cap;
+    return p;
+}
+
+long dns_dedup_insert(dns_dedup_t* d, const char* name, size_t name_len, uint16_t qtype)
+{
+    uint64_t hash = dns_dedup_hash(name, name_len, qtype);
+    size_t i = dns_dedup_probe(d, hash, name, name_len, qtype);
+    if (d->slots[i] != 0) {
+        return d->slots[i] - 1;
+    }
+
+    if (d->count >= UINT32_MAX - 1 || d->arena_len + name_len + 1 > UINT32_MAX) {
+        dns_error(d->err, "Error: Too many unique names.\n");
+        return -1;
+    }
+
+    dns_dedup_entry_t* entries = dns_dedup_reserve(d->err, d->entries, &d->entries_cap, d->count + 1,
+                                                   sizeof(dns_dedup_entry_t));
+    if (entries == NULL) {
+        return -1;
+    }
+    d->entries = entries;
+
+    char* arena = dns_dedup_reserve(d->err, d->arena, &d->arena_cap, d->arena_len + name_len + 1, 1);
+    if (arena == NULL) {
+        return -1;
+    }
+    d->arena = arena;
+
+    dns_dedup_entry_t* e = &d->entries[d->count];
+    e->hash = hash;
+    e->name_off = d->arena_len;
+    e->qtype = qtype;
+    e->name_len = name_len;
+
+    memcpy(d->arena + d->arena_len, name, name_len);
+    d->arena[d->arena_len + name_len] = '\0';
+    d->arena_len += name_len + 1;
+
+    d->slots[i] = ++d->count;
+
+    if (d->count * 100 > d->cap * DEDUP_MAX_LOAD_PCT) {
+        if (dns_dedup_grow(d) != 0) {
+            return -1;
+        }
+    }
+    return d->count - 1;
+}
+
+long dns_dedup_find(const dns_dedup_t* d, const char* name, size_t name_len, uint16_t qtype)
+{
+    uint64_t hash = dns_dedup_hash(name, name_len, qtype);
+    size_t i = dns_dedup_probe(d, hash, name, name_len, qtype);
+    return d->slots[i] != 0 ? (long)d->slots[i] - 1 : -1;
+}
+
+const char* dns_dedup_name(const dns_dedup_t* d, size_t index)
+{
+    return d->arena + d->entries[index].name_off;
+}
@@ -0,0 +1,50 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_DEDUP_H__
+#define __DNS_DEDUP_H__
+
+#define DEDUP_MIN_CAPACITY 1024
+#define DEDUP_MAX_LOAD_PCT 50 // Grow when the table is half full
+
+typedef struct {
+    uint64_t hash;
+    uint32_t name_off; // Offset of the name in the arena
+    uint16_t qtype;
+    uint8_t name_len;
+} dns_dedup_entry_t;
+
+// Set of unique (name, type) pairs. The open addressing table holds only
+// 32 bit entry indices, names are packed one after another in an arena.
+typedef struct {
+    uint32_t* slots; // 0 = empty, otherwise entry index + 1
+    size_t cap; // Power of two
+
+    dns_dedup_entry_t* entries;
+    size_t count;
+    size_t entries_cap;
+
+    char* arena;
+    size_t arena_len;
+    size_t arena_cap;
+
+    FILE* err; // Diagnostics, NULL for none
+} dns_dedup_t;
+
+uint64_t dns_dedup_hash(const char* name, size_t name_len, uint16_t qtype);
+
+int dns_dedup_init(dns_dedup_t* d, FILE* err);
+void dns_dedup_free(dns_dedup_t* d);
+
+// Find the pair, insert it if it is not in the set yet.
+// Returns the index of the pair or -1 on allocation failure.
+long dns_dedup_insert(dns_dedup_t* d, const char* name, size_t name_len, uint16_t qtype);
+
+// Returns the index of the pair or -1 if it is not in the set
+long dns_dedup_find(const dns_dedup_t* d, const char* name, size_t name_len, uint16_t qtype);
+
+// NUL-terminated name of the pair with the given index
+const char* dns_dedup_name(const dns_dedup_t* d, size_t index);
+
+#endif // !__DNS_DEDUP_H__
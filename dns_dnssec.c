@@ -0,0 +1,2008 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_cc.h"
+#include "dns_engine.h"
+#include "dns_dedup.h"
+#include "dns_dnssec.h"
+#include "dns_error.h"
+
+#ifdef HAVE_OPENSSL
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#define MAX_WIRE_NAME 255
+#define KEY_ZONE_FLAG 0x0100 // DNSKEY of a zone, the only ones that may sign (RFC 4034 2.1.1)
+#define RCODE_SERVFAIL 2
+#define RCODE_NXDOMAIN 3
+#define MAX_REASON_LEN 192
+#define NSEC3_SHA1 1 // The only hash algorithm of NSEC3 (RFC 5155 11)
+#define NSEC3_HASH_LEN 20
+#define NSEC3_OPT_OUT 0x01 // Unsigned delegations may be left out of the chain (RFC 5155 3.1.2.1)
+#define NSEC3_MAX_ITERATIONS 150 // Records with more are not used as proof (RFC 9276 3.2)
+
+// Root zone key signing keys, KSK-2017 and KSK-2024 (IANA root-anchors.xml)
+static const char* const dnssec_root_anchors[] = {
+    ". IN DS 20326 8 2 E06D44B80B8F1D39A95C0B0D7C65D08458E880409BBC683457104237C7F8EC8D",
+    ". IN DS 38696 8 2 683D2D0ACB8C9B712A1948B27F741219298D0A450D612C483AF444A4C0FB2B16",
+};
+
+// Outcome of a record set, an answer or a zone, the worse one wins when combined
+enum { DNSSEC_PENDING, DNSSEC_SECURE, DNSSEC_INSECURE, DNSSEC_BOGUS };
+
+// Messages being validated
+enum { MSG_ANSWER, MSG_DS, MSG_DNSKEY };
+
+// Queries of the chain of trust
+enum { REQ_DS, REQ_DNSKEY, REQ_SOA };
+
+// Record of the answer or authority section in canonical form (RFC 4034 6.2):
+// names uncompressed and lowercase, also those in the RDATA of the old types
+typedef struct {
+    uint8_t section; // 0 answer, 1 authority
+    bool grouped; // Taken into a record set already
+    uint8_t owner_len;
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t rdata_len;
+    size_t owner, rdata; // Offsets in the arena of the message
+} dnssec_rr_t;
+
+typedef struct dnssec_check dnssec_check_t;
+typedef struct dnssec_msg dnssec_msg_t;
+typedef struct dnssec_zone dnssec_zone_t;
+
+// Record set of a message with the signatures that cover it
+struct dnssec_check {
+    dnssec_msg_t* msg;
+    int* rrs; // Records of the set, then its signatures
+    int n_rrs, n_sigs;
+    uchar owner[MAX_WIRE_NAME];
+    uint8_t owner_len;
+    uint16_t type;
+    bool key_set; // DNSKEY set of the zone being looked up, signed by a key its DS points to
+    dnssec_zone_t* zone; // Signer, or the zone the owner is in if the set is not signed
+    int jobs; // Signatures being verified
+    bool verified; // One of them is valid
+    dnssec_check_t* next_waiter;
+};
+
+struct dnssec_msg {
+    int kind;
+    dns_query_t q; // Query of the caller the answer is for
+    dnssec_zone_t* zone; // Zone the DS or DNSKEY set is looked up for
+    uchar* pkt;
+    size_t pkt_len;
+    size_t question_end;
+    dnssec_rr_t* rrs;
+    int n_rrs;
+    uchar* arena;
+    size_t arena_len, arena_cap;
+    dnssec_check_t* checks;
+    int n_checks;
+    int open; // Checks not decided yet
+    bool positive; // A DS set was found
+    bool denied; // The parent proves there is none with an NSEC or NSEC3 record
+    int result;
+    char reason[MAX_REASON_LEN]; // Of the first bogus set
+    dnssec_msg_t* next; // In the list of answers to pass on
+    FILE* err; // Of the validator
+};
+
+typedef struct {
+    uint16_t tag;
+    uint8_t alg;
+    uint8_t digest_type;
+    uint8_t digest_len;
+    uchar digest[EVP_MAX_MD_SIZE];
+} dnssec_ds_t;
+
+typedef struct {
+    uint16_t tag;
+    uint16_t flags;
+    uint8_t alg;
+    bool sep; // A DS of the zone points to it
+    EVP_PKEY* pkey; // NULL for algorithms that are not supported
+} dnssec_key_t;
+
+struct dnssec_zone {
+    uchar name[MAX_WIRE_NAME];
+    uint8_t name_len;
+    char str[MAX_NAME_STR_LEN]; // Dotted, "." for the root
+    int state;
+    char reason[MAX_REASON_LEN];
+    dnssec_ds_t* ds; // Validated DS set, or the trust anchors
+    int n_ds;
+    dnssec_key_t* keys;
+    int n_keys;
+    dnssec_check_t* waiters; // Record sets waiting for the outcome
+};
+
+// Lookup of the zone a name is in, for record sets without signatures
+typedef struct {
+    uchar name[MAX_WIRE_NAME];
+    uint8_t name_len;
+    char str[MAX_NAME_STR_LEN];
+    dnssec_zone_t* zone; // Once known
+    dnssec_check_t* waiters;
+} dnssec_find_t;
+
+typedef struct {
+    int kind;
+    void* target; // Zone, or the lookup for REQ_SOA
+} dnssec_req_t;
+
+// One signature to verify with the candidate keys
+typedef struct dnssec_job {
+    dnssec_check_t* check;
+    uchar* data; // Signed data (RFC 4034 3.1.8.1)
+    size_t data_len;
+    const uchar* sig; // In the arena of the message
+    size_t sig_len;
+    uint8_t alg;
+    EVP_PKEY* keys[DNSSEC_MAX_KEYS];
+    int n_keys;
+    bool ok;
+    struct dnssec_job* next;
+} dnssec_job_t;
+
+typedef struct {
+    uchar name[MAX_WIRE_NAME];
+    uint8_t name_len;
+    dnssec_ds_t ds;
+} dnssec_anchor_t;
+
+struct dns_validator {
+    dnssec_anchor_t* anchors;
+    int n_anchors;
+
+    dns_dedup_t names; // Zones (type DNSKEY) and zone lookups (type SOA)
+    void** objects; // Zone or lookup by index of its name
+    size_t objects_cap;
+
+    dnssec_req_t* reqs; // Sent in the order they were made
+    size_t n_reqs, reqs_cap, next_req;
+
+    dnssec_msg_t* ready; // Validated answers, in the order they were validated
+    dnssec_msg_t* ready_tail;
+    unsigned long parked; // Answers taken and not passed on yet
+    int jobs; // Handed to the workers and not processed yet
+
+    pthread_t threads[DNSSEC_MAX_WORKERS];
+    int n_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    dnssec_job_t* todo; // FIFO of the workers
+    dnssec_job_t* todo_tail;
+    dnssec_job_t* finished;
+    bool stop;
+    int pipe_fds[2]; // Workers write a byte for every finished job
+
+    dns_validator_stats_t stats;
+    FILE* err; // Diagnostics and the reasons of bogus answers, NULL for none
+};
+
+static void dnssec_check_ready(dns_validator_t* v, dnssec_check_t* c);
+static void dnssec_msg_release(dns_validator_t* v, dnssec_msg_t* m);
+
+/* Names in wire format */
+
+static bool dnssec_is_root(const char* str)
+{
+    return strcmp(str, ".") == 0;
+}
+
+// Length of the uncompressed name
+static uint8_t dnssec_name_len(const uchar* name)
+{
+    int len = 0;
+    while (name[len] != 0) {
+        len += 1 + name[len];
+    }
+    return len + 1;
+}
+
+static int dnssec_labels(const uchar* name)
+{
+    int n = 0;
+    for (int i = 0; name[i] != 0; i += 1 + name[i]) {
+        ++n;
+    }
+    return n;
+}
+
+// The name is the zone or below it
+static bool dnssec_name_under(const uchar* name, int len, const uchar* zone, int zone_len)
+{
+    for (int pos = 0; len - pos >= zone_len; pos += 1 + name[pos]) {
+        if (len - pos == zone_len && memcmp(name + pos, zone, zone_len) == 0) {
+            return true;
+        }
+        if (name[pos] == 0) {
+            break;
+        }
+    }
+    return false;
+}
+
+// Dotted form without the final dot, "." for the root
+static void dnssec_name_str(const uchar* name, char* out)
+{
+    if (name[0] == 0) {
+        strcpy(out, ".");
+        return;
+    }
+    int n = 0;
+    for (int i = 0; name[i] != 0; i += 1 + name[i]) {
+        if (n > 0) {
+            out[n++] = '.';
+        }
+        memcpy(out + n, name + i + 1, name[i]);
+        n += name[i];
+    }
+    out[n] = '\0';
+}
+
+// Lowercase wire format of a dotted name, the final dot is optional
+static int dnssec_name_wire(const char* str, uchar* out, uint8_t* out_len)
+{
+    int n = 0;
+    if (dnssec_is_root(str)) {
+        str = "";
+    }
+    while (*str != '\0') {
+        const char* dot = strchr(str, '.');
+        size_t len = dot != NULL ? (size_t)(dot - str) : strlen(str);
+        if (len == 0 || len > 63 || n + 1 + len >= MAX_WIRE_NAME) {
+            return 1;
+        }
+        out[n++] = len;
+        for (size_t i = 0; i < len; ++i) {
+            out[n++] = tolower((uchar)str[i]);
+        }
+        str += len + (dot != NULL);
+    }
+    out[n++] = 0;
+    *out_len = n;
+    return 0;
+}
+
+// Read a possibly compressed name at pos in lowercase wire format. next is
+// set to the position right after the name where it occurs in the message.
+static int dnssec_read_name(const uchar* msg, size_t msg_len, size_t pos, uchar* out, uint8_t* out_len,
+                            size_t* next)
+{
+    int n = 0, jumps = 0;
+    bool jumped = false;
+    while (true) {
+        if (pos >= msg_len) {
+            return 1;
+        }
+        uchar len = msg[pos];
+        if (len >= 192) {
+            if (pos + 1 >= msg_len) {
+                return 1;
+            }
+            size_t offset = (len & 0x3F) * 256 + msg[pos + 1];
+            if (offset >= pos || ++jumps > MAX_NAME_JUMPS) {
+                return 1;
+            }
+            if (!jumped) {
+                *next = pos + 2;
+            }
+            jumped = true;
+            pos = offset;
+            continue;
+        } else if (len >= 64) {
+            return 1;
+        }
+
+        if (pos + 1 + len > msg_len || n + 1 + len > MAX_WIRE_NAME) {
+            return 1;
+        }
+        out[n++] = len;
+        for (int i = 0; i < len; ++i) {
+            out[n++] = tolower(msg[pos + 1 + i]);
+        }
+        pos += 1 + len;
+        if (len == 0) {
+            break;
+        }
+    }
+    if (!jumped) {
+        *next = pos;
+    }
+    *out_len = n;
+    return 0;
+}
+
+/* Messages */
+
+// RDATA with names of the types listed in RFC 4034 6.2 (and RFC 6840 5.1):
+// fixed octets before the names and the number of names
+static const struct {
+    uint16_t type;
+    uint8_t prefix;
+    uint8_t names;
+} dnssec_name_rdata[] = {
+    { T_NS, 0, 1 }, { 3, 0, 1 }, { 4, 0, 1 }, { T_CNAME, 0, 1 }, { T_SOA, 0, 2 }, { 7, 0, 1 },
+    { 8, 0, 1 }, { 9, 0, 1 }, { T_PTR, 0, 1 }, { 14, 0, 2 }, { T_MX, 2, 1 }, { 17, 0, 2 },
+    { 18, 2, 1 }, { 21, 2, 1 }, { 26, 2, 2 }, { 33, 6, 1 }, { 36, 2, 1 }, { 39, 0, 1 },
+    { T_RRSIG, 18, 1 },
+};
+
+static int dnssec_arena_reserve(dnssec_msg_t* m, size_t n)
+{
+    if (m->arena_len + n <= m->arena_cap) {
+        return 0;
+    }
+    size_t cap = m->arena_cap * 2 > m->arena_len + n ? m->arena_cap * 2 : m->arena_len + n;
+    uchar* arena = realloc(m->arena, cap);
+    if (arena == NULL) {
+        dns_perror(m->err, "realloc failed");
+        return 1;
+    }
+    m->arena = arena;
+    m->arena_cap = cap;
+    return 0;
+}
+
+// Store the name at pos in the arena
+static int dnssec_arena_name(dnssec_msg_t* m, size_t pos, size_t* off, uint8_t* len, size_t* next)
+{
+    if (dnssec_arena_reserve(m, MAX_WIRE_NAME) != 0 ||
+        dnssec_read_name(m->pkt, m->pkt_len, pos, m->arena + m->arena_len, len, next) != 0) {
+        return 1;
+    }
+    *off = m->arena_len;
+    m->arena_len += *len;
+    return 0;
+}
+
+// Canonical form of the RDATA at pos
+static int dnssec_arena_rdata(dnssec_msg_t* m, dnssec_rr_t* rr, size_t pos, uint16_t len)
+{
+    int prefix = -1, names = 0;
+    for (size_t i = 0; i < sizeof(dnssec_name_rdata) / sizeof(dnssec_name_rdata[0]); ++i) {
+        if (dnssec_name_rdata[i].type == rr->type) {
+            prefix = dnssec_name_rdata[i].prefix;
+            names = dnssec_name_rdata[i].names;
+        }
+    }
+    if (prefix < 0) {
+        prefix = len; // Copied as is
+    }
+    if (prefix > len || dnssec_arena_reserve(m, len + names * MAX_WIRE_NAME) != 0) {
+        return 1;
+    }
+
+    rr->rdata = m->arena_len;
+    memcpy(m->arena + m->arena_len, m->pkt + pos, prefix);
+    m->arena_len += prefix;
+    size_t p = pos + prefix;
+    for (int i = 0; i < names; ++i) {
+        size_t off;
+        uint8_t name_len;
+        if (dnssec_arena_name(m, p, &off, &name_len, &p) != 0 || p > pos + len) {
+            return 1;
+        }
+    }
+    memcpy(m->arena + m->arena_len, m->pkt + p, pos + len - p);
+    m->arena_len += pos + len - p;
+    rr->rdata_len = m->arena_len - rr->rdata;
+    return 0;
+}
+
+static dnssec_msg_t* dnssec_msg_new(dns_validator_t* v, int kind, const uchar* pkt, size_t pkt_len)
+{
+    dnssec_msg_t* m = calloc(1, sizeof(dnssec_msg_t));
+    if (m == NULL) {
+        dns_perror(v->err, "calloc failed");
+        return NULL;
+    }
+    m->err = v->err;
+    m->kind = kind;
+    m->pkt = malloc(pkt_len);
+    m->arena_cap = pkt_len * 2;
+    m->arena = malloc(m->arena_cap);
+    if (m->pkt == NULL || m->arena == NULL) {
+        dns_perror(m->err, "malloc failed");
+        free(m->pkt);
+        free(m->arena);
+        free(m);
+        return NULL;
+    }
+    memcpy(m->pkt, pkt, pkt_len);
+    m->pkt_len = pkt_len;
+    return m;
+}
+
+static void dnssec_msg_free(dnssec_msg_t* m)
+{
+    for (int i = 0; i < m->n_checks; ++i) {
+        free(m->checks[i].rrs);
+    }
+    free(m->checks);
+    free(m->rrs);
+    free(m->arena);
+    free(m->pkt);
+    free(m);
+}
+
+// Decode the answer and authority sections, the additional one is not validated
+static int dnssec_msg_parse(dnssec_msg_t* m)
+{
+    if (m->pkt_len < sizeof(dns_header_t)) {
+        return 1;
+    }
+    dns_header_t header;
+    memcpy(&header, m->pkt, sizeof(dns_header_t));
+
+    size_t pos = sizeof(dns_header_t);
+    for (int i = 0; i < ntohs(header.q_count); ++i) {
+        size_t off;
+        uint8_t len;
+        if (dnssec_arena_name(m, pos, &off, &len, &pos) != 0 || pos + sizeof(dns_qdata_t) > m->pkt_len) {
+            return 1;
+        }
+        pos += sizeof(dns_qdata_t);
+    }
+    m->question_end = pos;
+
+    int n = ntohs(header.ans_count) + ntohs(header.auth_count);
+    if (n > (int)(m->pkt_len / 11)) {
+        return 1;
+    }
+    m->rrs = calloc(n + 1, sizeof(dnssec_rr_t));
+    if (m->rrs == NULL) {
+        dns_perror(m->err, "calloc failed");
+        return 1;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        dnssec_rr_t* rr = &m->rrs[i];
+        rr->section = i < ntohs(header.ans_count) ? 0 : 1;
+        if (dnssec_arena_name(m, pos, &rr->owner, &rr->owner_len, &pos) != 0 ||
+            pos + sizeof(dns_ansdata_t) > m->pkt_len) {
+            return 1;
+        }
+        dns_ansdata_t data;
+        memcpy(&data, m->pkt + pos, sizeof(dns_ansdata_t));
+        pos += sizeof(dns_ansdata_t);
+        rr->type = ntohs(data.type);
+        rr->class = ntohs(data.class);
+        rr->ttl = ntohl(data.ttl);
+        uint16_t len = ntohs(data.data_len);
+        if (pos + len > m->pkt_len || dnssec_arena_rdata(m, rr, pos, len) != 0) {
+            return 1;
+        }
+        pos += len;
+        ++m->n_rrs;
+    }
+    return 0;
+}
+
+static const uchar* dnssec_owner(const dnssec_msg_t* m, const dnssec_rr_t* rr)
+{
+    return m->arena + rr->owner;
+}
+
+static bool dnssec_same_owner(const dnssec_msg_t* m, const dnssec_rr_t* a, const dnssec_rr_t* b)
+{
+    return a->owner_len == b->owner_len && memcmp(dnssec_owner(m, a), dnssec_owner(m, b), a->owner_len) == 0;
+}
+
+static uint16_t dnssec_covered(const dnssec_msg_t* m, const dnssec_rr_t* sig)
+{
+    const uchar* r = m->arena + sig->rdata;
+    return sig->rdata_len >= 18 ? (r[0] << 8) | r[1] : 0;
+}
+
+// Group the record at first with the rest of its set and the signatures covering it
+static dnssec_check_t* dnssec_add_check(dnssec_msg_t* m, int first)
+{
+    dnssec_check_t* c = &m->checks[m->n_checks];
+    memset(c, 0, sizeof(dnssec_check_t));
+    c->rrs = malloc((m->n_rrs + 1) * sizeof(int));
+    if (c->rrs == NULL) {
+        dns_perror(m->err, "malloc failed");
+        return NULL;
+    }
+    ++m->n_checks;
+    c->msg = m;
+
+    const dnssec_rr_t* head = &m->rrs[first];
+    c->type = head->type;
+    c->owner_len = head->owner_len;
+    memcpy(c->owner, dnssec_owner(m, head), head->owner_len);
+
+    for (int i = first; i < m->n_rrs; ++i) {
+        dnssec_rr_t* rr = &m->rrs[i];
+        if (rr->type == head->type && rr->class == head->class && rr->section == head->section &&
+            dnssec_same_owner(m, rr, head)) {
+            rr->grouped = true;
+            c->rrs[c->n_rrs++] = i;
+        }
+    }
+    for (int i = 0; i < m->n_rrs; ++i) {
+        dnssec_rr_t* rr = &m->rrs[i];
+        if (rr->type == T_RRSIG && rr->section == head->section && dnssec_covered(m, rr) == head->type &&
+            dnssec_same_owner(m, rr, head)) {
+            rr->grouped = true;
+            c->rrs[c->n_rrs + c->n_sigs++] = i;
+        }
+    }
+    return c;
+}
+
+/* Keys and signatures */
+
+static size_t dnssec_der_len(uchar* out, size_t len)
+{
+    if (len < 128) {
+        out[0] = len;
+        return 1;
+    }
+    if (len < 256) {
+        out[0] = 0x81;
+        out[1] = len;
+        return 2;
+    }
+    out[0] = 0x82;
+    out[1] = len >> 8;
+    out[2] = len & 0xFF;
+    return 3;
+}
+
+static size_t dnssec_der(uchar* out, uchar tag, const uchar* value, size_t len)
+{
+    out[0] = tag;
+    size_t n = 1 + dnssec_der_len(out + 1, len);
+    memmove(out + n, value, len);
+    return n + len;
+}
+
+// Unsigned big endian integer, a leading zero keeps it positive
+static size_t dnssec_der_int(uchar* out, const uchar* value, size_t len)
+{
+    while (len > 1 && value[0] == 0) {
+        ++value;
+        --len;
+    }
+    uchar tmp[600];
+    size_t n = 0;
+    if (value[0] & 0x80) {
+        tmp[n++] = 0;
+    }
+    memcpy(tmp + n, value, len);
+    return dnssec_der(out, 0x02, tmp, n + len);
+}
+
+// SubjectPublicKeyInfo of the key, algorithm identifier given in DER
+static EVP_PKEY* dnssec_spki(const uchar* alg_id, size_t alg_id_len, const uchar* key, size_t key_len)
+{
+    uchar bits[600], inner[1200], spki[1300];
+    bits[0] = 0; // No unused bits
+    memcpy(bits + 1, key, key_len);
+    size_t n = 0;
+    memcpy(inner, alg_id, alg_id_len);
+    n = alg_id_len;
+    n += dnssec_der(inner + n, 0x03, bits, key_len + 1);
+    n = dnssec_der(spki, 0x30, inner, n);
+
+    const uchar* p = spki;
+    return d2i_PUBKEY(NULL, &p, n);
+}
+
+// Public key of a DNSKEY record (RFC 3110, RFC 6605, RFC 8080), NULL if not supported
+static EVP_PKEY* dnssec_key_new(uint8_t alg, const uchar* key, size_t len)
+{
+    static const uchar rsa_id[] = { 0x30, 0x0D, 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x01,
+                                    0x05, 0x00 };
+    static const uchar p256_id[] = { 0x30, 0x13, 0x06, 0x07, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01,
+                                     0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07 };
+    static const uchar p384_id[] = { 0x30, 0x10, 0x06, 0x07, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01,
+                                     0x06, 0x05, 0x2B, 0x81, 0x04, 0x00, 0x22 };
+    switch (alg) {
+        case 5: case 7: case 8: case 10: { // RSA, exponent length, exponent, modulus
+            if (len < 3) {
+                return NULL;
+            }
+            size_t exp_len = key[0], off = 1;
+            if (exp_len == 0) {
+                exp_len = (key[1] << 8) | key[2];
+                off = 3;
+            }
+            if (exp_len == 0 || off + exp_len >= len || len - off - exp_len > 512 || exp_len > 64) {
+                return NULL;
+            }
+            uchar seq[600];
+            size_t n = dnssec_der_int(seq, key + off + exp_len, len - off - exp_len);
+            n += dnssec_der_int(seq + n, key + off, exp_len);
+            uchar rsa[600];
+            n = dnssec_der(rsa, 0x30, seq, n);
+            return dnssec_spki(rsa_id, sizeof(rsa_id), rsa, n);
+        }
+        case 13: case 14: { // ECDSA P-256 and P-384, the point without the 0x04 prefix
+            if (len != (alg == 13 ? 64 : 96)) {
+                return NULL;
+            }
+            uchar point[97];
+            point[0] = 0x04;
+            memcpy(point + 1, key, len);
+            return alg == 13 ? dnssec_spki(p256_id, sizeof(p256_id), point, len + 1) :
+                dnssec_spki(p384_id, sizeof(p384_id), point, len + 1);
+        }
+        case 15:
+            return len == 32 ? EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, key, len) : NULL;
+        case 16:
+            return len == 57 ? EVP_PKEY_new_raw_public_key(EVP_PKEY_ED448, NULL, key, len) : NULL;
+        default:
+            return NULL;
+    }
+}
+
+static bool dnssec_alg_supported(uint8_t alg)
+{
+    return alg == 5 || alg == 7 || alg == 8 || alg == 10 || (alg >= 13 && alg <= 16);
+}
+
+static const EVP_MD* dnssec_digest_md(uint8_t digest_type)
+{
+    switch (digest_type) {
+        case 1:
+            return EVP_sha1();
+        case 2:
+            return EVP_sha256();
+        case 4:
+            return EVP_sha384();
+        default:
+            return NULL;
+    }
+}
+
+// Called by the workers
+static bool dnssec_verify(EVP_PKEY* key, uint8_t alg, const uchar* data, size_t data_len,
+                          const uchar* sig, size_t sig_len)
+{
+    const EVP_MD* md = NULL;
+    switch (alg) {
+        case 5: case 7:
+            md = EVP_sha1();
+            break;
+        case 8: case 13:
+            md = EVP_sha256();
+            break;
+        case 10:
+            md = EVP_sha512();
+            break;
+        case 14:
+            md = EVP_sha384();
+            break;
+    }
+
+    // ECDSA signatures are r and s as they are (RFC 6605 4), OpenSSL wants them in DER
+    uchar der[160];
+    if (alg == 13 || alg == 14) {
+        size_t half = alg == 13 ? 32 : 48;
+        if (sig_len != 2 * half) {
+            return false;
+        }
+        uchar seq[110];
+        size_t n = dnssec_der_int(seq, sig, half);
+        n += dnssec_der_int(seq + n, sig + half, half);
+        sig_len = dnssec_der(der, 0x30, seq, n);
+        sig = der;
+    }
+
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    bool ok = ctx != NULL && EVP_DigestVerifyInit(ctx, NULL, md, NULL, key) == 1 &&
+        EVP_DigestVerify(ctx, sig, sig_len, data, data_len) == 1;
+    EVP_MD_CTX_free(ctx);
+    ERR_clear_error(); // The error queue is per thread
+    return ok;
+}
+
+// The DNSKEY of the zone is the one the DS record points to (RFC 4034 5.1.4)
+static bool dnssec_ds_matches(const dnssec_zone_t* z, const dnssec_ds_t* ds, const dnssec_key_t* key,
+                              const uchar* rdata, size_t len)
+{
+    const EVP_MD* md = dnssec_digest_md(ds->digest_type);
+    if (md == NULL || ds->tag != key->tag || ds->alg != key->alg) {
+        return false;
+    }
+    uchar digest[EVP_MAX_MD_SIZE];
+    unsigned digest_len = 0;
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    bool ok = ctx != NULL && EVP_DigestInit_ex(ctx, md, NULL) == 1 &&
+        EVP_DigestUpdate(ctx, z->name, z->name_len) == 1 && EVP_DigestUpdate(ctx, rdata, len) == 1 &&
+        EVP_DigestFinal_ex(ctx, digest, &digest_len) == 1;
+    EVP_MD_CTX_free(ctx);
+    return ok && digest_len == ds->digest_len && memcmp(digest, ds->digest, digest_len) == 0;
+}
+
+static int dnssec_ds_parse(dnssec_ds_t* ds, const uchar* rdata, size_t len)
+{
+    if (len < 5 || len - 4 > EVP_MAX_MD_SIZE) {
+        return 1;
+    }
+    ds->tag = (rdata[0] << 8) | rdata[1];
+    ds->alg = rdata[2];
+    ds->digest_type = rdata[3];
+    ds->digest_len = len - 4;
+    memcpy(ds->digest, rdata + 4, len - 4);
+    return 0;
+}
+
+/* Workers */
+
+static void* dnssec_worker(void* arg)
+{
+    dns_validator_t* v = arg;
+    pthread_mutex_lock(&v->lock);
+    while (true) {
+        while (v->todo == NULL && !v->stop) {
+            pthread_cond_wait(&v->cond, &v->lock);
+        }
+        if (v->todo == NULL) {
+            break;
+        }
+        dnssec_job_t* job = v->todo;
+        v->todo = job->next;
+        pthread_mutex_unlock(&v->lock);
+
+        for (int i = 0; i < job->n_keys && !job->ok; ++i) {
+            job->ok = dnssec_verify(job->keys[i], job->alg, job->data, job->data_len, job->sig, job->sig_len);
+        }
+
+        pthread_mutex_lock(&v->lock);
+        job->next = v->finished;
+        v->finished = job;
+        // The pipe only wakes the I/O thread up, a full pipe already does
+        if (write(v->pipe_fds[1], "", 1) < 0 && errno != EAGAIN) {
+            dns_perror(v->err, "write failed");
+        }
+    }
+    pthread_mutex_unlock(&v->lock);
+    return NULL;
+}
+
+static void dnssec_job_push(dns_validator_t* v, dnssec_job_t* job)
+{
+    ++v->jobs;
+    ++job->check->jobs;
+    pthread_mutex_lock(&v->lock);
+    job->next = NULL;
+    if (v->todo == NULL) {
+        v->todo = job;
+    } else {
+        v->todo_tail->next = job;
+    }
+    v->todo_tail = job;
+    pthread_cond_signal(&v->cond);
+    pthread_mutex_unlock(&v->lock);
+}
+
+/* Denial of a DS set */
+
+// Hashed owner name of NSEC3 (RFC 5155 5)
+typedef struct {
+    uint8_t flags;
+    uint16_t iterations;
+    const uchar* salt;
+    uint8_t salt_len;
+    uchar owner[NSEC3_HASH_LEN]; // Decoded from the first label of the owner
+    const uchar* next; // Next hashed owner name
+    const uchar* bitmap;
+    size_t bitmap_len;
+    const uchar* zone; // The owner without the hash
+    uint8_t zone_len;
+} dnssec_nsec3_t;
+
+// The type is in the type bit maps of an NSEC or NSEC3 record (RFC 4034 4.1.2)
+static bool dnssec_bitmap_has(const uchar* p, size_t len, uint16_t type)
+{
+    size_t pos = 0;
+    while (pos + 2 <= len) {
+        uint8_t window = p[pos], n = p[pos + 1];
+        if (pos + 2 + n > len) {
+            return false;
+        }
+        if (window == type >> 8) {
+            uint8_t byte = (type & 0xFF) / 8;
+            return byte < n && (p[pos + 2 + byte] & (0x80 >> (type % 8))) != 0;
+        }
+        pos += 2 + n;
+    }
+    return false;
+}
+
+// Types of a delegation without a DS, the apex of the child has a SOA (RFC 6840 4.4)
+static bool dnssec_bitmap_unsigned_delegation(const uchar* p, size_t len)
+{
+    return dnssec_bitmap_has(p, len, T_NS) && !dnssec_bitmap_has(p, len, T_DS) && !dnssec_bitmap_has(p, len, T_SOA);
+}
+
+// Base32 with the extended hex alphabet, lowercase and without padding (RFC 4648 7)
+static bool dnssec_base32hex(const uchar* label, uchar* out, size_t out_len)
+{
+    if (label[0] != (out_len * 8 + 4) / 5) {
+        return false;
+    }
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for (int i = 1; i <= label[0]; ++i) {
+        int c = label[i];
+        int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'v' ? c - 'a' + 10 : -1;
+        if (d < 0) {
+            return false;
+        }
+        acc = (acc << 5) | d;
+        bits += 5;
+        if (bits >= 8) {
+            bits -= 8;
+            if (n < out_len) {
+                out[n++] = acc >> bits;
+            }
+            acc &= (1u << bits) - 1;
+        }
+    }
+    return n == out_len;
+}
+
+static bool dnssec_nsec3_parse(const dnssec_msg_t* m, const dnssec_rr_t* rr, dnssec_nsec3_t* n)
+{
+    const uchar* p = m->arena + rr->rdata;
+    size_t len = rr->rdata_len;
+    if (len < 5 || p[0] != NSEC3_SHA1) {
+        return false;
+    }
+    n->flags = p[1];
+    n->iterations = (p[2] << 8) | p[3];
+    n->salt_len = p[4];
+    n->salt = p + 5;
+    size_t pos = 5 + n->salt_len;
+    if (pos + 1 + NSEC3_HASH_LEN > len || p[pos] != NSEC3_HASH_LEN) {
+        return false;
+    }
+    n->next = p + pos + 1;
+    n->bitmap = n->next + NSEC3_HASH_LEN;
+    n->bitmap_len = len - (pos + 1 + NSEC3_HASH_LEN);
+
+    const uchar* owner = dnssec_owner(m, rr);
+    if (n->iterations > NSEC3_MAX_ITERATIONS || !dnssec_base32hex(owner, n->owner, NSEC3_HASH_LEN)) {
+        return false;
+    }
+    n->zone = owner + 1 + owner[0];
+    n->zone_len = rr->owner_len - 1 - owner[0];
+    return true;
+}
+
+// SHA-1 of the name and the salt, then of the hash and the salt once per iteration
+static bool dnssec_nsec3_hash(const dnssec_nsec3_t* n, const uchar* name, uint8_t name_len, uchar* out)
+{
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+    bool ok = ctx != NULL;
+    const uchar* data = name;
+    size_t data_len = name_len;
+    for (int i = 0; ok && i <= n->iterations; ++i) {
+        ok = EVP_DigestInit_ex(ctx, EVP_sha1(), NULL) == 1 && EVP_DigestUpdate(ctx, data, data_len) == 1 &&
+            EVP_DigestUpdate(ctx, n->salt, n->salt_len) == 1 && EVP_DigestFinal_ex(ctx, out, NULL) == 1;
+        data = out;
+        data_len = NSEC3_HASH_LEN;
+    }
+    EVP_MD_CTX_free(ctx);
+    return ok;
+}
+
+// NSEC3 record of a zone above the one looked up matching the name, or covering
+// it if cover is set. Returns false if there is none.
+static bool dnssec_nsec3_find(const dnssec_msg_t* m, const uchar* name, uint8_t len, bool cover,
+                              dnssec_nsec3_t* out)
+{
+    const dnssec_zone_t* z = m->zone;
+    for (int i = 0; i < m->n_rrs; ++i) {
+        const dnssec_rr_t* rr = &m->rrs[i];
+        uchar hash[NSEC3_HASH_LEN];
+        if (rr->section != 1 || rr->type != T_NSEC3 || !dnssec_nsec3_parse(m, rr, out) ||
+            out->zone_len >= z->name_len || !dnssec_name_under(z->name, z->name_len, out->zone, out->zone_len) ||
+            !dnssec_nsec3_hash(out, name, len, hash)) {
+            continue;
+        }
+        int to_owner = memcmp(hash, out->owner, NSEC3_HASH_LEN);
+        int to_next = memcmp(hash, out->next, NSEC3_HASH_LEN);
+        bool last = memcmp(out->next, out->owner, NSEC3_HASH_LEN) <= 0; // Its next wraps around to the first
+        if (!cover ? to_owner == 0 : last ? to_owner > 0 || to_next < 0 : to_owner > 0 && to_next < 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The authority section of the DS response proves that the zone has no DS
+// set: the NSEC record of the delegation (RFC 4035 5.2), its NSEC3 record
+// (RFC 5155 8.5) or the closest encloser and an opt-out NSEC3 record covering
+// the name below it (RFC 5155 8.6). That the records are signed by the parent
+// is up to the checks of the message.
+static bool dnssec_ds_denied(const dnssec_msg_t* m)
+{
+    const dnssec_zone_t* z = m->zone;
+    for (int i = 0; i < m->n_rrs; ++i) {
+        const dnssec_rr_t* rr = &m->rrs[i];
+        if (rr->section != 1 || rr->type != T_NSEC || rr->owner_len != z->name_len ||
+            memcmp(dnssec_owner(m, rr), z->name, z->name_len) != 0) {
+            continue;
+        }
+        // The next name is not compressed
+        const uchar* p = m->arena + rr->rdata;
+        size_t pos = 0;
+        while (pos < rr->rdata_len && p[pos] != 0 && p[pos] < 64) {
+            pos += 1 + p[pos];
+        }
+        if (pos < rr->rdata_len && p[pos] == 0 &&
+            dnssec_bitmap_unsigned_delegation(p + pos + 1, rr->rdata_len - pos - 1)) {
+            return true;
+        }
+    }
+
+    dnssec_nsec3_t n;
+    if (dnssec_nsec3_find(m, z->name, z->name_len, false, &n)) {
+        return dnssec_bitmap_unsigned_delegation(n.bitmap, n.bitmap_len);
+    }
+    const uchar* next_closer = z->name;
+    uint8_t next_len = z->name_len;
+    while (next_len > 1) {
+        const uchar* encloser = next_closer + 1 + next_closer[0];
+        uint8_t encloser_len = next_len - 1 - next_closer[0];
+        if (dnssec_nsec3_find(m, encloser, encloser_len, false, &n)) {
+            // Nothing below a delegation is proven by the zone above it (RFC 5155 8.3)
+            if (dnssec_bitmap_has(n.bitmap, n.bitmap_len, T_NS) && !dnssec_bitmap_has(n.bitmap, n.bitmap_len, T_SOA)) {
+                return false;
+            }
+            return dnssec_nsec3_find(m, next_closer, next_len, true, &n) && (n.flags & NSEC3_OPT_OUT);
+        }
+        next_closer = encloser;
+        next_len = encloser_len;
+    }
+    return false;
+}
+
+/* Validation */
+
+static const char* dnssec_dot(const char* str)
+{
+    return dnssec_is_root(str) ? "" : ".";
+}
+
+static void dnssec_check_done(dns_validator_t* v, dnssec_check_t* c, int state, const char* fmt, ...)
+{
+    dnssec_msg_t* m = c->msg;
+    if (state > m->result) {
+        m->result = state;
+    }
+    if (state == DNSSEC_BOGUS && m->reason[0] == '\0') {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(m->reason, MAX_REASON_LEN, fmt, ap);
+        va_end(ap);
+    }
+    dnssec_msg_release(v, m);
+}
+
+// Records of the set in canonical order (RFC 4034 6.3)
+typedef struct {
+    const uchar* rdata;
+    uint16_t len;
+} dnssec_rdata_ref_t;
+
+static int dnssec_rdata_cmp(const void* a, const void* b)
+{
+    const dnssec_rdata_ref_t* x = a;
+    const dnssec_rdata_ref_t* y = b;
+    int n = memcmp(x->rdata, y->rdata, x->len < y->len ? x->len : y->len);
+    return n != 0 ? n : x->len - y->len;
+}
+
+// Data the signature is over (RFC 4034 3.1.8.1), NULL if the signature can not be for the set
+static uchar* dnssec_signed_data(const dnssec_check_t* c, const dnssec_rr_t* sig, size_t* out_len)
+{
+    const dnssec_msg_t* m = c->msg;
+    const uchar* sr = m->arena + sig->rdata;
+    uint8_t signer_len = dnssec_name_len(sr + 18);
+    uint32_t ttl = ((uint32_t)sr[4] << 24) | (sr[5] << 16) | (sr[6] << 8) | sr[7];
+
+    // Owner of a record expanded from a wildcard has more labels than the signature counts
+    const uchar* owner = c->owner;
+    int owner_len = c->owner_len;
+    int labels = dnssec_labels(owner) - (owner[0] == 1 && owner[1] == '*');
+    if (sr[3] > labels) {
+        return NULL;
+    }
+    bool wildcard = sr[3] < labels;
+    for (int i = sr[3]; i < labels; ++i) {
+        owner_len -= 1 + owner[0];
+        owner += 1 + owner[0];
+    }
+
+    dnssec_rdata_ref_t refs[c->n_rrs];
+    size_t size = 18 + signer_len;
+    for (int i = 0; i < c->n_rrs; ++i) {
+        const dnssec_rr_t* rr = &m->rrs[c->rrs[i]];
+        refs[i].rdata = m->arena + rr->rdata;
+        refs[i].len = rr->rdata_len;
+        size += 2 + owner_len + 10 + rr->rdata_len;
+    }
+    qsort(refs, c->n_rrs, sizeof(dnssec_rdata_ref_t), dnssec_rdata_cmp);
+
+    uchar* data = malloc(size);
+    if (data == NULL) {
+        dns_perror(c->msg->err, "malloc failed");
+        return NULL;
+    }
+    memcpy(data, sr, 18 + signer_len);
+    size_t n = 18 + signer_len;
+    for (int i = 0; i < c->n_rrs; ++i) {
+        if (i > 0 && dnssec_rdata_cmp(&refs[i - 1], &refs[i]) == 0) {
+            continue; // Duplicates are not part of the set
+        }
+        if (wildcard) {
+            data[n++] = 1;
+            data[n++] = '*';
+        }
+        memcpy(data + n, owner, owner_len);
+        n += owner_len;
+        dns_ansdata_t fields;
+        fields.type = htons(c->type);
+        fields.class = htons(m->rrs[c->rrs[0]].class);
+        fields.ttl = htonl(ttl);
+        fields.data_len = htons(refs[i].len);
+        memcpy(data + n, &fields, sizeof(dns_ansdata_t));
+        n += sizeof(dns_ansdata_t);
+        memcpy(data + n, refs[i].rdata, refs[i].len);
+        n += refs[i].len;
+    }
+    *out_len = n;
+    return data;
+}
+
+// Hand every signature of the set made by a key of the zone to the workers
+static void dnssec_check_verify(dns_validator_t* v, dnssec_check_t* c, dnssec_zone_t* z)
+{
+    dnssec_msg_t* m = c->msg;
+    char tbuf[MAX_TYPE_STR_LEN];
+    const char* type = dns_record_type_str(c->type, tbuf);
+    char owner[MAX_NAME_STR_LEN];
+    dnssec_name_str(c->owner, owner);
+    const char* problem = "no signature by a key of the zone";
+
+    uint32_t now = time(NULL);
+    for (int i = 0; i < c->n_sigs; ++i) {
+        const dnssec_rr_t* sig = &m->rrs[c->rrs[c->n_rrs + i]];
+        const uchar* sr = m->arena + sig->rdata;
+        uint8_t signer_len = dnssec_name_len(sr + 18);
+        if (signer_len != z->name_len || memcmp(sr + 18, z->name, signer_len) != 0) {
+            continue; // Made by another zone
+        }
+        uint32_t exp = ((uint32_t)sr[8] << 24) | (sr[9] << 16) | (sr[10] << 8) | sr[11];
+        uint32_t inc = ((uint32_t)sr[12] << 24) | (sr[13] << 16) | (sr[14] << 8) | sr[15];
+        if ((int32_t)(now - inc) < 0 || (int32_t)(exp - now) < 0) { // Serial number arithmetic (RFC 4034 3.1.5)
+            problem = "signature expired or not yet valid";
+            continue;
+        }
+
+        dnssec_job_t* job = calloc(1, sizeof(dnssec_job_t));
+        if (job == NULL) {
+            dns_perror(v->err, "calloc failed");
+            break;
+        }
+        uint16_t tag = (sr[16] << 8) | sr[17];
+        for (int k = 0; k < z->n_keys && job->n_keys < DNSSEC_MAX_KEYS; ++k) {
+            const dnssec_key_t* key = &z->keys[k];
+            if (key->tag == tag && key->alg == sr[2] && key->pkey != NULL && (key->flags & KEY_ZONE_FLAG) &&
+                (!c->key_set || key->sep)) {
+                job->keys[job->n_keys++] = key->pkey;
+            }
+        }
+        if (job->n_keys == 0) {
+            free(job);
+            continue;
+        }
+        job->data = dnssec_signed_data(c, sig, &job->data_len);
+        if (job->data == NULL) {
+            free(job);
+            problem = "signature does not match the record set";
+            continue;
+        }
+        job->check = c;
+        job->alg = sr[2];
+        job->sig = sr + 18 + signer_len;
+        job->sig_len = sig->rdata_len - 18 - signer_len;
+        dnssec_job_push(v, job);
+    }
+
+    if (c->jobs == 0) {
+        dnssec_check_done(v, c, DNSSEC_BOGUS, "%s%s %s: %s (zone %s%s)", owner, dnssec_dot(owner), type, problem,
+                          z->str, dnssec_dot(z->str));
+    }
+}
+
+// Decide the set now that the state of its zone is known
+static void dnssec_check_ready(dns_validator_t* v, dnssec_check_t* c)
+{
+    dnssec_zone_t* z = c->zone;
+    char owner[MAX_NAME_STR_LEN];
+    char tbuf[MAX_TYPE_STR_LEN];
+    dnssec_name_str(c->owner, owner);
+
+    if (z->state == DNSSEC_BOGUS) {
+        dnssec_check_done(v, c, DNSSEC_BOGUS, "%s", z->reason);
+    } else if (z->state == DNSSEC_INSECURE) {
+        dnssec_check_done(v, c, DNSSEC_INSECURE, NULL);
+    } else if (c->n_sigs == 0) {
+        dnssec_check_done(v, c, DNSSEC_BOGUS, "%s%s %s is not signed in the signed zone %s%s", owner, dnssec_dot(owner),
+                          dns_record_type_str(c->type, tbuf), z->str, dnssec_dot(z->str));
+    } else {
+        dnssec_check_verify(v, c, z);
+    }
+}
+
+static void dnssec_wait(dns_validator_t* v, dnssec_check_t* c, dnssec_zone_t* z)
+{
+    c->zone = z;
+    if (z->state != DNSSEC_PENDING) {
+        dnssec_check_ready(v, c);
+        return;
+    }
+    c->next_waiter = z->waiters;
+    z->waiters = c;
+}
+
+static void dnssec_request(dns_validator_t* v, int kind, void* target)
+{
+    if (v->n_reqs == v->reqs_cap) {
+        size_t cap = v->reqs_cap ? v->reqs_cap * 2 : 64;
+        dnssec_req_t* reqs = realloc(v->reqs, cap * sizeof(dnssec_req_t));
+        if (reqs == NULL) {
+            dns_perror(v->err, "realloc failed");
+            return; // The queries waiting for it time out
+        }
+        v->reqs = reqs;
+        v->reqs_cap = cap;
+    }
+    v->reqs[v->n_reqs].kind = kind;
+    v->reqs[v->n_reqs++].target = target;
+    ++v->stats.chain_queries;
+}
+
+static void dnssec_zone_set(dns_validator_t* v, dnssec_zone_t* z, int state, const char* fmt, ...)
+{
+    z->state = state;
+    if (fmt != NULL) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(z->reason, MAX_REASON_LEN, fmt, ap);
+        va_end(ap);
+    }
+
+    dnssec_check_t* c = z->waiters;
+    z->waiters = NULL;
+    while (c != NULL) {
+        dnssec_check_t* next = c->next_waiter;
+        dnssec_check_ready(v, c);
+        c = next;
+    }
+}
+
+// Index of the name in the table, objects grows along
+static long dnssec_insert(dns_validator_t* v, const uchar* name, uint8_t len, uint16_t type, bool* added)
+{
+    size_t count = v->names.count;
+    long index = dns_dedup_insert(&v->names, (const char*)name, len, type);
+    if (index < 0) {
+        return -1;
+    }
+    *added = v->names.count > count;
+    if ((size_t)index >= v->objects_cap) {
+        size_t cap = v->objects_cap ? v->objects_cap * 2 : 256;
+        void** objects = realloc(v->objects, cap * sizeof(void*));
+        if (objects == NULL) {
+            dns_perror(v->err, "realloc failed");
+            return -1;
+        }
+        v->objects = objects;
+        v->objects_cap = cap;
+    }
+    return index;
+}
+
+// Zone of the name, its keys are looked up the first time
+static dnssec_zone_t* dnssec_zone_get(dns_validator_t* v, const uchar* name, uint8_t len)
+{
+    bool added = false;
+    long index = dnssec_insert(v, name, len, T_DNSKEY, &added);
+    if (index < 0) {
+        return NULL;
+    }
+    if (!added) {
+        return v->objects[index];
+    }
+
+    v->objects[index] = NULL;
+    dnssec_zone_t* z = calloc(1, sizeof(dnssec_zone_t));
+    if (z == NULL) {
+        dns_perror(v->err, "calloc failed");
+        return NULL;
+    }
+    v->objects[index] = z;
+    memcpy(z->name, name, len);
+    z->name_len = len;
+    dnssec_name_str(name, z->str);
+    ++v->stats.zones;
+
+    // Keys of a zone with an anchor are trusted if the anchor points to them
+    for (int i = 0; i < v->n_anchors; ++i) {
+        if (v->anchors[i].name_len == len && memcmp(v->anchors[i].name, name, len) == 0) {
+            dnssec_ds_t* ds = realloc(z->ds, (z->n_ds + 1) * sizeof(dnssec_ds_t));
+            if (ds == NULL) {
+                dns_perror(v->err, "realloc failed");
+                break;
+            }
+            z->ds = ds;
+            z->ds[z->n_ds++] = v->anchors[i].ds;
+        }
+    }
+
+    if (z->n_ds > 0) {
+        dnssec_request(v, REQ_DNSKEY, z);
+    } else if (len == 1) {
+        z->state = DNSSEC_INSECURE; // No anchor covers the tree
+    } else {
+        dnssec_request(v, REQ_DS, z);
+    }
+    return z;
+}
+
+// Closest enclosing zone looked up so far
+static dnssec_zone_t* dnssec_known_zone(dns_validator_t* v, const uchar* name, uint8_t len)
+{
+    while (true) {
+        long index = dns_dedup_find(&v->names, (const char*)name, len, T_DNSKEY);
+        if (index >= 0) {
+            return v->objects[index];
+        }
+        if (len == 1) {
+            return NULL;
+        }
+        len -= 1 + name[0];
+        name += 1 + name[0];
+    }
+}
+
+// An unsigned set is fine outside of signed zones, the zone the owner is in
+// is found from the SOA record the server answers with
+static void dnssec_check_unsigned(dns_validator_t* v, dnssec_check_t* c)
+{
+    const uchar* name = c->owner;
+    uint8_t len = c->owner_len;
+    if (c->msg->kind == MSG_DS) { // Everything of a DS response is of the parent of the zone
+        name = c->msg->zone->name;
+        len = c->msg->zone->name_len;
+    }
+    if (c->type == T_DS || c->msg->kind == MSG_DS) { // Belongs to the parent
+        if (len == 1) {
+            dnssec_check_done(v, c, DNSSEC_BOGUS, "DS of the root");
+            return;
+        }
+        len -= 1 + name[0];
+        name += 1 + name[0];
+    }
+
+    // Below an unsigned zone everything is unsigned
+    dnssec_zone_t* known = dnssec_known_zone(v, name, len);
+    if (known != NULL && known->state == DNSSEC_INSECURE) {
+        dnssec_check_done(v, c, DNSSEC_INSECURE, NULL);
+        return;
+    }
+
+    bool added = false;
+    long index = dnssec_insert(v, name, len, T_SOA, &added);
+    dnssec_find_t* f = NULL;
+    if (index >= 0 && added) {
+        f = calloc(1, sizeof(dnssec_find_t));
+        if (f != NULL) {
+            memcpy(f->name, name, len);
+            f->name_len = len;
+            dnssec_name_str(name, f->str);
+            dnssec_request(v, REQ_SOA, f);
+        }
+        v->objects[index] = f;
+    } else if (index >= 0) {
+        f = v->objects[index];
+    }
+    if (f == NULL) {
+        dnssec_check_done(v, c, DNSSEC_BOGUS, "out of memory");
+    } else if (f->zone != NULL) {
+        dnssec_wait(v, c, f->zone);
+    } else {
+        c->next_waiter = f->waiters;
+        f->waiters = c;
+    }
+}
+
+static void dnssec_check_begin(dns_validator_t* v, dnssec_check_t* c)
+{
+    dnssec_msg_t* m = c->msg;
+    if (c->key_set) { // Verified with the keys the DS points to, the zone is not secure yet
+        c->zone = m->zone;
+        dnssec_check_verify(v, c, m->zone);
+        return;
+    }
+    if (c->n_sigs == 0) {
+        dnssec_check_unsigned(v, c);
+        return;
+    }
+
+    // The first signature names the zone, it must be the owner or above it (the parent for a DS,
+    // and for everything of a DS response the parent of the zone looked up)
+    const uchar* signer = m->arena + m->rrs[c->rrs[c->n_rrs]].rdata + 18;
+    uint8_t signer_len = dnssec_name_len(signer);
+    if (!dnssec_name_under(c->owner, c->owner_len, signer, signer_len) ||
+        (c->type == T_DS && signer_len == c->owner_len) ||
+        (m->kind == MSG_DS && (signer_len >= m->zone->name_len ||
+                               !dnssec_name_under(m->zone->name, m->zone->name_len, signer, signer_len)))) {
+        char owner[MAX_NAME_STR_LEN];
+        char tbuf[MAX_TYPE_STR_LEN];
+        dnssec_name_str(c->owner, owner);
+        dnssec_check_done(v, c, DNSSEC_BOGUS, "%s%s %s signed by a zone not above it", owner, dnssec_dot(owner),
+                          dns_record_type_str(c->type, tbuf));
+        return;
+    }
+    dnssec_zone_t* z = dnssec_zone_get(v, signer, signer_len);
+    if (z == NULL) {
+        dnssec_check_done(v, c, DNSSEC_BOGUS, "out of memory");
+        return;
+    }
+    dnssec_wait(v, c, z);
+}
+
+// Create the checks the filter keeps and start them. The message is released
+// once all of them are decided, which may happen right away.
+static void dnssec_msg_start(dns_validator_t* v, dnssec_msg_t* m, bool (*keep)(const dnssec_msg_t*, const dnssec_rr_t*))
+{
+    m->checks = calloc(m->n_rrs + 1, sizeof(dnssec_check_t));
+    if (m->checks == NULL) {
+        dns_perror(v->err, "calloc failed");
+        m->result = DNSSEC_BOGUS;
+        strcpy(m->reason, "out of memory");
+        m->open = 1;
+        dnssec_msg_release(v, m);
+        return;
+    }
+
+    for (int i = 0; i < m->n_rrs; ++i) {
+        dnssec_rr_t* rr = &m->rrs[i];
+        if (rr->grouped || rr->type == T_RRSIG || !keep(m, rr)) {
+            continue;
+        }
+        dnssec_check_t* c = dnssec_add_check(m, i);
+        if (c == NULL) {
+            break;
+        }
+        c->key_set = m->kind == MSG_DNSKEY;
+
+        // Authority records of a referral are not signed by the parent (RFC 4035 2.2)
+        if (c->type == T_NS && rr->section == 1 && c->n_sigs == 0) {
+            free(c->rrs);
+            --m->n_checks;
+        }
+    }
+
+    // Nothing at all, e.g. an empty NODATA answer, is secure only outside of signed zones
+    if (m->n_checks == 0 && m->kind == MSG_ANSWER) {
+        dnssec_check_t* c = &m->checks[m->n_checks++];
+        c->msg = m;
+        c->rrs = NULL;
+        c->type = m->q.pend.qtype;
+        uint8_t len = dnssec_name_len(m->arena);
+        memcpy(c->owner, m->arena, len); // The question name, stored first
+        c->owner_len = len;
+    }
+
+    // Held open until all checks are started, so that deciding one does not free it
+    m->open = m->n_checks + 1;
+    for (int i = 0; i < m->n_checks; ++i) {
+        dnssec_check_begin(v, &m->checks[i]);
+    }
+    dnssec_msg_release(v, m);
+}
+
+static bool dnssec_keep_all(const dnssec_msg_t* m, const dnssec_rr_t* rr)
+{
+    return true;
+}
+
+// DS set of the zone, or the proof that there is none in the authority section
+static bool dnssec_keep_ds(const dnssec_msg_t* m, const dnssec_rr_t* rr)
+{
+    if (m->positive) {
+        return rr->section == 0 && rr->type == T_DS && rr->owner_len == m->zone->name_len &&
+            memcmp(dnssec_owner(m, rr), m->zone->name, rr->owner_len) == 0;
+    }
+    return rr->section == 1;
+}
+
+static bool dnssec_keep_keys(const dnssec_msg_t* m, const dnssec_rr_t* rr)
+{
+    return rr->section == 0 && rr->type == T_DNSKEY && rr->owner_len == m->zone->name_len &&
+        memcmp(dnssec_owner(m, rr), m->zone->name, rr->owner_len) == 0;
+}
+
+// The DS set is validated, or its absence proven
+static void dnssec_zone_ds_done(dns_validator_t* v, dnssec_msg_t* m)
+{
+    dnssec_zone_t* z = m->zone;
+    if (m->result == DNSSEC_BOGUS) {
+        dnssec_zone_set(v, z, DNSSEC_BOGUS, "%s", m->reason);
+        return;
+    }
+    if (m->result == DNSSEC_INSECURE) { // Below an unsigned zone
+        dnssec_zone_set(v, z, DNSSEC_INSECURE, NULL);
+        return;
+    }
+    if (!m->positive && !m->denied) { // Otherwise the DS set could have been stripped
+        dnssec_zone_set(v, z, DNSSEC_BOGUS, "no DS set for %s%s and no NSEC or NSEC3 record proving there is none",
+                        z->str, dnssec_dot(z->str));
+        return;
+    }
+    if (!m->positive) { // Delegated without a DS, an unsigned zone
+        dnssec_zone_set(v, z, DNSSEC_INSECURE, NULL);
+        return;
+    }
+
+    // Records of unknown algorithms or digests are as good as none (RFC 4035 5.2)
+    const dnssec_check_t* c = &m->checks[0];
+    z->ds = malloc(c->n_rrs * sizeof(dnssec_ds_t));
+    for (int i = 0; z->ds != NULL && i < c->n_rrs; ++i) {
+        const dnssec_rr_t* rr = &m->rrs[c->rrs[i]];
+        dnssec_ds_t* ds = &z->ds[z->n_ds];
+        if (dnssec_ds_parse(ds, m->arena + rr->rdata, rr->rdata_len) == 0 && dnssec_alg_supported(ds->alg) &&
+            dnssec_digest_md(ds->digest_type) != NULL) {
+            ++z->n_ds;
+        }
+    }
+    if (z->n_ds == 0) {
+        dnssec_zone_set(v, z, DNSSEC_INSECURE, NULL);
+        return;
+    }
+    dnssec_request(v, REQ_DNSKEY, z);
+}
+
+static void dnssec_msg_finish(dns_validator_t* v, dnssec_msg_t* m)
+{
+    dns_header_t* header = (dns_header_t*)m->pkt;
+    header->ad = m->result == DNSSEC_SECURE;
+    if (m->result == DNSSEC_SECURE) {
+        ++v->stats.secure;
+    } else if (m->result == DNSSEC_INSECURE) {
+        ++v->stats.insecure;
+    } else {
+        // Like a validating resolver, nothing of a bogus answer is passed on
+        ++v->stats.bogus;
+        char tbuf[MAX_TYPE_STR_LEN];
+        dns_error(v->err, "Error: DNSSEC validation of %s. %s failed: %s.\n", m->q.qstr,
+                  dns_record_type_str(m->q.pend.qtype, tbuf), m->reason);
+        header->rcode = RCODE_SERVFAIL;
+        header->ans_count = header->auth_count = header->add_count = 0;
+        m->pkt_len = m->question_end;
+    }
+
+    m->next = NULL;
+    if (v->ready == NULL) {
+        v->ready = m;
+    } else {
+        v->ready_tail->next = m;
+    }
+    v->ready_tail = m;
+}
+
+// One more check of the message is decided
+static void dnssec_msg_release(dns_validator_t* v, dnssec_msg_t* m)
+{
+    if (--m->open > 0) {
+        return;
+    }
+    if (m->kind == MSG_ANSWER) {
+        dnssec_msg_finish(v, m);
+        return;
+    }
+
+    if (m->kind == MSG_DS) {
+        dnssec_zone_ds_done(v, m);
+    } else if (m->result == DNSSEC_SECURE) {
+        dnssec_zone_set(v, m->zone, DNSSEC_SECURE, NULL);
+    } else {
+        dnssec_zone_set(v, m->zone, DNSSEC_BOGUS, "%s", m->reason);
+    }
+    dnssec_msg_free(m);
+}
+
+// Keys of the zone, those the DS set points to are marked
+static int dnssec_zone_keys(dnssec_zone_t* z, const dnssec_msg_t* m)
+{
+    z->keys = calloc(m->n_rrs, sizeof(dnssec_key_t));
+    if (z->keys == NULL) {
+        dns_perror(m->err, "calloc failed");
+        return 1;
+    }
+    bool matched = false;
+    for (int i = 0; i < m->n_rrs; ++i) {
+        const dnssec_rr_t* rr = &m->rrs[i];
+        const uchar* rdata = m->arena + rr->rdata;
+        if (!dnssec_keep_keys(m, rr) || rr->rdata_len < 4 || rdata[2] != 3) { // Protocol is always 3
+            continue;
+        }
+        dnssec_key_t* key = &z->keys[z->n_keys++];
+        key->flags = (rdata[0] << 8) | rdata[1];
+        key->alg = rdata[3];
+        key->tag = dns_key_tag(rdata, rr->rdata_len);
+        key->pkey = dnssec_key_new(key->alg, rdata + 4, rr->rdata_len - 4);
+        for (int j = 0; j < z->n_ds && key->pkey != NULL && !key->sep; ++j) {
+            key->sep = dnssec_ds_matches(z, &z->ds[j], key, rdata, rr->rdata_len);
+        }
+        matched = matched || key->sep;
+    }
+    return matched ? 0 : 1;
+}
+
+static void dnssec_zone_response(dns_validator_t* v, dnssec_zone_t* z, int kind, const uchar* pkt, size_t pkt_len)
+{
+    const char* what = kind == REQ_DS ? "DS" : "DNSKEY";
+    dnssec_msg_t* m = dnssec_msg_new(v, kind == REQ_DS ? MSG_DS : MSG_DNSKEY, pkt, pkt_len);
+    if (m == NULL) {
+        dnssec_zone_set(v, z, DNSSEC_BOGUS, "out of memory");
+        return;
+    }
+    m->zone = z;
+
+    const dns_header_t* header = (const dns_header_t*)m->pkt;
+    if (dnssec_msg_parse(m) != 0) {
+        dnssec_zone_set(v, z, DNSSEC_BOGUS, "malformed %s response for %s%s", what, z->str, dnssec_dot(z->str));
+    } else if (header->tc) { // Even over TCP, or the engine has no TCP fallback
+        dnssec_zone_set(v, z, DNSSEC_BOGUS, "truncated %s response for %s%s", what, z->str, dnssec_dot(z->str));
+    } else if (header->rcode != 0 && (kind != REQ_DS || header->rcode != RCODE_NXDOMAIN)) {
+        dnssec_zone_set(v, z, DNSSEC_BOGUS, "%s query for %s%s failed (rcode %d)", what, z->str, dnssec_dot(z->str),
+                        header->rcode);
+    } else if (kind == REQ_DS) {
+        m->positive = true;
+        bool found = false;
+        for (int i = 0; i < m->n_rrs; ++i) {
+            found = found || dnssec_keep_ds(m, &m->rrs[i]);
+        }
+        m->positive = found;
+        m->denied = !found && dnssec_ds_denied(m);
+        // Without a DS set the parent proves there is none, or its SOA record shows it is unsigned
+        bool soa = false;
+        for (int i = 0; i < m->n_rrs && !m->positive; ++i) {
+            const dnssec_rr_t* rr = &m->rrs[i];
+            soa = soa || (rr->type == T_SOA && rr->section == 1 && rr->owner_len < z->name_len &&
+                          dnssec_name_under(z->name, z->name_len, dnssec_owner(m, rr), rr->owner_len));
+        }
+        if (m->positive || m->denied || soa) {
+            dnssec_msg_start(v, m, dnssec_keep_ds);
+            return;
+        }
+        dnssec_zone_set(v, z, DNSSEC_BOGUS, "no DS set for %s%s and no SOA record of its parent", z->str,
+                        dnssec_dot(z->str));
+    } else if (dnssec_zone_keys(z, m) != 0) {
+        dnssec_zone_set(v, z, DNSSEC_BOGUS, "no DNSKEY of %s%s matches its DS set", z->str, dnssec_dot(z->str));
+    } else {
+        dnssec_msg_start(v, m, dnssec_keep_keys);
+        return;
+    }
+    dnssec_msg_free(m);
+}
+
+// The owner of the SOA record in the response is the apex of the zone the name is in
+static void dnssec_find_response(dns_validator_t* v, dnssec_find_t* f, const uchar* pkt, size_t pkt_len)
+{
+    dnssec_msg_t* m = pkt != NULL ? dnssec_msg_new(v, MSG_ANSWER, pkt, pkt_len) : NULL;
+    if (m != NULL && dnssec_msg_parse(m) == 0) {
+        for (int i = 0; i < m->n_rrs && f->zone == NULL; ++i) {
+            const dnssec_rr_t* rr = &m->rrs[i];
+            if (rr->type == T_SOA && dnssec_name_under(f->name, f->name_len, dnssec_owner(m, rr), rr->owner_len)) {
+                f->zone = dnssec_zone_get(v, dnssec_owner(m, rr), rr->owner_len);
+            }
+        }
+    }
+    if (m != NULL) {
+        dnssec_msg_free(m);
+    }
+
+    dnssec_check_t* c = f->waiters;
+    f->waiters = NULL;
+    while (c != NULL) {
+        dnssec_check_t* next = c->next_waiter;
+        if (f->zone != NULL) {
+            dnssec_wait(v, c, f->zone);
+        } else {
+            dnssec_check_done(v, c, DNSSEC_BOGUS, "zone of %s%s not found", f->str, dnssec_dot(f->str));
+        }
+        c = next;
+    }
+}
+
+/* Interface */
+
+// DS record in master file format: owner [TTL] [class] DS tag algorithm digest-type digest
+static int dnssec_anchor_parse(dnssec_anchor_t* a, char* line)
+{
+    char* save = NULL;
+    char* owner = strtok_r(line, " \t\r\n", &save);
+    char* tok = strtok_r(NULL, " \t\r\n", &save);
+    while (tok != NULL && (isdigit((uchar)tok[0]) || strcasecmp(tok, "IN") == 0)) {
+        tok = strtok_r(NULL, " \t\r\n", &save);
+    }
+    if (owner == NULL || tok == NULL || strcasecmp(tok, "DS") != 0 ||
+        dnssec_name_wire(owner, a->name, &a->name_len) != 0) {
+        return 1;
+    }
+
+    long fields[3];
+    for (int i = 0; i < 3; ++i) {
+        char* end = NULL;
+        tok = strtok_r(NULL, " \t\r\n", &save);
+        fields[i] = tok != NULL ? strtol(tok, &end, 10) : -1;
+        if (tok == NULL || *end != '\0' || fields[i] < 0 || fields[i] > (i == 0 ? 65535 : 255)) {
+            return 1;
+        }
+    }
+    a->ds.tag = fields[0];
+    a->ds.alg = fields[1];
+    a->ds.digest_type = fields[2];
+
+    // The digest may be split into several words
+    a->ds.digest_len = 0;
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        for (; tok[0] != '\0'; tok += 2) {
+            unsigned byte;
+            if (!isxdigit((uchar)tok[0]) || !isxdigit((uchar)tok[1]) || a->ds.digest_len == EVP_MAX_MD_SIZE ||
+                sscanf(tok, "%2x", &byte) != 1) {
+                return 1;
+            }
+            a->ds.digest[a->ds.digest_len++] = byte;
+        }
+    }
+    const EVP_MD* md = dnssec_digest_md(a->ds.digest_type);
+    return md == NULL || a->ds.digest_len != EVP_MD_size(md) ? 1 : 0;
+}
+
+static int dnssec_anchor_add(dns_validator_t* v, char* line, const char* path, int line_no)
+{
+    dnssec_anchor_t* anchors = realloc(v->anchors, (v->n_anchors + 1) * sizeof(dnssec_anchor_t));
+    if (anchors == NULL) {
+        dns_perror(v->err, "realloc failed");
+        return 1;
+    }
+    v->anchors = anchors;
+    if (dnssec_anchor_parse(&v->anchors[v->n_anchors], line) != 0) {
+        dns_error(v->err, "Trust anchor %s:%d: expected 'owner DS tag algorithm digest-type digest'.\n", path, line_no);
+        return 1;
+    }
+    ++v->n_anchors;
+    return 0;
+}
+
+static int dnssec_anchors_load(dns_validator_t* v, const char* path)
+{
+    if (path == NULL) {
+        for (size_t i = 0; i < sizeof(dnssec_root_anchors) / sizeof(dnssec_root_anchors[0]); ++i) {
+            char line[256];
+            strcpy(line, dnssec_root_anchors[i]);
+            if (dnssec_anchor_add(v, line, "built-in", i + 1) != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        dns_perror(v->err, "Trust anchor file can not be opened");
+        return 1;
+    }
+    char line[1024];
+    int line_no = 0, ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+        ++line_no;
+        char* p = line + strspn(line, " \t\r\n");
+        if (*p != '\0' && *p != ';' && *p != '#') {
+            ret = dnssec_anchor_add(v, p, path, line_no);
+        }
+    }
+    fclose(f);
+    if (ret == 0 && v->n_anchors == 0) {
+        dns_error(v->err, "Trust anchor file %s has no DS records.\n", path);
+        ret = 1;
+    }
+    return ret;
+}
+
+dns_validator_t* dns_validator_new(const char* anchor_path, int workers, FILE* err)
+{
+    dns_validator_t* v = calloc(1, sizeof(dns_validator_t));
+    if (v == NULL) {
+        dns_perror(err, "calloc failed");
+        return NULL;
+    }
+    v->err = err;
+    v->pipe_fds[0] = v->pipe_fds[1] = -1;
+    if (dnssec_anchors_load(v, anchor_path) != 0 || dns_dedup_init(&v->names, err) != 0) {
+        free(v->anchors);
+        free(v);
+        return NULL;
+    }
+
+    if (pipe(v->pipe_fds) != 0) {
+        dns_perror(err, "pipe failed");
+        dns_validator_free(v);
+        return NULL;
+    }
+    fcntl(v->pipe_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(v->pipe_fds[1], F_SETFL, O_NONBLOCK);
+
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (int)cpus : 1;
+    }
+    if (workers > DNSSEC_MAX_WORKERS) {
+        workers = DNSSEC_MAX_WORKERS;
+    }
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->cond, NULL);
+    for (v->n_threads = 0; v->n_threads < workers; ++v->n_threads) {
+        if (pthread_create(&v->threads[v->n_threads], NULL, dnssec_worker, v) != 0) {
+            dns_error(err, "Failed creating a thread.\n");
+            dns_validator_free(v);
+            return NULL;
+        }
+    }
+    return v;
+}
+
+void dns_validator_free(dns_validator_t* v)
+{
+    if (v == NULL) {
+        return;
+    }
+    if (v->n_threads > 0) {
+        pthread_mutex_lock(&v->lock);
+        v->stop = true;
+        pthread_cond_broadcast(&v->cond);
+        pthread_mutex_unlock(&v->lock);
+        for (int i = 0; i < v->n_threads; ++i) {
+            pthread_join(v->threads[i], NULL);
+        }
+    }
+    pthread_mutex_destroy(&v->lock);
+    pthread_cond_destroy(&v->cond);
+
+    for (size_t i = 0; i < v->names.count; ++i) {
+        if (v->names.entries[i].qtype == T_DNSKEY && v->objects[i] != NULL) {
+            dnssec_zone_t* z = v->objects[i];
+            for (int k = 0; k < z->n_keys; ++k) {
+                EVP_PKEY_free(z->keys[k].pkey);
+            }
+            free(z->keys);
+            free(z->ds);
+        }
+        free(v->objects[i]);
+    }
+    while (v->ready != NULL) {
+        dnssec_msg_t* next = v->ready->next;
+        dnssec_msg_free(v->ready);
+        v->ready = next;
+    }
+    if (v->pipe_fds[0] >= 0) {
+        close(v->pipe_fds[0]);
+        close(v->pipe_fds[1]);
+    }
+    dns_dedup_free(&v->names);
+    free(v->objects);
+    free(v->reqs);
+    free(v->anchors);
+    free(v);
+}
+
+int dns_validator_fd(const dns_validator_t* v)
+{
+    return v->pipe_fds[0];
+}
+
+void dns_validator_process(dns_validator_t* v)
+{
+    char buf[256];
+    while (read(v->pipe_fds[0], buf, sizeof(buf)) > 0) {
+    }
+
+    pthread_mutex_lock(&v->lock);
+    dnssec_job_t* job = v->finished;
+    v->finished = NULL;
+    pthread_mutex_unlock(&v->lock);
+
+    while (job != NULL) {
+        dnssec_job_t* next = job->next;
+        dnssec_check_t* c = job->check;
+        --v->jobs;
+        --c->jobs;
+        if (job->ok) {
+            c->verified = true;
+            ++v->stats.signatures;
+        }
+        free(job->data);
+        free(job);
+
+        if (c->jobs == 0) {
+            char owner[MAX_NAME_STR_LEN];
+            char tbuf[MAX_TYPE_STR_LEN];
+            dnssec_name_str(c->owner, owner);
+            dnssec_check_done(v, c, c->verified ? DNSSEC_SECURE : DNSSEC_BOGUS, "signature of %s%s %s does not verify",
+                              owner, dnssec_dot(owner), dns_record_type_str(c->type, tbuf));
+        }
+        job = next;
+    }
+}
+
+int dns_validator_next(dns_validator_t* v, size_t* index, const char** name, uint16_t* qtype)
+{
+    if (v->next_req == v->n_reqs) {
+        return 0;
+    }
+    const dnssec_req_t* r = &v->reqs[v->next_req];
+    *index = v->next_req++;
+    if (r->kind == REQ_SOA) {
+        *name = ((dnssec_find_t*)r->target)->str;
+        *qtype = T_SOA;
+    } else {
+        *name = ((dnssec_zone_t*)r->target)->str;
+        *qtype = r->kind == REQ_DS ? T_DS : T_DNSKEY;
+    }
+    return 1;
+}
+
+void dns_validator_chain_done(dns_validator_t* v, const dns_query_t* q, dns_query_status_t status,
+                              const uchar* pkt, size_t pkt_len)
+{
+    const dnssec_req_t* r = &v->reqs[q->index];
+    if (r->kind == REQ_SOA) {
+        dnssec_find_response(v, r->target, status == QUERY_OK ? pkt : NULL, pkt_len);
+        return;
+    }
+
+    dnssec_zone_t* z = r->target;
+    if (status != QUERY_OK) {
+        dnssec_zone_set(v, z, DNSSEC_BOGUS, "no answer to the %s query for %s%s", r->kind == REQ_DS ? "DS" : "DNSKEY",
+                        z->str, dnssec_dot(z->str));
+        return;
+    }
+    dnssec_zone_response(v, z, r->kind, pkt, pkt_len);
+}
+
+void dns_validator_submit(dns_validator_t* v, const dns_query_t* q, const uchar* pkt, size_t pkt_len)
+{
+    dnssec_msg_t* m = dnssec_msg_new(v, MSG_ANSWER, pkt, pkt_len);
+    if (m == NULL) {
+        return; // Reported as never answered, nothing else can be done without memory
+    }
+    m->q = *q;
+    ++v->parked;
+
+    const dns_header_t* header = (const dns_header_t*)m->pkt;
+    if (dnssec_msg_parse(m) != 0) {
+        m->result = DNSSEC_BOGUS;
+        strcpy(m->reason, "malformed response");
+    } else if (header->tc) { // Even over TCP, or the engine has no TCP fallback
+        m->result = DNSSEC_BOGUS;
+        strcpy(m->reason, "truncated response");
+    } else if (header->rcode == 0 || header->rcode == RCODE_NXDOMAIN) {
+        dnssec_msg_start(v, m, dnssec_keep_all);
+        return;
+    } else { // Failures are passed on as they are
+        m->next = NULL;
+        if (v->ready == NULL) {
+            v->ready = m;
+        } else {
+            v->ready_tail->next = m;
+        }
+        v->ready_tail = m;
+        return;
+    }
+    m->open = 1;
+    dnssec_msg_release(v, m);
+}
+
+void dns_validator_deliver(dns_validator_t* v, dns_engine_done_cb done, void* ctx)
+{
+    while (v->ready != NULL) {
+        dnssec_msg_t* m = v->ready;
+        v->ready = m->next;
+        --v->parked;
+        done(ctx, &m->q, QUERY_OK, m->pkt, m->pkt_len);
+        dnssec_msg_free(m);
+    }
+}
+
+bool dns_validator_idle(const dns_validator_t* v)
+{
+    return v->parked == 0 && v->jobs == 0 && v->next_req == v->n_reqs;
+}
+
+void dns_validator_stats(const dns_validator_t* v, dns_validator_stats_t* stats)
+{
+    *stats = v->stats;
+}
+
+#else // !HAVE_OPENSSL
+
+dns_validator_t* dns_validator_new(const char* anchor_path, int workers, FILE* err)
+{
+    dns_error(err, "DNSSEC validation needs OpenSSL, rebuild with 'make TLS=1'.\n");
+    return NULL;
+}
+
+void dns_validator_free(dns_validator_t* v)
+{
+}
+
+int dns_validator_fd(const dns_validator_t* v)
+{
+    return -1;
+}
+
+void dns_validator_process(dns_validator_t* v)
+{
+}
+
+int dns_validator_next(dns_validator_t* v, size_t* index, const char** name, uint16_t* qtype)
+{
+    return 0;
+}
+
+void dns_validator_chain_done(dns_validator_t* v, const dns_query_t* q, dns_query_status_t status,
+                              const uchar* pkt, size_t pkt_len)
+{
+}
+
+void dns_validator_submit(dns_validator_t* v, const dns_query_t* q, const uchar* pkt, size_t pkt_len)
+{
+}
+
+void dns_validator_deliver(dns_validator_t* v, dns_engine_done_cb done, void* ctx)
+{
+}
+
+bool dns_validator_idle(const dns_validator_t* v)
+{
+    return true;
+}
+
+void dns_validator_stats(const dns_validator_t* v, dns_validator_stats_t* stats)
+{
+    memset(stats, 0, sizeof(dns_validator_stats_t));
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_DNSSEC_H__
+#define __DNS_DNSSEC_H__
+
+#define DNSSEC_UDP_SIZE 1232 // EDNS0 payload size, fits the usual MTU without fragments
+#define DNSSEC_MAX_WORKERS 8 // Threads verifying signatures
+#define DNSSEC_MAX_KEYS 16 // Keys of a zone tried for one signature
+
+// Answers counted by outcome, like a validating resolver would report them
+typedef struct {
+    unsigned long secure; // Signed all the way up to a trust anchor, AD is set
+    unsigned long insecure; // In a zone proven to be unsigned
+    unsigned long bogus; // Turned into SERVFAIL
+    unsigned long zones; // Zones whose keys were looked up
+    unsigned long chain_queries; // DS, DNSKEY and SOA queries of the validator
+    unsigned long signatures; // Verified by the workers
+} dns_validator_stats_t;
+
+// Validator of the answers of an engine. Answers are parked until every
+// signed record set in the answer and authority sections is verified with
+// a key of a zone on the chain of trust up to an anchor. The DS and DNSKEY
+// sets of every zone are looked up and validated once and then cached, the
+// signatures are verified by a pool of worker threads.
+//
+// Secure answers get the AD flag, bogus ones are turned into SERVFAIL with
+// the reason written to err, insecure ones are passed on with AD clear.
+// Denial of existence is only proven for DS sets: a zone is insecure if the
+// parent proves with a signed NSEC or NSEC3 record that it has no DS set,
+// bogus if the set is just missing. Other negative answers are only required
+// to carry valid signatures.
+
+// The anchors are DS records in master file format read from anchor_path,
+// the root key signing keys if NULL. workers is 0 for one thread per CPU.
+// Diagnostics go to err, NULL for none. Returns NULL if the validator can
+// not be created.
+dns_validator_t* dns_validator_new(const char* anchor_path, int workers, FILE* err);
+void dns_validator_free(dns_validator_t* v);
+
+// Readable once the workers have results, dns_validator_process() takes them
+int dns_validator_fd(const dns_validator_t* v);
+void dns_validator_process(dns_validator_t* v);
+
+// Query of the chain of trust to send. Returns 0 if there is none now.
+int dns_validator_next(dns_validator_t* v, size_t* index, const char** name, uint16_t* qtype);
+
+// Outcome of a query from dns_validator_next()
+void dns_validator_chain_done(dns_validator_t* v, const dns_query_t* q, dns_query_status_t status,
+                              const uchar* pkt, size_t pkt_len);
+
+// Park the answer to a query of the caller until it is validated
+void dns_validator_submit(dns_validator_t* v, const dns_query_t* q, const uchar* pkt, size_t pkt_len);
+
+// Pass the validated answers on to the completion callback
+void dns_validator_deliver(dns_validator_t* v, dns_engine_done_cb done, void* ctx);
+
+// Nothing is parked or being verified
+bool dns_validator_idle(const dns_validator_t* v);
+
+void dns_validator_stats(const dns_validator_t* v, dns_validator_stats_t* stats);
+
+#endif // !__DNS_DNSSEC_H__
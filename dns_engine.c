@@ -0,0 +1,948 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_cc.h"
+#include "dns_engine.h"
+#include "dns_dnssec.h"
+#include "dns_error.h"
+
+#include <poll.h>
+#include <time.h>
+
+#ifdef HAVE_IO_URING
+#include "dns_uring.h"
+#endif
+
+#define NIL -1
+#define MAX_POLL_FDS (MAX_SERVERS * (SOCK_POOL_SIZE + STREAM_POOL_SIZE) + 1)
+
+#ifdef HAVE_IO_URING
+#define MAX_QUERY_SIZE 512 // Header, the longest name and the question fields fit
+
+// Kinds of io_uring requests, with the server and socket or connection they are for
+#define URING_SEND 1 // UDP query, only failures complete
+#define URING_RECV 2 // Multishot receive on a UDP socket
+#define URING_STREAM_RECV 3 // Multishot receive on a TCP connection
+#define URING_STREAM_SEND 4 // Queued queries of a TCP connection
+#define URING_CANCEL 5
+#define URING_DATA(kind, server, index, gen) \
+    ((uint64_t)(kind) | (uint64_t)(server) << 8 | (uint64_t)(index) << 16 | (uint64_t)(gen) << 40)
+
+// UDP query of a slot, kept in place until the kernel has sent it
+typedef struct {
+    uchar pkt[MAX_QUERY_SIZE];
+    struct iovec iov;
+    struct msghdr msg;
+} dns_uring_send_t;
+
+typedef struct {
+    dns_uring_t ring;
+    dns_uring_send_t* sends; // One per slot
+    struct msghdr recv_msg; // Layout of the datagrams the multishot receives produce
+
+    // TCP connections, a reopened connection gets a new generation so that
+    // completions of the old one are ignored
+    int armed_fd[MAX_SERVERS][STREAM_POOL_SIZE];
+    unsigned gen[MAX_SERVERS][STREAM_POOL_SIZE];
+    bool writing[MAX_SERVERS][STREAM_POOL_SIZE];
+} dns_engine_uring_t;
+#endif
+
+typedef struct {
+    dns_engine_t* e;
+    dns_query_t* slots;
+    int* free_slots; // Stack of unused slot indices
+    int n_free;
+    int head, tail; // In-flight list, the try that expires first is at the head
+    int in_flight;
+    char last_qstr[MAX_NAME_STR_LEN]; // Name, server and socket of the last first try
+    int last_server, last_fd;
+#ifdef HAVE_IO_URING
+    dns_engine_uring_t* u; // Completion based I/O, NULL for poll()
+#endif
+    uchar pkt[BUFFER_SIZE];
+} dns_engine_state_t;
+
+static long dns_elapsed_ms(const struct timespec* from, const struct timespec* to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static void dns_time_add_ms(struct timespec* t, long ms)
+{
+    t->tv_sec += ms / 1000;
+    t->tv_nsec += (ms % 1000) * 1000000L;
+    if (t->tv_nsec >= 1000000000L) {
+        t->tv_sec += 1;
+        t->tv_nsec -= 1000000000L;
+    }
+}
+
+static bool dns_time_before(const struct timespec* a, const struct timespec* b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Insert the query into the in-flight list ordered by expiry. A new try
+// usually expires last, so its place is searched for from the tail.
+static void dns_engine_link(dns_engine_state_t* s, int slot)
+{
+    dns_query_t* q = &s->slots[slot];
+    int after = s->tail;
+    while (after != NIL && dns_time_before(&q->expires, &s->slots[after].expires)) {
+        after = s->slots[after].prev;
+    }
+
+    q->prev = after;
+    q->next = after != NIL ? s->slots[after].next : s->head;
+    if (q->next != NIL) {
+        s->slots[q->next].prev = slot;
+    } else {
+        s->tail = slot;
+    }
+    if (after != NIL) {
+        s->slots[after].next = slot;
+    } else {
+        s->head = slot;
+    }
+    ++s->in_flight;
+    if (s->e->servers[q->server].cc != NULL) {
+        ++s->e->servers[q->server].cc->in_flight;
+    }
+}
+
+static void dns_engine_unlink(dns_engine_state_t* s, int slot)
+{
+    dns_query_t* q = &s->slots[slot];
+    if (q->prev != NIL) {
+        s->slots[q->prev].next = q->next;
+    } else {
+        s->head = q->next;
+    }
+    if (q->next != NIL) {
+        s->slots[q->next].prev = q->prev;
+    } else {
+        s->tail = q->prev;
+    }
+    --s->in_flight;
+    if (s->e->servers[q->server].cc != NULL) {
+        --s->e->servers[q->server].cc->in_flight;
+    }
+}
+
+// Report the query to the caller and give its slot back. With validation
+// answers are passed on once validated, those of the chain go to the validator.
+static void dns_engine_finish(dns_engine_state_t* s, int slot, dns_query_status_t status,
+                              const uchar* pkt, size_t pkt_len)
+{
+    dns_query_t* q = &s->slots[slot];
+    dns_validator_t* v = s->e->validator;
+    if (q->chain) {
+        dns_validator_chain_done(v, q, status, pkt, pkt_len);
+    } else if (v != NULL && status == QUERY_OK) {
+        dns_validator_submit(v, q, pkt, pkt_len);
+    } else {
+        s->e->done(s->e->ctx, q, status, pkt, pkt_len);
+    }
+    s->free_slots[s->n_free++] = slot;
+}
+
+#ifdef HAVE_IO_URING
+// Queue the UDP query, the whole batch is sent with one submit
+static int dns_engine_uring_send(dns_engine_state_t* s, dns_query_t* q, const struct sockaddr* addr,
+                                 socklen_t addr_len, size_t pkt_size)
+{
+    int slot = q - s->slots;
+    dns_uring_send_t* d = &s->u->sends[slot];
+    memcpy(d->pkt, s->pkt, pkt_size);
+    d->iov.iov_base = d->pkt;
+    d->iov.iov_len = pkt_size;
+    memset(&d->msg, 0, sizeof(struct msghdr));
+    d->msg.msg_name = (void*)addr;
+    d->msg.msg_namelen = addr_len;
+    d->msg.msg_iov = &d->iov;
+    d->msg.msg_iovlen = 1;
+
+    struct io_uring_sqe* sqe = dns_uring_sqe(&s->u->ring);
+    if (sqe == NULL) {
+        return 1;
+    }
+    // Without waiting the datagram is sent during the submit or lost like any other,
+    // so the slot can be reused right after
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = q->pend.sock_fd;
+    sqe->addr = (unsigned long)&d->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = URING_DATA(URING_SEND, q->server, slot, 0);
+    return 0;
+}
+#endif
+
+// Connections the current try of the query goes over, NULL for UDP
+static dns_stream_pool_t* dns_engine_streams(dns_engine_state_t* s, const dns_query_t* q)
+{
+    dns_server_t* serv = &s->e->servers[q->server];
+    return q->tcp ? serv->fallback : serv->streams;
+}
+
+// Register the query and send it to the server of its current try
+static int dns_engine_transmit(dns_engine_state_t* s, dns_query_t* q, const struct timespec* now)
+{
+    dns_engine_t* e = s->e;
+    dns_server_t* serv = &e->servers[q->server];
+    dns_stream_pool_t* streams = dns_engine_streams(s, q);
+    q->pend.serv = serv->addr;
+    q->backoff = false;
+
+    dns_stream_conn_t* conn = NULL;
+    if (streams != NULL) {
+        // Connecting is part of the try like waiting for the answer
+        long left = dns_elapsed_ms(now, &q->expires);
+        conn = dns_stream_pick(streams, left > 0 ? (int)left : 1);
+        if (conn == NULL) {
+            return 1;
+        }
+        q->pend.sock_fd = conn->fd;
+    } else if (q->tries == 1 && q->server == s->last_server && strcmp(q->qstr, s->last_qstr) == 0) {
+        // Questions for one name (e.g. A and AAAA) leave together from one socket
+        q->pend.sock_fd = s->last_fd;
+    } else {
+        q->pend.sock_fd = sock_pool_pick(serv->socks);
+        if (q->pend.sock_fd < 0) {
+            return 1;
+        }
+        if (q->tries == 1) {
+            strcpy(s->last_qstr, q->qstr);
+            s->last_server = q->server;
+            s->last_fd = q->pend.sock_fd;
+        }
+    }
+
+    if (dns_pending_add(e->pending, &q->pend) != 0) {
+        return 1;
+    }
+
+    size_t pkt_size = dns_build_query(s->pkt, &q->pend, e->recursion_desired);
+    if (e->validator != NULL) { // Signatures are only sent with the DO flag
+        pkt_size = dns_add_opt(s->pkt, pkt_size, DNSSEC_UDP_SIZE, true);
+    }
+
+    if (conn != NULL) {
+        if (dns_stream_send(streams, conn, s->pkt, pkt_size) != 0) {
+            dns_pending_remove(e->pending, &q->pend);
+            return 1;
+        }
+        return 0;
+    }
+
+    struct sockaddr* server_addr = serv->addr.ipv4 ?
+        (struct sockaddr*)&(serv->addr.addr_ip4) : (struct sockaddr*)&(serv->addr.addr_ip6);
+
+    socklen_t server_addr_len = serv->addr.ipv4 ?
+        sizeof(serv->addr.addr_ip4) : sizeof(serv->addr.addr_ip6);
+
+#ifdef HAVE_IO_URING
+    if (s->u != NULL) {
+        if (dns_engine_uring_send(s, q, server_addr, server_addr_len, pkt_size) != 0) {
+            dns_pending_remove(e->pending, &q->pend);
+            return 1;
+        }
+        return 0;
+    }
+#endif
+
+    if (sendto(q->pend.sock_fd, (char*)s->pkt, pkt_size, 0, server_addr, server_addr_len) < 0) {
+        // A full socket buffer loses the datagram, the next try sends it again
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            return 0;
+        }
+        dns_perror(e->err, "sendto failed");
+        dns_pending_remove(e->pending, &q->pend);
+        return 1;
+    }
+    return 0;
+}
+
+// Send the next try of the query, to the next server. Its answer is awaited
+// until the timeout of the try, but never past the deadline of the query.
+static int dns_engine_try(dns_engine_state_t* s, int slot, const struct timespec* now)
+{
+    dns_engine_t* e = s->e;
+    dns_query_t* q = &s->slots[slot];
+    struct timespec t = *now;
+
+    while (true) {
+        q->server = (q->first_server + q->tries) % e->n_servers;
+        ++q->tries;
+        q->tcp = false;
+
+        q->sent = t;
+        q->expires = t;
+        dns_time_add_ms(&q->expires, e->timeout_ms);
+        if (dns_time_before(&q->deadline, &q->expires)) {
+            q->expires = q->deadline;
+        }
+
+        if (dns_engine_transmit(s, q, &t) == 0) {
+            dns_engine_link(s, slot);
+            return 0;
+        }
+
+        // A server that can not be reached is skipped right away
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        if (q->tries >= e->tries || !dns_time_before(&t, &q->deadline)) {
+            return 1;
+        }
+    }
+}
+
+// Server with the most room in its congestion window for a new query,
+// NIL if all windows are full. Without congestion control the first one.
+static int dns_engine_pick_server(dns_engine_state_t* s)
+{
+    dns_engine_t* e = s->e;
+    if (e->servers[0].cc == NULL) {
+        return 0;
+    }
+
+    int best = NIL, best_room = 0;
+    for (int i = 0; i < e->n_servers; ++i) {
+        int room = dns_cc_room(e->servers[i].cc);
+        if (room > best_room) {
+            best = i;
+            best_room = room;
+        }
+    }
+    return best;
+}
+
+// Take queries from the caller until the window is full. Queries of the
+// validator go first, the answers waiting for them can not be passed on before.
+static void dns_engine_fill(dns_engine_state_t* s, bool* exhausted)
+{
+    dns_engine_t* e = s->e;
+
+    while (s->in_flight < e->window) {
+        int server = dns_engine_pick_server(s);
+        if (server == NIL) {
+            break;
+        }
+
+        size_t index = 0;
+        const char* name = NULL;
+        uint16_t qtype = 0;
+        bool chain = e->validator != NULL && dns_validator_next(e->validator, &index, &name, &qtype);
+        if (!chain && (*exhausted || e->next(e->ctx, &index, &name, &qtype) == 0)) {
+            *exhausted = true;
+            break;
+        }
+
+        int slot = s->free_slots[--s->n_free];
+        dns_query_t* q = &s->slots[slot];
+        memset(&q->pend, 0, sizeof(dns_pending_t));
+        q->chain = chain;
+        q->tcp = false;
+        q->index = index;
+        q->pend.qtype = qtype;
+        q->pend.qclass = 1;
+
+        if (dns_make_qname(name, qtype, q->qstr, q->pend.qname, &q->pend.qname_len) != 0) {
+            strncpy(q->qstr, name, MAX_NAME_STR_LEN - 1);
+            dns_engine_finish(s, slot, QUERY_BAD_NAME, NULL, 0);
+            continue;
+        }
+
+        // All tries of the query share one budget
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        q->first_server = server;
+        q->tries = 0;
+        q->deadline = now;
+        dns_time_add_ms(&q->deadline, e->deadline_ms > 0 ? e->deadline_ms : (long)e->timeout_ms * e->tries);
+
+        if (dns_engine_try(s, slot, &now) != 0) {
+            dns_engine_finish(s, slot, QUERY_SEND_FAILED, NULL, 0);
+        }
+    }
+}
+
+// Complete the query the validated response answers
+static void dns_engine_complete(dns_engine_state_t* s, int fd, const uchar* pkt, size_t pkt_len,
+                                const struct sockaddr* from, socklen_t from_len)
+{
+    dns_pending_t* p = dns_pending_match(s->e->pending, pkt, pkt_len, fd, from, from_len);
+    if (p == NULL) {
+        return;
+    }
+    dns_pending_remove(s->e->pending, p);
+
+    int slot = (dns_query_t*)p - s->slots; // pend is the first member of the query
+    dns_query_t* q = &s->slots[slot];
+    dns_header_t header;
+    memcpy(&header, pkt, sizeof(dns_header_t)); // Matching checked the length
+    dns_cc_t* cc = s->e->servers[q->server].cc;
+    if (cc != NULL && !q->tcp) { // The window is of the UDP queries
+        // Every try has its own ID, so the answer is to the current try
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double rtt_ms = (now.tv_sec - q->sent.tv_sec) * 1000.0 + (now.tv_nsec - q->sent.tv_nsec) / 1e6;
+        dns_cc_answer(cc, rtt_ms, header.rcode == RCODE_REFUSED, &now);
+
+        // Refused because of the rate, the query keeps its place in the window
+        // for another RTT and is then asked again, unless it was the last try
+        if (header.rcode == RCODE_REFUSED && q->tries < s->e->tries) {
+            dns_engine_unlink(s, slot);
+            q->backoff = true;
+            q->expires = now;
+            dns_time_add_ms(&q->expires, cc->srtt_ms > 1 ? (long)cc->srtt_ms : 1);
+            if (dns_time_before(&q->deadline, &q->expires)) {
+                q->expires = q->deadline;
+            }
+            dns_engine_link(s, slot);
+            return;
+        }
+    }
+
+    // Truncated, the try asks again over TCP in the time it has left (RFC 7766 5)
+    if (header.tc && !q->tcp && s->e->servers[q->server].fallback != NULL) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        q->tcp = true;
+        if (dns_engine_transmit(s, q, &now) != 0) {
+            dns_engine_unlink(s, slot);
+            dns_engine_finish(s, slot, QUERY_SEND_FAILED, NULL, 0);
+        }
+        return;
+    }
+    dns_engine_unlink(s, slot);
+    dns_engine_finish(s, slot, QUERY_OK, pkt, pkt_len);
+}
+
+// Read everything that is queued on the socket and complete matching queries
+static int dns_engine_drain(dns_engine_state_t* s, int fd)
+{
+    while (true) {
+        struct sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+
+        ssize_t n = recvfrom(fd, (char*)s->pkt, BUFFER_SIZE, MSG_DONTWAIT, (struct sockaddr*)&from, &from_len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            if (errno == ECONNREFUSED) { // ICMP error of an earlier datagram, not fatal
+                continue;
+            }
+            dns_perror(s->e->err, "recvfrom failed");
+            return 1;
+        }
+
+        dns_engine_complete(s, fd, s->pkt, n, (struct sockaddr*)&from, from_len);
+    }
+}
+
+// Complete the query a response received from a stream connection answers
+static void dns_engine_stream_msg(void* ctx, dns_stream_pool_t* pool, dns_stream_conn_t* conn,
+                                  const uchar* msg, size_t msg_len)
+{
+    dns_engine_state_t* s = ctx;
+    serv_addr_t* serv = &pool->serv;
+
+    // Messages follow each other in the stream at any offset, the header is read in place
+    memcpy(s->pkt, msg, msg_len);
+
+    // The connection can only deliver what the server sent
+    if (serv->ipv4) {
+        dns_engine_complete(s, conn->fd, s->pkt, msg_len, (struct sockaddr*)&serv->addr_ip4, sizeof(serv->addr_ip4));
+    } else {
+        dns_engine_complete(s, conn->fd, s->pkt, msg_len, (struct sockaddr*)&serv->addr_ip6, sizeof(serv->addr_ip6));
+    }
+}
+
+// The answer to the current try of the query is not awaited anymore
+static void dns_engine_forget(dns_engine_state_t* s, dns_query_t* q)
+{
+    dns_pending_remove(s->e->pending, &q->pend);
+
+    dns_stream_pool_t* streams = dns_engine_streams(s, q);
+    if (streams != NULL) {
+        dns_stream_conn_t* conn = dns_stream_by_fd(streams, q->pend.sock_fd);
+        if (conn != NULL && conn->outstanding > 0) {
+            --conn->outstanding;
+        }
+    }
+}
+
+// Send the next try of the queries whose try has run out of time, give up on
+// those without tries or time left. The try that expires first is at the head.
+// Returns how long until the next try expires.
+static int dns_engine_expire(dns_engine_state_t* s)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (s->head != NIL) {
+        int slot = s->head;
+        dns_query_t* q = &s->slots[slot];
+        long left = dns_elapsed_ms(&now, &q->expires);
+        if (left > 0) {
+            return (int)left;
+        }
+        dns_engine_unlink(s, slot);
+        if (!q->backoff) { // The refused try was already accounted for
+            dns_engine_forget(s, q);
+            if (s->e->servers[q->server].cc != NULL) {
+                dns_cc_timeout(s->e->servers[q->server].cc, &now);
+            }
+        }
+
+        if (q->tries >= s->e->tries || !dns_time_before(&now, &q->deadline)) {
+            dns_engine_finish(s, slot, QUERY_TIMEOUT, NULL, 0);
+        } else if (dns_engine_try(s, slot, &now) != 0) {
+            dns_engine_finish(s, slot, QUERY_SEND_FAILED, NULL, 0);
+        }
+    }
+    return s->e->timeout_ms;
+}
+
+// Keep the history of the congestion windows
+static void dns_engine_tick(dns_engine_state_t* s)
+{
+    if (s->e->servers[0].cc == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < s->e->n_servers; ++i) {
+        dns_cc_tick(s->e->servers[i].cc, &now);
+    }
+}
+
+// Sockets to wait on, stream connections are opened and closed as needed
+static int dns_engine_pollset(dns_engine_state_t* s, struct pollfd* pfds)
+{
+    int n = 0;
+    for (int i = 0; i < s->e->n_servers; ++i) {
+        dns_server_t* serv = &s->e->servers[i];
+        dns_stream_pool_t* streams = serv->streams != NULL ? serv->streams : serv->fallback;
+        if (serv->streams == NULL) {
+            for (int j = 0; j < serv->socks->count; ++j) {
+                pfds[n].fd = serv->socks->fds[j];
+                pfds[n++].events = POLLIN;
+            }
+        }
+
+        for (int j = 0; streams != NULL && j < STREAM_POOL_SIZE; ++j) {
+            dns_stream_conn_t* conn = &streams->conns[j];
+            if (conn->fd >= 0) {
+                pfds[n].fd = conn->fd;
+                pfds[n++].events = POLLIN | (dns_stream_wants_write(conn) ? POLLOUT : 0);
+            }
+        }
+    }
+    if (s->e->validator != NULL) { // Signatures checked by the worker threads
+        pfds[n].fd = dns_validator_fd(s->e->validator);
+        pfds[n++].events = POLLIN;
+    }
+    return n;
+}
+
+// Send the unanswered queries of a connection the server closed again over
+// another connection (RFC 7766 6.2.1), this does not count as another try
+static void dns_engine_resend(dns_engine_state_t* s, int fd)
+{
+    // Mark them first, the new connection may get the same descriptor
+    for (int slot = s->head; slot != NIL; slot = s->slots[slot].next) {
+        if (s->slots[slot].pend.sock_fd == fd) {
+            dns_pending_remove(s->e->pending, &s->slots[slot].pend);
+            s->slots[slot].pend.sock_fd = NIL;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int slot = s->head;
+    while (slot != NIL) {
+        dns_query_t* q = &s->slots[slot];
+        int next = q->next;
+        if (q->pend.sock_fd == NIL && dns_engine_transmit(s, q, &now) != 0) {
+            dns_engine_unlink(s, slot);
+            dns_engine_finish(s, slot, QUERY_SEND_FAILED, NULL, 0);
+        }
+        slot = next;
+    }
+}
+
+// Handle the socket poll() reported as ready
+static int dns_engine_ready(dns_engine_state_t* s, const struct pollfd* pfd)
+{
+    if (s->e->validator != NULL && pfd->fd == dns_validator_fd(s->e->validator)) {
+        dns_validator_process(s->e->validator);
+        return 0;
+    }
+    for (int i = 0; i < s->e->n_servers; ++i) {
+        dns_server_t* serv = &s->e->servers[i];
+        dns_stream_pool_t* streams = serv->streams != NULL ? serv->streams : serv->fallback;
+        dns_stream_conn_t* conn = streams != NULL ? dns_stream_by_fd(streams, pfd->fd) : NULL;
+        if (conn == NULL) {
+            continue;
+        }
+        if (pfd->revents & (POLLOUT | POLLERR)) {
+            dns_stream_flush(streams, conn);
+        }
+        if (conn->fd >= 0 && (pfd->revents & (POLLIN | POLLERR | POLLHUP))) {
+            dns_stream_recv(streams, conn, dns_engine_stream_msg, s);
+        }
+        if (conn->fd < 0) {
+            dns_engine_resend(s, pfd->fd);
+        }
+        return 0;
+    }
+    // All servers are asked over the same transport
+    if (s->e->servers[0].streams == NULL && (pfd->revents & (POLLIN | POLLERR))) {
+        return dns_engine_drain(s, pfd->fd);
+    }
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+// Multishot receive, every datagram or piece of the stream completes on its own
+// into a buffer of the buffer ring
+static int dns_engine_uring_recv(dns_engine_state_t* s, int fd, bool datagram, uint64_t data)
+{
+    struct io_uring_sqe* sqe = dns_uring_sqe(&s->u->ring);
+    if (sqe == NULL) {
+        return 1;
+    }
+    sqe->opcode = datagram ? IORING_OP_RECVMSG : IORING_OP_RECV;
+    sqe->fd = fd;
+    if (datagram) { // Source address is needed for the validation
+        sqe->addr = (unsigned long)&s->u->recv_msg;
+        sqe->len = 1;
+    }
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = data;
+    return 0;
+}
+
+// Close the TCP connection and send its unanswered queries again
+static void dns_engine_uring_close(dns_engine_state_t* s, int server, int index)
+{
+    dns_engine_uring_t* u = s->u;
+    dns_stream_conn_t* conn = &s->e->servers[server].streams->conns[index];
+
+    // The receive holds the socket open otherwise
+    struct io_uring_sqe* sqe = dns_uring_sqe(&u->ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_DATA(URING_STREAM_RECV, server, index, u->gen[server][index]);
+        sqe->user_data = URING_DATA(URING_CANCEL, server, index, 0);
+    }
+
+    int fd = conn->fd;
+    dns_stream_close(conn);
+    u->armed_fd[server][index] = NIL;
+    u->writing[server][index] = false;
+    dns_engine_resend(s, fd);
+}
+
+// Arm receives on new TCP connections and hand over the queued queries,
+// one write per connection takes everything queued since the last one
+static int dns_engine_uring_streams(dns_engine_state_t* s)
+{
+    dns_engine_uring_t* u = s->u;
+    for (int i = 0; i < s->e->n_servers; ++i) {
+        dns_stream_pool_t* streams = s->e->servers[i].streams;
+        for (int j = 0; streams != NULL && j < STREAM_POOL_SIZE; ++j) {
+            dns_stream_conn_t* conn = &streams->conns[j];
+            if (conn->fd < 0) {
+                continue;
+            }
+            if (u->armed_fd[i][j] != conn->fd) {
+                ++u->gen[i][j];
+                u->writing[i][j] = false;
+                if (dns_engine_uring_recv(s, conn->fd, false, URING_DATA(URING_STREAM_RECV, i, j, u->gen[i][j])) != 0) {
+                    return 1;
+                }
+                u->armed_fd[i][j] = conn->fd;
+            }
+
+            const uchar* data = NULL;
+            size_t len = u->writing[i][j] ? 0 : dns_stream_write_take(conn, &data);
+            if (len > 0) {
+                struct io_uring_sqe* sqe = dns_uring_sqe(&u->ring);
+                if (sqe == NULL) {
+                    return 1;
+                }
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = conn->fd;
+                sqe->addr = (unsigned long)data;
+                sqe->len = len;
+                sqe->msg_flags = MSG_NOSIGNAL;
+                sqe->user_data = URING_DATA(URING_STREAM_SEND, i, j, u->gen[i][j]);
+                u->writing[i][j] = true;
+            }
+        }
+    }
+    return 0;
+}
+
+// Handle one completion
+static void dns_engine_uring_complete(dns_engine_state_t* s, uint64_t data, int res, unsigned flags)
+{
+    dns_engine_uring_t* u = s->u;
+    int kind = data & 0xFF;
+    int server = (data >> 8) & 0xFF;
+    int index = (data >> 16) & 0xFFFFFF;
+    unsigned gen = data >> 40;
+
+    uchar* buf = NULL;
+    if (flags & IORING_CQE_F_BUFFER) {
+        buf = dns_uring_buf(&u->ring, flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    bool more = flags & IORING_CQE_F_MORE;
+
+    if (kind == URING_RECV) {
+        int fd = s->e->servers[server].socks->fds[index];
+        if (res > 0 && buf != NULL) {
+            struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buf;
+            socklen_t name_len = out->namelen < u->recv_msg.msg_namelen ? out->namelen : u->recv_msg.msg_namelen;
+            uchar* payload = buf + sizeof(struct io_uring_recvmsg_out) + u->recv_msg.msg_namelen;
+            if (!(out->flags & MSG_TRUNC)) {
+                dns_engine_complete(s, fd, payload, out->payloadlen,
+                                    (struct sockaddr*)(buf + sizeof(struct io_uring_recvmsg_out)), name_len);
+            }
+        }
+        // Stopped when the buffers ran out or on an ICMP error, start it again
+        if (!more) {
+            dns_engine_uring_recv(s, fd, true, data);
+        }
+    } else if (kind == URING_STREAM_RECV || kind == URING_STREAM_SEND) {
+        dns_stream_pool_t* streams = s->e->servers[server].streams;
+        dns_stream_conn_t* conn = &streams->conns[index];
+        bool current = gen == u->gen[server][index] && u->armed_fd[server][index] == conn->fd && conn->fd >= 0;
+
+        if (!current) {
+            // Completion of a closed connection
+        } else if (kind == URING_STREAM_SEND) {
+            u->writing[server][index] = false;
+            if (res < 0) {
+                dns_engine_uring_close(s, server, index);
+            } else {
+                dns_stream_write_done(conn, res);
+            }
+        } else if (res > 0) {
+            dns_stream_feed(streams, conn, buf, res, dns_engine_stream_msg, s);
+            if (!more) {
+                dns_engine_uring_recv(s, conn->fd, false, data);
+            }
+        } else if (res == -ENOBUFS) {
+            dns_engine_uring_recv(s, conn->fd, false, data);
+        } else if (!more) { // Closed by the server or reset
+            dns_engine_uring_close(s, server, index);
+        }
+    }
+    // A failed UDP send is a lost datagram, the next try sends it again
+
+    if (buf != NULL) {
+        dns_uring_buf_return(&u->ring, flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+}
+
+// Submit everything queued, wait for completions and handle them
+static int dns_engine_uring_wait(dns_engine_state_t* s, int wait_ms)
+{
+    if (dns_engine_uring_streams(s) != 0 || dns_uring_submit_wait(&s->u->ring, wait_ms) != 0) {
+        return 1;
+    }
+
+    struct io_uring_cqe* cqe;
+    while ((cqe = dns_uring_cqe(&s->u->ring)) != NULL) {
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        dns_uring_cqe_seen(&s->u->ring);
+        dns_engine_uring_complete(s, data, res, flags);
+    }
+    return 0;
+}
+
+// Set up the ring and receive on all UDP sockets, NULL if io_uring can not be used
+static dns_engine_uring_t* dns_engine_uring_start(dns_engine_state_t* s)
+{
+    dns_engine_uring_t* u = calloc(1, sizeof(dns_engine_uring_t));
+    if (u == NULL) {
+        dns_perror(s->e->err, "calloc failed");
+        return NULL;
+    }
+    u->sends = calloc(s->e->window, sizeof(dns_uring_send_t));
+    if (u->sends == NULL || dns_uring_init(&u->ring, s->e->err) != 0) {
+        free(u->sends);
+        free(u);
+        return NULL;
+    }
+    s->u = u;
+
+    u->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+    for (int i = 0; i < s->e->n_servers; ++i) {
+        dns_server_t* serv = &s->e->servers[i];
+        for (int j = 0; j < STREAM_POOL_SIZE; ++j) {
+            u->armed_fd[i][j] = NIL;
+        }
+        if (serv->streams != NULL) {
+            serv->streams->defer_writes = true;
+            continue;
+        }
+        for (int j = 0; j < serv->socks->count; ++j) {
+            dns_engine_uring_recv(s, serv->socks->fds[j], true, URING_DATA(URING_RECV, i, j, 0));
+        }
+    }
+    return u;
+}
+
+static void dns_engine_uring_stop(dns_engine_state_t* s)
+{
+#if VERBOSE == 1
+    dns_error(s->e->err, "io_uring: %lu submits, %lu completions\n", s->u->ring.enters, s->u->ring.completions);
+#endif
+    dns_uring_free(&s->u->ring);
+    for (int i = 0; i < s->e->n_servers; ++i) {
+        dns_stream_pool_t* streams = s->e->servers[i].streams;
+        if (streams != NULL) {
+            // Writes queued but not handed over are lost with the ring, the connections go too
+            for (int j = 0; j < STREAM_POOL_SIZE; ++j) {
+                dns_stream_close(&streams->conns[j]);
+            }
+            streams->defer_writes = false;
+        }
+    }
+    free(s->u->sends);
+    free(s->u);
+    s->u = NULL;
+}
+#endif
+
+int dns_engine_run(dns_engine_t* e)
+{
+    dns_engine_state_t* s = malloc(sizeof(dns_engine_state_t));
+    if (s == NULL) {
+        dns_perror(e->err, "malloc failed");
+        return 1;
+    }
+    s->e = e;
+    s->head = s->tail = NIL;
+    s->in_flight = 0;
+    s->last_qstr[0] = '\0';
+    s->last_server = s->last_fd = NIL;
+    s->slots = calloc(e->window, sizeof(dns_query_t));
+    s->free_slots = calloc(e->window, sizeof(int));
+    if (s->slots == NULL || s->free_slots == NULL) {
+        dns_perror(e->err, "calloc failed");
+        free(s->slots);
+        free(s->free_slots);
+        free(s);
+        return 1;
+    }
+    for (s->n_free = 0; s->n_free < e->window; ++s->n_free) {
+        s->free_slots[s->n_free] = e->window - 1 - s->n_free;
+    }
+
+#ifdef HAVE_IO_URING
+    s->u = NULL;
+    if (e->io_uring && e->validator == NULL && e->servers[0].fallback == NULL) {
+        dns_engine_uring_start(s);
+    }
+#else
+    if (e->io_uring) {
+        dns_error(e->err, "Warning: io_uring is not supported by this build, using poll.\n");
+    }
+#endif
+
+    struct pollfd pfds[MAX_POLL_FDS];
+
+    int ret = 0;
+    bool exhausted = false;
+    while (true) {
+        dns_engine_tick(s);
+        dns_engine_fill(s, &exhausted);
+        if (e->validator != NULL) {
+            dns_validator_deliver(e->validator, e->done, e->ctx);
+        }
+        bool validating = e->validator != NULL && !dns_validator_idle(e->validator);
+        if (exhausted && s->in_flight == 0 && !validating) {
+            break;
+        }
+
+        int wait_ms = dns_engine_expire(s);
+        if (s->in_flight == 0 && !validating) {
+            continue;
+        }
+
+#ifdef HAVE_IO_URING
+        if (s->u != NULL) {
+            if (dns_engine_uring_wait(s, wait_ms) != 0) {
+                ret = 1;
+                break;
+            }
+            dns_engine_expire(s);
+            continue;
+        }
+#endif
+
+        int n_pfds = dns_engine_pollset(s, pfds);
+        int ready = poll(pfds, n_pfds, wait_ms);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            dns_perror(e->err, "poll failed");
+            ret = 1;
+            break;
+        }
+
+        for (int i = 0; i < n_pfds && ready > 0; ++i) {
+            if (pfds[i].revents != 0 && dns_engine_ready(s, &pfds[i]) != 0) {
+                ret = 1;
+                break;
+            }
+        }
+        if (ret != 0) {
+            break;
+        }
+        dns_engine_expire(s);
+    }
+
+    // Whatever is still in flight after an error is reported as failed
+    while (s->head != NIL) {
+        int slot = s->head;
+        dns_pending_remove(e->pending, &s->slots[slot].pend);
+        dns_engine_unlink(s, slot);
+        dns_engine_finish(s, slot, QUERY_SEND_FAILED, NULL, 0);
+    }
+    if (e->validator != NULL) {
+        dns_validator_deliver(e->validator, e->done, e->ctx);
+    }
+
+#ifdef HAVE_IO_URING
+    if (s->u != NULL) {
+        dns_engine_uring_stop(s);
+    }
+#endif
+
+    free(s->slots);
+    free(s->free_slots);
+    free(s);
+    return ret;
+}
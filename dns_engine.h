@@ -0,0 +1,75 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_ENGINE_H__
+#define __DNS_ENGINE_H__
+
+#define DEFAULT_WINDOW 64 // Queries in flight at once
+
+// Outcome of a query passed to the completion callback
+typedef enum {
+    QUERY_OK, // Matching response received
+    QUERY_TIMEOUT, // No response in time
+    QUERY_BAD_NAME, // Name could not be encoded
+    QUERY_SEND_FAILED,
+    QUERY_MALFORMED, // Response could not be decoded, only from dns_resolve_many()
+} dns_query_status_t;
+
+typedef struct {
+    dns_pending_t pend; // Registered in the pending table while in flight
+    char qstr[MAX_NAME_STR_LEN]; // Name as asked (reversed address for PTR)
+    size_t index; // Caller's identifier of the query
+    int server; // Server of the current try
+    int first_server; // Server of the first try, the next tries go to the next ones
+    int tries; // Tries sent so far
+    struct timespec sent; // Start of the current try
+    bool backoff; // The try was refused, the next one waits for the expiry
+    struct timespec deadline; // The query times out at the latest then
+    struct timespec expires; // End of the current try, never past the deadline of the query
+    bool chain; // Asked by the validator for the chain of trust, not by the caller
+    bool tcp; // The UDP answer of the current try was truncated, it is asked again over TCP
+    int prev, next; // Neighbours in the in-flight list (slot indices)
+} dns_query_t;
+
+// Produce the next query to send. Returns 0 once there are no more queries.
+typedef int (*dns_engine_next_cb)(void* ctx, size_t* index, const char** name, uint16_t* qtype);
+
+// Called exactly once for every query. pkt is the validated response for QUERY_OK, NULL otherwise.
+typedef void (*dns_engine_done_cb)(void* ctx, const dns_query_t* q, dns_query_status_t status,
+                                   const uchar* pkt, size_t pkt_len);
+
+// DNSSEC validation of the answers, see dns_dnssec.h
+typedef struct dns_validator dns_validator_t;
+
+// Server the queries are sent to, each has its own sockets or connections
+typedef struct {
+    serv_addr_t addr;
+    sock_pool_t* socks; // UDP transport
+    dns_stream_pool_t* streams; // TCP or TLS transport, used instead of socks if set
+    dns_stream_pool_t* fallback; // TCP connections for truncated UDP answers, NULL to pass them on (not with io_uring)
+    dns_cc_t* cc; // Congestion window of the server, NULL for the fixed window
+} dns_server_t;
+
+typedef struct {
+    dns_server_t servers[MAX_SERVERS]; // Tries of a query go to them in turn
+    int n_servers;
+    dns_pending_table_t* pending;
+    bool recursion_desired;
+    int window; // Maximum number of queries in flight, the congestion windows may allow less
+    int timeout_ms; // Wait for the answer to one try
+    int tries; // Tries of a query before it times out
+    int deadline_ms; // Bound on a query from its first try, 0 for timeout_ms * tries
+    bool io_uring; // Submit sends and receives in batches through io_uring if available
+    dns_validator_t* validator; // Answers are validated before they are passed on, NULL if off
+    FILE* err; // Diagnostics, NULL for none
+
+    dns_engine_next_cb next;
+    dns_engine_done_cb done;
+    void* ctx;
+} dns_engine_t;
+
+// Send all queries produced by the next callback, keeping up to window of them in flight
+int dns_engine_run(dns_engine_t* e);
+
+#endif // !__DNS_ENGINE_H__
@@ -0,0 +1,26 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_error.h"
+
+#include <stdarg.h>
+
+void dns_error(FILE* err, const char* fmt, ...)
+{
+    if (err == NULL) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(err, fmt, ap);
+    va_end(ap);
+}
+
+void dns_perror(FILE* err, const char* what)
+{
+    if (err != NULL) {
+        fprintf(err, "%s: %s\n", what, strerror(errno));
+    }
+}
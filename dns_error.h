@@ -0,0 +1,15 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_ERROR_H__
+#define __DNS_ERROR_H__
+
+// Diagnostics of the library modules go to the stream the caller set up
+// (stderr in the dns program), NULL keeps the library silent
+void dns_error(FILE* err, const char* fmt, ...);
+
+// Like perror(), what is followed by the description of errno
+void dns_perror(FILE* err, const char* what);
+
+#endif // !__DNS_ERROR_H__
@@ -0,0 +1,216 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_input.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Size of the fixed part of a spill record: line_no, qtype, name_len
+#define SPILL_HEADER_SIZE (sizeof(uint64_t) + sizeof(uint16_t) + sizeof(uint8_t))
+
+static int dns_input_map(dns_input_t* in, int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat failed");
+        return 1;
+    }
+
+    in->size = st.st_size;
+    in->data = NULL;
+    if (in->size == 0) { // Nothing to map
+        return 0;
+    }
+
+    void* data = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap failed");
+        return 1;
+    }
+    posix_madvise(data, in->size, POSIX_MADV_SEQUENTIAL);
+    in->data = data;
+    return 0;
+}
+
+int dns_input_open_file(dns_input_t* in, const char* path, uint16_t default_qtype)
+{
+    memset(in, 0, sizeof(dns_input_t));
+    in->kind = INPUT_TEXT;
+    in->default_qtype = default_qtype;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open input file %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    int ret = dns_input_map(in, fd);
+    close(fd); // The mapping stays valid
+    return ret;
+}
+
+int dns_input_open_spill(dns_input_t* in, FILE* f)
+{
+    memset(in, 0, sizeof(dns_input_t));
+    in->kind = INPUT_SPILL;
+
+    if (fflush(f) != 0) {
+        perror("fflush failed");
+        return 1;
+    }
+    return dns_input_map(in, fileno(f));
+}
+
+void dns_input_close(dns_input_t* in)
+{
+    if (in->data != NULL) {
+        munmap((void*)in->data, in->size);
+    }
+    in->data = NULL;
+    in->size = 0;
+}
+
+void dns_input_rewind(dns_input_t* in)
+{
+    in->pos = 0;
+    in->line_no = 0;
+    in->rewound = true; // Malformed lines were reported the first time
+}
+
+// Split the line into the name and the optional type column and normalize the name
+static bool dns_input_parse_line(dns_input_t* in, const char* line, size_t len, dns_input_entry_t* e)
+{
+    size_t i = 0;
+    while (i < len && isspace((uchar)line[i])) {
+        ++i;
+    }
+    if (i == len || line[i] == '#') { // Empty line or comment
+        return false;
+    }
+
+    size_t name_start = i;
+    while (i < len && !isspace((uchar)line[i])) {
+        ++i;
+    }
+    size_t name_end = i;
+
+    // Names are case-insensitive and www.github.com. is the same as www.github.com,
+    // only the root label may follow the last dot
+    if (name_end > name_start && line[name_end-1] == '.') {
+        --name_end;
+    }
+    if (name_end > name_start && line[name_end-1] == '.') {
+        if (!in->rewound) {
+            ++in->malformed;
+            fprintf(stderr, "Error: Invalid query name %.*s on line %llu.\n", (int)(i - name_start),
+                    line + name_start, (unsigned long long)in->line_no);
+        }
+        return false;
+    }
+    size_t name_len = name_end - name_start;
+    if (name_len > INPUT_MAX_NAME_LEN) {
+        name_len = INPUT_MAX_NAME_LEN;
+    }
+    for (size_t j = 0; j < name_len; ++j) {
+        e->name[j] = tolower((uchar)line[name_start + j]);
+    }
+    e->name[name_len] = '\0';
+    e->name_len = name_len;
+
+    while (i < len && isspace((uchar)line[i])) {
+        ++i;
+    }
+    size_t type_start = i;
+    while (i < len && !isspace((uchar)line[i])) {
+        ++i;
+    }
+
+    e->qtype = in->default_qtype;
+    if (i > type_start) {
+        char type_str[16];
+        size_t type_len = i - type_start;
+        if (type_len >= sizeof(type_str)) {
+            e->qtype = 0;
+        } else {
+            memcpy(type_str, line + type_start, type_len);
+            type_str[type_len] = '\0';
+            e->qtype = dns_record_type_from_str(type_str);
+        }
+        if (e->qtype == 0) { // Nothing to ask for
+            if (!in->rewound) {
+                ++in->malformed;
+                fprintf(stderr, "Error: Unknown record type for %s on line %llu.\n", e->name,
+                        (unsigned long long)in->line_no);
+            }
+            return false;
+        }
+    }
+    e->line_no = in->line_no;
+    return true;
+}
+
+static int dns_input_next_text(dns_input_t* in, dns_input_entry_t* e)
+{
+    while (in->pos < in->size) {
+        const char* line = in->data + in->pos;
+        size_t left = in->size - in->pos;
+        const char* nl = memchr(line, '\n', left);
+        size_t len = nl ? (size_t)(nl - line) : left;
+
+        in->pos += nl ? len + 1 : len;
+        ++in->line_no;
+
+        if (dns_input_parse_line(in, line, len, e)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int dns_input_next_spill(dns_input_t* in, dns_input_entry_t* e)
+{
+    if (in->pos + SPILL_HEADER_SIZE > in->size) {
+        return 0;
+    }
+    const char* p = in->data + in->pos;
+    memcpy(&e->line_no, p, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    memcpy(&e->qtype, p, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    e->name_len = (uint8_t)*p++;
+
+    if (in->pos + SPILL_HEADER_SIZE + e->name_len > in->size) {
+        return 0; // Truncated record
+    }
+    memcpy(e->name, p, e->name_len);
+    e->name[e->name_len] = '\0';
+
+    in->pos += SPILL_HEADER_SIZE + e->name_len;
+    in->line_no = e->line_no;
+    return 1;
+}
+
+int dns_input_next(dns_input_t* in, dns_input_entry_t* e)
+{
+    return in->kind == INPUT_TEXT ? dns_input_next_text(in, e) : dns_input_next_spill(in, e);
+}
+
+int dns_input_write_spill(FILE* f, const dns_input_entry_t* e)
+{
+    if (fwrite(&e->line_no, sizeof(uint64_t), 1, f) != 1 ||
+        fwrite(&e->qtype, sizeof(uint16_t), 1, f) != 1 ||
+        fwrite(&e->name_len, sizeof(uint8_t), 1, f) != 1 ||
+        fwrite(e->name, 1, e->name_len, f) != e->name_len) {
+        perror("Failed writing spill file");
+        return 1;
+    }
+    return 0;
+}
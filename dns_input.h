@@ -0,0 +1,51 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_INPUT_H__
+#define __DNS_INPUT_H__
+
+#define INPUT_MAX_NAME_LEN 255 // Longer names are cut, they fail to encode anyway
+
+typedef enum {
+    INPUT_TEXT, // Domain list, one "name [type]" per line
+    INPUT_SPILL, // Normalized entries written by dns_input_write_spill()
+} dns_input_kind_t;
+
+// Memory mapped input read sequentially
+typedef struct {
+    dns_input_kind_t kind;
+    const char* data;
+    size_t size;
+    size_t pos;
+    uint64_t line_no;
+    uint16_t default_qtype;
+    uint64_t malformed; // Lines skipped as malformed, each reported on stderr once
+    bool rewound;
+} dns_input_t;
+
+typedef struct {
+    uint64_t line_no; // 1-based line of the original input
+    uint16_t qtype;
+    uint8_t name_len;
+    char name[INPUT_MAX_NAME_LEN + 1]; // Lowercase, without the trailing dot
+} dns_input_entry_t;
+
+// Map a domain list, lines without a type column are asked for default_qtype
+int dns_input_open_file(dns_input_t* in, const char* path, uint16_t default_qtype);
+
+// Map a spill file, the whole file must have been written already
+int dns_input_open_spill(dns_input_t* in, FILE* f);
+
+void dns_input_close(dns_input_t* in);
+
+// Start reading from the beginning again
+void dns_input_rewind(dns_input_t* in);
+
+// Read the next entry, empty lines, '#' comments and malformed lines are skipped.
+// Returns 0 at the end of the input.
+int dns_input_next(dns_input_t* in, dns_input_entry_t* e);
+
+int dns_input_write_spill(FILE* f, const dns_input_entry_t* e);
+
+#endif // !__DNS_INPUT_H__
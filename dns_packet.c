@@ -3,12 +3,16 @@
  */
 
 #include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
 #include "dns_packet.h"
+#include "dns_error.h"
 
-uchar buf[BUFFER_SIZE];
+#include <strings.h> // strcasecmp
 
 
-int dns_domain_to_ip(const char* server_domain_name, serv_addr_t* serv)
+int dns_domain_to_ip(const char* server_domain_name, serv_addr_t* serv, FILE* err)
 {
     struct addrinfo gai_hints; //ipv4, udp
     memset(&gai_hints, 0, sizeof(struct addrinfo));
@@ -20,22 +24,22 @@ int dns_domain_to_ip(const char* server_domain_name, serv_addr_t* serv)
     gai_hints.ai_protocol = IPPROTO_UDP;
 
 #if VERBOSE == 1
-    printf("Resolving server domain name: %s... ", server_domain_name);
+    dns_error(err, "Resolving server domain name: %s... ", server_domain_name);
 #endif
 
     struct addrinfo* gai_ret = NULL;
     int addr_err = 0;
     if ((addr_err = getaddrinfo(server_domain_name, "53", &gai_hints, &gai_ret)) != 0 || gai_ret == NULL) {
-        fprintf(stderr, "(getaddrinfo) Failed to resolve server address: %s.\n", gai_strerror(addr_err));
+        dns_error(err, "(getaddrinfo) Failed to resolve server address: %s.\n", gai_strerror(addr_err));
         return 1;
     }
 
 #if VERBOSE == 1
-    printf("Done\n");
+    dns_error(err, "Done\n");
 #endif    
     
 #if VERBOSE == 1
-    printf("Available addresses:\n");
+    dns_error(err, "Available addresses:\n");
     char tmpbuf[INET6_ADDRSTRLEN];
 #endif
     
@@ -57,7 +61,7 @@ int dns_domain_to_ip(const char* server_domain_name, serv_addr_t* serv)
             struct sockaddr_in6* ip6 = (struct sockaddr_in6*)ai_tmp->ai_addr;
             inet_ntop(AF_INET6, &ip6->sin6_addr, tmpbuf, INET6_ADDRSTRLEN);
         }
-        printf("\t%s\n", tmpbuf);
+        dns_error(err, "\t%s\n", tmpbuf);
 #endif        
     }
 
@@ -73,7 +77,7 @@ int dns_domain_to_ip(const char* server_domain_name, serv_addr_t* serv)
     }
 
 #if VERBOSE == 1    
-    printf("Proceeding with %s address: %s\n\n", (ip4_found ? "IPv4" : "IPv6"), server_ip);
+    dns_error(err, "Proceeding with %s address\n\n", (ip4_found ? "IPv4" : "IPv6"));
 #endif    
     
     freeaddrinfo(gai_ret);
@@ -83,62 +87,99 @@ int dns_domain_to_ip(const char* server_domain_name, serv_addr_t* serv)
 
 
 
-const char* dns_record_type_to_str(uint16_t type)
+const char* dns_record_type_name(uint16_t type)
 {
-    static char tbuf[16];
-    memset(tbuf, 0, 16);
-
     switch (type)
     {
     case T_A:
-        memcpy(tbuf, "A", 1);
-        break;
+        return "A";
     case T_AAAA:
-        memcpy(tbuf, "AAAA", 4);
-        break;
+        return "AAAA";
     case T_CNAME:
-        memcpy(tbuf, "CNAME", 5);
-        break;
+        return "CNAME";
     case T_SOA:
-        memcpy(tbuf, "SOA", 3);
-        break;
+        return "SOA";
     case T_PTR:
-        memcpy(tbuf, "PTR", 3);
-        break;
+        return "PTR";
     case T_NS:
-        memcpy(tbuf, "NS", 2);
-        break;
+        return "NS";
+    case T_MX:
+        return "MX";
+    case T_TXT:
+        return "TXT";
+    case T_DS:
+        return "DS";
+    case T_RRSIG:
+        return "RRSIG";
+    case T_NSEC:
+        return "NSEC";
+    case T_DNSKEY:
+        return "DNSKEY";
+    case T_NSEC3:
+        return "NSEC3";
     default:
-        snprintf(tbuf, 15, "%d", type);
-        break;
+        return NULL;
+    }
+}
+
+const char* dns_record_type_str(uint16_t type, char* buf)
+{
+    const char* name = dns_record_type_name(type);
+    if (name != NULL) {
+        return name;
+    }
+    snprintf(buf, MAX_TYPE_STR_LEN, "%d", type);
+    return buf;
+}
+
+uint16_t dns_record_type_from_str(const char* str)
+{
+    static const struct {
+        const char* name;
+        uint16_t type;
+    } types[] = {
+        { "A", T_A }, { "AAAA", T_AAAA }, { "CNAME", T_CNAME }, { "SOA", T_SOA },
+        { "PTR", T_PTR }, { "NS", T_NS }, { "MX", T_MX }, { "TXT", T_TXT },
+        { "DS", T_DS }, { "RRSIG", T_RRSIG }, { "NSEC", T_NSEC }, { "DNSKEY", T_DNSKEY },
+        { "NSEC3", T_NSEC3 },
+    };
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        if (strcasecmp(str, types[i].name) == 0) {
+            return types[i].type;
+        }
+    }
+
+    // Numeric type, e.g. 65 or TYPE65 (RFC 3597)
+    if (strncasecmp(str, "TYPE", 4) == 0) {
+        str += 4;
+    }
+    char* end = NULL;
+    long type = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || type <= 0 || type > 65535) {
+        return 0;
     }
-    return tbuf;
+    return (uint16_t)type;
 }
 
-int dns_parse_rcode(uint8_t rcode)
+const char* dns_rcode_to_str(uint8_t rcode)
 {
     switch (rcode) {
-        case 0: // Success
-            break;
+        case 0:
+            return "Success.";
         case 1:
-            fprintf(stderr, "Error: Server was unable to interpret the query.\n");
-            break;
+            return "Server was unable to interpret the query.";
         case 2:
-            fprintf(stderr, "Error: Name server failure.\n");
-            break;
+            return "Name server failure.";
         case 3:
-            fprintf(stderr, "Error: Authoritative server: domain name does not exist.\n");
-            break;
+            return "Authoritative server: domain name does not exist.";
         case 4:
-            fprintf(stderr, "Error: Not implemented: name server does not support this kind of query.\n");
-            break;
+            return "Not implemented: name server does not support this kind of query.";
         case 5:
-            fprintf(stderr, "Error: Refused for policy reasons.\n");
-            break;
+            return "Refused for policy reasons.";
         default:
-            break;
+            return "Unknown response code.";
     }
-    return rcode != 0;
 }
 
 
@@ -156,6 +197,7 @@ void dns_encode_name(uchar* dst, uchar* src)
             dst[i+1] = src[i];
         }
     }
+    dst[di] = 0; // The root label
 
     src[strlen((char*)src)-1] = '\0';
 }
@@ -170,8 +212,7 @@ int dns_reverse_ipv4(char* out_addr, const char* in_addr) {
         memcpy(&ipv4_addr.s_addr, &addr_value, sizeof(addr_value));
         inet_ntop(AF_INET, &ipv4_addr, out_addr, INET_ADDRSTRLEN);
     } else {
-        fprintf(stderr, "Invalid IPv4 address %s.\n", in_addr);
-        return 1;
+        return 1; // Invalid IPv4 address
     }
 
     strcat(out_addr, ".in-addr.arpa");
@@ -192,8 +233,7 @@ int dns_reverse_ipv6(char* out_addr, const char* in_addr) {
             }
         }
     } else {
-        fprintf(stderr, "Invalid IPv6 address: %s\n", in_addr);
-        return 0;
+        return 1; // Invalid IPv6 address
     }
 
     int j = 0;
@@ -207,79 +247,78 @@ int dns_reverse_ipv6(char* out_addr, const char* in_addr) {
         }
         j += 2;
     }
+    out_addr[j - 1] = '\0';
 
     strcat(out_addr, ".ip6.arpa");
     return 0;
 }
 
 
-
-uchar* dns_read_name(uchar* reader, uchar* buffer, int* name_len)
+int dns_make_qname(const char* domain_or_ip, uint16_t query_type, char* qstr, uchar* qname, int* qname_len)
 {
-    // The logic of the function implementation is inspired by: 
-    // https://www.binarytides.com/dns-query-code-in-c-with-linux-sockets/
-    // (License not specified)
-    
-    uchar *name = (uchar*)malloc(256);
-    memset(name, 0, 256);
- 
-    *name_len = 1;
- 
-    bool jumped = false;
-    unsigned int offset = 0;
-    unsigned int p = 0;
-    // Read the names in e.g. 3www6github3com format
-    while (*reader != '\0') {
-        uchar msb = *reader;
-        uchar lsb = *(reader+1);
+    memset(qstr, 0, MAX_NAME_STR_LEN);
 
-        // If msb is 11XX XXXX then we have a pointer to another location
-        if (msb >= 192) { // 192 = 1100 0000 
-            offset = msb * 256 - 49152 + lsb; // 49152 = 1100 0000  0000 0000
-            reader = buffer + offset - 1;
-            jumped = true; // We have jumped to another location so name_len won't be incremented
-        } else {
-            name[p] = *reader;
-            ++p;
+    if (query_type != T_PTR) { // Forward query
+        if (strcmp(domain_or_ip, ".") == 0) { // The root, e.g. for its DNSKEY
+            domain_or_ip = "";
         }
- 
-        reader += 1;
- 
-        if (!jumped) {
-            *name_len += 1;
+        size_t len = strlen(domain_or_ip);
+        if (len > 1 && domain_or_ip[len - 1] == '.') { // Absolute name, the root label is added while encoding
+            --len;
         }
-    }
- 
-    name[p] = '\0';
-    if (jumped) {
-        *name_len += 1; // Number of steps moved forward in the packet
-    }
- 
-    // Now convert e.g. 3www6github3com to www.github.com
-    int i = 0;
-    for (; i < (int)strlen((const char*)name); ++i) {
-        p = name[i];
-        for (int j = 0; j < (int)p; ++j) {
-            name[i] = name[i+1];
-            ++i;
+        if (len >= MAX_NAME_STR_LEN - 2) { // Leave space for the dot added while encoding
+            return 1;
+        }
+        memcpy(qstr, domain_or_ip, len);
+    } else { // Reverse query
+        struct in_addr ipv4;
+        struct in6_addr ipv6;
+
+        // Attempt to parse the address as IPv4
+        if (inet_pton(AF_INET, domain_or_ip, &ipv4) == 1) {
+            // Reverse the bytes in IP address and append .IN-ADDR.ARPA
+            if (dns_reverse_ipv4(qstr, domain_or_ip) != 0) {
+                return 1;
+            }
+        // Attempt to parse the address as IPv6 
+        } else if (inet_pton(AF_INET6, domain_or_ip, &ipv6) == 1) {
+            // Reverse the IPv6 address and append .IP6.ARPA
+            if (dns_reverse_ipv6(qstr, domain_or_ip) != 0) {
+                return 1;
+            }
+        } else {
+            return 1; // Not a valid IPv4 or IPv6 address
         }
-        name[i] = '.';
     }
 
-    if (i > 0) {
-        name[i-1] = '\0'; // Remove the last dot
+    // Every label must have 1 to 63 characters
+    const char* label = qstr;
+    while (qstr[0] != '\0') {
+        const char* dot = strchr(label, '.');
+        size_t label_len = dot ? (size_t)(dot - label) : strlen(label);
+        if (label_len == 0 || label_len > 63) {
+            return 1;
+        }
+        if (dot == NULL) {
+            break;
+        }
+        label = dot + 1;
     }
 
-    return name;
+    // Encode the resulting domain name
+    memset(qname, 0, MAX_NAME_STR_LEN);
+    dns_encode_name(qname, (uchar*)qstr);
+    *qname_len = strlen((const char*)qname) + 1;
+    return 0;
 }
 
-
-int dns_send_question(int sock_fd, serv_addr_t serv, char* domain_or_ip, bool recursion_desired, uint16_t query_type)
+size_t dns_build_query(uchar* out, const dns_pending_t* q, bool recursion_desired)
 {
     // Fill in the DNS header
-    dns_header_t *dns = (dns_header_t*)&buf;
-    
-    dns->id = (uint16_t)htons(getpid());
+    dns_header_t* dns = (dns_header_t*)out;
+    memset(dns, 0, sizeof(dns_header_t));
+
+    dns->id = htons(q->id);
     dns->rd = recursion_desired;
     dns->tc = 0; // This message is not truncated
     dns->aa = 0; // Not Authoritative
@@ -295,220 +334,340 @@ int dns_send_question(int sock_fd, serv_addr_t serv, char* domain_or_ip, bool re
     dns->add_count = 0;
 
     // Point to the query portion
-    uchar* qname = (uchar*)&buf[sizeof(dns_header_t)];
+    uchar* qname = out + sizeof(dns_header_t);
+    memcpy(qname, q->qname, q->qname_len);
 
-    char out_address[INET6_ADDRSTRLEN*2+9];
-    memset(out_address, 0, INET6_ADDRSTRLEN*2+9);
-    
-    if (query_type != T_PTR) { // Forward query
-        memcpy(out_address, domain_or_ip, strlen(domain_or_ip));
-    } else { // Reverse query
-        struct in_addr ipv4;
-        struct in6_addr ipv6;
+    // Point to the qinfo section
+    dns_qdata_t qinfo;
+    qinfo.qtype  = htons(q->qtype);
+    qinfo.qclass = htons(q->qclass);
+    memcpy(qname + q->qname_len, &qinfo, sizeof(dns_qdata_t));
 
-        // Attempt to parse the address as IPv4
-        if (inet_pton(AF_INET, domain_or_ip, &ipv4) == 1) {
-            // Reverse the bytes in IP address and append .IN-ADDR.ARPA
-            if (dns_reverse_ipv4(out_address, domain_or_ip) != 0) {
+    return sizeof(dns_header_t) + q->qname_len + sizeof(dns_qdata_t);
+}
+
+size_t dns_add_opt(uchar* out, size_t len, uint16_t udp_size, bool dnssec_ok)
+{
+    dns_header_t* dns = (dns_header_t*)out;
+    dns->add_count = htons(ntohs(dns->add_count) + 1);
+    if (dnssec_ok) {
+        dns->cd = 1; // The answers are validated here, the resolver passes on even bogus ones
+    }
+
+    uchar* opt = out + len;
+    opt[0] = 0; // Root owner
+    dns_ansdata_t data;
+    data.type = htons(T_OPT);
+    data.class = htons(udp_size); // Payload size the client can receive
+    data.ttl = htonl(dnssec_ok ? 0x8000 : 0); // Extended rcode, version 0, DO flag
+    data.data_len = 0;
+    memcpy(opt + 1, &data, sizeof(dns_ansdata_t));
+    return len + 1 + sizeof(dns_ansdata_t);
+}
+
+
+int dns_read_name(const uchar* reader, const uchar* msg, size_t msg_len, char* name, int* name_len)
+{
+    // The logic of the function implementation is inspired by: 
+    // https://www.binarytides.com/dns-query-code-in-c-with-linux-sockets/
+    // (License not specified)
+
+    const uchar* end = msg + msg_len;
+
+    *name_len = 0;
+
+    bool jumped = false;
+    int jumps = 0;
+    int p = 0;
+    // Read the names in e.g. 3www6github3com format
+    while (true) {
+        if (reader >= end) {
+            return 1;
+        }
+
+        uchar msb = *reader;
+
+        // If msb is 11XX XXXX then we have a pointer to another location
+        if (msb >= 192) { // 192 = 1100 0000
+            if (reader + 1 >= end) {
                 return 1;
             }
-        // Attempt to parse the address as IPv6 
-        } else if (inet_pton(AF_INET6, domain_or_ip, &ipv6) == 1) {
-            // Reverse the IPv6 address and append .IP6.ARPA
-            if (dns_reverse_ipv6(out_address, domain_or_ip) != 0) {
+            unsigned int offset = (msb & 0x3F) * 256 + *(reader+1);
+            if (!jumped) {
+                *name_len += 2; // Number of steps moved forward in the packet
+            }
+            // Pointers may only point backwards, which also rules out loops
+            if (offset >= (unsigned int)(reader - msg) || ++jumps > MAX_NAME_JUMPS) {
                 return 1;
             }
-        } else {
-            fprintf(stderr, "Not a valid IPv4 or IPv6 address: %s\n", domain_or_ip);
+            reader = msg + offset;
+            jumped = true; // We have jumped to another location so name_len won't be incremented
+            continue;
+        } else if (msb >= 64) { // Reserved label types
             return 1;
         }
-    }
 
-    // Encode the resulting domain name
-    dns_encode_name(qname, (uchar*)out_address);
+        if (!jumped) {
+            *name_len += 1 + msb;
+        }
+        if (msb == 0) {
+            break;
+        }
 
-    // Point to the qinfo section
-    dns_qdata_t* qinfo = (dns_qdata_t*)&buf[sizeof(dns_header_t) + (strlen((const char*)qname) + 1)];
- 
-    qinfo->qtype  = htons(query_type);
-    qinfo->qclass = htons(1);
+        // Now convert e.g. 3www6github3com to www.github.com
+        if (reader + 1 + msb > end || p + msb + 1 >= MAX_NAME_STR_LEN) {
+            return 1;
+        }
+        if (p > 0) {
+            name[p++] = '.';
+        }
+        memcpy(name + p, reader + 1, msb);
+        p += msb;
+        reader += 1 + msb;
+    }
 
-#if VERBOSE == 1 
-    printf("Resolving %s" , domain_or_ip);
+    name[p] = '\0';
+    return 0;
+}
 
-    printf("\nSending Packet... ");
-#endif    
+uint16_t dns_key_tag(const uchar* rdata, size_t len)
+{
+    if (len >= 4 && rdata[3] == 1) { // RSA/MD5 keys use the low bits of the modulus
+        return (rdata[len - 3] << 8) | rdata[len - 2];
+    }
+    uint32_t ac = 0;
+    for (size_t i = 0; i < len; ++i) {
+        ac += (i & 1) ? rdata[i] : (uint32_t)rdata[i] << 8;
+    }
+    ac += (ac >> 16) & 0xFFFF;
+    return ac & 0xFFFF;
+}
 
-    // Send the packet to the server
-    size_t pkt_size = sizeof(dns_header_t) + (strlen((const char*)qname)+1) + sizeof(dns_qdata_t);
+// Signature time as YYYYMMDDHHmmSS (RFC 4034 3.2)
+static int dns_format_sig_time(char* out, size_t size, uint32_t t)
+{
+    time_t tt = t;
+    struct tm tm;
+    gmtime_r(&tt, &tm);
+    return strftime(out, size, "%Y%m%d%H%M%S", &tm);
+}
 
-    struct sockaddr* server_addr = serv.ipv4 ? 
-        (struct sockaddr*)&(serv.addr_ip4) : (struct sockaddr*)&(serv.addr_ip6);
-    
-    socklen_t server_addr_len = serv.ipv4 ? 
-        sizeof(serv.addr_ip4) : sizeof(serv.addr_ip6);
+// DNSSEC records in presentation form, keys and signatures are left out
+static int dns_format_dnssec(dns_record_t* rec, const uchar* rdata, uint16_t rdata_len,
+                             const uchar* msg, size_t msg_len)
+{
+    char* out = rec->rdata;
+    size_t size = MAX_RDATA_STR_LEN;
+    int name_len = 0;
 
-    if (sendto(sock_fd, (char*)buf, pkt_size, 0, server_addr, server_addr_len) < 0) {
-        perror("sendto failed");
-        return 1;
+    switch (rec->type) {
+        case T_DS: // Tag, algorithm, digest type, digest
+        case T_DNSKEY: { // Flags, protocol, algorithm, the key only by its tag
+            if (rdata_len < 4) {
+                return 1;
+            }
+            if (rec->type == T_DNSKEY) {
+                snprintf(out, size, "%u %u %u (key tag %u)", (rdata[0] << 8) | rdata[1], rdata[2], rdata[3],
+                         dns_key_tag(rdata, rdata_len));
+                return 0;
+            }
+            size_t n = snprintf(out, size, "%u %u %u ", (rdata[0] << 8) | rdata[1], rdata[2], rdata[3]);
+            for (int i = 4; i < rdata_len && n + 3 < size; ++i) {
+                n += snprintf(out + n, size - n, "%02X", rdata[i]);
+            }
+            return 0;
+        }
+        case T_RRSIG: { // Covered type, algorithm, labels, TTL, expiration, inception, tag, signer
+            if (rdata_len < 19) {
+                return 1;
+            }
+            uint32_t ttl = ((uint32_t)rdata[4] << 24) | (rdata[5] << 16) | (rdata[6] << 8) | rdata[7];
+            uint32_t exp = ((uint32_t)rdata[8] << 24) | (rdata[9] << 16) | (rdata[10] << 8) | rdata[11];
+            uint32_t inc = ((uint32_t)rdata[12] << 24) | (rdata[13] << 16) | (rdata[14] << 8) | rdata[15];
+            char exp_str[16], inc_str[16];
+            dns_format_sig_time(exp_str, sizeof(exp_str), exp);
+            dns_format_sig_time(inc_str, sizeof(inc_str), inc);
+
+            const char* covered = dns_record_type_name((rdata[0] << 8) | rdata[1]);
+            int n = covered != NULL ? snprintf(out, size, "%s ", covered) :
+                snprintf(out, size, "TYPE%u ", (rdata[0] << 8) | rdata[1]);
+            n += snprintf(out + n, size - n, "%u %u %u %s %s %u ", rdata[2], rdata[3], ttl, exp_str, inc_str,
+                          (rdata[16] << 8) | rdata[17]);
+            if (dns_read_name(rdata + 18, msg, msg_len, out + n, &name_len) != 0 || 18 + name_len > rdata_len) {
+                return 1;
+            }
+            strcat(out, ".");
+            return 0;
+        }
+        case T_NSEC: { // Next owner name, types of the owner
+            if (dns_read_name(rdata, msg, msg_len, out, &name_len) != 0 || name_len > rdata_len) {
+                return 1;
+            }
+            strcat(out, ".");
+            size_t n = strlen(out);
+            for (int i = name_len; i + 2 <= rdata_len; ) {
+                int window = rdata[i], len = rdata[i + 1];
+                if (len == 0 || len > 32 || i + 2 + len > rdata_len) {
+                    return 1;
+                }
+                for (int bit = 0; bit < len * 8; ++bit) {
+                    if (!(rdata[i + 2 + bit / 8] & (0x80 >> (bit % 8)))) {
+                        continue;
+                    }
+                    uint16_t type = window * 256 + bit;
+                    const char* name = dns_record_type_name(type);
+                    char num[16];
+                    if (name == NULL) {
+                        snprintf(num, sizeof(num), "TYPE%u", type);
+                        name = num;
+                    }
+                    if (n + strlen(name) + 2 >= size) {
+                        return 0; // Cut short, the record is still valid
+                    }
+                    n += snprintf(out + n, size - n, " %s", name);
+                }
+                i += 2 + len;
+            }
+            return 0;
+        }
+        default:
+            return 0;
     }
-#if VERBOSE == 1     
-    printf("Done\n");
-#endif    
-
-    printf("Question section (%d)\n", N_QUESTIONS);
-    printf("  %s., %s, %s\n", out_address, dns_record_type_to_str(ntohs(qinfo->qtype)), "IN");
-
-    return 0;
 }
 
-int dns_parse_answer(dns_answer_t* ans, uchar* reader, int* ans_real_len)
+int dns_parse_answer(dns_record_t* rec, const uchar* reader, const uchar* msg, size_t msg_len, int* ans_real_len)
 {
-    uchar* reader_ini = reader;
+    const uchar* reader_ini = reader;
+    const uchar* end = msg + msg_len;
 
     int name_len = 0;
-    ans->name = dns_read_name(reader, buf, &name_len);
-
+    if (dns_read_name(reader, msg, msg_len, rec->name, &name_len) != 0) {
+        return 1;
+    }
     reader += name_len;
 
-    ans->resource = (dns_ansdata_t*)(reader);
+    if (reader + sizeof(dns_ansdata_t) > end) {
+        return 1;
+    }
+    dns_ansdata_t resource;
+    memcpy(&resource, reader, sizeof(dns_ansdata_t));
     reader += sizeof(dns_ansdata_t);
 
-
-    printf("  ");
-    printf("%s., ", ans->name);
-    free(ans->name);
-    ans->name = NULL;
-
-    const char* type_str = dns_record_type_to_str(ntohs(ans->resource->type));
-
-    printf("%s, ", type_str);
-    printf("IN, "); // It should always be internet
-
-    printf("%d, ", ntohl(ans->resource->ttl));
-
-    uint16_t type = ntohs(ans->resource->type);
-    size_t len = type == T_A ? INET_ADDRSTRLEN : INET6_ADDRSTRLEN;
-    char ip_buf[len];
-
+    rec->type  = ntohs(resource.type);
+    rec->class = ntohs(resource.class);
+    rec->ttl   = ntohl(resource.ttl);
+    rec->rdata[0] = '\0';
 
     // Parse RDATA
-    uint16_t rdata_len = ntohs(ans->resource->data_len);
-    if (rdata_len == 0) {
-        fprintf(stderr, "RDATA is empty.\n");
+    uint16_t rdata_len = ntohs(resource.data_len);
+    if (reader + rdata_len > end) {
         return 1;
     }
 
-    name_len = 0;
-    switch (type) {
+    switch (rec->type) {
         case T_A:
         case T_AAAA:
-            ans->rdata = malloc(rdata_len);
-            memcpy(ans->rdata, reader, rdata_len);
-
-            reader += rdata_len;
-            
-            if (inet_ntop(type == T_A ? AF_INET : AF_INET6, ans->rdata, ip_buf, len) == NULL) {
-                free(ans->rdata);
-                perror("inet_ntop: invalid address in RDATA (A/AAAA)");
+            if (rdata_len != (rec->type == T_A ? 4 : 16)) {
+                return 1; // Invalid address in RDATA
+            }
+            if (inet_ntop(rec->type == T_A ? AF_INET : AF_INET6, reader, rec->rdata, MAX_RDATA_STR_LEN) == NULL) {
                 return 1;
             }
-
-            printf("%s\n", ip_buf);
             break;
-        case T_NS: case T_MX: case T_SOA:
+        case T_MX: { // Preference before the exchange name
+            if (rdata_len < 3) {
+                return 1;
+            }
+            uint16_t pref = (reader[0] << 8) | reader[1];
+            int n = snprintf(rec->rdata, MAX_RDATA_STR_LEN, "%u ", pref);
+            if (dns_read_name(reader + 2, msg, msg_len, rec->rdata + n, &name_len) != 0) {
+                return 1;
+            }
+            strcat(rec->rdata, ".");
+            break;
+        }
+        case T_NS: case T_SOA:
         case T_CNAME: case T_PTR:
-            ans->rdata = dns_read_name(reader, buf, &name_len);
-
-            reader += name_len;
-
-            printf("%s.\n", ans->rdata);  
-            break;            
+            if (rdata_len == 0 || dns_read_name(reader, msg, msg_len, rec->rdata, &name_len) != 0) {
+                return 1;
+            }
+            strcat(rec->rdata, ".");
+            break;
+        case T_DS: case T_RRSIG:
+        case T_NSEC: case T_DNSKEY:
+            if (dns_format_dnssec(rec, reader, rdata_len, msg, msg_len) != 0) {
+                return 1;
+            }
+            break;
         default:
-            printf("\n");
             break;
     }
-
-    free(ans->rdata);
-    ans->rdata = NULL;
+    reader += rdata_len;
 
     *ans_real_len = reader - reader_ini;
     return 0;
 }
 
-
-int dns_receive_answers(int sock_fd, serv_addr_t serv)
+int dns_parse_response(const uchar* pkt, size_t pkt_len, dns_result_t* res)
 {
-#if VERBOSE == 1  
-    printf("\nReceiving answer... ");
-#endif
+    memset(res, 0, sizeof(dns_result_t));
 
-    struct sockaddr* server_addr = serv.ipv4 ? 
-        (struct sockaddr*)&(serv.addr_ip4) : (struct sockaddr*)&(serv.addr_ip6);
-
-    socklen_t server_addr_len = serv.ipv4 ? sizeof(serv.addr_ip4) : sizeof(serv.addr_ip6);
-
-    if (recvfrom(sock_fd, (char*)buf, BUFFER_SIZE, 0, server_addr, &server_addr_len) < 0) {
-        perror("recvfrom failed");
+    if (pkt_len < sizeof(dns_header_t)) {
         return 1;
     }
+    memcpy(&res->header, pkt, sizeof(dns_header_t));
 
-#if VERBOSE == 1      
-    printf("Done\n\n");
-#endif    
+    res->ans_count  = ntohs(res->header.ans_count);
+    res->auth_count = ntohs(res->header.auth_count);
+    res->add_count  = ntohs(res->header.add_count);
 
-    dns_header_t* dns = (dns_header_t*)buf;
-    if (dns_parse_rcode(dns->rcode) != 0) {
-        return 1;
-    }
+    const uchar* reader = pkt + sizeof(dns_header_t);
 
-    printf("Authoritative: %s, ", (dns->aa == 1) ? "Yes" : "No");
-    printf("Recursive: %s, ", (dns->rd == 1) ? "Yes" : "No"); // Maybe ra instead of rd?
-    printf("Truncated: %s\n", (dns->tc == 1) ? "Yes" : "No"); // What to do with truncated message?
-    
-    uchar* qname = (uchar*)&buf[sizeof(dns_header_t)];
- 
-    uchar* reader = &buf[sizeof(dns_header_t) + (strlen((const char*)qname)+1) + sizeof(dns_qdata_t)];
-
-#if VERBOSE == 1 
-    printf("\nThe response contains : ");
-    printf("\n %d Questions.", ntohs(dns->q_count));
-    printf("\n %d Answers.", ntohs(dns->ans_count));
-    printf("\n %d Authoritative Servers.", ntohs(dns->auth_count));
-    printf("\n %d Additional records.\n\n", ntohs(dns->add_count));
-#endif
-
-    dns_answer_t answer;
-    memset(&answer, 0, sizeof(dns_answer_t));
-
-    // Read answers
-    printf("Answer section (%d)\n", ntohs(dns->ans_count));
-    int ans_real_len = 0;    
-    for (int i = 0; i < ntohs(dns->ans_count); ++i) {
-        if (dns_parse_answer(&answer, reader, &ans_real_len) != 0) {
+    // Skip the question section
+    char name[MAX_NAME_STR_LEN];
+    int name_len = 0;
+    for (int i = 0; i < ntohs(res->header.q_count); ++i) {
+        if (dns_read_name(reader, pkt, pkt_len, name, &name_len) != 0) {
             return 1;
         }
-        reader += ans_real_len;
+        reader += name_len + sizeof(dns_qdata_t);
     }
- 
-    // Read authorities
-    printf("Authority section (%d)\n", ntohs(dns->auth_count));
-    for (int i = 0; i < ntohs(dns->auth_count); ++i) {
-        if (dns_parse_answer(&answer, reader, &ans_real_len) != 0) {
-            return 1;
-        }
-        reader += ans_real_len;
+
+    // Every record takes at least 11 octets, don't trust the counts blindly
+    int total = res->ans_count + res->auth_count + res->add_count;
+    if (total > (int)(pkt_len / 11)) {
+        return 1;
     }
- 
-    // Read additional
-    printf("Additional section (%d)\n", ntohs(dns->add_count));
-    for (int i = 0; i < ntohs(dns->add_count); ++i) {
-        if (dns_parse_answer(&answer, reader, &ans_real_len) != 0) {
+    if (total == 0) {
+        return 0;
+    }
+
+    res->records = malloc(total * sizeof(dns_record_t));
+    if (res->records == NULL) {
+        return 1;
+    }
+
+    int ans_real_len = 0;
+    for (int i = 0, kept = 0; i < total; ++i) {
+        if (reader > pkt + pkt_len ||
+            dns_parse_answer(&res->records[kept], reader, pkt, pkt_len, &ans_real_len) != 0) {
+            dns_free_result(res);
             return 1;
         }
         reader += ans_real_len;
-    }
 
+        // The OPT pseudo-record of EDNS0 is not data, it is left out
+        if (i >= res->ans_count + res->auth_count && res->records[kept].type == T_OPT) {
+            --res->add_count;
+        } else {
+            ++kept;
+        }
+    }
     return 0;
 }
 
+void dns_free_result(dns_result_t* res)
+{
+    free(res->records);
+    res->records = NULL;
+}
@@ -29,6 +29,8 @@ typedef struct {
     uint16_t auth_count; // Number of authority entries
     uint16_t add_count; // Number of resource entries
 } dns_header_t;
+
+#define RCODE_REFUSED 5 // Policy refusal, e.g. the client is rate limited
  
 // Constant sized fields of query structure
 typedef struct {
@@ -46,13 +48,6 @@ typedef struct {
 } dns_ansdata_t;
 #pragma pack(pop) // End of packed structure
 
-// Pointers to resource record contents
-typedef struct {
-    uchar *name;
-    dns_ansdata_t *resource;
-    uchar *rdata;
-} dns_answer_t;
- 
 // Structure of a Query
 typedef struct {
     uchar *name;
@@ -61,20 +56,78 @@ typedef struct {
 
 
 
+#define MAX_NAME_STR_LEN 256 // Dotted name including the terminator
+#define MAX_RDATA_STR_LEN 512 // Textual form of RDATA
+#define MAX_TYPE_STR_LEN 16 // Mnemonic or number of a record type
+#define MAX_NAME_JUMPS 64 // Compression pointers followed per name
+
+// Decoded resource record
 typedef struct {
-    struct sockaddr_in  addr_ip4;
-    struct sockaddr_in6 addr_ip6;
-    bool ipv4;
-} serv_addr_t;
+    char name[MAX_NAME_STR_LEN];
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    char rdata[MAX_RDATA_STR_LEN];
+} dns_record_t;
+
+// Decoded response
+typedef struct {
+    dns_header_t header; // As received, in network byte order
+    dns_record_t* records; // Answers, then authorities, then additionals
+    int ans_count;
+    int auth_count;
+    int add_count;
+} dns_result_t;
+
+
+// Convert domain name to IP address using getaddrinfo(), failures are reported to err
+int dns_domain_to_ip(const char* server_domain_name, serv_addr_t* serv, FILE* err);
+
+// Mnemonic of a known type, NULL otherwise
+const char* dns_record_type_name(uint16_t type);
+
+// Mnemonic of a known type, otherwise the number written to buf of
+// MAX_TYPE_STR_LEN characters
+const char* dns_record_type_str(uint16_t type, char* buf);
+
+// Returns 0 if the string is not a known or numeric record type
+uint16_t dns_record_type_from_str(const char* str);
+
+const char* dns_rcode_to_str(uint8_t rcode);
+
+// E.g. convert www.google.com to 3www6google3com0. src needs room for one
+// more character, it is the same again on return.
+void dns_encode_name(uchar* dst, uchar* src);
+
+// Name of the address under in-addr.arpa or ip6.arpa. Return 1 for an
+// invalid address.
+int dns_reverse_ipv4(char* out_addr, const char* in_addr);
+int dns_reverse_ipv6(char* out_addr, const char* in_addr);
+
+// Produce the name to ask for (reversed address for PTR, "." for the root)
+// in dotted form (qstr) and encoded form (qname). Returns 1 for an invalid
+// name or address.
+int dns_make_qname(const char* domain_or_ip, uint16_t query_type, char* qstr, uchar* qname, int* qname_len);
+
+// Fill in a query packet for the registered outstanding query, returns its size
+size_t dns_build_query(uchar* out, const dns_pending_t* q, bool recursion_desired);
+
+// Append an EDNS0 OPT record (RFC 6891) to the query of length len, with the
+// DO flag (RFC 3225) and checking disabled if dnssec_ok. Returns the new length.
+size_t dns_add_opt(uchar* out, size_t len, uint16_t udp_size, bool dnssec_ok);
 
+// Key tag of the DNSKEY record with the given RDATA (RFC 4034 Appendix B)
+uint16_t dns_key_tag(const uchar* rdata, size_t len);
 
-// Convert domain name to IP address using getaddrinfo()
-int dns_domain_to_ip(const char* server_domain_name, serv_addr_t* serv);
+// Read a possibly compressed name at reader. name_len is set to the
+// number of octets the name occupies at reader.
+int dns_read_name(const uchar* reader, const uchar* msg, size_t msg_len, char* name, int* name_len);
 
-// Send DNS query
-int dns_send_question(int sock_fd, serv_addr_t serv, char* domain_or_ip, bool recursion_desired, uint16_t query_type);
+// Decode one resource record at reader
+int dns_parse_answer(dns_record_t* rec, const uchar* reader, const uchar* msg, size_t msg_len, int* ans_real_len);
 
-// Receive all DNS answers
-int dns_receive_answers(int sock_fd, serv_addr_t serv);
+// Decode the whole response, the result must be freed with dns_free_result()
+int dns_parse_response(const uchar* pkt, size_t pkt_len, dns_result_t* res);
+void dns_free_result(dns_result_t* res);
 
 #endif // !__DNS_PACKET_H__
\ No newline at end of file
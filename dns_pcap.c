@@ -0,0 +1,1221 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_dedup.h"
+#include "dns_pcap.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PCAP_MAGIC_US 0xA1B2C3D4
+#define PCAP_MAGIC_NS 0xA1B23C4D
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_IDB 1
+#define PCAPNG_PB 2 // Obsolete packet block
+#define PCAPNG_SPB 3
+#define PCAPNG_EPB 6
+#define PCAP_MAX_IFS 64
+#define PCAP_MAX_FRAME (256 << 10)
+#define PCAP_SYNC_RECORDS 16 // Consecutive valid headers that mark a record boundary
+#define PCAP_SYNC_TS_RANGE (366 * 86400) // Seconds a timestamp may differ from the first one
+
+#define LINK_NULL 0
+#define LINK_ETHERNET 1
+#define LINK_RAW 101
+#define LINK_LOOP 108
+#define LINK_LINUX_SLL 113
+#define LINK_IPV4 228
+#define LINK_IPV6 229
+#define LINK_LINUX_SLL2 276
+
+#define DNS_PORT 53
+
+typedef struct {
+    uint16_t linktype;
+    uint64_t ticks; // Timestamp units per second
+} dns_pcap_if_t;
+
+// Mapped capture with what its header says
+typedef struct {
+    const uchar* data;
+    size_t size;
+    bool ng;
+    bool swap; // Written with the other byte order
+    size_t start; // First record or block after the file header
+    uint32_t snaplen; // Classic only
+    uint32_t first_ts; // Seconds of the first record, classic only
+    dns_pcap_if_t ifs[PCAP_MAX_IFS]; // Classic files have one
+    int n_ifs;
+} dns_pcap_file_t;
+
+// Query waiting for its response, identified as dns_pending_match() would:
+// the ID, the client address and port and the server address
+typedef struct {
+    uchar client[16];
+    uchar server[16];
+    uint16_t client_port;
+    uint16_t id;
+    uint8_t proto;
+    bool used;
+    uint64_t ts_ns;
+} dns_pcap_query_t;
+
+// Open addressing with linear probing, deleted slots are refilled by shifting back
+typedef struct {
+    dns_pcap_query_t* slots;
+    size_t cap; // Power of two
+    size_t count;
+} dns_pcap_table_t;
+
+// One region of the file, decoded by one thread
+typedef struct {
+    const dns_pcap_file_t* file;
+    const dns_pcap_opts_t* opts;
+    size_t index;
+    size_t from; // Offsets of the records
+    size_t to;
+    int ret;
+
+    dns_pcap_stats_t stats;
+    dns_dedup_t names; // Query names, counted in counts
+    unsigned long* counts;
+    size_t counts_cap;
+
+    bool have_ts;
+    uint64_t first_ts_ns;
+    uint64_t last_ts_ns;
+    dns_pcap_table_t pending; // Queries not answered within the region
+    dns_pcap_query_t* orphans; // Responses early in the region without a query, it may be in the previous one
+    size_t n_orphans;
+    size_t orphans_cap;
+
+    FILE* out; // Records, in memory until the earlier regions are written
+    char* out_buf;
+    size_t out_len;
+} dns_pcap_chunk_t;
+
+static const char* rcode_names[16] = {
+    "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED", "YXDOMAIN", "YXRRSET",
+    "NXRRSET", "NOTAUTH", "NOTZONE", "RCODE11", "RCODE12", "RCODE13", "RCODE14", "RCODE15",
+};
+
+static uint16_t pf_u16(const dns_pcap_file_t* f, const uchar* p)
+{
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return f->swap ? (uint16_t)((v >> 8) | (v << 8)) : v;
+}
+
+static uint32_t pf_u32(const dns_pcap_file_t* f, const uchar* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return f->swap ? __builtin_bswap32(v) : v;
+}
+
+// Network byte order fields of the frames
+static uint16_t be16(const uchar* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint64_t dns_pcap_ns(uint64_t ts, uint64_t ticks)
+{
+    return ts / ticks * 1000000000ULL + ts % ticks * 1000000000ULL / ticks;
+}
+
+//
+// File header and record boundaries
+//
+
+static int dns_pcap_ng_idb(dns_pcap_file_t* f, const uchar* b, uint32_t len)
+{
+    if (f->n_ifs == PCAP_MAX_IFS || len < 20) {
+        return 1;
+    }
+    dns_pcap_if_t* ifc = &f->ifs[f->n_ifs++];
+    ifc->linktype = pf_u16(f, b + 8);
+    ifc->ticks = 1000000;
+
+    // Options, only the timestamp resolution matters
+    const uchar* o = b + 16;
+    const uchar* end = b + len - 4;
+    while (o + 4 <= end) {
+        uint16_t code = pf_u16(f, o);
+        uint16_t olen = pf_u16(f, o + 2);
+        if (code == 0 || o + 4 + olen > end) {
+            break;
+        }
+        if (code == 9 && olen >= 1) { // if_tsresol
+            uchar r = o[4];
+            uint64_t ticks = 1;
+            for (int i = 0; i < (r & 0x7F) && ticks < UINT64_MAX / 10; ++i) {
+                ticks *= (r & 0x80) ? 2 : 10;
+            }
+            ifc->ticks = ticks;
+        }
+        o += 4 + ((olen + 3) & ~3u);
+    }
+    return 0;
+}
+
+static int dns_pcap_header(dns_pcap_file_t* f, const char* path)
+{
+    if (f->size < 24) {
+        fprintf(stderr, "Error: %s is not a pcap or pcapng file.\n", path);
+        return 1;
+    }
+    uint32_t magic;
+    memcpy(&magic, f->data, sizeof(magic));
+
+    if (magic == PCAPNG_SHB) {
+        f->ng = true;
+        uint32_t bom;
+        memcpy(&bom, f->data + 8, sizeof(bom));
+        if (bom != PCAPNG_BYTE_ORDER && bom != __builtin_bswap32(PCAPNG_BYTE_ORDER)) {
+            fprintf(stderr, "Error: %s has an invalid pcapng section header.\n", path);
+            return 1;
+        }
+        f->swap = bom != PCAPNG_BYTE_ORDER;
+        f->start = pf_u32(f, f->data + 4);
+
+        // Interfaces are described before their first packet
+        size_t off = f->start;
+        while (off + 12 <= f->size) {
+            uint32_t type = pf_u32(f, f->data + off);
+            uint32_t len = pf_u32(f, f->data + off + 4);
+            if (len < 12 || off + len > f->size || type == PCAPNG_EPB || type == PCAPNG_SPB || type == PCAPNG_PB) {
+                break;
+            }
+            if (type == PCAPNG_IDB && dns_pcap_ng_idb(f, f->data + off, len) != 0) {
+                fprintf(stderr, "Error: %s has an invalid interface description.\n", path);
+                return 1;
+            }
+            off += len;
+        }
+        return 0;
+    }
+
+    if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+        f->swap = false;
+    } else if (__builtin_bswap32(magic) == PCAP_MAGIC_US || __builtin_bswap32(magic) == PCAP_MAGIC_NS) {
+        f->swap = true;
+        magic = __builtin_bswap32(magic);
+    } else {
+        fprintf(stderr, "Error: %s is not a pcap or pcapng file.\n", path);
+        return 1;
+    }
+    f->start = 24;
+    f->snaplen = pf_u32(f, f->data + 16);
+    if (f->snaplen == 0 || f->snaplen > PCAP_MAX_FRAME) {
+        f->snaplen = PCAP_MAX_FRAME;
+    }
+    f->n_ifs = 1;
+    f->ifs[0].linktype = pf_u32(f, f->data + 20) & 0xFFFF;
+    f->ifs[0].ticks = magic == PCAP_MAGIC_NS ? 1000000000 : 1000000;
+    if (f->size >= 28) {
+        f->first_ts = pf_u32(f, f->data + 24);
+    }
+    return 0;
+}
+
+// Length of a plausible record or block at off, 0 if there is none
+static size_t dns_pcap_record_len(const dns_pcap_file_t* f, size_t off)
+{
+    const uchar* p = f->data + off;
+    if (f->ng) {
+        if (off + 12 > f->size) {
+            return 0;
+        }
+        uint32_t type = pf_u32(f, p);
+        uint32_t len = pf_u32(f, p + 4);
+        if (len < 12 || len % 4 != 0 || len > f->size - off || pf_u32(f, p + len - 4) != len) {
+            return 0;
+        }
+        bool known = type <= 10 || type == PCAPNG_SHB || (type & 0x7FFFFFFF) == 0xBAD;
+        return known ? len : 0;
+    }
+
+    if (off + 16 > f->size) {
+        return 0;
+    }
+    uint32_t ts = pf_u32(f, p);
+    uint32_t frac = pf_u32(f, p + 4);
+    uint32_t incl = pf_u32(f, p + 8);
+    uint32_t orig = pf_u32(f, p + 12);
+    uint32_t ts_diff = ts > f->first_ts ? ts - f->first_ts : f->first_ts - ts;
+    if (frac >= f->ifs[0].ticks || incl > f->snaplen || incl > orig || orig > PCAP_MAX_FRAME ||
+        ts_diff > PCAP_SYNC_TS_RANGE || incl > f->size - off - 16) {
+        return 0;
+    }
+    return 16 + incl;
+}
+
+// First record boundary at or after off. Records carry no marker, a boundary
+// is where a chain of valid headers starts that reaches the end of the file
+// or is long enough.
+static size_t dns_pcap_sync(const dns_pcap_file_t* f, size_t off)
+{
+    if (off <= f->start) {
+        return f->start;
+    }
+    size_t step = f->ng ? 4 : 1; // Blocks are aligned to 32 bits
+    off = f->start + (off - f->start + step - 1) / step * step;
+
+    for (; off < f->size; off += step) {
+        size_t o = off;
+        int n = 0;
+        while (n < PCAP_SYNC_RECORDS && o < f->size) {
+            size_t len = dns_pcap_record_len(f, o);
+            if (len == 0) {
+                break;
+            }
+            o += len;
+            ++n;
+        }
+        if (n == PCAP_SYNC_RECORDS || (n > 0 && o == f->size)) {
+            return off;
+        }
+    }
+    return f->size;
+}
+
+//
+// Queries waiting for their responses
+//
+
+static int dns_pcap_table_init(dns_pcap_table_t* t)
+{
+    t->cap = 1024;
+    t->count = 0;
+    t->slots = calloc(t->cap, sizeof(dns_pcap_query_t));
+    if (t->slots == NULL) {
+        perror("calloc failed");
+        return 1;
+    }
+    return 0;
+}
+
+static void dns_pcap_table_free(dns_pcap_table_t* t)
+{
+    free(t->slots);
+    memset(t, 0, sizeof(dns_pcap_table_t));
+}
+
+static size_t dns_pcap_key_hash(const dns_pcap_query_t* q)
+{
+    uint64_t h = 14695981039346656037ULL;
+    const uchar* parts[] = { q->client, q->server };
+    for (int k = 0; k < 2; ++k) {
+        for (int i = 0; i < 16; ++i) {
+            h = (h ^ parts[k][i]) * 1099511628211ULL;
+        }
+    }
+    h = (h ^ q->client_port) * 1099511628211ULL;
+    h = (h ^ q->id) * 1099511628211ULL;
+    h = (h ^ q->proto) * 1099511628211ULL;
+    return h ^ (h >> 29);
+}
+
+static bool dns_pcap_key_equal(const dns_pcap_query_t* a, const dns_pcap_query_t* b)
+{
+    return a->id == b->id && a->client_port == b->client_port && a->proto == b->proto &&
+        memcmp(a->client, b->client, 16) == 0 && memcmp(a->server, b->server, 16) == 0;
+}
+
+static size_t dns_pcap_table_probe(const dns_pcap_table_t* t, const dns_pcap_query_t* key)
+{
+    size_t mask = t->cap - 1;
+    size_t i = dns_pcap_key_hash(key) & mask;
+    while (t->slots[i].used && !dns_pcap_key_equal(&t->slots[i], key)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int dns_pcap_table_put(dns_pcap_table_t* t, const dns_pcap_query_t* q)
+{
+    if ((t->count + 1) * 2 > t->cap) {
+        dns_pcap_table_t bigger = { calloc(t->cap * 2, sizeof(dns_pcap_query_t)), t->cap * 2, 0 };
+        if (bigger.slots == NULL) {
+            perror("calloc failed");
+            return 1;
+        }
+        for (size_t i = 0; i < t->cap; ++i) {
+            if (t->slots[i].used) {
+                bigger.slots[dns_pcap_table_probe(&bigger, &t->slots[i])] = t->slots[i];
+                ++bigger.count;
+            }
+        }
+        free(t->slots);
+        *t = bigger;
+    }
+
+    // A retransmitted query replaces the earlier one, the response answers the latest
+    size_t i = dns_pcap_table_probe(t, q);
+    if (!t->slots[i].used) {
+        ++t->count;
+    }
+    t->slots[i] = *q;
+    t->slots[i].used = true;
+    return 0;
+}
+
+// Remove the query matching key, returns false if there is none
+static bool dns_pcap_table_take(dns_pcap_table_t* t, const dns_pcap_query_t* key, dns_pcap_query_t* out)
+{
+    size_t mask = t->cap - 1;
+    size_t i = dns_pcap_table_probe(t, key);
+    if (!t->slots[i].used) {
+        return false;
+    }
+    *out = t->slots[i];
+    t->slots[i].used = false;
+    --t->count;
+
+    // Move the following entries of the cluster back where a lookup finds them
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        if (!t->slots[j].used) {
+            break;
+        }
+        size_t home = dns_pcap_key_hash(&t->slots[j]) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            t->slots[i] = t->slots[j];
+            t->slots[j].used = false;
+            i = j;
+        }
+    }
+    return true;
+}
+
+//
+// Statistics
+//
+
+static void dns_pcap_latency(dns_pcap_stats_t* s, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int octave = 0;
+    while (octave < 63 && (us >> (octave + 1)) != 0) {
+        ++octave;
+    }
+    size_t sub = us == 0 ? 0 : ((us - (1ULL << octave)) * PCAP_LATENCY_SUB) >> octave;
+    size_t bucket = octave * PCAP_LATENCY_SUB + sub;
+    if (bucket >= PCAP_LATENCY_BUCKETS) {
+        bucket = PCAP_LATENCY_BUCKETS - 1;
+    }
+    ++s->latency[bucket];
+    ++s->matched;
+    s->latency_sum_us += ns / 1000.0;
+}
+
+// Upper bound of a latency bucket in milliseconds
+static double dns_pcap_bucket_ms(size_t bucket)
+{
+    double base = (double)(1ULL << (bucket / PCAP_LATENCY_SUB));
+    return (base + base * (bucket % PCAP_LATENCY_SUB + 1) / PCAP_LATENCY_SUB) / 1000.0;
+}
+
+static void dns_pcap_stats_add(dns_pcap_stats_t* to, const dns_pcap_stats_t* from)
+{
+    to->frames += from->frames;
+    to->skipped += from->skipped;
+    to->tcp_partial += from->tcp_partial;
+    to->queries += from->queries;
+    to->responses += from->responses;
+    to->malformed += from->malformed;
+    to->udp += from->udp;
+    to->tcp += from->tcp;
+    for (int i = 0; i < 16; ++i) {
+        to->rcodes[i] += from->rcodes[i];
+    }
+    for (int i = 0; i < 65536; ++i) {
+        to->qtypes[i] += from->qtypes[i];
+    }
+    for (int i = 0; i < PCAP_SIZE_BUCKETS; ++i) {
+        to->sizes[i] += from->sizes[i];
+    }
+    to->matched += from->matched;
+    to->unanswered += from->unanswered;
+    to->unmatched_responses += from->unmatched_responses;
+    for (int i = 0; i < PCAP_LATENCY_BUCKETS; ++i) {
+        to->latency[i] += from->latency[i];
+    }
+    to->latency_sum_us += from->latency_sum_us;
+}
+
+// Count the query name, names are counted case-insensitively
+static int dns_pcap_count_name(dns_pcap_chunk_t* c, const char* qname, unsigned long n)
+{
+    char name[MAX_NAME_STR_LEN];
+    size_t len = strlen(qname);
+    for (size_t i = 0; i < len; ++i) {
+        name[i] = tolower((uchar)qname[i]);
+    }
+    long idx = dns_dedup_insert(&c->names, name, len, 0);
+    if (idx < 0) {
+        return 1;
+    }
+    if ((size_t)idx >= c->counts_cap) {
+        size_t cap = c->counts_cap ? c->counts_cap * 2 : 1024;
+        unsigned long* counts = realloc(c->counts, cap * sizeof(unsigned long));
+        if (counts == NULL) {
+            perror("realloc failed");
+            return 1;
+        }
+        memset(counts + c->counts_cap, 0, (cap - c->counts_cap) * sizeof(unsigned long));
+        c->counts = counts;
+        c->counts_cap = cap;
+    }
+    c->counts[idx] += n;
+    return 0;
+}
+
+//
+// Frames
+//
+
+// Endpoints of a message
+typedef struct {
+    int family;
+    uchar src[16];
+    uchar dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto; // IPPROTO_UDP or IPPROTO_TCP
+} dns_pcap_flow_t;
+
+static void dns_pcap_print_endpoint(FILE* out, int family, const uchar* addr, uint16_t port)
+{
+    char str[INET6_ADDRSTRLEN];
+    inet_ntop(family, family == AF_INET ? addr + 12 : addr, str, sizeof(str));
+    fprintf(out, "%s.%u", str, port);
+}
+
+static void dns_pcap_print_message(dns_pcap_chunk_t* c, uint64_t ts_ns, const dns_pcap_flow_t* flow,
+                                   const dns_header_t* h, const char* qname, uint16_t qtype, size_t len)
+{
+    FILE* out = c->out;
+    fprintf(out, "%llu.%06llu ", (unsigned long long)(ts_ns / 1000000000ULL),
+            (unsigned long long)(ts_ns % 1000000000ULL / 1000));
+    dns_pcap_print_endpoint(out, flow->family, flow->src, flow->sport);
+    fprintf(out, " > ");
+    dns_pcap_print_endpoint(out, flow->family, flow->dst, flow->dport);
+    fprintf(out, " %s %u %s", flow->proto == IPPROTO_UDP ? "udp" : "tcp", ntohs(h->id),
+            h->qr ? "response" : "query");
+    if (h->qr) {
+        fprintf(out, " %s", rcode_names[h->rcode]);
+    }
+    if (qname != NULL) {
+        const char* type = dns_record_type_name(qtype);
+        if (type != NULL) {
+            fprintf(out, " %s. %s", qname, type);
+        } else {
+            fprintf(out, " %s. TYPE%u", qname, qtype);
+        }
+    }
+    fprintf(out, " %zu bytes", len);
+    if (h->qr) {
+        fprintf(out, " %u/%u/%u", ntohs(h->ans_count), ntohs(h->auth_count), ntohs(h->add_count));
+    }
+    fprintf(out, "\n");
+}
+
+static void dns_pcap_print_record(FILE* out, const dns_record_t* rec)
+{
+    const char* type = dns_record_type_name(rec->type);
+    if (type != NULL) {
+        fprintf(out, "  %s., %s, IN, %u, %s\n", rec->name, type, rec->ttl, rec->rdata);
+    } else {
+        fprintf(out, "  %s., TYPE%u, IN, %u, %s\n", rec->name, rec->type, rec->ttl, rec->rdata);
+    }
+}
+
+static int dns_pcap_message(dns_pcap_chunk_t* c, uint64_t ts_ns, const dns_pcap_flow_t* flow,
+                            const uchar* msg, size_t len)
+{
+    dns_pcap_stats_t* s = &c->stats;
+    if (len < sizeof(dns_header_t)) {
+        ++s->malformed;
+        return 0;
+    }
+    dns_header_t h;
+    memcpy(&h, msg, sizeof(dns_header_t));
+
+    // The first question names the message
+    const uchar* reader = msg + sizeof(dns_header_t);
+    char qname[MAX_NAME_STR_LEN];
+    char other[MAX_NAME_STR_LEN];
+    uint16_t qtype = 0;
+    bool has_question = false;
+    int name_len = 0;
+    for (int i = 0; i < ntohs(h.q_count); ++i) {
+        if (dns_read_name(reader, msg, len, i == 0 ? qname : other, &name_len) != 0 ||
+            reader + name_len + sizeof(dns_qdata_t) > msg + len) {
+            ++s->malformed;
+            return 0;
+        }
+        if (i == 0) {
+            qtype = be16(reader + name_len);
+            has_question = true;
+        }
+        reader += name_len + sizeof(dns_qdata_t);
+    }
+
+    // Decoded the same way as the answers of the queries sent by the resolver
+    int total = ntohs(h.ans_count) + ntohs(h.auth_count) + ntohs(h.add_count);
+    if (total > (int)(len / 11)) {
+        ++s->malformed;
+        return 0;
+    }
+    if (c->out != NULL) {
+        dns_pcap_print_message(c, ts_ns, flow, &h, has_question ? qname : NULL, qtype, len);
+    }
+    dns_record_t rec;
+    int rec_len = 0;
+    for (int i = 0; i < total; ++i) {
+        if (reader >= msg + len || dns_parse_answer(&rec, reader, msg, len, &rec_len) != 0) {
+            if (c->out != NULL) {
+                fprintf(c->out, "  (malformed record)\n");
+            }
+            ++s->malformed;
+            return 0;
+        }
+        if (c->out != NULL) {
+            dns_pcap_print_record(c->out, &rec);
+        }
+        reader += rec_len;
+    }
+
+    if (flow->proto == IPPROTO_UDP) {
+        ++s->udp;
+    } else {
+        ++s->tcp;
+    }
+
+    dns_pcap_query_t key;
+    memset(&key, 0, sizeof(dns_pcap_query_t));
+    key.id = ntohs(h.id);
+    key.proto = flow->proto;
+    key.ts_ns = ts_ns;
+
+    if (!h.qr) {
+        ++s->queries;
+        if (has_question) {
+            ++s->qtypes[qtype];
+            if (dns_pcap_count_name(c, qname, 1) != 0) {
+                return 1;
+            }
+        }
+        memcpy(key.client, flow->src, 16);
+        memcpy(key.server, flow->dst, 16);
+        key.client_port = flow->sport;
+        return dns_pcap_table_put(&c->pending, &key);
+    }
+
+    ++s->responses;
+    ++s->rcodes[h.rcode];
+    int bucket = 0;
+    while (bucket < PCAP_SIZE_BUCKETS - 1 && (len >> (bucket + 1)) != 0) {
+        ++bucket;
+    }
+    ++s->sizes[bucket];
+
+    memcpy(key.client, flow->dst, 16);
+    memcpy(key.server, flow->src, 16);
+    key.client_port = flow->dport;
+    dns_pcap_query_t q;
+    if (dns_pcap_table_take(&c->pending, &key, &q) && ts_ns >= q.ts_ns) {
+        dns_pcap_latency(s, ts_ns - q.ts_ns);
+    } else if (c->index > 0 && ts_ns < c->first_ts_ns + PCAP_MATCH_WINDOW_NS) {
+        // The query may be at the end of the previous region
+        if (c->n_orphans == c->orphans_cap) {
+            size_t cap = c->orphans_cap ? c->orphans_cap * 2 : 256;
+            dns_pcap_query_t* orphans = realloc(c->orphans, cap * sizeof(dns_pcap_query_t));
+            if (orphans == NULL) {
+                perror("realloc failed");
+                return 1;
+            }
+            c->orphans = orphans;
+            c->orphans_cap = cap;
+        }
+        c->orphans[c->n_orphans++] = key;
+    } else {
+        ++s->unmatched_responses;
+    }
+    return 0;
+}
+
+// UDP datagram or TCP segment of an IP packet
+static int dns_pcap_transport(dns_pcap_chunk_t* c, uint64_t ts_ns, dns_pcap_flow_t* flow,
+                              const uchar* p, size_t len)
+{
+    dns_pcap_stats_t* s = &c->stats;
+    if (flow->proto == IPPROTO_UDP) {
+        if (len < 8) {
+            ++s->skipped;
+            return 0;
+        }
+        flow->sport = be16(p);
+        flow->dport = be16(p + 2);
+        size_t udp_len = be16(p + 4);
+        if ((flow->sport != DNS_PORT && flow->dport != DNS_PORT) || udp_len < 8 || udp_len > len) {
+            ++s->skipped; // Other traffic or cut by the snapshot length
+            return 0;
+        }
+        return dns_pcap_message(c, ts_ns, flow, p + 8, udp_len - 8);
+    }
+
+    if (flow->proto != IPPROTO_TCP || len < 20) {
+        ++s->skipped;
+        return 0;
+    }
+    flow->sport = be16(p);
+    flow->dport = be16(p + 2);
+    size_t data_off = (p[12] >> 4) * 4;
+    if ((flow->sport != DNS_PORT && flow->dport != DNS_PORT) || data_off < 20 || data_off > len) {
+        ++s->skipped;
+        return 0;
+    }
+
+    // Messages with their length prefixes (RFC 7766), a message split over
+    // several segments is counted but not reassembled
+    const uchar* data = p + data_off;
+    size_t left = len - data_off;
+    while (left >= 2) {
+        size_t msg_len = be16(data);
+        if (msg_len + 2 > left) {
+            ++s->tcp_partial;
+            break;
+        }
+        if (dns_pcap_message(c, ts_ns, flow, data + 2, msg_len) != 0) {
+            return 1;
+        }
+        data += 2 + msg_len;
+        left -= 2 + msg_len;
+    }
+    if (left == 1) {
+        ++s->tcp_partial;
+    }
+    return 0;
+}
+
+static int dns_pcap_ip(dns_pcap_chunk_t* c, uint64_t ts_ns, const uchar* p, size_t len)
+{
+    dns_pcap_stats_t* s = &c->stats;
+    dns_pcap_flow_t flow;
+    memset(&flow, 0, sizeof(dns_pcap_flow_t));
+
+    if (len >= 20 && (p[0] >> 4) == 4) {
+        size_t ihl = (p[0] & 0x0F) * 4;
+        size_t total = be16(p + 2);
+        if (ihl < 20 || total < ihl || (be16(p + 6) & 0x3FFF) != 0) {
+            ++s->skipped; // Fragments are not reassembled
+            return 0;
+        }
+        if (total > len) {
+            total = len; // Cut by the snapshot length, the UDP length tells
+        }
+        flow.family = AF_INET;
+        flow.proto = p[9];
+        // Mapped into IPv6 addresses to share the keys
+        flow.src[10] = flow.src[11] = flow.dst[10] = flow.dst[11] = 0xFF;
+        memcpy(flow.src + 12, p + 12, 4);
+        memcpy(flow.dst + 12, p + 16, 4);
+        return dns_pcap_transport(c, ts_ns, &flow, p + ihl, total - ihl);
+    }
+
+    if (len >= 40 && (p[0] >> 4) == 6) {
+        size_t total = 40 + be16(p + 4);
+        if (total > len) {
+            total = len;
+        }
+        flow.family = AF_INET6;
+        memcpy(flow.src, p + 8, 16);
+        memcpy(flow.dst, p + 24, 16);
+
+        // Skip the extension headers
+        uint8_t next = p[6];
+        size_t off = 40;
+        while (next == 0 || next == 43 || next == 60 || next == 44) {
+            if (off + 8 > total) {
+                ++s->skipped;
+                return 0;
+            }
+            if (next == 44) {
+                if ((be16(p + off + 2) & 0xFFF9) != 0) {
+                    ++s->skipped; // Fragment
+                    return 0;
+                }
+                next = p[off];
+                off += 8;
+            } else {
+                next = p[off];
+                off += (p[off + 1] + 1) * 8;
+            }
+        }
+        if (off > total) {
+            ++s->skipped;
+            return 0;
+        }
+        flow.proto = next;
+        return dns_pcap_transport(c, ts_ns, &flow, p + off, total - off);
+    }
+
+    ++s->skipped;
+    return 0;
+}
+
+// Strip the link layer header of a frame
+static int dns_pcap_frame(dns_pcap_chunk_t* c, uint16_t linktype, uint64_t ts_ns, const uchar* p, size_t len)
+{
+    dns_pcap_stats_t* s = &c->stats;
+    ++s->frames;
+    if (!c->have_ts) {
+        c->have_ts = true;
+        c->first_ts_ns = ts_ns;
+    }
+    c->last_ts_ns = ts_ns;
+
+    size_t off = 0;
+    uint16_t ethertype = 0;
+    switch (linktype) {
+        case LINK_ETHERNET:
+            if (len < 14) {
+                break;
+            }
+            ethertype = be16(p + 12);
+            off = 14;
+            while ((ethertype == 0x8100 || ethertype == 0x88A8) && off + 4 <= len) { // VLAN tags
+                ethertype = be16(p + off + 2);
+                off += 4;
+            }
+            break;
+        case LINK_LINUX_SLL:
+            if (len >= 16) {
+                ethertype = be16(p + 14);
+                off = 16;
+            }
+            break;
+        case LINK_LINUX_SLL2:
+            if (len >= 20) {
+                ethertype = be16(p);
+                off = 20;
+            }
+            break;
+        case LINK_NULL:
+        case LINK_LOOP:
+            if (len >= 4) {
+                // Address family in the byte order of the capturing host (LOOP: network order)
+                uint32_t af = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+                if (af > 0xFFFF) {
+                    af = __builtin_bswap32(af);
+                }
+                ethertype = af == 2 ? 0x0800 : (af == 10 || af == 24 || af == 28 || af == 30) ? 0x86DD : 0;
+                off = 4;
+            }
+            break;
+        case LINK_RAW:
+        case LINK_IPV4:
+        case LINK_IPV6:
+            if (len >= 1) {
+                ethertype = (p[0] >> 4) == 6 ? 0x86DD : 0x0800;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (ethertype != 0x0800 && ethertype != 0x86DD) {
+        ++s->skipped;
+        return 0;
+    }
+    return dns_pcap_ip(c, ts_ns, p + off, len - off);
+}
+
+//
+// Regions
+//
+
+static int dns_pcap_chunk_records(dns_pcap_chunk_t* c)
+{
+    const dns_pcap_file_t* f = c->file;
+    size_t off = c->from;
+    while (off < c->to) {
+        size_t len = dns_pcap_record_len(f, off);
+        if (len == 0) {
+            fprintf(stderr, "Warning: Damaged record at offset %zu, the rest of the region is skipped.\n", off);
+            return 0;
+        }
+        const uchar* r = f->data + off;
+        off += len;
+
+        if (!f->ng) {
+            uint64_t ts = (uint64_t)pf_u32(f, r) * f->ifs[0].ticks + pf_u32(f, r + 4);
+            if (dns_pcap_frame(c, f->ifs[0].linktype, dns_pcap_ns(ts, f->ifs[0].ticks), r + 16,
+                               pf_u32(f, r + 8)) != 0) {
+                return 1;
+            }
+            continue;
+        }
+
+        uint32_t type = pf_u32(f, r);
+        uint32_t if_id = 0;
+        uint64_t ts = 0;
+        size_t cap_len = 0;
+        const uchar* data = NULL;
+        if (type == PCAPNG_EPB && len >= 32) {
+            if_id = pf_u32(f, r + 8);
+            ts = ((uint64_t)pf_u32(f, r + 12) << 32) | pf_u32(f, r + 16);
+            cap_len = pf_u32(f, r + 20);
+            data = r + 28;
+        } else if (type == PCAPNG_PB && len >= 32) {
+            if_id = pf_u16(f, r + 8);
+            ts = ((uint64_t)pf_u32(f, r + 12) << 32) | pf_u32(f, r + 16);
+            cap_len = pf_u32(f, r + 20);
+            data = r + 28;
+        } else if (type == PCAPNG_SPB && len >= 16) {
+            cap_len = pf_u32(f, r + 8);
+            data = r + 12;
+            if (cap_len > len - 16) {
+                cap_len = len - 16;
+            }
+        } else {
+            continue; // Not a packet
+        }
+        if (if_id >= (uint32_t)f->n_ifs || data + cap_len > r + len - 4) {
+            ++c->stats.frames;
+            ++c->stats.skipped;
+            continue;
+        }
+        if (dns_pcap_frame(c, f->ifs[if_id].linktype, dns_pcap_ns(ts, f->ifs[if_id].ticks), data, cap_len) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void* dns_pcap_worker(void* arg)
+{
+    dns_pcap_chunk_t* c = arg;
+    const dns_pcap_file_t* f = c->file;
+
+    c->ret = 1;
+    size_t from = f->start + c->index * (size_t)PCAP_CHUNK_SIZE;
+    c->from = dns_pcap_sync(f, from);
+    c->to = from + PCAP_CHUNK_SIZE >= f->size ? f->size : dns_pcap_sync(f, from + PCAP_CHUNK_SIZE);
+    if (c->to < c->from) {
+        c->to = c->from;
+    }
+
+    if (dns_dedup_init(&c->names, stderr) != 0 || dns_pcap_table_init(&c->pending) != 0) {
+        return NULL;
+    }
+    if (c->opts->records) {
+        c->out = open_memstream(&c->out_buf, &c->out_len);
+        if (c->out == NULL) {
+            perror("open_memstream failed");
+            return NULL;
+        }
+    }
+
+    c->ret = dns_pcap_chunk_records(c);
+    if (c->out != NULL && fclose(c->out) != 0) {
+        perror("Writing the records failed");
+        c->ret = 1;
+    }
+    c->out = NULL;
+    return NULL;
+}
+
+static void dns_pcap_chunk_free(dns_pcap_chunk_t* c)
+{
+    dns_dedup_free(&c->names);
+    free(c->counts);
+    dns_pcap_table_free(&c->pending);
+    free(c->orphans);
+    free(c->out_buf);
+    memset(c, 0, sizeof(dns_pcap_chunk_t));
+}
+
+// Fold a decoded region into the totals, in the file order
+static int dns_pcap_merge(dns_pcap_chunk_t* total, dns_pcap_table_t* carry, dns_pcap_chunk_t* c, FILE* out)
+{
+    if (c->out_buf != NULL && fwrite(c->out_buf, 1, c->out_len, out) != c->out_len) {
+        perror("Writing the records failed");
+        return 1;
+    }
+    dns_pcap_stats_add(&total->stats, &c->stats);
+
+    for (size_t i = 0; i < c->names.count; ++i) {
+        const char* name = dns_dedup_name(&c->names, i);
+        long idx = dns_dedup_insert(&total->names, name, strlen(name), 0);
+        if (idx < 0) {
+            return 1;
+        }
+        if ((size_t)idx >= total->counts_cap) {
+            size_t cap = total->counts_cap ? total->counts_cap * 2 : 1024;
+            while (cap <= (size_t)idx) {
+                cap *= 2;
+            }
+            unsigned long* counts = realloc(total->counts, cap * sizeof(unsigned long));
+            if (counts == NULL) {
+                perror("realloc failed");
+                return 1;
+            }
+            memset(counts + total->counts_cap, 0, (cap - total->counts_cap) * sizeof(unsigned long));
+            total->counts = counts;
+            total->counts_cap = cap;
+        }
+        total->counts[idx] += c->counts[i];
+    }
+
+    // Responses at the start of the region to queries at the end of the previous one
+    dns_pcap_stats_t* s = &total->stats;
+    for (size_t i = 0; i < c->n_orphans; ++i) {
+        dns_pcap_query_t q;
+        if (dns_pcap_table_take(carry, &c->orphans[i], &q) && c->orphans[i].ts_ns >= q.ts_ns) {
+            dns_pcap_latency(s, c->orphans[i].ts_ns - q.ts_ns);
+        } else {
+            ++s->unmatched_responses;
+        }
+    }
+    s->unanswered += carry->count;
+    memset(carry->slots, 0, carry->cap * sizeof(dns_pcap_query_t));
+    carry->count = 0;
+
+    // Only recent queries may still be answered in the next region
+    for (size_t i = 0; i < c->pending.cap; ++i) {
+        dns_pcap_query_t* q = &c->pending.slots[i];
+        if (!q->used) {
+            continue;
+        }
+        if (q->ts_ns + PCAP_MATCH_WINDOW_NS < c->last_ts_ns) {
+            ++s->unanswered;
+        } else if (dns_pcap_table_put(carry, q) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void dns_pcap_print(FILE* out, const dns_pcap_chunk_t* total)
+{
+    const dns_pcap_stats_t* s = &total->stats;
+    unsigned long messages = s->queries + s->responses;
+    fprintf(out, "Capture: %llu bytes, %lu frames, %lu DNS messages (%lu UDP, %lu TCP)\n",
+            s->bytes, s->frames, messages, s->udp, s->tcp);
+    fprintf(out, "Skipped: %lu other frames, %lu partial TCP segments, %lu malformed messages\n",
+            s->skipped, s->tcp_partial, s->malformed);
+    fprintf(out, "Queries: %lu, responses: %lu\n", s->queries, s->responses);
+
+    // Selection of the most frequent names, the list is short
+    size_t top[PCAP_TOP_NAMES];
+    int n_top = 0;
+    for (size_t i = 0; i < total->names.count; ++i) {
+        int pos = n_top;
+        while (pos > 0 && total->counts[top[pos - 1]] < total->counts[i]) {
+            --pos;
+        }
+        if (pos == PCAP_TOP_NAMES) {
+            continue;
+        }
+        if (n_top < PCAP_TOP_NAMES) {
+            ++n_top;
+        }
+        memmove(&top[pos + 1], &top[pos], (n_top - 1 - pos) * sizeof(size_t));
+        top[pos] = i;
+    }
+    fprintf(out, "\nTop query names (%zu unique)\n", total->names.count);
+    for (int i = 0; i < n_top; ++i) {
+        fprintf(out, "  %10lu  %s.\n", total->counts[top[i]], dns_dedup_name(&total->names, top[i]));
+    }
+
+    fprintf(out, "\nQuery types\n");
+    for (int i = 0; i < 65536; ++i) {
+        if (s->qtypes[i] == 0) {
+            continue;
+        }
+        const char* type = dns_record_type_name(i);
+        char buf[16];
+        if (type == NULL) {
+            snprintf(buf, sizeof(buf), "TYPE%d", i);
+            type = buf;
+        }
+        fprintf(out, "  %-10s %10lu %6.2f%%\n", type, s->qtypes[i], 100.0 * s->qtypes[i] / s->queries);
+    }
+
+    fprintf(out, "\nResponse codes\n");
+    for (int i = 0; i < 16; ++i) {
+        if (s->rcodes[i] > 0) {
+            fprintf(out, "  %-10s %10lu %6.2f%%\n", rcode_names[i], s->rcodes[i], 100.0 * s->rcodes[i] / s->responses);
+        }
+    }
+
+    fprintf(out, "\nResponse sizes\n");
+    for (int i = 0; i < PCAP_SIZE_BUCKETS; ++i) {
+        if (s->sizes[i] > 0) {
+            fprintf(out, "  %5lu-%-5lu B %10lu %6.2f%%\n", i == 0 ? 0UL : 1UL << i, (2UL << i) - 1, s->sizes[i],
+                    100.0 * s->sizes[i] / s->responses);
+        }
+    }
+
+    fprintf(out, "\nLatency: %lu matched, %lu unanswered queries, %lu responses without a query\n",
+            s->matched, s->unanswered, s->unmatched_responses);
+    if (s->matched == 0) {
+        return;
+    }
+    const double pcts[] = { 50, 90, 99, 99.9 };
+    size_t p = 0;
+    unsigned long seen = 0;
+    fprintf(out, "  mean %.3f ms", s->latency_sum_us / s->matched / 1000);
+    for (size_t i = 0; i < PCAP_LATENCY_BUCKETS && p < sizeof(pcts) / sizeof(pcts[0]); ++i) {
+        seen += s->latency[i];
+        while (p < sizeof(pcts) / sizeof(pcts[0]) && seen >= s->matched * pcts[p] / 100) {
+            fprintf(out, ", p%g <= %.3f ms", pcts[p++], dns_pcap_bucket_ms(i));
+        }
+    }
+    fprintf(out, "\n");
+
+    // One row per power of two
+    for (int o = 0; o < PCAP_LATENCY_BUCKETS / PCAP_LATENCY_SUB; ++o) {
+        unsigned long n = 0;
+        for (int i = 0; i < PCAP_LATENCY_SUB; ++i) {
+            n += s->latency[o * PCAP_LATENCY_SUB + i];
+        }
+        if (n > 0) {
+            fprintf(out, "  %9.3f-%-9.3f ms %10lu %6.2f%%\n", o == 0 ? 0 : (1ULL << o) / 1000.0,
+                    (2ULL << o) / 1000.0, n, 100.0 * n / s->matched);
+        }
+    }
+}
+
+static int dns_pcap_map(dns_pcap_file_t* f, const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open capture file %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat failed");
+        close(fd);
+        return 1;
+    }
+    f->size = st.st_size;
+    void* data = f->size > 0 ? mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd); // The mapping stays valid
+    if (data == MAP_FAILED) {
+        perror("mmap failed");
+        return 1;
+    }
+    f->data = data;
+    return 0;
+}
+
+int dns_pcap_run(const dns_pcap_opts_t* opts, FILE* out)
+{
+    dns_pcap_file_t f;
+    memset(&f, 0, sizeof(dns_pcap_file_t));
+    if (dns_pcap_map(&f, opts->path) != 0) {
+        return 1;
+    }
+    if (dns_pcap_header(&f, opts->path) != 0) {
+        if (f.data != NULL) {
+            munmap((void*)f.data, f.size);
+        }
+        return 1;
+    }
+    posix_madvise((void*)f.data, f.size, POSIX_MADV_SEQUENTIAL);
+
+    size_t n_chunks = f.size > f.start ? (f.size - f.start + PCAP_CHUNK_SIZE - 1) / PCAP_CHUNK_SIZE : 1;
+    long threads = opts->threads > 0 ? opts->threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > PCAP_MAX_THREADS) {
+        threads = PCAP_MAX_THREADS;
+    }
+    if ((size_t)threads > n_chunks) {
+        threads = n_chunks;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Regions are decoded in rounds of one per thread, the output of a round
+    // is written before the next starts so it stays in memory only that long
+    dns_pcap_chunk_t* chunks = calloc(threads, sizeof(dns_pcap_chunk_t));
+    dns_pcap_chunk_t* total = calloc(1, sizeof(dns_pcap_chunk_t));
+    pthread_t tids[PCAP_MAX_THREADS];
+    dns_pcap_table_t carry;
+    int ret = 0;
+    if (chunks == NULL || total == NULL || dns_dedup_init(&total->names, stderr) != 0 || dns_pcap_table_init(&carry) != 0) {
+        perror("Allocation failed");
+        free(chunks);
+        free(total);
+        munmap((void*)f.data, f.size);
+        return 1;
+    }
+
+    for (size_t first = 0; first < n_chunks && ret == 0; first += threads) {
+        size_t n = n_chunks - first < (size_t)threads ? n_chunks - first : (size_t)threads;
+        size_t started = 0;
+        for (size_t i = 0; i < n; ++i) {
+            chunks[i].file = &f;
+            chunks[i].opts = opts;
+            chunks[i].index = first + i;
+            if (i == n - 1 || pthread_create(&tids[i], NULL, dns_pcap_worker, &chunks[i]) != 0) {
+                break; // The last region, or any that got no thread, is decoded by this one
+            }
+            ++started;
+        }
+        for (size_t i = started; i < n; ++i) {
+            dns_pcap_worker(&chunks[i]);
+        }
+        for (size_t i = 0; i < started; ++i) {
+            pthread_join(tids[i], NULL);
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            if (ret == 0 && (chunks[i].ret != 0 || dns_pcap_merge(total, &carry, &chunks[i], out) != 0)) {
+                ret = 1;
+            }
+            dns_pcap_chunk_free(&chunks[i]);
+        }
+    }
+    total->stats.unanswered += carry.count;
+    total->stats.bytes = f.size;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+
+    if (ret == 0 && !opts->records) {
+        dns_pcap_print(out, total);
+    }
+    if (ret == 0) {
+        fprintf(stderr, "Decoded %.1f MB in %.0f ms (%.0f MB/s, %ld thread(s)), %lu DNS messages.\n",
+                f.size / 1e6, ms, ms > 0 ? f.size / 1e3 / ms : 0, threads,
+                total->stats.queries + total->stats.responses);
+    }
+
+    dns_pcap_table_free(&carry);
+    dns_pcap_chunk_free(total);
+    free(total);
+    free(chunks);
+    munmap((void*)f.data, f.size);
+    return ret;
+}
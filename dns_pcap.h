@@ -0,0 +1,51 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_PCAP_H__
+#define __DNS_PCAP_H__
+
+#define PCAP_CHUNK_SIZE (32 << 20) // Region of the capture decoded by one thread at a time
+#define PCAP_MAX_THREADS 64
+#define PCAP_TOP_NAMES 10
+#define PCAP_SIZE_BUCKETS 17 // Powers of two up to 64 KiB
+#define PCAP_LATENCY_SUB 8 // Latency buckets per power of two microseconds
+#define PCAP_LATENCY_BUCKETS (24 * PCAP_LATENCY_SUB) // Up to 2^24 us
+#define PCAP_MATCH_WINDOW_NS 10000000000LL // Queries unanswered this long are given up
+
+typedef struct {
+    const char* path;
+    bool records; // Print every message instead of the statistics
+    int threads; // 0 for every online CPU
+} dns_pcap_opts_t;
+
+// Totals over the capture
+typedef struct {
+    unsigned long long bytes; // Of the capture file
+    unsigned long frames;
+    unsigned long skipped; // Not IP, not port 53, fragments, truncated frames
+    unsigned long tcp_partial; // TCP segments without a whole message, there is no reassembly
+    unsigned long queries;
+    unsigned long responses;
+    unsigned long malformed;
+    unsigned long udp;
+    unsigned long tcp;
+
+    unsigned long rcodes[16];
+    unsigned long qtypes[65536];
+    unsigned long sizes[PCAP_SIZE_BUCKETS]; // Responses, bucket i holds sizes below 2^(i+1)
+
+    unsigned long matched;
+    unsigned long unanswered;
+    unsigned long unmatched_responses;
+    unsigned long latency[PCAP_LATENCY_BUCKETS];
+    double latency_sum_us;
+} dns_pcap_stats_t;
+
+// Decode the DNS messages of a pcap or pcapng capture (Ethernet, Linux
+// cooked, loopback or raw IP links, UDP and TCP port 53) and write either
+// every message with its records or the statistics to out. Regions of the
+// file are decoded by several threads, the output keeps the file order.
+int dns_pcap_run(const dns_pcap_opts_t* opts, FILE* out);
+
+#endif // !__DNS_PCAP_H__
@@ -0,0 +1,135 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_error.h"
+
+#include <ctype.h>
+
+int dns_pending_init(dns_pending_table_t* table, dns_random_t* rnd, FILE* err)
+{
+    memset(table, 0, sizeof(dns_pending_table_t));
+    table->rnd = rnd;
+    table->err = err;
+    table->slots = calloc(PENDING_TABLE_SIZE, sizeof(dns_pending_t*));
+    if (table->slots == NULL) {
+        dns_perror(err, "calloc failed");
+        return 1;
+    }
+    return 0;
+}
+
+void dns_pending_free(dns_pending_table_t* table)
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->count = 0;
+}
+
+int dns_pending_add(dns_pending_table_t* table, dns_pending_t* q)
+{
+    if (table->count >= PENDING_TABLE_SIZE) {
+        dns_error(table->err, "Error: Too many outstanding queries.\n");
+        return 1;
+    }
+
+    // While the table is sparse, a free ID is found in a couple of tries
+    uint16_t id;
+    do {
+        if (dns_random_u16(table->rnd, &id) != 0) {
+            return 1;
+        }
+    } while (table->slots[id] != NULL);
+
+    q->id = id;
+    table->slots[id] = q;
+    ++table->count;
+    return 0;
+}
+
+void dns_pending_remove(dns_pending_table_t* table, dns_pending_t* q)
+{
+    if (table->slots[q->id] == q) {
+        table->slots[q->id] = NULL;
+        --table->count;
+    }
+}
+
+static bool dns_pending_same_source(const dns_pending_t* q, const struct sockaddr* from, socklen_t from_len)
+{
+    if (q->serv.ipv4) {
+        const struct sockaddr_in* a = (const struct sockaddr_in*)from;
+        return from_len >= sizeof(struct sockaddr_in) && a->sin_family == AF_INET &&
+            a->sin_port == q->serv.addr_ip4.sin_port &&
+            a->sin_addr.s_addr == q->serv.addr_ip4.sin_addr.s_addr;
+    }
+    const struct sockaddr_in6* a = (const struct sockaddr_in6*)from;
+    return from_len >= sizeof(struct sockaddr_in6) && a->sin6_family == AF_INET6 &&
+        a->sin6_port == q->serv.addr_ip6.sin6_port &&
+        memcmp(&a->sin6_addr, &q->serv.addr_ip6.sin6_addr, sizeof(struct in6_addr)) == 0;
+}
+
+// Compare the question section of the response with the query.
+// Names are compared case-insensitively (RFC 4343), length octets
+// are below 64 so tolower() does not change them.
+static bool dns_pending_same_question(const dns_pending_t* q, const uchar* pkt, size_t pkt_len)
+{
+    const dns_header_t* dns = (const dns_header_t*)pkt;
+    if (ntohs(dns->q_count) != N_QUESTIONS) {
+        return false;
+    }
+
+    size_t qend = sizeof(dns_header_t) + q->qname_len + sizeof(dns_qdata_t);
+    if (pkt_len < qend) {
+        return false;
+    }
+
+    const uchar* name = pkt + sizeof(dns_header_t);
+    for (int i = 0; i < q->qname_len; ++i) {
+        if (tolower(name[i]) != tolower(q->qname[i])) {
+            return false;
+        }
+    }
+
+    dns_qdata_t qdata;
+    memcpy(&qdata, name + q->qname_len, sizeof(dns_qdata_t));
+    return ntohs(qdata.qtype) == q->qtype && ntohs(qdata.qclass) == q->qclass;
+}
+
+dns_pending_t* dns_pending_match(dns_pending_table_t* table, const uchar* pkt, size_t pkt_len,
+                                 int sock_fd, const struct sockaddr* from, socklen_t from_len)
+{
+    if (pkt_len < sizeof(dns_header_t) || ((const dns_header_t*)pkt)->qr != 1) {
+        ++table->dropped.bad_format;
+        return NULL;
+    }
+
+    dns_pending_t* q = table->slots[ntohs(((const dns_header_t*)pkt)->id)];
+    if (q == NULL) {
+        ++table->dropped.bad_id;
+        return NULL;
+    }
+
+    if (q->sock_fd != sock_fd || !dns_pending_same_source(q, from, from_len)) {
+        ++table->dropped.bad_source;
+        return NULL;
+    }
+
+    if (!dns_pending_same_question(q, pkt, pkt_len)) {
+        ++table->dropped.bad_question;
+        return NULL;
+    }
+
+    return q;
+}
+
+unsigned long dns_pending_dropped_total(const dns_pending_table_t* table)
+{
+    return table->dropped.bad_format + table->dropped.bad_id +
+        table->dropped.bad_source + table->dropped.bad_question;
+}
@@ -0,0 +1,53 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_PENDING_H__
+#define __DNS_PENDING_H__
+
+#define PENDING_TABLE_SIZE 65536 // One slot per possible query ID
+#define MAX_QNAME_WIRE_LEN 255 // RFC 1035: names are limited to 255 octets
+
+// Outstanding query, a response is accepted only if it matches all of it
+typedef struct {
+    uint16_t id;
+    int sock_fd; // Socket the query was sent from
+    serv_addr_t serv; // Server the query was sent to
+    uchar qname[MAX_QNAME_WIRE_LEN+1]; // Encoded name, e.g. 3www6github3com0
+    int qname_len; // Including the terminating zero octet
+    uint16_t qtype;
+    uint16_t qclass;
+} dns_pending_t;
+
+// Counters of dropped (unmatched) datagrams
+typedef struct {
+    unsigned long bad_format; // Too short or not a response
+    unsigned long bad_id; // No outstanding query with this ID
+    unsigned long bad_source; // Wrong server address, port or socket
+    unsigned long bad_question; // Question section does not echo the query
+} dns_drop_stats_t;
+
+typedef struct {
+    dns_pending_t** slots; // Indexed directly by query ID
+    size_t count;
+    dns_drop_stats_t dropped;
+    dns_random_t* rnd; // Query IDs
+    FILE* err; // Diagnostics, NULL for none
+} dns_pending_table_t;
+
+int dns_pending_init(dns_pending_table_t* table, dns_random_t* rnd, FILE* err);
+void dns_pending_free(dns_pending_table_t* table);
+
+// Assign a random unused ID to the query and register it
+int dns_pending_add(dns_pending_table_t* table, dns_pending_t* q);
+
+void dns_pending_remove(dns_pending_table_t* table, dns_pending_t* q);
+
+// Find the outstanding query the datagram answers.
+// Returns NULL and counts the datagram as dropped if there is none.
+dns_pending_t* dns_pending_match(dns_pending_table_t* table, const uchar* pkt, size_t pkt_len,
+                                 int sock_fd, const struct sockaddr* from, socklen_t from_len);
+
+unsigned long dns_pending_dropped_total(const dns_pending_table_t* table);
+
+#endif // !__DNS_PENDING_H__
@@ -0,0 +1,189 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_cc.h"
+#include "dns_engine.h"
+#include "dns_dnssec.h"
+#include "libdns.h"
+#include "dns_print.h"
+
+const char* dns_record_type_to_str(uint16_t type)
+{
+    static char tbuf[MAX_TYPE_STR_LEN];
+    return dns_record_type_str(type, tbuf);
+}
+
+void dns_print_question(FILE* out, const char* qstr, uint16_t qtype)
+{
+    fprintf(out, "Question section (%d)\n", N_QUESTIONS);
+    fprintf(out, "  %s., %s, %s\n", qstr, dns_record_type_to_str(qtype), "IN");
+}
+
+static void dns_print_record(FILE* out, const dns_record_t* rec)
+{
+    fprintf(out, "  ");
+    fprintf(out, "%s., ", rec->name);
+    fprintf(out, "%s, ", dns_record_type_to_str(rec->type));
+    fprintf(out, "IN, "); // It should always be internet
+    fprintf(out, "%u, ", rec->ttl);
+    fprintf(out, "%s\n", rec->rdata);
+}
+
+void dns_print_result(FILE* out, const dns_result_t* res)
+{
+    const dns_header_t* dns = &res->header;
+
+    fprintf(out, "Authoritative: %s, ", (dns->aa == 1) ? "Yes" : "No");
+    fprintf(out, "Recursive: %s, ", (dns->rd == 1) ? "Yes" : "No"); // Maybe ra instead of rd?
+    fprintf(out, "Truncated: %s, ", (dns->tc == 1) ? "Yes" : "No"); // What to do with truncated message?
+    fprintf(out, "Authenticated: %s\n", (dns->ad == 1) ? "Yes" : "No");
+
+#if VERBOSE == 1 
+    fprintf(out, "\nThe response contains : ");
+    fprintf(out, "\n %d Questions.", ntohs(dns->q_count));
+    fprintf(out, "\n %d Answers.", res->ans_count);
+    fprintf(out, "\n %d Authoritative Servers.", res->auth_count);
+    fprintf(out, "\n %d Additional records.\n\n", res->add_count);
+#endif
+
+    const dns_record_t* rec = res->records;
+
+    // Print answers
+    fprintf(out, "Answer section (%d)\n", res->ans_count);
+    for (int i = 0; i < res->ans_count; ++i) {
+        dns_print_record(out, rec++);
+    }
+
+    // Print authorities
+    fprintf(out, "Authority section (%d)\n", res->auth_count);
+    for (int i = 0; i < res->auth_count; ++i) {
+        dns_print_record(out, rec++);
+    }
+
+    // Print additional
+    fprintf(out, "Additional section (%d)\n", res->add_count);
+    for (int i = 0; i < res->add_count; ++i) {
+        dns_print_record(out, rec++);
+    }
+}
+
+// Records of one section of every response, in the order of the responses
+static void dns_print_merged_section(FILE* out, const char* title, const dns_result_t* results,
+                                     const bool* ok, int n, int section)
+{
+    int total = 0;
+    for (int i = 0; i < n; ++i) {
+        if (ok[i]) {
+            total += section == 0 ? results[i].ans_count : section == 1 ? results[i].auth_count : results[i].add_count;
+        }
+    }
+    fprintf(out, "%s section (%d)\n", title, total);
+
+    for (int i = 0; i < n; ++i) {
+        if (!ok[i]) {
+            continue;
+        }
+        const dns_result_t* res = &results[i];
+        int first = section == 0 ? 0 : section == 1 ? res->ans_count : res->ans_count + res->auth_count;
+        int count = section == 0 ? res->ans_count : section == 1 ? res->auth_count : res->add_count;
+        for (int j = first; j < first + count; ++j) {
+            dns_print_record(out, &res->records[j]);
+        }
+    }
+}
+
+void dns_print_merged(FILE* out, const char* qstr, const uint16_t* qtypes, const dns_result_t* results,
+                      const bool* ok, int n)
+{
+    fprintf(out, "Question section (%d)\n", n);
+    for (int i = 0; i < n; ++i) {
+        fprintf(out, "  %s., %s, %s\n", qstr, dns_record_type_to_str(qtypes[i]), "IN");
+    }
+
+    // The flags hold for the merged result only if they hold for every response
+    bool any = false, aa = true, rd = true, tc = false, ad = true;
+    for (int i = 0; i < n; ++i) {
+        if (ok[i]) {
+            any = true;
+            aa = aa && results[i].header.aa == 1;
+            rd = rd && results[i].header.rd == 1;
+            tc = tc || results[i].header.tc == 1;
+            ad = ad && results[i].header.ad == 1;
+        }
+    }
+    if (!any) {
+        return;
+    }
+    fprintf(out, "Authoritative: %s, ", aa ? "Yes" : "No");
+    fprintf(out, "Recursive: %s, ", rd ? "Yes" : "No");
+    fprintf(out, "Truncated: %s, ", tc ? "Yes" : "No");
+    fprintf(out, "Authenticated: %s\n", ad ? "Yes" : "No");
+
+    dns_print_merged_section(out, "Answer", results, ok, n, 0);
+    dns_print_merged_section(out, "Authority", results, ok, n, 1);
+    dns_print_merged_section(out, "Additional", results, ok, n, 2);
+}
+
+int dns_lookup_print(FILE* out, FILE* err, const dns_lookup_t* l)
+{
+    if (l->status == QUERY_BAD_NAME) {
+        fprintf(err, "Error: Invalid query name %s.\n", l->qstr);
+        return 1;
+    }
+
+    dns_print_question(out, l->qstr, l->qtype);
+
+    if (l->status == QUERY_TIMEOUT) {
+        fprintf(err, "Error: No answer received.\n");
+        return 1;
+    } else if (l->status == QUERY_SEND_FAILED) {
+        fprintf(err, "Error: Query could not be sent.\n");
+        return 1;
+    } else if (l->status == QUERY_MALFORMED) {
+        fprintf(err, "Error: Malformed response.\n");
+        return 1;
+    } else if (l->result.header.rcode != 0) {
+        fprintf(err, "Error: %s\n", dns_rcode_to_str(l->result.header.rcode));
+        return 1;
+    }
+    dns_print_result(out, &l->result);
+    return 0;
+}
+
+static void dns_cc_print_row(FILE* out, double from_ms, double len_ms, const dns_cc_sample_t* s)
+{
+    fprintf(out, "  %9.0f %7d %9.2f %10.0f %7u\n", from_ms, s->window, s->srtt_ms,
+            len_ms > 0 ? s->answers * 1000.0 / len_ms : 0, s->losses);
+}
+
+void dns_cc_print(FILE* out, const dns_cc_t* cc, const char* name)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    fprintf(out, "Window of %s: %d (lowest RTT %.2f ms), %lu answers, %lu timeouts, %lu refused, "
+            "%lu cuts (%lu for RTT)\n", name, dns_cc_window(cc), cc->min_rtt_ms, cc->answers,
+            cc->timeouts, cc->refused, cc->cuts, cc->inflated);
+    fprintf(out, "  %9s %7s %9s %10s %7s\n", "time ms", "window", "srtt ms", "answers/s", "losses");
+
+    for (int i = 0; i < cc->n_history; ++i) {
+        dns_cc_print_row(out, (double)i * cc->interval_ms, cc->interval_ms, &cc->history[i]);
+    }
+
+    // The interval in progress
+    double from_ms = (double)cc->n_history * cc->interval_ms;
+    dns_cc_sample_t last = cc->current;
+    last.window = dns_cc_window(cc);
+    last.srtt_ms = cc->srtt_ms;
+    if (last.answers > 0 || last.losses > 0 || cc->n_history == 0) {
+        double now_ms = (now.tv_sec - cc->start.tv_sec) * 1000.0 + (now.tv_nsec - cc->start.tv_nsec) / 1e6;
+        dns_cc_print_row(out, from_ms, now_ms - from_ms, &last);
+    }
+}
@@ -0,0 +1,30 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_PRINT_H__
+#define __DNS_PRINT_H__
+
+// Output of the dns program, the library itself never prints
+
+// Mnemonic or number of a type. The number is kept in a static buffer,
+// use dns_record_type_str() from several threads.
+const char* dns_record_type_to_str(uint16_t type);
+
+void dns_print_question(FILE* out, const char* qstr, uint16_t qtype);
+void dns_print_result(FILE* out, const dns_result_t* res);
+
+// Print the responses to several questions about one name as one result: all
+// questions, then every section with the records of the responses in the order
+// of the questions. Responses with ok[i] false are left out.
+void dns_print_merged(FILE* out, const char* qstr, const uint16_t* qtypes, const dns_result_t* results,
+                      const bool* ok, int n);
+
+// Print the outcome of the lookup the way a single lookup prints it,
+// errors go to err. Returns 1 if the query failed.
+int dns_lookup_print(FILE* out, FILE* err, const dns_lookup_t* l);
+
+// Summary of the congestion window with the window over time
+void dns_cc_print(FILE* out, const dns_cc_t* cc, const char* name);
+
+#endif // !__DNS_PRINT_H__
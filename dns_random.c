@@ -0,0 +1,94 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_error.h"
+
+#include <sys/random.h>
+#include <fcntl.h>
+
+void dns_random_init(dns_random_t* r, FILE* err)
+{
+    r->pos = RANDOM_POOL_SIZE; // Empty until first use
+    r->err = err;
+}
+
+// Refill the pool from getrandom(), /dev/urandom is used as a fallback
+static int dns_random_refill(dns_random_t* r)
+{
+    size_t got = 0;
+    while (got < RANDOM_POOL_SIZE) {
+        ssize_t n = getrandom(r->pool + got, RANDOM_POOL_SIZE - got, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        got += n;
+    }
+
+    if (got < RANDOM_POOL_SIZE) {
+        int fd = open("/dev/urandom", O_RDONLY);
+        while (fd >= 0 && got < RANDOM_POOL_SIZE) {
+            ssize_t n = read(fd, r->pool + got, RANDOM_POOL_SIZE - got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Never hand out predictable numbers
+    if (got < RANDOM_POOL_SIZE) {
+        dns_error(r->err, "Error: Failed to read random data.\n");
+        return 1;
+    }
+    r->pos = 0;
+    return 0;
+}
+
+static int dns_random_bytes(dns_random_t* r, void* dst, size_t n)
+{
+    if (r->pos + n > RANDOM_POOL_SIZE && dns_random_refill(r) != 0) {
+        return 1;
+    }
+    memcpy(dst, r->pool + r->pos, n);
+    // Wipe the consumed bytes so they can not leak later
+    memset(r->pool + r->pos, 0, n);
+    r->pos += n;
+    return 0;
+}
+
+int dns_random_u16(dns_random_t* r, uint16_t* out)
+{
+    return dns_random_bytes(r, out, sizeof(*out));
+}
+
+int dns_random_u32(dns_random_t* r, uint32_t* out)
+{
+    return dns_random_bytes(r, out, sizeof(*out));
+}
+
+int dns_random_range(dns_random_t* r, uint32_t lo, uint32_t hi, uint32_t* out)
+{
+    uint32_t span = hi - lo + 1;
+    if (span == 0) { // Full 32 bit range
+        return dns_random_u32(r, out);
+    }
+    // Reject values from the incomplete last bucket to avoid modulo bias
+    uint32_t limit = UINT32_MAX - (UINT32_MAX % span);
+    uint32_t v;
+    do {
+        if (dns_random_u32(r, &v) != 0) {
+            return 1;
+        }
+    } while (v >= limit);
+    *out = lo + v % span;
+    return 0;
+}
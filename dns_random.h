@@ -0,0 +1,31 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_RANDOM_H__
+#define __DNS_RANDOM_H__
+
+#include <stdint.h>
+
+#define RANDOM_POOL_SIZE 4096 // Bytes fetched from the kernel at once
+
+// Uniformly distributed random numbers from the kernel CSPRNG. Bytes are
+// fetched in blocks so that a syscall is not paid per call. Every resolver
+// has its own pool, a pool is not shared between threads.
+typedef struct {
+    uchar pool[RANDOM_POOL_SIZE];
+    size_t pos; // Bytes handed out, the pool is refilled once they are all gone
+    FILE* err; // Diagnostics, NULL for none
+} dns_random_t;
+
+void dns_random_init(dns_random_t* r, FILE* err);
+
+// The functions return 1 if the kernel has no random data to give, never
+// a predictable number
+int dns_random_u16(dns_random_t* r, uint16_t* out);
+int dns_random_u32(dns_random_t* r, uint32_t* out);
+
+// Random number in range [lo, hi]
+int dns_random_range(dns_random_t* r, uint32_t lo, uint32_t hi, uint32_t* out);
+
+#endif // !__DNS_RANDOM_H__
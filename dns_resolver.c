@@ -0,0 +1,217 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_cc.h"
+#include "dns_engine.h"
+#include "dns_dnssec.h"
+#include "libdns.h"
+
+// Callbacks of dns_resolve_many() with their context, the engine has one context for both
+typedef struct {
+    dns_engine_next_cb next;
+    dns_lookup_cb done;
+    void* ctx;
+} dns_resolve_many_t;
+
+// The one query of dns_resolve()
+typedef struct {
+    const char* name;
+    uint16_t qtype;
+    bool sent;
+    dns_lookup_t* out;
+} dns_resolve_one_t;
+
+static int dns_resolver_address(serv_addr_t* serv, const char* server_name, uint16_t server_port, FILE* err)
+{
+    // Attempt to parse the address as IPv4
+    if (inet_pton(AF_INET , server_name, &serv->addr_ip4.sin_addr) == 1) {
+        serv->ipv4 = true;
+        serv->addr_ip4.sin_family = AF_INET;
+        serv->addr_ip4.sin_port = htons(server_port);
+    } else if (inet_pton(AF_INET6, server_name, &serv->addr_ip6.sin6_addr) == 1) {
+        serv->ipv4 = false;
+        serv->addr_ip6.sin6_family = AF_INET6;
+        serv->addr_ip6.sin6_port = htons(server_port);
+    } else {
+        // Convert server name to IP address using getaddrinfo()
+        if (dns_domain_to_ip(server_name, serv, err) != 0) {
+            return 1;
+        }
+
+        if (serv->ipv4) {
+            serv->addr_ip4.sin_port = htons(server_port);
+        } else {
+            serv->addr_ip6.sin6_port = htons(server_port);
+        }
+    }
+    return 0;
+}
+
+int dns_resolver_init(dns_resolver_t* r, const dns_resolver_opts_t* opts)
+{
+    memset(r, 0, sizeof(dns_resolver_t));
+    r->err = opts->err;
+    dns_random_init(&r->rnd, opts->err);
+
+    uint16_t port = opts->port;
+    if (port == 0) {
+        port = opts->transport == TRANSPORT_TLS ? DEFAULT_TLS_PORT : DEFAULT_PORT;
+    }
+
+    // Every server gets its own sockets or connections
+    dns_engine_t* e = &r->engine;
+    for (int i = 0; i < opts->n_servers && i < MAX_SERVERS; ++i) {
+        const char* name = opts->servers[i];
+        dns_server_t* serv = &e->servers[i];
+
+        if (dns_resolver_address(&serv->addr, name, port, r->err) != 0) {
+            return 1;
+        }
+
+        if (opts->transport == TRANSPORT_UDP) {
+            if (sock_pool_open(&r->socks[i], serv->addr.ipv4, &r->rnd, r->err) != 0) {
+                return 1;
+            }
+            serv->socks = &r->socks[i];
+            // Signed answers often exceed the EDNS0 payload size, they are asked again over TCP
+            if (opts->dnssec) {
+                if (dns_stream_pool_init(&r->streams[i], serv->addr, false, NULL, NULL, r->err) != 0) {
+                    return 1;
+                }
+                serv->fallback = &r->streams[i];
+            }
+        } else {
+            // The certificate is checked against the server name, or its address if given as one
+            struct in6_addr tmp;
+            bool is_addr = inet_pton(AF_INET, name, &tmp) == 1 || inet_pton(AF_INET6, name, &tmp) == 1;
+            if (dns_stream_pool_init(&r->streams[i], serv->addr, opts->transport == TRANSPORT_TLS,
+                                     is_addr ? NULL : name, opts->tls_ca_path, r->err) != 0) {
+                return 1;
+            }
+            serv->streams = &r->streams[i];
+        }
+        ++e->n_servers;
+    }
+
+    if (dns_pending_init(&r->pending, &r->rnd, r->err) != 0) {
+        return 1;
+    }
+
+    e->pending = &r->pending;
+    e->recursion_desired = opts->recursion_desired;
+    e->window = opts->adaptive ? CC_MAX_WINDOW : DEFAULT_WINDOW;
+    for (int i = 0; opts->adaptive && i < e->n_servers; ++i) {
+        dns_cc_init(&r->ccs[i], CC_MAX_WINDOW);
+        e->servers[i].cc = &r->ccs[i];
+    }
+    e->timeout_ms = opts->timeout_ms > 0 ? opts->timeout_ms : DEFAULT_TIMEOUT_MS;
+    e->tries = opts->tries > 0 ? opts->tries : DEFAULT_TRIES;
+    e->deadline_ms = opts->deadline_ms;
+    e->io_uring = opts->io_uring;
+    e->err = r->err;
+    if (opts->dnssec) {
+        r->validator = dns_validator_new(opts->trust_anchor_path, 0, r->err);
+        if (r->validator == NULL) {
+            return 1;
+        }
+        e->validator = r->validator;
+    }
+    return 0;
+}
+
+void dns_resolver_free(dns_resolver_t* r)
+{
+    for (int i = 0; i < MAX_SERVERS; ++i) {
+        sock_pool_close(&r->socks[i]);
+        dns_stream_pool_free(&r->streams[i]);
+    }
+    dns_pending_free(&r->pending);
+    dns_validator_free(r->validator);
+    r->validator = NULL;
+}
+
+void dns_lookup_fill(dns_lookup_t* l, const dns_query_t* q, dns_query_status_t status,
+                     const uchar* pkt, size_t pkt_len)
+{
+    memset(l, 0, sizeof(dns_lookup_t));
+    l->index = q->index;
+    strcpy(l->qstr, q->qstr);
+    l->qtype = q->pend.qtype;
+    l->status = status;
+    if (status == QUERY_OK && dns_parse_response(pkt, pkt_len, &l->result) != 0) {
+        l->status = QUERY_MALFORMED;
+    }
+}
+
+void dns_lookup_free(dns_lookup_t* l)
+{
+    dns_free_result(&l->result);
+}
+
+static int dns_resolve_many_next(void* ctx, size_t* index, const char** name, uint16_t* qtype)
+{
+    dns_resolve_many_t* m = ctx;
+    return m->next(m->ctx, index, name, qtype);
+}
+
+static void dns_resolve_many_done(void* ctx, const dns_query_t* q, dns_query_status_t status,
+                                  const uchar* pkt, size_t pkt_len)
+{
+    dns_resolve_many_t* m = ctx;
+    dns_lookup_t l;
+    dns_lookup_fill(&l, q, status, pkt, pkt_len);
+    m->done(m->ctx, &l);
+    dns_lookup_free(&l);
+}
+
+int dns_resolve_many(dns_resolver_t* r, dns_engine_next_cb next, dns_lookup_cb done, void* ctx)
+{
+    dns_resolve_many_t m = { next, done, ctx };
+    r->engine.next = dns_resolve_many_next;
+    r->engine.done = dns_resolve_many_done;
+    r->engine.ctx = &m;
+    int ret = dns_engine_run(&r->engine);
+    r->engine.ctx = NULL;
+    return ret != 0 ? 1 : 0;
+}
+
+static int dns_resolve_next(void* ctx, size_t* index, const char** name, uint16_t* qtype)
+{
+    dns_resolve_one_t* one = ctx;
+    if (one->sent) {
+        return 0;
+    }
+    one->sent = true;
+    *index = 0;
+    *name = one->name;
+    *qtype = one->qtype;
+    return 1;
+}
+
+static void dns_resolve_done(void* ctx, dns_lookup_t* lookup)
+{
+    dns_resolve_one_t* one = ctx;
+    *one->out = *lookup;
+    lookup->result.records = NULL; // Kept in out
+}
+
+int dns_resolve(dns_resolver_t* r, const char* name, uint16_t qtype, dns_lookup_t* out)
+{
+    memset(out, 0, sizeof(dns_lookup_t));
+    strncpy(out->qstr, name, MAX_NAME_STR_LEN - 1);
+    out->qtype = qtype;
+    out->status = QUERY_SEND_FAILED; // Unless the engine gets to finish it
+
+    dns_resolve_one_t one = { name, qtype, false, out };
+    if (dns_resolve_many(r, dns_resolve_next, dns_resolve_done, &one) != 0) {
+        return 1;
+    }
+    return out->status != QUERY_OK || out->result.header.rcode != 0 ? 1 : 0;
+}
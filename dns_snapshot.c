@@ -0,0 +1,617 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_cc.h"
+#include "dns_engine.h"
+#include "dns_dnssec.h"
+#include "libdns.h"
+#include "dns_print.h"
+#include "dns_snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_HEADER_SIZE (SNAPSHOT_MAGIC_LEN + sizeof(uint64_t))
+// Blob length, name length, type, rcode, expiration, record count
+#define ENTRY_FIXED_SIZE (4 + 1 + 2 + 1 + 8 + 2)
+// TTL, name length, type, rdata length
+#define RECORD_FIXED_SIZE (4 + 1 + 2 + 2)
+
+// Decoded view of a record of an entry
+typedef struct {
+    uint32_t ttl;
+    const char* name;
+    uint8_t name_len;
+    uint16_t type;
+    const char* rdata;
+    uint16_t rdata_len;
+} dns_snapshot_record_t;
+
+uint32_t dns_snapshot_blob_len(const uchar* blob)
+{
+    uint32_t len;
+    memcpy(&len, blob, sizeof(uint32_t));
+    return len;
+}
+
+static int dns_snapshot_next_record(const uchar** p, const uchar* end, dns_snapshot_record_t* r)
+{
+    const uchar* c = *p;
+    if (c + RECORD_FIXED_SIZE > end) {
+        return 1;
+    }
+    memcpy(&r->ttl, c, sizeof(uint32_t));
+    c += sizeof(uint32_t);
+    r->name_len = *c++;
+    if (c + r->name_len + 4 > end) {
+        return 1;
+    }
+    r->name = (const char*)c;
+    c += r->name_len;
+    memcpy(&r->type, c, sizeof(uint16_t));
+    c += sizeof(uint16_t);
+    memcpy(&r->rdata_len, c, sizeof(uint16_t));
+    c += sizeof(uint16_t);
+    if (c + r->rdata_len > end) {
+        return 1;
+    }
+    r->rdata = (const char*)c;
+    *p = c + r->rdata_len;
+    return 0;
+}
+
+int dns_snapshot_decode(const uchar* blob, dns_snapshot_entry_t* e)
+{
+    uint32_t len = dns_snapshot_blob_len(blob);
+    if (len < ENTRY_FIXED_SIZE) {
+        return 1;
+    }
+    e->end = blob + len;
+
+    const uchar* p = blob + sizeof(uint32_t);
+    e->name_len = *p++;
+    if (ENTRY_FIXED_SIZE + e->name_len > len) {
+        return 1;
+    }
+    e->name = (const char*)p;
+    p += e->name_len;
+    memcpy(&e->qtype, p, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    e->rcode = *p++;
+    memcpy(&e->expires, p, sizeof(int64_t));
+    p += sizeof(int64_t);
+    memcpy(&e->n_records, p, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    e->records = p;
+
+    // Make sure all records are within the blob
+    dns_snapshot_record_t r;
+    for (int i = 0; i < e->n_records; ++i) {
+        if (dns_snapshot_next_record(&p, e->end, &r) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Order of the entries: name bytes, then type
+static int dns_snapshot_cmp_key(const char* a, size_t a_len, uint16_t a_type,
+                                const char* b, size_t b_len, uint16_t b_type)
+{
+    size_t n = a_len < b_len ? a_len : b_len;
+    int c = memcmp(a, b, n);
+    if (c != 0) {
+        return c;
+    }
+    if (a_len != b_len) {
+        return a_len < b_len ? -1 : 1;
+    }
+    return (a_type > b_type) - (a_type < b_type);
+}
+
+static int dns_snapshot_cmp_blobs(const uchar* a, const uchar* b)
+{
+    dns_snapshot_entry_t ea, eb;
+    dns_snapshot_decode(a, &ea);
+    dns_snapshot_decode(b, &eb);
+    return dns_snapshot_cmp_key(ea.name, ea.name_len, ea.qtype, eb.name, eb.name_len, eb.qtype);
+}
+
+int dns_snapshot_load(dns_snapshot_t* snap, const char* path)
+{
+    memset(snap, 0, sizeof(dns_snapshot_t));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) { // First run
+            return 0;
+        }
+        fprintf(stderr, "Failed to open snapshot %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)SNAPSHOT_HEADER_SIZE) {
+        fprintf(stderr, "Invalid snapshot %s.\n", path);
+        close(fd);
+        return 1;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap failed");
+        return 1;
+    }
+    snap->data = data;
+    snap->size = st.st_size;
+
+    uint64_t count;
+    memcpy(&count, snap->data + SNAPSHOT_MAGIC_LEN, sizeof(uint64_t));
+    if (memcmp(snap->data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 ||
+        count > (snap->size - SNAPSHOT_HEADER_SIZE) / ENTRY_FIXED_SIZE) {
+        fprintf(stderr, "Invalid snapshot %s.\n", path);
+        dns_snapshot_close(snap);
+        return 1;
+    }
+
+    snap->entries = malloc((count ? count : 1) * sizeof(uchar*));
+    if (snap->entries == NULL) {
+        perror("malloc failed");
+        dns_snapshot_close(snap);
+        return 1;
+    }
+
+    // Index the entries for binary search
+    const uchar* p = snap->data + SNAPSHOT_HEADER_SIZE;
+    const uchar* end = snap->data + snap->size;
+    dns_snapshot_entry_t e;
+    for (snap->count = 0; snap->count < count; ++snap->count) {
+        if (p + sizeof(uint32_t) > end || dns_snapshot_blob_len(p) > (size_t)(end - p) ||
+            dns_snapshot_decode(p, &e) != 0) {
+            fprintf(stderr, "Corrupted snapshot %s.\n", path);
+            dns_snapshot_close(snap);
+            return 1;
+        }
+        snap->entries[snap->count] = p;
+        p = e.end;
+    }
+    return 0;
+}
+
+void dns_snapshot_close(dns_snapshot_t* snap)
+{
+    if (snap->data != NULL) {
+        munmap((void*)snap->data, snap->size);
+    }
+    free(snap->entries);
+    memset(snap, 0, sizeof(dns_snapshot_t));
+}
+
+const uchar* dns_snapshot_find(const dns_snapshot_t* snap, const char* name, size_t name_len, uint16_t qtype)
+{
+    size_t lo = 0, hi = snap->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        dns_snapshot_entry_t e;
+        dns_snapshot_decode(snap->entries[mid], &e);
+        int c = dns_snapshot_cmp_key(e.name, e.name_len, e.qtype, name, name_len, qtype);
+        if (c == 0) {
+            return snap->entries[mid];
+        } else if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+uchar* dns_snapshot_encode(const char* name, uint16_t qtype, const dns_result_t* res, time_t now)
+{
+    size_t name_len = strlen(name);
+    int n_records = res->header.rcode == 0 ? res->ans_count : 0;
+
+    size_t len = ENTRY_FIXED_SIZE + name_len;
+    for (int i = 0; i < n_records; ++i) {
+        len += RECORD_FIXED_SIZE + strlen(res->records[i].name) + strlen(res->records[i].rdata);
+    }
+
+    uchar* blob = malloc(len);
+    if (blob == NULL) {
+        perror("malloc failed");
+        return NULL;
+    }
+
+    // The entry is valid until the shortest TTL of the answer runs out.
+    // Without an answer, the SOA of a negative response tells how long.
+    int64_t ttl = -1;
+    int ttl_from = n_records > 0 ? 0 : res->ans_count;
+    int ttl_to = n_records > 0 ? n_records : res->ans_count + res->auth_count;
+    for (int i = ttl_from; i < ttl_to; ++i) {
+        if (ttl < 0 || res->records[i].ttl < ttl) {
+            ttl = res->records[i].ttl;
+        }
+    }
+
+    uchar* p = blob;
+    uint32_t blob_len = len;
+    memcpy(p, &blob_len, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+    *p++ = name_len;
+    memcpy(p, name, name_len);
+    p += name_len;
+    memcpy(p, &qtype, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+    *p++ = res->header.rcode;
+    int64_t expires = now + (ttl > 0 ? ttl : 0);
+    memcpy(p, &expires, sizeof(int64_t));
+    p += sizeof(int64_t);
+    uint16_t n = n_records;
+    memcpy(p, &n, sizeof(uint16_t));
+    p += sizeof(uint16_t);
+
+    for (int i = 0; i < n_records; ++i) {
+        const dns_record_t* rec = &res->records[i];
+        uint8_t rec_name_len = strlen(rec->name);
+        uint16_t rdata_len = strlen(rec->rdata);
+        memcpy(p, &rec->ttl, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+        *p++ = rec_name_len;
+        memcpy(p, rec->name, rec_name_len);
+        p += rec_name_len;
+        memcpy(p, &rec->type, sizeof(uint16_t));
+        p += sizeof(uint16_t);
+        memcpy(p, &rdata_len, sizeof(uint16_t));
+        p += sizeof(uint16_t);
+        memcpy(p, rec->rdata, rdata_len);
+        p += rdata_len;
+    }
+    return blob;
+}
+
+// Is the record (ignoring its TTL) one of the records of the entry
+static bool dns_snapshot_has_record(const dns_snapshot_entry_t* e, const dns_snapshot_record_t* r)
+{
+    const uchar* p = e->records;
+    dns_snapshot_record_t other;
+    for (int i = 0; i < e->n_records; ++i) {
+        dns_snapshot_next_record(&p, e->end, &other);
+        if (other.type == r->type && other.name_len == r->name_len && other.rdata_len == r->rdata_len &&
+            memcmp(other.name, r->name, r->name_len) == 0 &&
+            memcmp(other.rdata, r->rdata, r->rdata_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Print the records of a that are not in b
+static int dns_snapshot_print_missing(FILE* out, char sign, const dns_snapshot_entry_t* a,
+                                      const dns_snapshot_entry_t* b, bool header)
+{
+    int changes = 0;
+    const uchar* p = a->records;
+    dns_snapshot_record_t r;
+    for (int i = 0; i < a->n_records; ++i) {
+        dns_snapshot_next_record(&p, a->end, &r);
+        if (b != NULL && dns_snapshot_has_record(b, &r)) {
+            continue;
+        }
+        if (header && changes == 0) {
+            fprintf(out, "Changed: %.*s., %s\n", a->name_len, a->name, dns_record_type_to_str(a->qtype));
+        }
+        fprintf(out, "  %c %.*s., %s, IN, %u, %.*s\n", sign, r.name_len, r.name,
+            dns_record_type_to_str(r.type), r.ttl, r.rdata_len, r.rdata);
+        ++changes;
+    }
+    return changes;
+}
+
+int dns_snapshot_diff(FILE* out, const uchar* old_blob, const uchar* new_blob)
+{
+    dns_snapshot_entry_t n;
+    dns_snapshot_decode(new_blob, &n);
+
+    dns_snapshot_entry_t o;
+    dns_snapshot_entry_t* old = NULL;
+    if (old_blob != NULL) {
+        dns_snapshot_decode(old_blob, &o);
+        old = &o;
+    }
+
+    bool rcode_changed = old == NULL ? n.rcode != 0 : old->rcode != n.rcode;
+    if (rcode_changed) {
+        fprintf(out, "Changed: %.*s., %s\n", n.name_len, n.name, dns_record_type_to_str(n.qtype));
+        if (old != NULL && old->rcode != 0) {
+            fprintf(out, "  - Error: %s\n", dns_rcode_to_str(old->rcode));
+        }
+        if (n.rcode != 0) {
+            fprintf(out, "  + Error: %s\n", dns_rcode_to_str(n.rcode));
+        }
+    }
+
+    int changes = rcode_changed;
+    if (old != NULL) {
+        changes += dns_snapshot_print_missing(out, '-', old, &n, changes == 0);
+    }
+    changes += dns_snapshot_print_missing(out, '+', &n, old, changes == 0);
+    return changes > 0;
+}
+
+void dns_snapshot_writer_init(dns_snapshot_writer_t* w, size_t mem_limit, int max_runs)
+{
+    memset(w, 0, sizeof(dns_snapshot_writer_t));
+    w->mem_limit = mem_limit;
+    w->max_runs = max_runs < 3 ? 3 : max_runs; // Two runs and the one they are merged into
+}
+
+static int dns_snapshot_qsort_cmp(const void* a, const void* b)
+{
+    return dns_snapshot_cmp_blobs(*(uchar* const*)a, *(uchar* const*)b);
+}
+
+static int dns_snapshot_merge_runs(FILE** runs, int n_runs, FILE* out, uint64_t* count);
+
+// Merge all runs into one, so that there is a descriptor for the next run
+static int dns_snapshot_writer_compact(dns_snapshot_writer_t* w)
+{
+    FILE* run = tmpfile();
+    if (run == NULL) {
+        perror("Failed creating temporary file");
+        return 1;
+    }
+    uint64_t count = 0;
+    if (dns_snapshot_merge_runs(w->runs, w->n_runs, run, &count) != 0) {
+        fclose(run);
+        return 1;
+    }
+    if (fflush(run) != 0 || fseek(run, 0, SEEK_SET) != 0) {
+        perror("Failed writing temporary file");
+        fclose(run);
+        return 1;
+    }
+    for (int i = 0; i < w->n_runs; ++i) {
+        fclose(w->runs[i]);
+    }
+    w->runs[0] = run;
+    w->n_runs = 1;
+    return 0;
+}
+
+// Sort the collected entries and write them to a temporary file
+static int dns_snapshot_writer_flush(dns_snapshot_writer_t* w)
+{
+    if (w->n_runs + 1 >= w->max_runs && dns_snapshot_writer_compact(w) != 0) {
+        return 1;
+    }
+
+    FILE** runs = realloc(w->runs, (w->n_runs + 1) * sizeof(FILE*));
+    if (runs == NULL) {
+        perror("realloc failed");
+        return 1;
+    }
+    w->runs = runs;
+
+    FILE* run = tmpfile();
+    if (run == NULL) {
+        perror("Failed creating temporary file");
+        return 1;
+    }
+    w->runs[w->n_runs++] = run;
+
+    qsort(w->blobs, w->count, sizeof(uchar*), dns_snapshot_qsort_cmp);
+    for (size_t i = 0; i < w->count; ++i) {
+        uint32_t len = dns_snapshot_blob_len(w->blobs[i]);
+        if (fwrite(w->blobs[i], 1, len, run) != len) {
+            perror("Failed writing temporary file");
+            return 1;
+        }
+        free(w->blobs[i]);
+    }
+    w->count = 0;
+    w->bytes = 0;
+
+    if (fflush(run) != 0 || fseek(run, 0, SEEK_SET) != 0) {
+        perror("Failed writing temporary file");
+        return 1;
+    }
+    return 0;
+}
+
+int dns_snapshot_writer_add(dns_snapshot_writer_t* w, const uchar* blob)
+{
+    uint32_t len = dns_snapshot_blob_len(blob);
+
+    if (w->count == w->cap) {
+        size_t cap = w->cap ? w->cap * 2 : 1024;
+        uchar** blobs = realloc(w->blobs, cap * sizeof(uchar*));
+        if (blobs == NULL) {
+            perror("realloc failed");
+            return 1;
+        }
+        w->blobs = blobs;
+        w->cap = cap;
+    }
+
+    uchar* copy = malloc(len);
+    if (copy == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    memcpy(copy, blob, len);
+    w->blobs[w->count++] = copy;
+    w->bytes += len;
+
+    if (w->bytes > w->mem_limit) {
+        return dns_snapshot_writer_flush(w);
+    }
+    return 0;
+}
+
+// Read the next blob of a run into buf, returns 0 at the end of the run
+static int dns_snapshot_read_blob(FILE* run, uchar** buf, size_t* cap)
+{
+    uint32_t len;
+    if (fread(&len, sizeof(uint32_t), 1, run) != 1) {
+        return 0;
+    }
+    if (len > *cap) {
+        uchar* b = realloc(*buf, len);
+        if (b == NULL) {
+            return 0;
+        }
+        *buf = b;
+        *cap = len;
+    }
+    memcpy(*buf, &len, sizeof(uint32_t));
+    if (fread(*buf + sizeof(uint32_t), 1, len - sizeof(uint32_t), run) != len - sizeof(uint32_t)) {
+        return 0;
+    }
+    return 1;
+}
+
+static void dns_snapshot_heap_down(uchar** heads, int* heap, int n, int i)
+{
+    while (true) {
+        int l = 2*i + 1, r = l + 1, min = i;
+        if (l < n && dns_snapshot_cmp_blobs(heads[heap[l]], heads[heap[min]]) < 0) {
+            min = l;
+        }
+        if (r < n && dns_snapshot_cmp_blobs(heads[heap[r]], heads[heap[min]]) < 0) {
+            min = r;
+        }
+        if (min == i) {
+            return;
+        }
+        int tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+// K-way merge of the sorted runs into out, the runs are read from their current position
+static int dns_snapshot_merge_runs(FILE** runs, int n_runs, FILE* out, uint64_t* count)
+{
+    uchar** heads = calloc(n_runs, sizeof(uchar*));
+    size_t* caps = calloc(n_runs, sizeof(size_t));
+    int* heap = calloc(n_runs, sizeof(int));
+    if (heads == NULL || caps == NULL || heap == NULL) {
+        perror("calloc failed");
+        free(heads);
+        free(caps);
+        free(heap);
+        return 1;
+    }
+
+    int n = 0;
+    for (int i = 0; i < n_runs; ++i) {
+        if (dns_snapshot_read_blob(runs[i], &heads[i], &caps[i])) {
+            heap[n++] = i;
+        }
+    }
+    for (int i = n/2 - 1; i >= 0; --i) {
+        dns_snapshot_heap_down(heads, heap, n, i);
+    }
+
+    int ret = 0;
+    *count = 0;
+    while (n > 0) {
+        int min = heap[0];
+        uint32_t len = dns_snapshot_blob_len(heads[min]);
+        if (fwrite(heads[min], 1, len, out) != len) {
+            perror("Failed writing snapshot");
+            ret = 1;
+            break;
+        }
+        ++*count;
+        if (!dns_snapshot_read_blob(runs[min], &heads[min], &caps[min])) {
+            heap[0] = heap[--n];
+        }
+        dns_snapshot_heap_down(heads, heap, n, 0);
+    }
+
+    for (int i = 0; i < n_runs; ++i) {
+        free(heads[i]);
+    }
+    free(heads);
+    free(caps);
+    free(heap);
+    return ret;
+}
+
+int dns_snapshot_writer_finish(dns_snapshot_writer_t* w, const char* path)
+{
+    if (dns_snapshot_writer_flush(w) != 0) {
+        return 1;
+    }
+
+    size_t tmp_len = strlen(path) + 5;
+    char* tmp_path = malloc(tmp_len);
+    if (tmp_path == NULL) {
+        perror("malloc failed");
+        return 1;
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+    FILE* out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to create %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    uint64_t count = 0;
+    int ret = 1;
+    if (fwrite(SNAPSHOT_MAGIC, 1, SNAPSHOT_MAGIC_LEN, out) != SNAPSHOT_MAGIC_LEN ||
+        fwrite(&count, sizeof(uint64_t), 1, out) != 1 ||
+        dns_snapshot_merge_runs(w->runs, w->n_runs, out, &count) != 0) {
+        goto cleanup;
+    }
+
+    // Now that the number of entries is known, fill it in
+    if (fseek(out, SNAPSHOT_MAGIC_LEN, SEEK_SET) != 0 ||
+        fwrite(&count, sizeof(uint64_t), 1, out) != 1 ||
+        fflush(out) != 0 || fsync(fileno(out)) != 0) {
+        perror("Failed writing snapshot");
+        goto cleanup;
+    }
+
+    // Readers see either the old or the new snapshot, never a partial one
+    if (rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Failed to replace %s: %s\n", path, strerror(errno));
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    fclose(out);
+    if (ret != 0) {
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return ret;
+}
+
+void dns_snapshot_writer_free(dns_snapshot_writer_t* w)
+{
+    for (size_t i = 0; i < w->count; ++i) {
+        free(w->blobs[i]);
+    }
+    free(w->blobs);
+    for (int i = 0; i < w->n_runs; ++i) {
+        fclose(w->runs[i]);
+    }
+    free(w->runs);
+    memset(w, 0, sizeof(dns_snapshot_writer_t));
+}
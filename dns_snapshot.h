@@ -0,0 +1,74 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_SNAPSHOT_H__
+#define __DNS_SNAPSHOT_H__
+
+#define SNAPSHOT_MAGIC "DNSSNAP1"
+#define SNAPSHOT_MAGIC_LEN 8
+
+// Snapshot of the results of the previous run, sorted by (name, type).
+// Every entry is a blob:
+//   u32 blob length, u8 name length, name, u16 type, u8 rcode,
+//   i64 expiration (unix time), u16 record count, records
+// and every record of the answer section:
+//   u32 ttl, u8 name length, name, u16 type, u16 rdata length, rdata (text)
+typedef struct {
+    const uchar* data; // Memory mapped file
+    size_t size;
+    const uchar** entries; // Start of every entry
+    size_t count;
+} dns_snapshot_t;
+
+// Decoded view of an entry blob
+typedef struct {
+    const char* name;
+    uint8_t name_len;
+    uint16_t qtype;
+    uint8_t rcode;
+    int64_t expires;
+    uint16_t n_records;
+    const uchar* records;
+    const uchar* end;
+} dns_snapshot_entry_t;
+
+// Sorted runs of new entries, merged into the snapshot file at the end
+typedef struct {
+    uchar** blobs; // Entries not written yet
+    size_t count;
+    size_t cap;
+    size_t bytes;
+    size_t mem_limit; // Bytes of blobs kept before they are written as a run
+    FILE** runs;
+    int n_runs;
+    int max_runs; // Runs open at once, reaching it merges them into one
+} dns_snapshot_writer_t;
+
+// Map the snapshot, a missing file is an empty snapshot
+int dns_snapshot_load(dns_snapshot_t* snap, const char* path);
+void dns_snapshot_close(dns_snapshot_t* snap);
+
+// Returns the blob of the (name, type) pair or NULL
+const uchar* dns_snapshot_find(const dns_snapshot_t* snap, const char* name, size_t name_len, uint16_t qtype);
+
+int dns_snapshot_decode(const uchar* blob, dns_snapshot_entry_t* e);
+uint32_t dns_snapshot_blob_len(const uchar* blob);
+
+// Encode the answer of the query. Returns a malloc'd blob.
+uchar* dns_snapshot_encode(const char* name, uint16_t qtype, const dns_result_t* res, time_t now);
+
+// Print the records that differ between the entries, returns 1 if there are any
+int dns_snapshot_diff(FILE* out, const uchar* old_blob, const uchar* new_blob);
+
+void dns_snapshot_writer_init(dns_snapshot_writer_t* w, size_t mem_limit, int max_runs);
+
+// Add a copy of the blob to the new snapshot
+int dns_snapshot_writer_add(dns_snapshot_writer_t* w, const uchar* blob);
+
+// Write the new snapshot next to path and rename it over path
+int dns_snapshot_writer_finish(dns_snapshot_writer_t* w, const char* path);
+
+void dns_snapshot_writer_free(dns_snapshot_writer_t* w);
+
+#endif // !__DNS_SNAPSHOT_H__
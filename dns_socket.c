@@ -0,0 +1,95 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_error.h"
+
+#include <fcntl.h>
+
+// Bind the socket to a random source port, so that the port
+// adds entropy on top of the query ID
+static int sock_bind_random(sock_pool_t* pool, int fd)
+{
+    bool ipv4 = pool->ipv4;
+    for (int i = 0; i < SOCK_BIND_ATTEMPTS; ++i) {
+        uint32_t port;
+        if (dns_random_range(pool->rnd, MIN_SRC_PORT, MAX_SRC_PORT, &port) != 0) {
+            return 1;
+        }
+        int ret;
+        if (ipv4) {
+            struct sockaddr_in a;
+            memset(&a, 0, sizeof(a));
+            a.sin_family = AF_INET;
+            a.sin_addr.s_addr = htonl(INADDR_ANY);
+            a.sin_port = htons(port);
+            ret = bind(fd, (struct sockaddr*)&a, sizeof(a));
+        } else {
+            struct sockaddr_in6 a;
+            memset(&a, 0, sizeof(a));
+            a.sin6_family = AF_INET6;
+            a.sin6_addr = in6addr_any;
+            a.sin6_port = htons(port);
+            ret = bind(fd, (struct sockaddr*)&a, sizeof(a));
+        }
+        if (ret == 0) {
+            return 0;
+        }
+        if (errno != EADDRINUSE && errno != EACCES) {
+            break;
+        }
+    }
+    dns_perror(pool->err, "Failed binding socket to a random port");
+    return 1;
+}
+
+int sock_pool_open(sock_pool_t* pool, bool ipv4, dns_random_t* rnd, FILE* err)
+{
+    pool->count = 0;
+    pool->ipv4 = ipv4;
+    pool->rnd = rnd;
+    pool->err = err;
+
+    for (int i = 0; i < SOCK_POOL_SIZE; ++i) {
+        int fd = socket(ipv4 ? AF_INET : AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+        if (fd < 0) {
+            dns_perror(err, "Failed creatng socket.");
+            return 1;
+        }
+        pool->fds[pool->count++] = fd;
+
+        if (sock_bind_random(pool, fd) != 0) {
+            return 1;
+        }
+
+        // Waiting is done by the poll loop of the engine against its deadlines,
+        // a datagram the socket can not take now is lost like any other
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+            dns_perror(err, "fcntl failed");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void sock_pool_close(sock_pool_t* pool)
+{
+    for (int i = 0; i < pool->count; ++i) {
+        if (pool->fds[i] >= 0) {
+            close(pool->fds[i]);
+        }
+    }
+    pool->count = 0;
+}
+
+int sock_pool_pick(sock_pool_t* pool)
+{
+    uint32_t i;
+    if (dns_random_range(pool->rnd, 0, pool->count - 1, &i) != 0) {
+        return -1;
+    }
+    return pool->fds[i];
+}
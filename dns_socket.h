@@ -0,0 +1,41 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_SOCKET_H__
+#define __DNS_SOCKET_H__
+
+#include <stdbool.h>
+
+#define SOCK_POOL_SIZE 4 // Number of UDP sockets queries are spread over
+#define SOCK_BIND_ATTEMPTS 32 // Random source ports tried per socket
+
+#define MIN_SRC_PORT 1024
+#define MAX_SRC_PORT 65535
+
+typedef struct {
+    struct sockaddr_in  addr_ip4;
+    struct sockaddr_in6 addr_ip6;
+    bool ipv4;
+} serv_addr_t;
+
+// Pool of UDP sockets, each bound to a random source port
+typedef struct {
+    int fds[SOCK_POOL_SIZE];
+    int count;
+    bool ipv4;
+    dns_random_t* rnd; // Source ports and the socket of every query
+    FILE* err; // Diagnostics, NULL for none
+} sock_pool_t;
+
+// Create and bind all sockets of the pool
+int sock_pool_open(sock_pool_t* pool, bool ipv4, dns_random_t* rnd, FILE* err);
+
+// Close all sockets of the pool
+void sock_pool_close(sock_pool_t* pool);
+
+// Pick a random socket of the pool to send a query from, -1 if there is no
+// random number for it
+int sock_pool_pick(sock_pool_t* pool);
+
+#endif // !__DNS_SOCKET_H__
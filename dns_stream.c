@@ -0,0 +1,527 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_error.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
+
+#define STREAM_RBUF_SIZE (2 * STREAM_MSG_MAX) // Room for a whole message after any leftover
+
+#ifdef HAVE_OPENSSL
+static void dns_stream_print_ssl_error(FILE* out, const char* what)
+{
+    unsigned long err = ERR_get_error();
+    if (err != 0) {
+        char msg[256];
+        ERR_error_string_n(err, msg, sizeof(msg));
+        dns_error(out, "%s: %s\n", what, msg);
+        ERR_clear_error();
+        return;
+    }
+    dns_error(out, "%s.\n", what);
+}
+
+// Keep the newest session ticket, connections opened later resume it
+static int dns_stream_new_session(SSL* ssl, SSL_SESSION* session)
+{
+    dns_stream_pool_t* pool = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    if (pool->session != NULL) {
+        SSL_SESSION_free(pool->session);
+    }
+    pool->session = session;
+    return 1; // We own the reference now
+}
+#endif
+
+int dns_stream_pool_init(dns_stream_pool_t* pool, serv_addr_t serv, bool tls, const char* host,
+                         const char* ca_file, FILE* err)
+{
+    memset(pool, 0, sizeof(dns_stream_pool_t));
+    pool->err = err;
+    pool->tls = tls;
+    pool->serv = serv;
+    if (host != NULL) {
+        strncpy(pool->host, host, MAX_NAME_STR_LEN - 1);
+    }
+    for (int i = 0; i < STREAM_POOL_SIZE; ++i) {
+        pool->conns[i].fd = -1;
+    }
+    pool->initialized = true;
+
+    if (!tls) {
+        return 0;
+    }
+
+#ifdef HAVE_OPENSSL
+    pool->ctx = SSL_CTX_new(TLS_client_method());
+    if (pool->ctx == NULL) {
+        dns_stream_print_ssl_error(pool->err, "Failed creating TLS context");
+        return 1;
+    }
+    SSL_CTX_set_min_proto_version(pool->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_verify(pool->ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_mode(pool->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // Servers often close idle connections without close_notify, nothing is lost
+    // because unanswered queries are sent again
+    SSL_CTX_set_options(pool->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    int loaded = ca_file != NULL ?
+        SSL_CTX_load_verify_locations(pool->ctx, ca_file, NULL) :
+        SSL_CTX_set_default_verify_paths(pool->ctx);
+    if (loaded != 1) {
+        dns_stream_print_ssl_error(pool->err, "Failed loading trusted certificates");
+        return 1;
+    }
+
+    // Session tickets are kept by the pool itself
+    SSL_CTX_set_app_data(pool->ctx, pool);
+    SSL_CTX_set_session_cache_mode(pool->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(pool->ctx, dns_stream_new_session);
+    return 0;
+#else
+    dns_error(err, "Error: DNS over TLS is not supported by this build.\n");
+    return 1;
+#endif
+}
+
+void dns_stream_close(dns_stream_conn_t* conn)
+{
+#ifdef HAVE_OPENSSL
+    if (conn->ssl != NULL) {
+        SSL_shutdown(conn->ssl); // Best effort close_notify, keeps the ticket valid
+        SSL_free(conn->ssl);
+    }
+#endif
+    conn->ssl = NULL;
+    if (conn->fd >= 0) {
+        close(conn->fd);
+    }
+    conn->fd = -1;
+    conn->outstanding = 0;
+    conn->rlen = 0;
+    conn->wlen = 0;
+    conn->wretry = 0;
+    conn->slen = 0;
+    conn->soff = 0;
+}
+
+void dns_stream_pool_free(dns_stream_pool_t* pool)
+{
+    if (!pool->initialized) {
+        return;
+    }
+    for (int i = 0; i < STREAM_POOL_SIZE; ++i) {
+        dns_stream_close(&pool->conns[i]);
+        free(pool->conns[i].rbuf);
+        free(pool->conns[i].wbuf);
+        free(pool->conns[i].sbuf);
+        pool->conns[i].rbuf = NULL;
+        pool->conns[i].wbuf = NULL;
+        pool->conns[i].sbuf = NULL;
+    }
+#ifdef HAVE_OPENSSL
+    if (pool->session != NULL) {
+        SSL_SESSION_free(pool->session);
+    }
+    if (pool->ctx != NULL) {
+        SSL_CTX_free(pool->ctx);
+    }
+#endif
+    pool->session = NULL;
+    pool->ctx = NULL;
+    pool->initialized = false;
+}
+
+static long dns_stream_ms_left(const struct timespec* deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+// Wait until the socket is ready or the deadline passes
+static int dns_stream_wait(const dns_stream_pool_t* pool, int fd, short events, const struct timespec* deadline)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    while (true) {
+        long left = dns_stream_ms_left(deadline);
+        if (left <= 0) {
+            dns_error(pool->err, "Error: Connecting to the server timed out.\n");
+            return 1;
+        }
+        int ready = poll(&pfd, 1, left);
+        if (ready > 0) {
+            return 0;
+        } else if (ready < 0 && errno != EINTR) {
+            dns_perror(pool->err, "poll failed");
+            return 1;
+        }
+    }
+}
+
+#ifdef HAVE_OPENSSL
+static int dns_stream_handshake(dns_stream_pool_t* pool, dns_stream_conn_t* conn, const struct timespec* deadline)
+{
+    conn->ssl = SSL_new(pool->ctx);
+    if (conn->ssl == NULL || SSL_set_fd(conn->ssl, conn->fd) != 1) {
+        dns_stream_print_ssl_error(pool->err, "Failed creating TLS connection");
+        return 1;
+    }
+
+    if (pool->host[0] != '\0') {
+        SSL_set_tlsext_host_name(conn->ssl, pool->host);
+        SSL_set1_host(conn->ssl, pool->host);
+    } else { // The certificate must be issued for the address
+        char ip[INET6_ADDRSTRLEN];
+        if (pool->serv.ipv4) {
+            inet_ntop(AF_INET, &pool->serv.addr_ip4.sin_addr, ip, sizeof(ip));
+        } else {
+            inet_ntop(AF_INET6, &pool->serv.addr_ip6.sin6_addr, ip, sizeof(ip));
+        }
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(conn->ssl), ip);
+    }
+
+    if (pool->session != NULL) {
+        SSL_set_session(conn->ssl, pool->session);
+    }
+
+    while (true) {
+        int ret = SSL_connect(conn->ssl);
+        if (ret == 1) {
+            break;
+        }
+        int err = SSL_get_error(conn->ssl, ret);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+            if (dns_stream_wait(pool, conn->fd, err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, deadline) != 0) {
+                return 1;
+            }
+            continue;
+        }
+        long verify = SSL_get_verify_result(conn->ssl);
+        if (verify != X509_V_OK) {
+            dns_error(pool->err, "Error: Server certificate verification failed: %s\n",
+                X509_verify_cert_error_string(verify));
+        } else {
+            dns_stream_print_ssl_error(pool->err, "TLS handshake failed");
+        }
+        return 1;
+    }
+
+    ++pool->handshakes;
+    if (SSL_session_reused(conn->ssl)) {
+        ++pool->resumed;
+    }
+    return 0;
+}
+#endif
+
+static int dns_stream_open(dns_stream_pool_t* pool, dns_stream_conn_t* conn, int timeout_ms)
+{
+    if (conn->rbuf == NULL) {
+        conn->rbuf = malloc(STREAM_RBUF_SIZE);
+        if (conn->rbuf == NULL) {
+            dns_perror(pool->err, "malloc failed");
+            return 1;
+        }
+    }
+
+    struct sockaddr* server_addr = pool->serv.ipv4 ?
+        (struct sockaddr*)&(pool->serv.addr_ip4) : (struct sockaddr*)&(pool->serv.addr_ip6);
+
+    socklen_t server_addr_len = pool->serv.ipv4 ?
+        sizeof(pool->serv.addr_ip4) : sizeof(pool->serv.addr_ip6);
+
+    conn->fd = socket(pool->serv.ipv4 ? AF_INET : AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+    if (conn->fd < 0) {
+        dns_perror(pool->err, "Failed creatng socket.");
+        return 1;
+    }
+
+    // Queries are small and pipelined, don't let Nagle hold them back
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    if (connect(conn->fd, server_addr, server_addr_len) != 0) {
+        if (errno != EINPROGRESS) {
+            dns_perror(pool->err, "connect failed");
+            dns_stream_close(conn);
+            return 1;
+        }
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (dns_stream_wait(pool, conn->fd, POLLOUT, &deadline) != 0 ||
+            getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err != 0) {
+            if (err != 0) {
+                dns_error(pool->err, "connect failed: %s\n", strerror(err));
+            }
+            dns_stream_close(conn);
+            return 1;
+        }
+    }
+
+#ifdef HAVE_OPENSSL
+    if (pool->tls && dns_stream_handshake(pool, conn, &deadline) != 0) {
+        dns_stream_close(conn);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+dns_stream_conn_t* dns_stream_pick(dns_stream_pool_t* pool, int timeout_ms)
+{
+    dns_stream_conn_t* best = NULL;
+    dns_stream_conn_t* closed = NULL;
+    for (int i = 0; i < STREAM_POOL_SIZE; ++i) {
+        dns_stream_conn_t* conn = &pool->conns[i];
+        if (conn->fd < 0) {
+            if (closed == NULL) {
+                closed = conn;
+            }
+        } else if (best == NULL || conn->outstanding < best->outstanding) {
+            best = conn;
+        }
+    }
+
+    // Open another connection only when the open ones are busy
+    if (closed != NULL && (best == NULL || best->outstanding >= STREAM_PIPELINE_DEPTH)) {
+        if (dns_stream_open(pool, closed, timeout_ms) == 0) {
+            return closed;
+        }
+    }
+    return best;
+}
+
+dns_stream_conn_t* dns_stream_by_fd(dns_stream_pool_t* pool, int fd)
+{
+    for (int i = 0; i < STREAM_POOL_SIZE; ++i) {
+        if (pool->conns[i].fd == fd) {
+            return &pool->conns[i];
+        }
+    }
+    return NULL;
+}
+
+bool dns_stream_wants_write(const dns_stream_conn_t* conn)
+{
+    return conn->wlen > 0;
+}
+
+bool dns_stream_has_pending(const dns_stream_conn_t* conn)
+{
+#ifdef HAVE_OPENSSL
+    return conn->ssl != NULL && SSL_pending(conn->ssl) > 0;
+#else
+    return false;
+#endif
+}
+
+// Write queued data until the socket would block, 1 on error
+static int dns_stream_try_write(dns_stream_pool_t* pool, dns_stream_conn_t* conn)
+{
+    while (conn->wlen > 0) {
+        ssize_t n;
+#ifdef HAVE_OPENSSL
+        if (conn->ssl != NULL) {
+            // A retried write must repeat the same length
+            size_t len = conn->wretry ? conn->wretry : conn->wlen;
+            int ret = SSL_write(conn->ssl, conn->wbuf, len);
+            if (ret <= 0) {
+                int err = SSL_get_error(conn->ssl, ret);
+                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) {
+                    conn->wretry = len;
+                    return 0;
+                }
+                if (err != SSL_ERROR_SYSCALL || (errno != EPIPE && errno != ECONNRESET)) {
+                    dns_stream_print_ssl_error(pool->err, "TLS write failed");
+                }
+                return 1;
+            }
+            conn->wretry = 0;
+            n = ret;
+        } else
+#endif
+        {
+            // No SIGPIPE for a connection the server closed, the process may not be ours
+            n = send(conn->fd, conn->wbuf, conn->wlen, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    return 0;
+                }
+                if (errno != EPIPE && errno != ECONNRESET) { // Closed by the server
+                    dns_perror(pool->err, "write failed");
+                }
+                return 1;
+            }
+        }
+        memmove(conn->wbuf, conn->wbuf + n, conn->wlen - n);
+        conn->wlen -= n;
+    }
+    return 0;
+}
+
+int dns_stream_flush(dns_stream_pool_t* pool, dns_stream_conn_t* conn)
+{
+    if (dns_stream_try_write(pool, conn) != 0) {
+        dns_stream_close(conn);
+        return 1;
+    }
+    return 0;
+}
+
+int dns_stream_send(dns_stream_pool_t* pool, dns_stream_conn_t* conn, const uchar* msg, size_t msg_len)
+{
+    size_t need = conn->wlen + 2 + msg_len;
+    if (need > conn->wcap) {
+        size_t cap = conn->wcap ? conn->wcap : 4096;
+        while (cap < need) {
+            cap *= 2;
+        }
+        uchar* wbuf = realloc(conn->wbuf, cap);
+        if (wbuf == NULL) {
+            dns_perror(pool->err, "realloc failed");
+            return 1;
+        }
+        conn->wbuf = wbuf;
+        conn->wcap = cap;
+    }
+
+    // Every message is prefixed with its length (RFC 1035 4.2.2)
+    conn->wbuf[conn->wlen] = msg_len >> 8;
+    conn->wbuf[conn->wlen + 1] = msg_len & 0xFF;
+    memcpy(conn->wbuf + conn->wlen + 2, msg, msg_len);
+    conn->wlen += 2 + msg_len;
+    ++conn->outstanding;
+
+    // Closing here would lose the other queries of the connection, the poll
+    // loop finds the error and sends them again
+    if (!pool->defer_writes) {
+        dns_stream_try_write(pool, conn);
+    }
+    return 0;
+}
+
+// Pass on every complete message of the read buffer
+static void dns_stream_deliver(dns_stream_pool_t* pool, dns_stream_conn_t* conn, dns_stream_msg_cb cb, void* ctx)
+{
+    size_t pos = 0;
+    while (conn->rlen - pos >= 2) {
+        size_t msg_len = (conn->rbuf[pos] << 8) | conn->rbuf[pos + 1];
+        if (conn->rlen - pos - 2 < msg_len) {
+            break;
+        }
+        if (conn->outstanding > 0) {
+            --conn->outstanding;
+        }
+        cb(ctx, pool, conn, conn->rbuf + pos + 2, msg_len);
+        pos += 2 + msg_len;
+    }
+    memmove(conn->rbuf, conn->rbuf + pos, conn->rlen - pos);
+    conn->rlen -= pos;
+}
+
+int dns_stream_recv(dns_stream_pool_t* pool, dns_stream_conn_t* conn, dns_stream_msg_cb cb, void* ctx)
+{
+    while (conn->fd >= 0) {
+        ssize_t n;
+        size_t room = STREAM_RBUF_SIZE - conn->rlen;
+#ifdef HAVE_OPENSSL
+        if (conn->ssl != NULL) {
+            int ret = SSL_read(conn->ssl, conn->rbuf + conn->rlen, room);
+            if (ret <= 0) {
+                int err = SSL_get_error(conn->ssl, ret);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+                    return 0;
+                }
+                if (err != SSL_ERROR_ZERO_RETURN && (err != SSL_ERROR_SYSCALL || errno != ECONNRESET)) {
+                    dns_stream_print_ssl_error(pool->err, "TLS read failed");
+                }
+                dns_stream_close(conn);
+                return 1;
+            }
+            n = ret;
+        } else
+#endif
+        {
+            n = read(conn->fd, conn->rbuf + conn->rlen, room);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return 0;
+            }
+            if (n <= 0) { // Closed by the server or reset
+                dns_stream_close(conn);
+                return 1;
+            }
+        }
+        conn->rlen += n;
+        dns_stream_deliver(pool, conn, cb, ctx);
+    }
+    return 1;
+}
+
+void dns_stream_feed(dns_stream_pool_t* pool, dns_stream_conn_t* conn, const uchar* data, size_t len,
+                     dns_stream_msg_cb cb, void* ctx)
+{
+    while (len > 0) {
+        size_t n = STREAM_RBUF_SIZE - conn->rlen;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(conn->rbuf + conn->rlen, data, n);
+        conn->rlen += n;
+        data += n;
+        len -= n;
+        dns_stream_deliver(pool, conn, cb, ctx);
+    }
+}
+
+size_t dns_stream_write_take(dns_stream_conn_t* conn, const uchar** data)
+{
+    if (conn->soff == conn->slen && conn->wlen > 0) {
+        // Swap the buffers, the taken data stay in place until written
+        uchar* buf = conn->sbuf;
+        size_t cap = conn->scap;
+        conn->sbuf = conn->wbuf;
+        conn->scap = conn->wcap;
+        conn->slen = conn->wlen;
+        conn->soff = 0;
+        conn->wbuf = buf;
+        conn->wcap = cap;
+        conn->wlen = 0;
+    }
+    *data = conn->sbuf + conn->soff;
+    return conn->slen - conn->soff;
+}
+
+void dns_stream_write_done(dns_stream_conn_t* conn, size_t n)
+{
+    conn->soff += n;
+    if (conn->soff >= conn->slen) {
+        conn->slen = conn->soff = 0;
+    }
+}
@@ -0,0 +1,104 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_STREAM_H__
+#define __DNS_STREAM_H__
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#else
+typedef struct ssl_st SSL;
+typedef struct ssl_ctx_st SSL_CTX;
+typedef struct ssl_session_st SSL_SESSION;
+#endif
+
+#define DEFAULT_TLS_PORT 853
+#define STREAM_POOL_SIZE 4 // Persistent connections to the server
+#define STREAM_PIPELINE_DEPTH 32 // Queries in flight on one connection before another is opened
+#define STREAM_MSG_MAX (2 + 65535) // Length prefix and the largest message
+
+// Persistent TCP or TLS connection with pipelined queries (RFC 7766)
+typedef struct {
+    int fd;
+    SSL* ssl; // NULL for plain TCP
+    int outstanding; // Queries sent on the connection and not answered yet
+
+    uchar* rbuf; // Partially received message
+    size_t rlen;
+
+    uchar* wbuf; // Queries not written yet
+    size_t wlen;
+    size_t wcap;
+    size_t wretry; // Length of a TLS write that has to be repeated
+
+    uchar* sbuf; // Queries handed to a deferred write, wbuf keeps taking new ones
+    size_t slen;
+    size_t scap;
+    size_t soff; // Written so far
+} dns_stream_conn_t;
+
+typedef struct {
+    bool initialized; // Connections are set up, the pool must be freed
+    bool tls;
+    SSL_CTX* ctx;
+    SSL_SESSION* session; // Latest ticket, new connections resume it
+    serv_addr_t serv;
+    char host[MAX_NAME_STR_LEN]; // Name the certificate must match, empty for address
+    bool defer_writes; // The caller writes the queued data itself (plain TCP only)
+
+    dns_stream_conn_t conns[STREAM_POOL_SIZE];
+
+    unsigned long handshakes; // Statistics
+    unsigned long resumed;
+    FILE* err; // Diagnostics, NULL for none
+} dns_stream_pool_t;
+
+// Called for every complete message received on the connection
+typedef void (*dns_stream_msg_cb)(void* ctx, dns_stream_pool_t* pool, dns_stream_conn_t* conn,
+                                  const uchar* msg, size_t msg_len);
+
+// host is the server name to verify the certificate against (NULL for an address),
+// ca_file replaces the system trust store if set. The pool must stay in place
+// until it is freed, the TLS context points to it.
+int dns_stream_pool_init(dns_stream_pool_t* pool, serv_addr_t serv, bool tls, const char* host,
+                         const char* ca_file, FILE* err);
+void dns_stream_pool_free(dns_stream_pool_t* pool);
+
+// Pick the least loaded connection, a new one is opened once the open ones are busy.
+// Opening it (TCP and TLS handshake) may take up to timeout_ms.
+dns_stream_conn_t* dns_stream_pick(dns_stream_pool_t* pool, int timeout_ms);
+
+dns_stream_conn_t* dns_stream_by_fd(dns_stream_pool_t* pool, int fd);
+
+// Queue the message with its length prefix and write as much as possible.
+// A write error leaves the data queued, the next dns_stream_flush() reports it.
+int dns_stream_send(dns_stream_pool_t* pool, dns_stream_conn_t* conn, const uchar* msg, size_t msg_len);
+
+// Write queued data when the socket becomes writable.
+// Returns 1 if the connection is broken, it is closed then.
+int dns_stream_flush(dns_stream_pool_t* pool, dns_stream_conn_t* conn);
+
+// Read whatever is available and pass complete messages to cb.
+// Returns 1 if the connection was closed.
+int dns_stream_recv(dns_stream_pool_t* pool, dns_stream_conn_t* conn, dns_stream_msg_cb cb, void* ctx);
+
+// Pass received data to the connection, complete messages go to cb.
+// For callers that read the socket themselves.
+void dns_stream_feed(dns_stream_pool_t* pool, dns_stream_conn_t* conn, const uchar* data, size_t len,
+                     dns_stream_msg_cb cb, void* ctx);
+
+// Deferred writes: the data to write next, all queued queries are taken at once.
+// Returns 0 if there is nothing to write.
+size_t dns_stream_write_take(dns_stream_conn_t* conn, const uchar** data);
+
+// n bytes of the taken data were written
+void dns_stream_write_done(dns_stream_conn_t* conn, size_t n);
+
+// Are there queued data or buffered TLS records on the connection
+bool dns_stream_wants_write(const dns_stream_conn_t* conn);
+bool dns_stream_has_pending(const dns_stream_conn_t* conn);
+
+void dns_stream_close(dns_stream_conn_t* conn);
+
+#endif // !__DNS_STREAM_H__
@@ -0,0 +1,268 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#define _DEFAULT_SOURCE // Required for 'syscall' and 'MAP_ANONYMOUS'
+
+#include "base.h"
+#include "dns_uring.h"
+#include "dns_error.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_REQUIRED_FEATURES (IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_CQE_SKIP)
+
+static int dns_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int dns_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                           void* arg, size_t arg_size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int dns_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Multishot receives came with 6.0 together with zero copy sends, which can be probed for
+static bool dns_uring_has_multishot(dns_uring_t* r)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (probe == NULL) {
+        return false;
+    }
+    bool ok = dns_uring_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+              probe->last_op >= IORING_OP_SEND_ZC &&
+              (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+static int dns_uring_map(dns_uring_t* r, const struct io_uring_params* p)
+{
+    r->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        return 1;
+    }
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            return 1;
+        }
+    }
+
+    r->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        return 1;
+    }
+
+    char* sq = r->sq_ring;
+    r->sq_head = (unsigned*)(sq + p->sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p->sq_off.tail);
+    r->sq_mask = *(unsigned*)(sq + p->sq_off.ring_mask);
+    r->sq_entries = p->sq_entries;
+
+    // SQEs are always used in ring order, the index array never changes
+    unsigned* array = (unsigned*)(sq + p->sq_off.array);
+    for (unsigned i = 0; i < p->sq_entries; ++i) {
+        array[i] = i;
+    }
+    r->sqe_head = r->sqe_tail = *r->sq_tail;
+
+    char* cq = r->cq_ring;
+    r->cq_head = (unsigned*)(cq + p->cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p->cq_off.tail);
+    r->cq_mask = *(unsigned*)(cq + p->cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+static int dns_uring_setup_buffers(dns_uring_t* r)
+{
+    r->br_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        return 1;
+    }
+    r->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (r->bufs == NULL) {
+        return 1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)r->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (dns_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return 1;
+    }
+
+    r->br_tail = 0;
+    for (unsigned bid = 0; bid < URING_BUF_COUNT; ++bid) {
+        dns_uring_buf_return(r, bid);
+    }
+    return 0;
+}
+
+int dns_uring_init(dns_uring_t* r, FILE* err)
+{
+    memset(r, 0, sizeof(dns_uring_t));
+    r->err = err;
+
+    // Completions are only processed when the engine waits for them
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+              IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    r->fd = dns_uring_setup(URING_ENTRIES, &p);
+    if (r->fd < 0 && errno == EINVAL) { // Older kernel, plain ring
+        memset(&p, 0, sizeof(p));
+        r->fd = dns_uring_setup(URING_ENTRIES, &p);
+    }
+    if (r->fd < 0) {
+        dns_error(err, "Warning: io_uring is not available (%s), using poll.\n", strerror(errno));
+        return 1;
+    }
+
+    if ((p.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES || !dns_uring_has_multishot(r)) {
+        dns_error(err, "Warning: The kernel lacks io_uring features, using poll.\n");
+        dns_uring_free(r);
+        return 1;
+    }
+
+    if (dns_uring_map(r, &p) != 0 || dns_uring_setup_buffers(r) != 0) {
+        dns_error(err, "Warning: Setting up io_uring failed (%s), using poll.\n", strerror(errno));
+        dns_uring_free(r);
+        return 1;
+    }
+    return 0;
+}
+
+void dns_uring_free(dns_uring_t* r)
+{
+    if (r->fd >= 0) {
+        close(r->fd); // Cancels whatever is still in flight
+    }
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring != NULL) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if (r->br != NULL) {
+        munmap(r->br, r->br_size);
+    }
+    free(r->bufs);
+    memset(r, 0, sizeof(dns_uring_t));
+    r->fd = -1;
+}
+
+struct io_uring_sqe* dns_uring_sqe(dns_uring_t* r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries) {
+        if (dns_uring_submit_wait(r, 0) != 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sqe_tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ++r->sqe_tail;
+    return sqe;
+}
+
+int dns_uring_submit_wait(dns_uring_t* r, int timeout_ms)
+{
+    unsigned to_submit = r->sqe_tail - r->sqe_head;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    r->sqe_head = r->sqe_tail;
+
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long)&ts;
+
+    // One call submits the whole batch and waits for the first completion
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    unsigned min_complete = timeout_ms > 0 ? 1 : 0;
+    ++r->enters;
+    if (dns_uring_enter(r->fd, to_submit, min_complete, flags, &arg, sizeof(arg)) < 0) {
+        if (errno == ETIME || errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            return 0;
+        }
+        dns_perror(r->err, "io_uring_enter failed");
+        return 1;
+    }
+    return 0;
+}
+
+struct io_uring_cqe* dns_uring_cqe(dns_uring_t* r)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &r->cqes[head & r->cq_mask];
+}
+
+void dns_uring_cqe_seen(dns_uring_t* r)
+{
+    ++r->completions;
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned char* dns_uring_buf(dns_uring_t* r, unsigned bid)
+{
+    return r->bufs + (size_t)bid * URING_BUF_SIZE;
+}
+
+void dns_uring_buf_return(dns_uring_t* r, unsigned bid)
+{
+    struct io_uring_buf* buf = &r->br->bufs[r->br_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (unsigned long)dns_uring_buf(r, bid);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ++r->br_tail;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,71 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_URING_H__
+#define __DNS_URING_H__
+
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024 // Submission queue size, the completion queue is twice as big
+#define URING_BUF_COUNT 1024 // Receive buffers in the provided buffer ring, power of 2
+#define URING_BUF_SIZE 2048 // One datagram with its source address, or a piece of a stream
+#define URING_BUF_GROUP 0
+
+// io_uring instance without liburing, only what the query engine needs
+typedef struct {
+    int fd;
+
+    // Submission queue, SQEs are prepared locally and published on submit
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    unsigned sqe_head, sqe_tail;
+
+    // Completion queue
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // Provided buffers the kernel receives into (buffer ring)
+    struct io_uring_buf_ring* br;
+    size_t br_size;
+    unsigned char* bufs;
+    unsigned short br_tail;
+
+    unsigned long enters; // Statistics
+    unsigned long completions;
+    FILE* err; // Diagnostics, NULL for none
+} dns_uring_t;
+
+// Only built with HAVE_IO_URING.
+// Set up the ring and its receive buffers. Returns 1 if io_uring or a needed
+// feature is not available, the caller falls back to poll() then.
+int dns_uring_init(dns_uring_t* r, FILE* err);
+void dns_uring_free(dns_uring_t* r);
+
+// Next free submission entry (zeroed), the queue is submitted first if full
+struct io_uring_sqe* dns_uring_sqe(dns_uring_t* r);
+
+// Submit everything prepared and wait up to timeout_ms for a completion
+// (0 does not wait). Returns 1 on error.
+int dns_uring_submit_wait(dns_uring_t* r, int timeout_ms);
+
+// Oldest unseen completion, NULL if there is none
+struct io_uring_cqe* dns_uring_cqe(dns_uring_t* r);
+void dns_uring_cqe_seen(dns_uring_t* r);
+
+// Receive buffer the completion selected, and giving it back to the kernel
+unsigned char* dns_uring_buf(dns_uring_t* r, unsigned bid);
+void dns_uring_buf_return(dns_uring_t* r, unsigned bid);
+
+#endif // !__DNS_URING_H__
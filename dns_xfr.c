@@ -0,0 +1,430 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_cc.h"
+#include "dns_engine.h"
+#include "dns_dnssec.h"
+#include "libdns.h"
+#include "dns_print.h"
+#include "dns_xfr.h"
+
+#include <poll.h>
+
+#define XFR_LINE_SIZE (4 * 65536 + 1024) // Longest RDATA, every octet escaped
+
+// Position in the sequence of records of the transfer
+typedef enum {
+    XFR_FIRST, // Waiting for the SOA of the zone
+    XFR_SECOND, // The second record tells an incremental response from a full one
+    XFR_FULL, // Records of the zone until the SOA comes again
+    XFR_DELETED, // Records removed by the change
+    XFR_ADDED, // Records added by the change
+    XFR_DONE,
+} dns_xfr_state_t;
+
+typedef struct {
+    const dns_xfr_opts_t* opts;
+    FILE* out;
+    dns_xfr_stats_t* stats;
+    uint16_t id;
+    dns_xfr_state_t state;
+    uint32_t serial; // Of the first SOA, the transfer ends with it
+    bool failed;
+    char* line; // Formatted record
+    char* first; // The first SOA, written once the kind of the response is known
+} dns_xfr_t;
+
+// Decoded fixed fields of a record
+typedef struct {
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint32_t serial; // SOA only
+} dns_xfr_rr_t;
+
+// RFC 1982 serial number arithmetic
+static bool dns_xfr_serial_le(uint32_t a, uint32_t b)
+{
+    return a == b || (int32_t)(b - a) > 0;
+}
+
+static uint32_t dns_xfr_u32(const uchar* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Append a possibly compressed name in the dotted form with the trailing dot
+static int dns_xfr_name(const uchar* at, const uchar* msg, size_t msg_len, char** p, int* name_len)
+{
+    char name[MAX_NAME_STR_LEN];
+    if (dns_read_name(at, msg, msg_len, name, name_len) != 0) {
+        return 1;
+    }
+    *p += sprintf(*p, "%s.", name);
+    return 0;
+}
+
+// Format RDATA into p, in the master file form of the type or RFC 3597 otherwise
+static int dns_xfr_rdata(const uchar* rdata, uint16_t len, const uchar* msg, size_t msg_len,
+                         dns_xfr_rr_t* rr, char* p)
+{
+    int name_len = 0;
+    switch (rr->type) {
+        case T_A:
+        case T_AAAA:
+            if (len != (rr->type == T_A ? 4 : 16)) {
+                return 1;
+            }
+            inet_ntop(rr->type == T_A ? AF_INET : AF_INET6, rdata, p, INET6_ADDRSTRLEN);
+            return 0;
+        case T_NS: case T_CNAME: case T_PTR:
+            return dns_xfr_name(rdata, msg, msg_len, &p, &name_len);
+        case T_MX:
+            if (len < 3) {
+                return 1;
+            }
+            p += sprintf(p, "%u ", (rdata[0] << 8) | rdata[1]);
+            return dns_xfr_name(rdata + 2, msg, msg_len, &p, &name_len);
+        case T_SOA: {
+            const uchar* r = rdata;
+            if (dns_xfr_name(r, msg, msg_len, &p, &name_len) != 0) {
+                return 1;
+            }
+            r += name_len;
+            *p++ = ' ';
+            if (r >= rdata + len || dns_xfr_name(r, msg, msg_len, &p, &name_len) != 0) {
+                return 1;
+            }
+            r += name_len;
+            if (r + 20 != rdata + len) {
+                return 1;
+            }
+            rr->serial = dns_xfr_u32(r);
+            sprintf(p, " %u %u %u %u %u", rr->serial, dns_xfr_u32(r + 4), dns_xfr_u32(r + 8),
+                    dns_xfr_u32(r + 12), dns_xfr_u32(r + 16));
+            return 0;
+        }
+        case T_TXT: {
+            const uchar* r = rdata;
+            while (r < rdata + len) {
+                uchar n = *r++;
+                if (r + n > rdata + len) {
+                    return 1;
+                }
+                *p++ = '"';
+                for (int i = 0; i < n; ++i, ++r) {
+                    if (*r == '"' || *r == '\\') {
+                        *p++ = '\\';
+                        *p++ = *r;
+                    } else if (*r < 32 || *r > 126) {
+                        p += sprintf(p, "\\%03u", *r);
+                    } else {
+                        *p++ = *r;
+                    }
+                }
+                *p++ = '"';
+                *p++ = r < rdata + len ? ' ' : '\0';
+            }
+            *p = '\0';
+            return 0;
+        }
+        default:
+            p += sprintf(p, "\\# %u%s", len, len > 0 ? " " : "");
+            for (int i = 0; i < len; ++i) {
+                p += sprintf(p, "%02x", rdata[i]);
+            }
+            return 0;
+    }
+}
+
+// Format the record at reader into x->line, prefixed with mark if not '\0'
+static int dns_xfr_format(dns_xfr_t* x, const uchar* reader, const uchar* msg, size_t msg_len,
+                          char mark, dns_xfr_rr_t* rr, int* rr_len)
+{
+    const uchar* end = msg + msg_len;
+    char* p = x->line;
+    if (mark != '\0') {
+        *p++ = mark;
+    }
+
+    int name_len = 0;
+    if (dns_xfr_name(reader, msg, msg_len, &p, &name_len) != 0) {
+        return 1;
+    }
+    const uchar* r = reader + name_len;
+    if (r + sizeof(dns_ansdata_t) > end) {
+        return 1;
+    }
+    rr->type = (r[0] << 8) | r[1];
+    rr->class = (r[2] << 8) | r[3];
+    rr->ttl = dns_xfr_u32(r + 4);
+    uint16_t rdata_len = (r[8] << 8) | r[9];
+    r += sizeof(dns_ansdata_t);
+    if (r + rdata_len > end) {
+        return 1;
+    }
+
+    p += sprintf(p, " %u ", rr->ttl);
+    if (rr->class == 1) {
+        p += sprintf(p, "IN ");
+    } else {
+        p += sprintf(p, "CLASS%u ", rr->class);
+    }
+    const char* type = dns_record_type_to_str(rr->type);
+    if (type[0] >= '0' && type[0] <= '9') {
+        p += sprintf(p, "TYPE%u ", rr->type);
+    } else {
+        p += sprintf(p, "%s ", type);
+    }
+
+    if (dns_xfr_rdata(r, rdata_len, msg, msg_len, rr, p) != 0) {
+        return 1;
+    }
+    strcat(p, "\n");
+    *rr_len = (r + rdata_len) - reader;
+    return 0;
+}
+
+// A full disk or a closed pipe ends the transfer
+static void dns_xfr_write(dns_xfr_t* x, const char* line)
+{
+    if (fputs(line, x->out) == EOF) {
+        perror("Writing the zone failed");
+        x->failed = true;
+        return;
+    }
+    ++x->stats->records;
+}
+
+// Move the transfer on by one record
+static void dns_xfr_record(dns_xfr_t* x, const uchar* reader, const uchar* msg, size_t msg_len, int* rr_len)
+{
+    // Changes are marked, the mark depends on the state before the record
+    char mark = x->state == XFR_DELETED ? '-' : x->state == XFR_ADDED ? '+' : '\0';
+    dns_xfr_rr_t rr;
+    if (dns_xfr_format(x, reader, msg, msg_len, mark, &rr, rr_len) != 0) {
+        fprintf(stderr, "Error: Malformed record in the zone transfer.\n");
+        x->failed = true;
+        return;
+    }
+    bool soa = rr.type == T_SOA;
+
+    switch (x->state) {
+        case XFR_FIRST:
+            if (!soa) {
+                fprintf(stderr, "Error: Zone transfer does not start with SOA.\n");
+                x->failed = true;
+                return;
+            }
+            x->serial = x->stats->serial = rr.serial;
+            strcpy(x->first, x->line);
+            x->state = XFR_SECOND;
+            return;
+        case XFR_SECOND:
+            if (x->opts->incremental && soa && rr.serial != x->serial) {
+                // The SOA of the version the client has, the changes follow
+                fprintf(x->out, "; %s changes from serial %u\n", x->opts->zone, rr.serial);
+                memmove(x->line + 1, x->line, strlen(x->line) + 1);
+                x->line[0] = '-';
+                dns_xfr_write(x, x->line);
+                x->state = XFR_DELETED;
+                return;
+            }
+            // The whole zone, a SOA right away means there is nothing else in it
+            x->stats->full = x->opts->incremental;
+            dns_xfr_write(x, x->first);
+            x->state = soa ? XFR_DONE : XFR_FULL;
+            if (soa) {
+                return;
+            }
+            break;
+        case XFR_FULL:
+            if (soa) { // Repeated at the end
+                x->state = XFR_DONE;
+                return;
+            }
+            break;
+        case XFR_DELETED:
+            if (soa) { // The version after the change, its additions follow
+                x->line[0] = '+';
+                x->state = XFR_ADDED;
+            }
+            break;
+        case XFR_ADDED:
+            if (soa && rr.serial == x->serial) {
+                x->state = XFR_DONE;
+                return;
+            }
+            if (soa) { // The next change
+                fprintf(x->out, "; %s changes from serial %u\n", x->opts->zone, rr.serial);
+                x->line[0] = '-';
+                x->state = XFR_DELETED;
+            }
+            break;
+        case XFR_DONE:
+            return;
+    }
+    dns_xfr_write(x, x->line);
+}
+
+// Decode one message of the transfer as soon as it has arrived
+static void dns_xfr_msg(void* ctx, dns_stream_pool_t* pool, dns_stream_conn_t* conn, const uchar* msg, size_t msg_len)
+{
+    dns_xfr_t* x = ctx;
+    if (x->failed || x->state == XFR_DONE) {
+        return;
+    }
+    ++x->stats->messages;
+    x->stats->bytes += 2 + msg_len;
+
+    dns_header_t header;
+    if (msg_len < sizeof(dns_header_t)) {
+        fprintf(stderr, "Error: Malformed response.\n");
+        x->failed = true;
+        return;
+    }
+    memcpy(&header, msg, sizeof(dns_header_t));
+    if (ntohs(header.id) != x->id || header.qr != 1) {
+        fprintf(stderr, "Error: Unexpected message in the zone transfer.\n");
+        x->failed = true;
+        return;
+    }
+    if (header.rcode != 0) {
+        fprintf(stderr, "Error: %s\n", dns_rcode_to_str(header.rcode));
+        x->failed = true;
+        return;
+    }
+
+    // Only the first message has to repeat the question
+    const uchar* reader = msg + sizeof(dns_header_t);
+    char name[MAX_NAME_STR_LEN];
+    int len = 0;
+    for (int i = 0; i < ntohs(header.q_count); ++i) {
+        if (dns_read_name(reader, msg, msg_len, name, &len) != 0) {
+            fprintf(stderr, "Error: Malformed response.\n");
+            x->failed = true;
+            return;
+        }
+        reader += len + sizeof(dns_qdata_t);
+    }
+
+    for (int i = 0; i < ntohs(header.ans_count) && !x->failed && x->state != XFR_DONE; ++i) {
+        dns_xfr_record(x, reader, msg, msg_len, &len);
+        reader += len;
+    }
+
+    // A single SOA not newer than the client's: nothing has changed (RFC 1995)
+    if (x->state == XFR_SECOND && x->opts->incremental && dns_xfr_serial_le(x->serial, x->opts->serial)) {
+        x->stats->up_to_date = true;
+        x->state = XFR_DONE;
+    }
+}
+
+// Query for the zone, an IXFR carries the SOA with the serial the client has
+static size_t dns_xfr_query(dns_xfr_t* x, uchar* out)
+{
+    dns_pending_t q;
+    memset(&q, 0, sizeof(dns_pending_t));
+    char qstr[MAX_NAME_STR_LEN];
+    if (dns_make_qname(x->opts->zone, T_SOA, qstr, q.qname, &q.qname_len) != 0) {
+        return 0;
+    }
+    q.id = x->id;
+    q.qtype = x->opts->incremental ? T_IXFR : T_AXFR;
+    q.qclass = 1;
+    size_t len = dns_build_query(out, &q, false);
+    if (!x->opts->incremental) {
+        return len;
+    }
+
+    out[9] = 1; // Authority count
+    uchar soa[] = {
+        0xC0, 0x0C, // The zone name of the question
+        0, T_SOA, 0, 1, 0, 0, 0, 0, 0, 22,
+        0, 0, // Root as the primary server and mailbox, only the serial matters
+        x->opts->serial >> 24, x->opts->serial >> 16, x->opts->serial >> 8, x->opts->serial,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    };
+    memcpy(out + len, soa, sizeof(soa));
+    return len + sizeof(soa);
+}
+
+int dns_xfr_run(dns_stream_pool_t* pool, const dns_xfr_opts_t* opts, FILE* out, dns_xfr_stats_t* stats)
+{
+    memset(stats, 0, sizeof(dns_xfr_stats_t));
+    dns_xfr_t x;
+    memset(&x, 0, sizeof(dns_xfr_t));
+    x.opts = opts;
+    x.out = out;
+    x.stats = stats;
+    dns_random_t rnd;
+    dns_random_init(&rnd, stderr);
+    if (dns_random_u16(&rnd, &x.id) != 0) {
+        return 1;
+    }
+    x.state = XFR_FIRST;
+    x.line = malloc(XFR_LINE_SIZE);
+    x.first = malloc(XFR_LINE_SIZE);
+    if (x.line == NULL || x.first == NULL) {
+        perror("malloc failed");
+        free(x.line);
+        free(x.first);
+        return 1;
+    }
+
+    uchar query[BUFFER_SIZE];
+    size_t query_len = dns_xfr_query(&x, query);
+    if (query_len == 0) {
+        fprintf(stderr, "Error: Invalid zone name %s.\n", opts->zone);
+    }
+    dns_stream_conn_t* conn = query_len > 0 ? dns_stream_pick(pool, opts->timeout_ms) : NULL;
+    if (conn == NULL || dns_stream_send(pool, conn, query, query_len) != 0) {
+        free(x.line);
+        free(x.first);
+        return 1;
+    }
+
+    // Messages are decoded and written while the next ones arrive
+    while (!x.failed && x.state != XFR_DONE) {
+        struct pollfd pfd = { conn->fd, POLLIN | (dns_stream_wants_write(conn) ? POLLOUT : 0), 0 };
+        int ready = dns_stream_has_pending(conn) ? 1 : poll(&pfd, 1, opts->timeout_ms);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready < 0) {
+            perror("poll failed");
+            x.failed = true;
+            break;
+        }
+        if (ready == 0) {
+            fprintf(stderr, "Error: Zone transfer timed out.\n");
+            x.failed = true;
+            break;
+        }
+        if ((pfd.revents & POLLOUT) && dns_stream_flush(pool, conn) != 0) {
+            x.failed = true;
+            break;
+        }
+        if (dns_stream_recv(pool, conn, dns_xfr_msg, &x) != 0 && !x.failed && x.state != XFR_DONE) {
+            fprintf(stderr, "Error: Connection closed before the end of the zone transfer.\n");
+            x.failed = true;
+        }
+    }
+    dns_stream_close(conn);
+
+    free(x.line);
+    free(x.first);
+    // The comment lines and the rest of the buffer are checked here
+    if ((fflush(out) != 0 || ferror(out)) && !x.failed) {
+        perror("Writing the zone failed");
+        return 1;
+    }
+    return x.failed ? 1 : 0;
+}
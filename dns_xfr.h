@@ -0,0 +1,36 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __DNS_XFR_H__
+#define __DNS_XFR_H__
+
+#define T_IXFR 251
+#define T_AXFR 252
+
+#define XFR_OUT_BUF_SIZE (1 << 20) // Records are written in blocks of this size
+
+typedef struct {
+    const char* zone;
+    bool incremental; // IXFR (RFC 1995) from serial, AXFR (RFC 5936) otherwise
+    uint32_t serial;
+    int timeout_ms; // Connecting and waiting for every next message
+} dns_xfr_opts_t;
+
+typedef struct {
+    unsigned long messages;
+    unsigned long records; // Written to the output
+    unsigned long long bytes; // Received, length prefixes included
+    uint32_t serial; // Serial of the zone after the transfer
+    bool up_to_date; // IXFR only, the zone has not changed since the serial
+    bool full; // IXFR answered with the whole zone
+} dns_xfr_stats_t;
+
+// Transfer the zone over a connection of the pool (TCP or TLS) and write it
+// to out in master file format, one record per line, while the messages
+// arrive. Memory does not depend on the size of the zone. An incremental
+// transfer writes the removed records with '-' and the added ones with '+',
+// every change starts with a comment line.
+int dns_xfr_run(dns_stream_pool_t* pool, const dns_xfr_opts_t* opts, FILE* out, dns_xfr_stats_t* stats);
+
+#endif // !__DNS_XFR_H__
@@ -0,0 +1,98 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#ifndef __LIBDNS_H__
+#define __LIBDNS_H__
+
+// Public interface of the resolver library (libdns.a, libdns.so). The
+// library never prints, diagnostics go to the err stream of the options
+// (NULL keeps it silent), it keeps no global state and never exits the
+// process, every failure is returned to the caller.
+//
+// Writing to a TLS connection the server has closed may raise SIGPIPE,
+// programs using TLS should ignore it. Plain TCP writes never raise it.
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_cc.h"
+#include "dns_engine.h"
+#include "dns_dnssec.h"
+
+typedef enum {
+    TRANSPORT_UDP,
+    TRANSPORT_TCP,
+    TRANSPORT_TLS, // DNS over TLS (RFC 7858)
+} transport_t;
+
+typedef struct {
+    const char* servers[MAX_SERVERS]; // Names or addresses, tries of a query go to them in turn
+    int n_servers;
+    uint16_t port; // 0 for 53, or 853 with TLS
+    transport_t transport;
+    const char* tls_ca_path; // Certificates to trust instead of the system ones
+    bool recursion_desired;
+    int timeout_ms; // Wait for the answer to one try, 0 for the default
+    int tries; // Tries of a query before it is given up, 0 for the default
+    int deadline_ms; // Bound on a query from its first try, 0 for timeout_ms * tries
+    bool adaptive; // Congestion window per server instead of the fixed window
+    bool io_uring; // Use the io_uring backend if the kernel supports it
+    bool dnssec; // Validate the answers up to a trust anchor
+    const char* trust_anchor_path; // DS records to trust instead of the root keys
+    FILE* err; // Diagnostics, NULL for none
+} dns_resolver_opts_t;
+
+// Everything one resolver owns. It must not be moved once initialized,
+// the engine points into it. Resolvers are independent of each other,
+// one resolver is used by one thread at a time.
+typedef struct {
+    dns_random_t rnd;
+    sock_pool_t socks[MAX_SERVERS];
+    dns_stream_pool_t streams[MAX_SERVERS]; // TCP or TLS, over UDP the TCP fallback of the validation
+    dns_cc_t ccs[MAX_SERVERS];
+    dns_pending_table_t pending;
+    dns_validator_t* validator;
+    dns_engine_t engine; // For callers driving the engine with their own callbacks
+    FILE* err;
+} dns_resolver_t;
+
+// Outcome of one query. result holds the decoded response if status is
+// QUERY_OK, which may still carry an error rcode.
+typedef struct {
+    size_t index; // Caller's identifier of the query
+    char qstr[MAX_NAME_STR_LEN]; // Name as asked (reversed address for PTR)
+    uint16_t qtype;
+    dns_query_status_t status;
+    dns_result_t result;
+} dns_lookup_t;
+
+// Called once for every query of dns_resolve_many(). The result is freed
+// after the call unless the callback takes it over by setting
+// lookup->result.records to NULL.
+typedef void (*dns_lookup_cb)(void* ctx, dns_lookup_t* lookup);
+
+// Resolve the server names and open the sockets or connections. Returns 1
+// on failure, the resolver must be freed with dns_resolver_free() either way.
+int dns_resolver_init(dns_resolver_t* r, const dns_resolver_opts_t* opts);
+void dns_resolver_free(dns_resolver_t* r);
+
+// Resolve every query produced by next, up to the engine window of them in
+// flight. Returns 1 if the engine failed, the failures of single queries
+// are only reported through their lookups.
+int dns_resolve_many(dns_resolver_t* r, dns_engine_next_cb next, dns_lookup_cb done, void* ctx);
+
+// Resolve one name, out must be freed with dns_lookup_free(). Returns 1 if
+// the query failed or the answer has an error rcode, out says which.
+int dns_resolve(dns_resolver_t* r, const char* name, uint16_t qtype, dns_lookup_t* out);
+
+// Decode the completion of an engine query into a lookup, for callers
+// driving the engine themselves
+void dns_lookup_fill(dns_lookup_t* l, const dns_query_t* q, dns_query_status_t status,
+                     const uchar* pkt, size_t pkt_len);
+void dns_lookup_free(dns_lookup_t* l);
+
+#endif // !__LIBDNS_H__
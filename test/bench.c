@@ -0,0 +1,363 @@
+/*
+ * @author Vadim Goncearenco (xgonce00)
+ */
+
+#include "base.h"
+#include "dns_random.h"
+#include "dns_socket.h"
+#include "dns_pending.h"
+#include "dns_packet.h"
+#include "dns_stream.h"
+#include "dns_cc.h"
+#include "dns_engine.h"
+#include "dns_dnssec.h"
+#include "libdns.h"
+#include "dns_print.h"
+
+#define BENCH_RUNS 5 // Timed runs of every benchmark, the fastest one is reported
+#define BENCH_MIN_RUN_NS 20000000LL // Iterations are doubled until one run takes this long
+#define BENCH_MAX_BENCHES 32
+#define BENCH_MAX_RECORDS 256 // Of one corpus response
+
+// Response of the corpus with the offsets of its records
+typedef struct {
+    const char* file;
+    uchar msg[BUFFER_SIZE];
+    size_t len;
+    size_t records; // Offset of the first record, right after the question
+    size_t owners[BENCH_MAX_RECORDS]; // Offsets of the records
+    int count;
+} bench_corpus_t;
+
+// Runs the operation iters times
+typedef void (*bench_fn_t)(void* ctx, long iters);
+
+typedef struct {
+    char name[64];
+    double ns_per_op;
+    double allocs_per_op;
+    long iters;
+} bench_result_t;
+
+static bench_result_t results[BENCH_MAX_BENCHES];
+static int n_results;
+
+// Keeps the compiler from dropping the results of the benchmarked calls
+static volatile size_t sink;
+
+// Allocations of the code under test. The linker sends its malloc(), calloc()
+// and realloc() calls to the wrappers (-Wl,--wrap), allocations inside libc
+// itself are not counted.
+static unsigned long allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    ++allocs;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+    ++allocs;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size)
+{
+    ++allocs;
+    return __real_realloc(ptr, size);
+}
+
+static long long bench_now_ns()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static void bench_run(const char* name, bench_fn_t fn, void* ctx)
+{
+    fn(ctx, 1); // Warm up the caches
+
+    // Long enough runs so that the clock resolution does not matter
+    long iters = 1;
+    long long ns = 0;
+    while (true) {
+        long long start = bench_now_ns();
+        fn(ctx, iters);
+        ns = bench_now_ns() - start;
+        if (ns >= BENCH_MIN_RUN_NS || iters >= (1L << 40)) {
+            break;
+        }
+        iters *= 2;
+    }
+
+    unsigned long before = allocs;
+    for (int i = 1; i < BENCH_RUNS; ++i) {
+        long long start = bench_now_ns();
+        fn(ctx, iters);
+        long long run = bench_now_ns() - start;
+        if (run < ns) {
+            ns = run;
+        }
+    }
+
+    bench_result_t* r = &results[n_results++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ns_per_op = (double)ns / iters;
+    r->allocs_per_op = (double)(allocs - before) / ((double)iters * (BENCH_RUNS - 1));
+    r->iters = iters;
+    printf("%-28s %12.1f ns/op %8.2f allocs/op %12ld iterations\n", r->name, r->ns_per_op,
+           r->allocs_per_op, r->iters);
+}
+
+static int bench_load(bench_corpus_t* c, const char* dir, const char* file)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    c->file = file;
+    c->len = fread(c->msg, 1, sizeof(c->msg), f);
+    fclose(f);
+
+    // Find the records once, the benchmarks only decode them
+    if (c->len < sizeof(dns_header_t)) {
+        fprintf(stderr, "%s: Too short for a DNS message.\n", path);
+        return 1;
+    }
+    const dns_header_t* dns = (const dns_header_t*)c->msg;
+    char name[MAX_NAME_STR_LEN];
+    int name_len = 0;
+    size_t pos = sizeof(dns_header_t);
+    for (int i = 0; i < ntohs(dns->q_count); ++i) {
+        if (dns_read_name(c->msg + pos, c->msg, c->len, name, &name_len) != 0) {
+            fprintf(stderr, "%s: Malformed question.\n", path);
+            return 1;
+        }
+        pos += name_len + sizeof(dns_qdata_t);
+    }
+    c->records = pos;
+
+    int total = ntohs(dns->ans_count) + ntohs(dns->auth_count) + ntohs(dns->add_count);
+    dns_record_t rec;
+    int rec_len = 0;
+    for (c->count = 0; c->count < total; ++c->count) {
+        if (c->count == BENCH_MAX_RECORDS || pos >= c->len ||
+            dns_parse_answer(&rec, c->msg + pos, c->msg, c->len, &rec_len) != 0) {
+            fprintf(stderr, "%s: Malformed record %d.\n", path, c->count);
+            return 1;
+        }
+        c->owners[c->count] = pos;
+        pos += rec_len;
+    }
+    return 0;
+}
+
+typedef struct {
+    char src[MAX_NAME_STR_LEN];
+    uchar dst[MAX_NAME_STR_LEN];
+} bench_encode_t;
+
+static void bench_encode_name(void* ctx, long iters)
+{
+    bench_encode_t* e = ctx;
+    for (long i = 0; i < iters; ++i) {
+        dns_encode_name(e->dst, (uchar*)e->src);
+        sink += e->dst[0];
+    }
+}
+
+typedef struct {
+    const bench_corpus_t* corpus;
+    size_t at; // Offset of the name
+} bench_name_t;
+
+static void bench_read_name(void* ctx, long iters)
+{
+    bench_name_t* n = ctx;
+    char name[MAX_NAME_STR_LEN];
+    int name_len = 0;
+    for (long i = 0; i < iters; ++i) {
+        dns_read_name(n->corpus->msg + n->at, n->corpus->msg, n->corpus->len, name, &name_len);
+        sink += name_len;
+    }
+}
+
+// Every record of the response, one operation decodes the whole response
+static void bench_parse_answer(void* ctx, long iters)
+{
+    const bench_corpus_t* c = ctx;
+    dns_record_t rec;
+    int rec_len = 0;
+    for (long i = 0; i < iters; ++i) {
+        const uchar* reader = c->msg + c->records;
+        for (int j = 0; j < c->count; ++j) {
+            dns_parse_answer(&rec, reader, c->msg, c->len, &rec_len);
+            reader += rec_len;
+        }
+        sink += rec.ttl;
+    }
+}
+
+static void bench_parse_response(void* ctx, long iters)
+{
+    const bench_corpus_t* c = ctx;
+    dns_result_t res;
+    for (long i = 0; i < iters; ++i) {
+        dns_parse_response(c->msg, c->len, &res);
+        sink += res.ans_count;
+        dns_free_result(&res);
+    }
+}
+
+typedef struct {
+    const char* addr;
+    char out[MAX_NAME_STR_LEN];
+    int (*reverse)(char* out_addr, const char* in_addr);
+} bench_reverse_t;
+
+static void bench_reverse(void* ctx, long iters)
+{
+    bench_reverse_t* r = ctx;
+    for (long i = 0; i < iters; ++i) {
+        r->reverse(r->out, r->addr);
+        sink += r->out[0];
+    }
+}
+
+// Known types and numbers printed as such, one operation is one type
+static const uint16_t bench_types[] = {
+    T_A, T_AAAA, T_MX, T_CNAME, T_NS, T_SOA, T_TXT, T_PTR,
+    T_RRSIG, T_DNSKEY, T_DS, T_NSEC3, 64, 65, 99, 257,
+};
+#define BENCH_N_TYPES (sizeof(bench_types) / sizeof(bench_types[0]))
+
+static void bench_type_to_str(void* ctx, long iters)
+{
+    for (long i = 0; i < iters; ++i) {
+        sink += dns_record_type_to_str(bench_types[i % BENCH_N_TYPES])[0];
+    }
+}
+
+static void bench_type_str(void* ctx, long iters)
+{
+    char tbuf[MAX_TYPE_STR_LEN];
+    for (long i = 0; i < iters; ++i) {
+        sink += dns_record_type_str(bench_types[i % BENCH_N_TYPES], tbuf)[0];
+    }
+}
+
+static void bench_json_str(FILE* f, const char* s)
+{
+    fputc('"', f);
+    for (; *s != '\0'; ++s) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', f);
+        }
+        if ((unsigned char)*s >= 0x20) {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+// One object for the whole run, see test/bench_compare.py
+static int bench_write_json(const char* path, const char* commit)
+{
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    fprintf(f, "{\n  \"commit\": ");
+    bench_json_str(f, commit);
+    fprintf(f, ",\n  \"runs\": %d,\n  \"benchmarks\": [\n", BENCH_RUNS);
+    for (int i = 0; i < n_results; ++i) {
+        fprintf(f, "    {\"name\": ");
+        bench_json_str(f, results[i].name);
+        fprintf(f, ", \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, \"iterations\": %ld}%s\n",
+                results[i].ns_per_op, results[i].allocs_per_op, results[i].iters, i + 1 < n_results ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    if (fclose(f) != 0) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* out_path = NULL;
+    const char* commit = "";
+    int opt;
+    while ((opt = getopt(argc, argv, "o:c:")) != -1) {
+        if (opt == 'o') {
+            out_path = optarg;
+        } else if (opt == 'c') {
+            commit = optarg;
+        } else {
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-o results.json] [-c commit] corpus_dir\n", argv[0]);
+        return 1;
+    }
+    const char* dir = argv[optind];
+
+    static bench_corpus_t corpora[4];
+    const char* files[] = { "response_1.bin", "response_10.bin", "response_100.bin", "compressed.bin" };
+    for (int i = 0; i < 4; ++i) {
+        if (bench_load(&corpora[i], dir, files[i]) != 0) {
+            return 1;
+        }
+    }
+    bench_corpus_t* chain = &corpora[3];
+
+    static bench_encode_t enc;
+    strcpy(enc.src, "www.example.com");
+    bench_run("encode_name/short", bench_encode_name, &enc);
+    // The same name the compressed corpus asks for
+    int len = 0;
+    dns_read_name(chain->msg + sizeof(dns_header_t), chain->msg, chain->len, enc.src, &len);
+    memset(enc.dst, 0, sizeof(enc.dst));
+    bench_run("encode_name/long", bench_encode_name, &enc);
+
+    bench_name_t plain = { chain, sizeof(dns_header_t) };
+    bench_run("read_name/plain", bench_read_name, &plain);
+    bench_name_t compressed = { chain, chain->owners[chain->count - 1] };
+    bench_run("read_name/compressed", bench_read_name, &compressed);
+
+    const char* sizes[] = { "1", "10", "100" };
+    char name[64];
+    for (int i = 0; i < 3; ++i) {
+        snprintf(name, sizeof(name), "parse_answer/%s", sizes[i]);
+        bench_run(name, bench_parse_answer, &corpora[i]);
+    }
+    for (int i = 0; i < 3; ++i) {
+        snprintf(name, sizeof(name), "parse_response/%s", sizes[i]);
+        bench_run(name, bench_parse_response, &corpora[i]);
+    }
+
+    static bench_reverse_t rev4 = { "192.0.2.53", "", dns_reverse_ipv4 };
+    bench_run("reverse_ipv4", bench_reverse, &rev4);
+    static bench_reverse_t rev6 = { "2001:db8::567:89ab", "", dns_reverse_ipv6 };
+    bench_run("reverse_ipv6", bench_reverse, &rev6);
+
+    bench_run("record_type_to_str", bench_type_to_str, NULL);
+    bench_run("record_type_str", bench_type_str, NULL);
+
+    if (out_path != NULL && bench_write_json(out_path, commit) != 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+"""
+@author Vadim Goncearenco (xgonce00)
+
+Compares two results of make bench (bench.json), e.g. of the commit before
+and after a change:
+
+    git stash && make bench BENCH_OUT=before.json && git stash pop
+    make bench && python3 test/bench_compare.py before.json bench.json
+
+Exits with 1 if a benchmark got slower by more than the threshold or
+allocates more per operation.
+"""
+
+import argparse
+import json
+import sys
+
+
+class bcolors:
+    OKGREEN = '\033[92m'
+    FAIL = '\033[91m'
+    ENDC = '\033[0m'
+
+
+def load(path: str):
+    with open(path) as f:
+        results = json.load(f)
+    return results.get('commit', ''), {b['name']: b for b in results['benchmarks']}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare two results of the codec benchmarks")
+    parser.add_argument("before")
+    parser.add_argument("after")
+    parser.add_argument("--threshold", type=float, default=10.0, help="slowdown in percent that fails (default 10)")
+    args = parser.parse_args()
+
+    before_commit, before = load(args.before)
+    after_commit, after = load(args.after)
+    print(f"{'benchmark':<28} {before_commit or 'before':>12} {after_commit or 'after':>12} {'change':>8}  allocs/op")
+
+    regressions = 0
+    for name, b in after.items():
+        a = before.get(name)
+        if a is None:
+            print(f"{name:<28} {'-':>12} {b['ns_per_op']:>12.1f} {'new':>8}  {b['allocs_per_op']:.2f}")
+            continue
+        change = (b['ns_per_op'] - a['ns_per_op']) / a['ns_per_op'] * 100 if a['ns_per_op'] > 0 else 0
+        more_allocs = b['allocs_per_op'] > a['allocs_per_op'] + 1e-6
+        bad = change > args.threshold or more_allocs
+        regressions += bad
+        color = bcolors.FAIL if bad else bcolors.OKGREEN if change < -args.threshold else ''
+        print(f"{color}{name:<28} {a['ns_per_op']:>12.1f} {b['ns_per_op']:>12.1f} {change:>+7.1f}%  "
+              f"{a['allocs_per_op']:.2f} -> {b['allocs_per_op']:.2f}{bcolors.ENDC if color else ''}")
+    for name in before:
+        if name not in after:
+            print(f"{name:<28} {before[name]['ns_per_op']:>12.1f} {'-':>12} {'removed':>8}")
+
+    print(f"\nRegressions: {regressions}")
+    sys.exit(1 if regressions > 0 else 0)
+
+
+if __name__ == '__main__':
+    main()
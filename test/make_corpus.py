@@ -0,0 +1,168 @@
+"""
+@author Vadim Goncearenco (xgonce00)
+
+Writes the fixed responses the codec benchmarks (make bench) decode into
+test/corpus. They are laid out the way name servers send them, every name
+compressed against the names before it:
+
+    response_1.bin      www.example.com A, one answer
+    response_10.bin     www.example.com A through a CNAME, 4 answers, 2 NS
+                        in the authority section and 3 glue records
+    response_100.bin    example.com ANY, 100 answers of A, AAAA, MX, NS,
+                        TXT, CNAME and SOA records
+    compressed.bin      a name of 56 one letter labels in the question, then
+                        56 A records each owned by one more label and a
+                        pointer to the owner before, the last owner is the
+                        question name again behind 56 pointers
+
+The files are checked in, run this only to change them. The content is
+fixed, regenerating gives the same bytes.
+"""
+
+import os
+import struct
+import sys
+
+T_A = 1
+T_NS = 2
+T_CNAME = 5
+T_SOA = 6
+T_MX = 15
+T_TXT = 16
+T_AAAA = 28
+T_ANY = 255
+
+CHAIN_LABELS = 56 # Pointers followed for the last owner of compressed.bin, under MAX_NAME_JUMPS
+
+
+class Message:
+    def __init__(self, qname: str, qtype: int, aa: bool = True):
+        flags = 0x8000 | (0x0400 if aa else 0) | 0x0100 | 0x0080 # QR, AA, RD, RA
+        self.header = [0x1234, flags, 1, 0, 0, 0]
+        self.data = bytearray(12)
+        self.suffixes = {} # Offsets of the names written so far, for compression
+        self.name(qname)
+        self.data += struct.pack('!HH', qtype, 1)
+
+    def name(self, name: str, compress: bool = True):
+        labels = [label for label in name.strip('.').split('.') if label]
+        for i in range(len(labels)):
+            suffix = '.'.join(labels[i:]).lower()
+            if compress and suffix in self.suffixes:
+                self.data += struct.pack('!H', 0xC000 | self.suffixes[suffix])
+                return
+            if len(self.data) < 0x4000:
+                self.suffixes.setdefault(suffix, len(self.data))
+            self.data += bytes([len(labels[i])]) + labels[i].encode()
+        self.data += b'\0'
+
+    def record(self, section: int, owner: str, rtype: int, ttl: int, rdata):
+        """rdata is bytes or a function writing it with the names compressed"""
+        self.name(owner)
+        self.data += struct.pack('!HHI', rtype, 1, ttl)
+        length_at = len(self.data)
+        self.data += b'\0\0'
+        if callable(rdata):
+            rdata(self)
+        else:
+            self.data += rdata
+        struct.pack_into('!H', self.data, length_at, len(self.data) - length_at - 2)
+        self.header[3 + section] += 1
+
+    def bytes(self) -> bytes:
+        struct.pack_into('!6H', self.data, 0, *self.header)
+        return bytes(self.data)
+
+
+def a(*octets) -> bytes:
+    return bytes(octets)
+
+
+def aaaa(n: int) -> bytes:
+    return bytes.fromhex('20010db8000000000000000000000000')[:14] + struct.pack('!H', n)
+
+
+def named(name: str):
+    return lambda m: m.name(name)
+
+
+def mx(pref: int, name: str):
+    def write(m):
+        m.data += struct.pack('!H', pref)
+        m.name(name)
+    return write
+
+
+def txt(text: str) -> bytes:
+    return bytes([len(text)]) + text.encode()
+
+
+def soa(m):
+    m.name('ns1.example.com')
+    m.name('hostmaster.example.com')
+    m.data += struct.pack('!5I', 2024010101, 7200, 3600, 1209600, 300)
+
+
+def response_1() -> bytes:
+    m = Message('www.example.com', T_A)
+    m.record(0, 'www.example.com', T_A, 300, a(93, 184, 216, 34))
+    return m.bytes()
+
+
+def response_10() -> bytes:
+    m = Message('www.example.com', T_A, aa=False)
+    m.record(0, 'www.example.com', T_CNAME, 3600, named('web.cdn.example.net'))
+    for i in range(4):
+        m.record(0, 'web.cdn.example.net', T_A, 60, a(198, 51, 100, 10 + i))
+    m.record(1, 'cdn.example.net', T_NS, 86400, named('ns1.cdn.example.net'))
+    m.record(1, 'cdn.example.net', T_NS, 86400, named('ns2.cdn.example.net'))
+    m.record(2, 'ns1.cdn.example.net', T_A, 86400, a(203, 0, 113, 1))
+    m.record(2, 'ns2.cdn.example.net', T_A, 86400, a(203, 0, 113, 2))
+    m.record(2, 'ns1.cdn.example.net', T_AAAA, 86400, aaaa(1))
+    return m.bytes()
+
+
+def response_100() -> bytes:
+    m = Message('example.com', T_ANY)
+    m.record(0, 'example.com', T_SOA, 3600, soa)
+    for i in range(4):
+        m.record(0, 'example.com', T_NS, 86400, named(f'ns{i + 1}.example.com'))
+    for i in range(10):
+        m.record(0, 'example.com', T_MX, 3600, mx(10 * (i + 1), f'mx{i}.mail.example.com'))
+    for i in range(10):
+        m.record(0, 'example.com', T_TXT, 3600, txt(f'v=spf1 ip4:192.0.2.{i}/32 include:_spf.example.com ~all'))
+    for i in range(5):
+        m.record(0, f'alias{i}.example.com', T_CNAME, 3600, named(f'host{i}.example.com'))
+    for i in range(40):
+        m.record(0, f'host{i}.example.com', T_A, 300, a(192, 0, 2, i))
+    for i in range(30):
+        m.record(0, f'host{i}.example.com', T_AAAA, 300, aaaa(i))
+    return m.bytes()
+
+
+def compressed() -> bytes:
+    qname = '.'.join(['a'] * CHAIN_LABELS) + '.example.com'
+    m = Message(qname, T_A)
+    prev = 12 + 2 * CHAIN_LABELS # example.com at the end of the question name
+    for i in range(CHAIN_LABELS):
+        owner = len(m.data)
+        m.data += b'\x01a' + struct.pack('!H', 0xC000 | prev)
+        m.data += struct.pack('!HHIH', T_A, 1, 300, 4) + a(192, 0, 2, i)
+        m.header[3] += 1
+        prev = owner
+    return m.bytes()
+
+
+def main():
+    directory = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), 'corpus')
+    os.makedirs(directory, exist_ok=True)
+    for name, make in (('response_1', response_1), ('response_10', response_10),
+                       ('response_100', response_100), ('compressed', compressed)):
+        data = make()
+        with open(os.path.join(directory, name + '.bin'), 'wb') as f:
+            f.write(data)
+        print(f'{name}.bin: {len(data)} bytes')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,811 @@
+"""
+@author Vadim Goncearenco (xgonce00)
+
+Local stand-in DNS responder serving a generated zone over UDP, TCP and TLS.
+
+    hostN.<zone>    A     10.(N>>16).(N>>8).N
+    hostN.<zone>    AAAA  fd00::N
+    hostN.<zone>    MX    10 mail.<zone>
+    anything else   NXDOMAIN
+
+AXFR and IXFR over TCP and TLS. Version S of the zone (--serial) also has
+vS.<zone> A 192.0.2.S, every version replaced the record of the one before.
+
+With --dnssec-anchor it serves a signed tree instead and writes the DS of its
+root key to the file, to be given to the client as the trust anchor:
+
+    .               RSA/SHA-256, DS for the signed zones below
+    example.test    ECDSA P-256, the hosts above, *.wild.example.test A 192.0.2.99,
+                    big.example.test 8 TXT records, truncated over UDP when signed
+    ed.test         Ed25519 (DS with SHA-384), www A 192.0.2.15
+    bogus.test      ECDSA P-256, the signature of www A is broken
+    expired.test    ECDSA P-256, the signatures expired ten days ago
+    insecure.test   unsigned, no DS in the root, www A 192.0.2.80
+    unproven.test   unsigned, no DS in the root and no NSEC proving it
+    nsec3.test      ECDSA P-256 with NSEC3, www A 192.0.2.82, 4 standby RSA keys
+                    make its DNSKEY set too large for UDP
+    optout.nsec3.test  unsigned, opted out of the NSEC3 chain, www A 192.0.2.81
+
+Answers without the asked type carry the NSEC or NSEC3 records proving it.
+UDP answers larger than the payload size of the query are truncated.
+
+With --forge every UDP answer follows four datagrams a resolver must drop:
+another ID, another source address, another source port, another question.
+
+The keys are generated from a fixed seed and the signatures made in pure
+Python, the tests need no crypto modules.
+"""
+
+import argparse
+import base64
+import hashlib
+import heapq
+import random
+import secrets
+import socket
+import socketserver
+import ssl
+import struct
+import threading
+import time
+
+T_A = 1
+T_NS = 2
+T_SOA = 6
+T_MX = 15
+T_TXT = 16
+T_AAAA = 28
+T_OPT = 41
+T_DS = 43
+T_RRSIG = 46
+T_NSEC = 47
+T_DNSKEY = 48
+T_NSEC3 = 50
+T_IXFR = 251
+T_AXFR = 252
+
+DEFAULT_ZONE = 'example.test'
+DEFAULT_TTL = 300
+DEFAULT_SERIAL = 10
+XFR_RECORDS_PER_MESSAGE = 500
+NSEC3_SALT = bytes.fromhex('aabbccdd')
+NSEC3_ITERATIONS = 2
+
+
+def encode_name(name: str) -> bytes:
+    out = b''
+    for label in name.strip('.').split('.'):
+        if label:
+            out += bytes([len(label)]) + label.encode()
+    return out + b'\0'
+
+
+def canonical_key(name: str):
+    """Sorts names in the canonical order of RFC 4034 6.1"""
+    return tuple(reversed(name.lower().split('.'))) if name else ()
+
+
+def type_bitmap(types) -> bytes:
+    out = b''
+    for window in sorted({t >> 8 for t in types}):
+        bits = bytearray(32)
+        for t in types:
+            if t >> 8 == window:
+                bits[(t & 0xFF) // 8] |= 0x80 >> (t % 8)
+        n = max(i for i, b in enumerate(bits) if b) + 1
+        out += bytes([window, n]) + bytes(bits[:n])
+    return out
+
+
+def nsec3_hash(name: str) -> int:
+    digest = hashlib.sha1(encode_name(name.lower()) + NSEC3_SALT).digest()
+    for _ in range(NSEC3_ITERATIONS):
+        digest = hashlib.sha1(digest + NSEC3_SALT).digest()
+    return int.from_bytes(digest, 'big')
+
+
+def truncate(msg: bytes, reply: bytes) -> bytes:
+    """Header and question only with TC set if the reply does not fit the UDP payload size of the query"""
+    if len(reply) <= 512:
+        return reply
+    _, _, qend = parse_question(msg)
+    size = 512
+    if struct.unpack('!H', msg[10:12])[0] and msg[qend + 1:qend + 3] == struct.pack('!H', T_OPT):
+        size = max(512, struct.unpack('!H', msg[qend + 3:qend + 5])[0])
+    if len(reply) <= size:
+        return reply
+    flags = struct.unpack('!H', reply[2:4])[0] | 0x0200
+    return reply[:2] + struct.pack('!HHHHH', flags, 1, 0, 0, 0) + msg[12:qend]
+
+
+def parse_question(msg: bytes):
+    """Return (name, qtype, end offset) of the first question."""
+    pos = 12
+    labels = []
+    while msg[pos] != 0:
+        n = msg[pos]
+        labels.append(msg[pos + 1:pos + 1 + n].decode(errors='replace'))
+        pos += 1 + n
+    qtype, = struct.unpack('!H', msg[pos + 1:pos + 3])
+    return '.'.join(labels), qtype, pos + 5
+
+
+def skip_name(msg: bytes, pos: int) -> int:
+    while msg[pos] != 0:
+        if msg[pos] >= 0xC0:
+            return pos + 2
+        pos += 1 + msg[pos]
+    return pos + 1
+
+
+def rr(name_ptr: bytes, rtype: int, ttl: int, rdata: bytes) -> bytes:
+    return name_ptr + struct.pack('!HHIH', rtype, 1, ttl, len(rdata)) + rdata
+
+
+class Zone:
+    def __init__(self, origin: str, size: int, ttl: int, serial: int = DEFAULT_SERIAL):
+        self.origin = origin.lower().strip('.')
+        self.size = size
+        self.ttl = ttl
+        self.serial = serial
+
+    def host_index(self, name: str):
+        name = name.lower()
+        suffix = '.' + self.origin
+        if not name.endswith(suffix) or not name.startswith('host'):
+            return None
+        try:
+            n = int(name[4:-len(suffix)])
+        except ValueError:
+            return None
+        return n if 0 <= n < self.size else None
+
+    def host_rdata(self, n: int, rtype: int) -> bytes:
+        if rtype == T_A:
+            return bytes([10, (n >> 16) & 0xFF, (n >> 8) & 0xFF, n & 0xFF])
+        if rtype == T_MX:
+            return struct.pack('!H', 10) + encode_name('mail.' + self.origin)
+        return bytes([0xfd]) + bytes(11) + struct.pack('!I', n)
+
+    def soa_rdata(self, serial: int = None) -> bytes:
+        return (encode_name('ns.' + self.origin) + encode_name('admin.' + self.origin) +
+                struct.pack('!IIIII', self.serial if serial is None else serial, 3600, 600, 86400, self.ttl))
+
+    # Records of a transfer as (owner, type, rdata), owners are relative to
+    # the question name at offset 12 of every message
+    def soa(self, serial: int = None):
+        return b'\xc0\x0c', T_SOA, self.soa_rdata(serial)
+
+    def version(self, serial: int):
+        label = b'v%d' % serial
+        return bytes([len(label)]) + label + b'\xc0\x0c', T_A, bytes([192, 0, 2, serial & 0xFF])
+
+    def axfr_records(self):
+        yield self.soa()
+        yield b'\xc0\x0c', T_NS, encode_name('ns.' + self.origin)
+        yield b'\xc0\x0c', T_TXT, b'\x0egenerated zone'
+        yield self.version(self.serial)
+        for n in range(self.size):
+            label = b'host%d' % n
+            owner = bytes([len(label)]) + label + b'\xc0\x0c'
+            for rtype in (T_A, T_AAAA, T_MX):
+                yield owner, rtype, self.host_rdata(n, rtype)
+        yield self.soa()
+
+    def ixfr_records(self, serial: int):
+        """Changes since serial (RFC 1995), the whole zone if they are not known"""
+        if serial >= self.serial:
+            yield self.soa()
+            return
+        if serial < 1:
+            yield from self.axfr_records()
+            return
+        yield self.soa()
+        for i in range(serial + 1, self.serial + 1):
+            yield self.soa(i - 1)
+            yield self.version(i - 1)
+            yield self.soa(i)
+            yield self.version(i)
+        yield self.soa()
+
+    def transfer(self, msg: bytes):
+        """Messages of the zone transfer asked for by msg"""
+        qid, flags = struct.unpack('!HH', msg[:4])
+        name, qtype, qend = parse_question(msg)
+        question = msg[12:qend]
+        if name.lower().strip('.') != self.origin:
+            yield self.refused(msg)
+            return
+        if qtype == T_AXFR:
+            records = self.axfr_records()
+        else:
+            # The authority section carries the SOA of the version the client has
+            pos = skip_name(msg, qend) + 10
+            pos = skip_name(msg, skip_name(msg, pos))
+            records = self.ixfr_records(struct.unpack('!I', msg[pos:pos + 4])[0])
+
+        batch = []
+        for owner, rtype, rdata in records:
+            batch.append(owner + struct.pack('!HHIH', rtype, 1, self.ttl, len(rdata)) + rdata)
+            if len(batch) == XFR_RECORDS_PER_MESSAGE:
+                yield struct.pack('!HHHHHH', qid, 0x8400, 1, len(batch), 0, 0) + question + b''.join(batch)
+                batch = []
+        if batch:
+            yield struct.pack('!HHHHHH', qid, 0x8400, 1, len(batch), 0, 0) + question + b''.join(batch)
+
+    def answer(self, msg: bytes) -> bytes:
+        qid, flags = struct.unpack('!HH', msg[:4])
+        name, qtype, qend = parse_question(msg)
+        question = msg[12:qend]
+        rd = flags & 0x0100
+
+        n = self.host_index(name)
+        answers = []
+        authority = []
+        rcode = 0
+        if n is not None and qtype in (T_A, T_AAAA, T_MX):
+            answers.append(rr(b'\xc0\x0c', qtype, self.ttl, self.host_rdata(n, qtype)))
+        elif n is None and name.lower() != self.origin:
+            rcode = 3
+            authority.append(rr(encode_name(self.origin), T_SOA, self.ttl, self.soa_rdata()))
+
+        header = struct.pack('!HHHHHH', qid, 0x8400 | rd | 0x80 | rcode, 1,
+                             len(answers), len(authority), 0)
+        return header + question + b''.join(answers) + b''.join(authority)
+
+    def refused(self, msg: bytes) -> bytes:
+        qid, flags = struct.unpack('!HH', msg[:4])
+        _, _, qend = parse_question(msg)
+        return struct.pack('!HHHHHH', qid, 0x8000 | (flags & 0x0100) | 5, 1, 0, 0, 0) + msg[12:qend]
+
+
+# DNSSEC signing (RFC 4034) with RSA/SHA-256 (RFC 5702), ECDSA P-256 (RFC 6605)
+# and Ed25519 (RFC 8080)
+
+def key_tag(rdata: bytes) -> int:
+    ac = 0
+    for i, b in enumerate(rdata):
+        ac += b if i & 1 else b << 8
+    return (ac + (ac >> 16)) & 0xFFFF
+
+
+def is_prime(n: int, rng: random.Random) -> bool:
+    for p in (2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37):
+        if n % p == 0:
+            return n == p
+    d, r = n - 1, 0
+    while d % 2 == 0:
+        d, r = d // 2, r + 1
+    for _ in range(32): # Miller-Rabin
+        x = pow(rng.randrange(2, n - 1), d, n)
+        if x in (1, n - 1):
+            continue
+        for _ in range(r - 1):
+            x = x * x % n
+            if x == n - 1:
+                break
+        else:
+            return False
+    return True
+
+
+class RsaKey:
+    alg = 8
+
+    def __init__(self, bits: int, rng: random.Random):
+        self.e = 65537
+        while True:
+            p, q = (self.prime(bits // 2, rng) for _ in range(2))
+            if p != q and (p - 1) % self.e and (q - 1) % self.e:
+                break
+        self.n = p * q
+        d = pow(self.e, -1, (p - 1) * (q - 1))
+        self.p, self.q, self.dp, self.dq, self.qinv = p, q, d % (p - 1), d % (q - 1), pow(q, -1, p)
+        self.size = (self.n.bit_length() + 7) // 8
+
+    @staticmethod
+    def prime(bits: int, rng: random.Random) -> int:
+        while True:
+            n = rng.getrandbits(bits) | (3 << (bits - 2)) | 1
+            if is_prime(n, rng):
+                return n
+
+    def public(self) -> bytes:
+        return bytes([3]) + self.e.to_bytes(3, 'big') + self.n.to_bytes(self.size, 'big')
+
+    def sign(self, data: bytes) -> bytes:
+        # PKCS #1 v1.5 with the DigestInfo of SHA-256
+        t = bytes.fromhex('3031300d060960864801650304020105000420') + hashlib.sha256(data).digest()
+        m = int.from_bytes(b'\x00\x01' + b'\xff' * (self.size - len(t) - 3) + b'\x00' + t, 'big')
+        s1, s2 = pow(m, self.dp, self.p), pow(m, self.dq, self.q)
+        return (s2 + (self.qinv * (s1 - s2) % self.p) * self.q).to_bytes(self.size, 'big')
+
+
+P256_P = 2**256 - 2**224 + 2**192 + 2**96 - 1
+P256_N = 0xffffffff00000000ffffffffffffffffbce6faada7179e84f3b9cac2fc632551
+P256_G = (0x6b17d1f2e12c4247f8bce6e563a440f277037d812deb33a0f4a13945d898c296,
+          0x4fe342e2fe1a7f9b8ee7eb4a7c0f9e162bce33576b315ececbb6406837bf51f5)
+
+
+def p256_double(a):
+    x, y, z = a
+    if z == 0 or y == 0:
+        return (0, 1, 0)
+    p = P256_P
+    yy = y * y % p
+    s = 4 * x * yy % p
+    zz = z * z % p
+    m = 3 * (x - zz) * (x + zz) % p # a = -3
+    x3 = (m * m - 2 * s) % p
+    return (x3, (m * (s - x3) - 8 * yy * yy) % p, 2 * y * z % p)
+
+
+def p256_add(a, b):
+    if a[2] == 0:
+        return b
+    if b[2] == 0:
+        return a
+    p = P256_P
+    (x1, y1, z1), (x2, y2, z2) = a, b
+    z1z1, z2z2 = z1 * z1 % p, z2 * z2 % p
+    u1, u2 = x1 * z2z2 % p, x2 * z1z1 % p
+    s1, s2 = y1 * z2 * z2z2 % p, y2 * z1 * z1z1 % p
+    if u1 == u2:
+        return p256_double(a) if s1 == s2 else (0, 1, 0)
+    h, r = (u2 - u1) % p, (s2 - s1) % p
+    hh = h * h % p
+    hhh, v = h * hh % p, u1 * hh % p
+    x3 = (r * r - hhh - 2 * v) % p
+    return (x3, (r * (v - x3) - s1 * hhh) % p, h * z1 * z2 % p)
+
+
+def p256_mul(k: int, point):
+    r, q = (0, 1, 0), (point[0], point[1], 1)
+    while k:
+        if k & 1:
+            r = p256_add(r, q)
+        q = p256_double(q)
+        k >>= 1
+    zi = pow(r[2], -1, P256_P)
+    return (r[0] * zi * zi % P256_P, r[1] * zi * zi * zi % P256_P)
+
+
+class EcdsaKey:
+    alg = 13
+
+    def __init__(self, rng: random.Random):
+        self.d = rng.randrange(1, P256_N)
+        self.q = p256_mul(self.d, P256_G)
+
+    def public(self) -> bytes:
+        return self.q[0].to_bytes(32, 'big') + self.q[1].to_bytes(32, 'big')
+
+    def sign(self, data: bytes) -> bytes:
+        h = int.from_bytes(hashlib.sha256(data).digest(), 'big')
+        while True:
+            k = secrets.randbelow(P256_N - 1) + 1
+            r = p256_mul(k, P256_G)[0] % P256_N
+            s = pow(k, -1, P256_N) * (h + r * self.d) % P256_N
+            if r and s:
+                return r.to_bytes(32, 'big') + s.to_bytes(32, 'big')
+
+
+ED_P = 2**255 - 19
+ED_L = 2**252 + 27742317777372353535851937790883648493
+ED_D = -121665 * pow(121666, -1, ED_P) % ED_P
+
+
+def ed_add(a, b):
+    p = ED_P
+    (x1, y1, z1, t1), (x2, y2, z2, t2) = a, b
+    aa, bb = (y1 - x1) * (y2 - x2) % p, (y1 + x1) * (y2 + x2) % p
+    cc, dd = t1 * 2 * ED_D * t2 % p, z1 * 2 * z2 % p
+    e, f, g, h = bb - aa, dd - cc, dd + cc, bb + aa
+    return (e * f % p, g * h % p, f * g % p, e * h % p)
+
+
+def ed_mul(k: int, point):
+    r = (0, 1, 1, 0)
+    while k:
+        if k & 1:
+            r = ed_add(r, point)
+        point = ed_add(point, point)
+        k >>= 1
+    return r
+
+
+def ed_encode(point) -> bytes:
+    zi = pow(point[2], -1, ED_P)
+    x, y = point[0] * zi % ED_P, point[1] * zi % ED_P
+    return (y | (x & 1) << 255).to_bytes(32, 'little')
+
+
+def ed_base():
+    y = 4 * pow(5, -1, ED_P) % ED_P
+    x2 = (y * y - 1) * pow(ED_D * y * y + 1, -1, ED_P) % ED_P
+    x = pow(x2, (ED_P + 3) // 8, ED_P)
+    if (x * x - x2) % ED_P:
+        x = x * pow(2, (ED_P - 1) // 4, ED_P) % ED_P
+    if x & 1:
+        x = ED_P - x
+    return (x, y, 1, x * y % ED_P)
+
+
+class Ed25519Key:
+    alg = 15
+
+    def __init__(self, rng: random.Random):
+        h = hashlib.sha512(rng.getrandbits(256).to_bytes(32, 'big')).digest()
+        self.a = (int.from_bytes(h[:32], 'little') & ((1 << 254) - 8)) | (1 << 254)
+        self.prefix = h[32:]
+        self.pub = ed_encode(ed_mul(self.a, ed_base()))
+
+    def public(self) -> bytes:
+        return self.pub
+
+    def sign(self, data: bytes) -> bytes:
+        r = int.from_bytes(hashlib.sha512(self.prefix + data).digest(), 'little') % ED_L
+        big_r = ed_encode(ed_mul(r, ed_base()))
+        k = int.from_bytes(hashlib.sha512(big_r + self.pub + data).digest(), 'little') % ED_L
+        return big_r + ((r + k * self.a) % ED_L).to_bytes(32, 'little')
+
+
+class SignedZone:
+    """Zone with its records in a dict, or generated like Zone for the hosts"""
+    def __init__(self, origin: str, key, ttl: int, records=None, hosts: Zone = None,
+                 corrupt: bool = False, expired: bool = False, nsec3: bool = False, standby_keys: int = 0):
+        self.origin = origin
+        self.nsec3 = nsec3
+        self.unproven = set() # Names answered without the NSEC records
+        self.key = key
+        self.ttl = ttl
+        self.hosts = hosts
+        self.corrupt = corrupt
+        now = int(time.time())
+        self.inception, self.expiration = (now - 30 * 86400, now - 10 * 86400) if expired else \
+            (now - 3600, now + 30 * 86400)
+        self.sigs = {}
+
+        apex = {T_SOA: [encode_name('ns.' + origin) + encode_name('admin.' + origin) +
+                        struct.pack('!IIIII', DEFAULT_SERIAL, 3600, 600, 86400, ttl)],
+                T_NS: [encode_name('ns.' + origin)]}
+        if key is not None:
+            apex[T_DNSKEY] = [self.dnskey()]
+            # Zone keys that sign nothing, RSA/SHA-256 with 2048 bit moduli
+            apex[T_DNSKEY] += [struct.pack('!HBB', 256, 3, 8) + b'\x03\x01\x00\x01' +
+                               hashlib.sha512(origin.encode() + bytes([i])).digest() * 4 for i in range(standby_keys)]
+        self.records = {origin: apex}
+        for owner, rtype, rdata in records or []:
+            self.records.setdefault(owner, {}).setdefault(rtype, []).append(rdata)
+
+    def dnskey(self) -> bytes:
+        return struct.pack('!HBB', 257, 3, self.key.alg) + self.key.public() # Key and zone signing key
+
+    def ds(self, digest_type: int = 2) -> bytes:
+        rdata = self.dnskey()
+        digest = (hashlib.sha256 if digest_type == 2 else hashlib.sha384)(encode_name(self.origin) + rdata)
+        return struct.pack('!HBB', key_tag(rdata), self.key.alg, digest_type) + digest.digest()
+
+    def node(self, name: str):
+        """Types of the name as (owner to sign, records), None if the name does not exist"""
+        if name in self.records:
+            return name, self.records[name]
+        if self.hosts is not None and self.hosts.host_index(name) is not None:
+            n = self.hosts.host_index(name)
+            return name, {t: [self.hosts.host_rdata(n, t)] for t in (T_A, T_AAAA, T_MX)}
+        if any(owner.endswith('.' + name) or (name == '' and owner) for owner in self.records):
+            return name, {} # Empty non-terminal
+        wildcard = '*.' + name.split('.', 1)[1] if '.' in name else None
+        if wildcard in self.records: # Synthesized from the wildcard (RFC 4592)
+            return wildcard, self.records[wildcard]
+        return None
+
+    def rrsig(self, owner: str, rtype: int, rdatas) -> bytes:
+        if (owner, rtype) in self.sigs:
+            return self.sigs[owner, rtype]
+        labels = len([l for l in owner.split('.') if l and l != '*'])
+        rdata = struct.pack('!HBBIIIH', rtype, self.key.alg, labels, self.ttl, self.expiration, self.inception,
+                            key_tag(self.dnskey())) + encode_name(self.origin)
+        wire = sorted(rdatas)
+        data = rdata + b''.join(encode_name(owner) + struct.pack('!HHIH', rtype, 1, self.ttl, len(r)) + r
+                                for r in wire)
+        sig = self.key.sign(data)
+        if self.corrupt and owner != self.origin:
+            sig = sig[:-1] + bytes([sig[-1] ^ 1])
+        self.sigs[owner, rtype] = rdata + sig
+        return rdata + sig
+
+    def nsec3_record(self, name: str, types, cover: bool = False):
+        """NSEC3 matching the name, or an opt-out one covering it"""
+        h = nsec3_hash(name)
+        owner_hash, next_hash = ((h - 1) % 2**160, (h + 1) % 2**160) if cover else (h, (h + 1) % 2**160)
+        owner = base64.b32hexencode(owner_hash.to_bytes(20, 'big')).decode().lower() + '.' + self.origin
+        rdata = struct.pack('!BBHB', 1, 1 if cover else 0, NSEC3_ITERATIONS, len(NSEC3_SALT)) + NSEC3_SALT + \
+            bytes([20]) + next_hash.to_bytes(20, 'big') + type_bitmap(types)
+        return owner, owner, T_NSEC3, [rdata]
+
+    def denial(self, name: str, types) -> list:
+        """Sets proving that the name has no other types than these"""
+        if not self.nsec3:
+            later = [o for o in self.records if canonical_key(o) > canonical_key(name)]
+            next_name = min(later, key=canonical_key) if later else self.origin
+            return [(name, name, T_NSEC, [encode_name(next_name) + type_bitmap(set(types) | {T_RRSIG, T_NSEC})])]
+        if T_NS in types and T_DS not in types and name != self.origin:
+            # Opted out, the apex is the closest encloser and the name is covered
+            return [self.nsec3_record(self.origin, set(self.records[self.origin]) | {T_RRSIG}),
+                    self.nsec3_record(name, (), cover=True)]
+        return [self.nsec3_record(name, set(types) | {T_RRSIG} if types else set())]
+
+    def lookup(self, name: str, qtype: int, dnssec_ok: bool):
+        """rcode, answer and authority records"""
+        found = self.node(name)
+        sets = []
+        if found is not None and qtype in found[1]:
+            rcode, section = 0, 0
+            sets.append((name, found[0], qtype, found[1][qtype]))
+        else:
+            rcode, section = (0 if found is not None else 3), 1
+            sets.append((self.origin, self.origin, T_SOA, self.records[self.origin][T_SOA]))
+            if found is not None and found[0] == name and dnssec_ok and self.key is not None and \
+                    name not in self.unproven:
+                sets += self.denial(name, found[1])
+
+        answer, authority = [], []
+        for owner, signed_owner, rtype, rdatas in sets:
+            out = answer if section == 0 else authority
+            out += [rr(encode_name(owner), rtype, self.ttl, r) for r in rdatas]
+            if dnssec_ok and self.key is not None:
+                out.append(rr(encode_name(owner), T_RRSIG, self.ttl, self.rrsig(signed_owner, rtype, rdatas)))
+        return rcode, answer, authority
+
+
+class SignedTree:
+    """Root with signed and unsigned zones below it, each its own authority"""
+    def __init__(self, size: int, ttl: int):
+        rng = random.Random(53) # Same keys every run
+        a = lambda *octets: bytes(octets)
+        self.root = SignedZone('', RsaKey(2048, rng), ttl)
+        big = [('big.' + DEFAULT_ZONE, T_TXT, bytes([200]) + bytes([ord('a') + i]) * 200) for i in range(8)]
+        example = SignedZone(DEFAULT_ZONE, EcdsaKey(rng), ttl,
+                             [('*.wild.' + DEFAULT_ZONE, T_A, a(192, 0, 2, 99))] + big,
+                             hosts=Zone(DEFAULT_ZONE, size, ttl))
+        ed = SignedZone('ed.test', Ed25519Key(rng), ttl, [('www.ed.test', T_A, a(192, 0, 2, 15))])
+        bogus = SignedZone('bogus.test', EcdsaKey(rng), ttl, [('www.bogus.test', T_A, a(192, 0, 2, 66))],
+                           corrupt=True)
+        expired = SignedZone('expired.test', EcdsaKey(rng), ttl, [('www.expired.test', T_A, a(192, 0, 2, 77))],
+                             expired=True)
+        insecure = SignedZone('insecure.test', None, ttl, [('www.insecure.test', T_A, a(192, 0, 2, 80))])
+        unproven = SignedZone('unproven.test', None, ttl, [('www.unproven.test', T_A, a(192, 0, 2, 83))])
+        nsec3 = SignedZone('nsec3.test', EcdsaKey(rng), ttl, [('www.nsec3.test', T_A, a(192, 0, 2, 82))], nsec3=True,
+                           standby_keys=4)
+        optout = SignedZone('optout.nsec3.test', None, ttl, [('www.optout.nsec3.test', T_A, a(192, 0, 2, 81))])
+
+        # Children before their parents, the first zone a name is in answers it
+        self.zones = [example, ed, bogus, expired, insecure, unproven, optout, nsec3]
+        for child in self.zones:
+            parent = self.parent(child)
+            delegation = parent.records.setdefault(child.origin, {})
+            delegation[T_NS] = [encode_name('ns.' + child.origin)]
+            if child.key is not None:
+                delegation[T_DS] = [child.ds(4 if child is ed else 2)]
+        self.root.unproven.add(unproven.origin)
+        self.zones.append(self.root)
+
+    def parent(self, child: SignedZone) -> SignedZone:
+        return next((zone for zone in self.zones if child.origin.endswith('.' + zone.origin)), self.root)
+
+    def anchor(self) -> str:
+        ds = self.root.ds()
+        tag, alg, digest_type = struct.unpack('!HBB', ds[:4])
+        return f". IN DS {tag} {alg} {digest_type} {ds[4:].hex().upper()}\n"
+
+    def zone_for(self, name: str, qtype: int) -> SignedZone:
+        for zone in self.zones:
+            if zone is self.root or name == zone.origin or name.endswith('.' + zone.origin):
+                if qtype == T_DS and name == zone.origin: # Answered by the parent
+                    return self.parent(zone)
+                return zone
+
+    def answer(self, msg: bytes) -> bytes:
+        qid, flags = struct.unpack('!HH', msg[:4])
+        name, qtype, qend = parse_question(msg)
+        opt = msg[qend:qend + 11] if struct.unpack('!H', msg[10:12])[0] else b''
+        dnssec_ok = len(opt) == 11 and struct.unpack('!I', opt[5:9])[0] & 0x8000 != 0
+
+        name = name.lower().strip('.')
+        rcode, answer, authority = self.zone_for(name, qtype).lookup(name, qtype, dnssec_ok)
+        additional = [b'\0' + struct.pack('!HHIH', T_OPT, 1232, 0x8000 if dnssec_ok else 0, 0)] if opt else []
+        header = struct.pack('!HHHHHH', qid, 0x8400 | (flags & 0x0100) | rcode, 1,
+                             len(answer), len(authority), len(additional))
+        return header + msg[12:qend] + b''.join(answer + authority + additional)
+
+    refused = Zone.refused
+
+    def transfer(self, msg: bytes):
+        yield self.refused(msg) # Not for the signed tree
+
+
+class RateLimit:
+    """Token bucket of answers per second, like response rate limiting of real servers"""
+    def __init__(self, rate: int):
+        self.rate = rate
+        self.burst = max(1, rate // 20)
+        self.tokens = self.burst
+        self.last = time.monotonic()
+
+    def allow(self) -> bool:
+        if self.rate == 0:
+            return True
+        now = time.monotonic()
+        self.tokens = min(self.burst, self.tokens + (now - self.last) * self.rate)
+        self.last = now
+        if self.tokens < 1:
+            return False
+        self.tokens -= 1
+        return True
+
+
+class Forger:
+    """Sends forged datagrams ahead of an answer, none of them matches the query:
+    another ID, the answer from another address and from another port, and the
+    answer to another question"""
+    def __init__(self, port: int):
+        self.other_port = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.other_port.bind(('127.0.0.1', 0))
+        self.other_addr = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.other_addr.bind(('127.0.0.2', port))
+
+    def send(self, sock, zone: Zone, msg: bytes, reply: bytes, addr):
+        qid, = struct.unpack('!H', reply[:2])
+        sock.sendto(struct.pack('!H', qid ^ 0x8000) + reply[2:], addr)
+        self.other_addr.sendto(reply, addr)
+        self.other_port.sendto(reply, addr)
+        # The first letter of the name changed
+        other = bytearray(msg)
+        other[13] = ord('x') if other[13] != ord('x') else ord('y')
+        sock.sendto(zone.answer(bytes(other)), addr)
+
+
+def serve_udp(zone: Zone, port: int, drop: float, limit: RateLimit, limit_drop: bool, delay: float, log: bool,
+              forger: Forger):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 << 20)
+    sock.bind(('127.0.0.1', port))
+    delayed = [] # (due, seq, reply, addr), the answers of a distant server
+    seq = 0
+    while True:
+        now = time.monotonic()
+        while delayed and delayed[0][0] <= now:
+            _, _, reply, addr = heapq.heappop(delayed)
+            sock.sendto(reply, addr)
+        sock.settimeout(delayed[0][0] - now if delayed else None)
+        try:
+            msg, addr = sock.recvfrom(65535)
+        except socket.timeout:
+            continue
+        if random.random() < drop: # Lost on the way
+            continue
+        try:
+            if log: # Lets a test count the queries
+                name, qtype, _ = parse_question(msg)
+                print(name, qtype, flush=True)
+            if limit.allow():
+                reply = zone.answer(msg)
+            elif not limit_drop:
+                reply = zone.refused(msg)
+            else:
+                continue
+            reply = truncate(msg, reply)
+            if forger is not None:
+                forger.send(sock, zone, msg, reply, addr)
+        except (IndexError, struct.error):
+            continue
+        if delay > 0:
+            seq += 1
+            heapq.heappush(delayed, (time.monotonic() + delay, seq, reply, addr))
+        else:
+            sock.sendto(reply, addr)
+
+
+def make_stream_handler(zone: Zone, max_per_conn: int):
+    class Handler(socketserver.BaseRequestHandler):
+        def recv_exact(self, n):
+            data = b''
+            while len(data) < n:
+                chunk = self.request.recv(n - len(data))
+                if not chunk:
+                    return None
+                data += chunk
+            return data
+
+        def handle(self):
+            # Queries on one connection are pipelined (RFC 7766), like real
+            # servers it may close the connection after a number of them
+            answered = 0
+            while max_per_conn == 0 or answered < max_per_conn:
+                prefix = self.recv_exact(2)
+                if prefix is None:
+                    return
+                msg = self.recv_exact(struct.unpack('!H', prefix)[0])
+                if msg is None:
+                    return
+                if len(msg) > 12 and parse_question(msg)[1] in (T_AXFR, T_IXFR):
+                    try:
+                        for reply in zone.transfer(msg):
+                            self.request.sendall(struct.pack('!H', len(reply)) + reply)
+                    except ConnectionError: # The client gave up on the transfer
+                        return
+                else:
+                    reply = zone.answer(msg)
+                    self.request.sendall(struct.pack('!H', len(reply)) + reply)
+                answered += 1
+    return Handler
+
+
+class TlsServer(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, addr, handler, context):
+        self.context = context
+        super().__init__(addr, handler)
+
+    def get_request(self):
+        sock, addr = super().get_request()
+        sock.settimeout(5)
+        try:
+            return self.context.wrap_socket(sock, server_side=True), addr
+        except (ssl.SSLError, OSError):
+            sock.close()
+            raise
+
+
+class TcpServer(socketserver.ThreadingTCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("--port", type=int, default=5353, help="UDP and TCP port")
+    parser.add_argument("--tls-port", type=int, help="DNS over TLS port")
+    parser.add_argument("--cert", help="TLS certificate (PEM)")
+    parser.add_argument("--key", help="TLS private key (PEM)")
+    parser.add_argument("--zone", default=DEFAULT_ZONE)
+    parser.add_argument("--size", type=int, default=1000, help="number of hosts in the zone")
+    parser.add_argument("--ttl", type=int, default=DEFAULT_TTL)
+    parser.add_argument("--serial", type=int, default=DEFAULT_SERIAL, help="current version of the zone")
+    parser.add_argument("--max-per-conn", type=int, default=0,
+                        help="close stream connections after this many answers (0 = never)")
+    parser.add_argument("--drop", type=float, default=0.0, help="fraction of UDP queries left unanswered")
+    parser.add_argument("--rate", type=int, default=0,
+                        help="UDP answers per second, the rest is REFUSED (0 = no limit)")
+    parser.add_argument("--rate-drop", action='store_true', help="leave queries over --rate unanswered instead")
+    parser.add_argument("--delay", type=float, default=0.0, help="UDP answers are sent this many ms later")
+    parser.add_argument("--dnssec-anchor", help="serve the signed tree, write the DS of its root here")
+    parser.add_argument("--log", action='store_true', help="print the name and type of every UDP query")
+    parser.add_argument("--forge", action='store_true', help="send forged answers ahead of every UDP answer")
+    args = parser.parse_args()
+
+    zone = Zone(args.zone, args.size, args.ttl, args.serial)
+    if args.dnssec_anchor:
+        zone = SignedTree(args.size, args.ttl)
+        with open(args.dnssec_anchor, 'w') as f:
+            f.write(zone.anchor())
+    handler = make_stream_handler(zone, args.max_per_conn)
+
+    servers = [TcpServer(('127.0.0.1', args.port), handler)]
+    if args.tls_port:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(args.cert, args.key)
+        servers.append(TlsServer(('127.0.0.1', args.tls_port), handler, context))
+
+    for server in servers:
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+    print("ready", flush=True)
+    serve_udp(zone, args.port, args.drop, RateLimit(args.rate), args.rate_drop, args.delay / 1000, args.log,
+              Forger(args.port) if args.forge else None)
+
+
+if __name__ == "__main__":
+    main()
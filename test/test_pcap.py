@@ -0,0 +1,287 @@
+"""
+@author Vadim Goncearenco (xgonce00)
+
+Writes the same generated DNS traffic as classic pcap (both byte orders and
+timestamp resolutions) and pcapng captures with different link layers and
+checks the offline analysis (--pcap) finds the same messages, statistics
+and latencies in all of them, with one thread and with several.
+"""
+
+import argparse
+import hashlib
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+
+DNS_PROGRAM_NAME = './dns'
+ZONE = 'example.test'
+BASE_TS_NS = 1700000000 * 10**9
+QUERY_INTERVAL_NS = 1000000
+LATENCY_NS = 500000
+SUBPROCESS_TIMEOUT = 300
+
+T_A = 1
+T_AAAA = 28
+
+LINK_ETHERNET = 1
+LINK_RAW = 101
+LINK_LINUX_SLL = 113
+
+
+class bcolors:
+    OKGREEN = '\033[92m'
+    FAIL = '\033[91m'
+    ENDC = '\033[0m'
+
+
+class Tester:
+    def __init__(self):
+        self.passed = 0
+        self.failed = 0
+
+    def check(self, name: str, ok: bool, detail: str = ''):
+        if ok:
+            self.passed += 1
+            print(f"{bcolors.OKGREEN}PASSED{bcolors.ENDC} {name}")
+        else:
+            self.failed += 1
+            print(f"{bcolors.FAIL}FAILED{bcolors.ENDC} {name} {detail}")
+
+
+def encode_name(name: str) -> bytes:
+    out = b''
+    for label in name.split('.'):
+        out += bytes([len(label)]) + label.encode()
+    return out + b'\0'
+
+
+def ipv4(src: bytes, dst: bytes, proto: int, payload: bytes) -> bytes:
+    return struct.pack('!BBHHHBBH4s4s', 0x45, 0, 20 + len(payload), 0, 0x4000, 64, proto, 0, src, dst) + payload
+
+
+def ipv6(src: bytes, dst: bytes, proto: int, payload: bytes) -> bytes:
+    return struct.pack('!IHBB16s16s', 6 << 28, len(payload), proto, 64, src, dst) + payload
+
+
+def udp(sport: int, dport: int, payload: bytes) -> bytes:
+    return struct.pack('!HHHH', sport, dport, 8 + len(payload), 0) + payload
+
+
+def tcp(sport: int, dport: int, payload: bytes) -> bytes:
+    return struct.pack('!HHIIBBHHH', sport, dport, 1, 1, 5 << 4, 0x18, 65535, 0, 0) + \
+        struct.pack('!H', len(payload)) + payload
+
+
+class Traffic:
+    """Query i asks for host(i % 1000) from one of a few clients. Every 100th
+    query is left unanswered, every 10th is answered NXDOMAIN, every 7th pair
+    goes over IPv6, every 13th over TCP and every 50th frame is not IP."""
+    def __init__(self, n: int):
+        self.n = n
+
+    def message(self, i: int, response: bool) -> bytes:
+        qtype = T_AAAA if i % 4 == 0 else T_A
+        question = encode_name(f'host{i % 1000}.{ZONE}') + struct.pack('!HH', qtype, 1)
+        if not response:
+            return struct.pack('!HHHHHH', i & 0xFFFF, 0x0100, 1, 0, 0, 0) + question
+        if i % 10 == 0:
+            return struct.pack('!HHHHHH', i & 0xFFFF, 0x8183, 1, 0, 0, 0) + question
+        rdata = bytes([10, 0, (i >> 8) & 0xFF, i & 0xFF]) if qtype == T_A else bytes(12) + struct.pack('!I', i)
+        answer = b'\xc0\x0c' + struct.pack('!HHIH', qtype, 1, 300, len(rdata)) + rdata
+        return struct.pack('!HHHHHH', i & 0xFFFF, 0x8180, 1, 1, 0, 0) + question + answer
+
+    def ip_packet(self, i: int, response: bool):
+        """IP packet of the query or the response and its ethertype"""
+        msg = self.message(i, response)
+        client_port = 10000 + i % 50000
+        sport, dport = (53, client_port) if response else (client_port, 53)
+        l4 = tcp(sport, dport, msg) if i % 13 == 0 else udp(sport, dport, msg)
+        proto = 6 if i % 13 == 0 else 17
+        if i % 7 == 0:
+            client = bytes.fromhex('fd000000000000000000000000000000')[:15] + bytes([i % 5 + 1])
+            server = bytes.fromhex('fd000000000000000000000000000053')
+            src, dst = (server, client) if response else (client, server)
+            return ipv6(src, dst, proto, l4), 0x86DD
+        client = bytes([10, 1, 0, i % 5 + 1])
+        server = bytes([10, 0, 0, 53])
+        src, dst = (server, client) if response else (client, server)
+        return ipv4(src, dst, proto, l4), 0x0800
+
+    def packets(self):
+        """(timestamp ns, IP packet or None for an ARP frame, ethertype) in the capture order"""
+        frames = 0
+        for i in range(self.n):
+            ts = BASE_TS_NS + i * QUERY_INTERVAL_NS
+            yield (ts,) + self.ip_packet(i, False)
+            frames += 1
+            if i % 100 != 99:
+                yield (ts + LATENCY_NS,) + self.ip_packet(i, True)
+                frames += 1
+            if frames % 50 == 0:
+                yield ts + LATENCY_NS, None, 0x0806
+
+    def expected(self):
+        answered = self.n - (self.n + 1) // 100
+        return {
+            'queries': self.n,
+            'responses': answered,
+            'unanswered': self.n - answered,
+            'nxdomain': (self.n + 9) // 10,
+        }
+
+
+def link_frame(link: int, packet, ethertype: int) -> bytes:
+    if packet is None:
+        packet = bytes(28) # ARP
+    if link == LINK_ETHERNET:
+        return b'\x02\x00\x00\x00\x00\x01\x02\x00\x00\x00\x00\x02' + struct.pack('!H', ethertype) + packet
+    if link == LINK_LINUX_SLL:
+        return struct.pack('!HHH8sH', 0, 1, 6, b'\x02\x00\x00\x00\x00\x01\x00\x00', ethertype) + packet
+    return packet if ethertype != 0x0806 else b'\x00' * 20 # Raw IP has no other protocols, a bogus packet
+
+
+def write_pcap(path: str, traffic: Traffic, link: int, big_endian: bool, nano: bool):
+    e = '>' if big_endian else '<'
+    with open(path, 'wb') as f:
+        f.write(struct.pack(e + 'IHHiIII', 0xA1B23C4D if nano else 0xA1B2C3D4, 2, 4, 0, 0, 65535, link))
+        for ts, packet, ethertype in traffic.packets():
+            frame = link_frame(link, packet, ethertype)
+            frac = ts % 10**9 if nano else ts % 10**9 // 1000
+            f.write(struct.pack(e + 'IIII', ts // 10**9, frac, len(frame), len(frame)) + frame)
+
+
+def pcapng_block(btype: int, body: bytes) -> bytes:
+    body += bytes(-len(body) % 4)
+    return struct.pack('<II', btype, 12 + len(body)) + body + struct.pack('<I', 12 + len(body))
+
+
+def write_pcapng(path: str, traffic: Traffic):
+    """Two interfaces, Ethernet with microseconds and Linux cooked with nanoseconds"""
+    with open(path, 'wb') as f:
+        f.write(pcapng_block(0x0A0D0D0A, struct.pack('<IHHq', 0x1A2B3C4D, 1, 0, -1)))
+        f.write(pcapng_block(1, struct.pack('<HHI', LINK_ETHERNET, 0, 65535)))
+        f.write(pcapng_block(1, struct.pack('<HHI', LINK_LINUX_SLL, 0, 65535) +
+                             struct.pack('<HHB3x', 9, 1, 9) + struct.pack('<HH', 0, 0)))
+        for n, (ts, packet, ethertype) in enumerate(traffic.packets()):
+            iface = n % 2
+            link = LINK_ETHERNET if iface == 0 else LINK_LINUX_SLL
+            frame = link_frame(link, packet, ethertype)
+            units = ts // 1000 if iface == 0 else ts
+            f.write(pcapng_block(6, struct.pack('<IIIII', iface, units >> 32, units & 0xFFFFFFFF,
+                                                len(frame), len(frame)) + frame))
+
+
+def run_dns(args):
+    return subprocess.run([DNS_PROGRAM_NAME] + args, capture_output=True, text=True, timeout=SUBPROCESS_TIMEOUT)
+
+
+def parse_stats(out: str):
+    stats = {}
+    m = re.search(r'Queries: (\d+), responses: (\d+)', out)
+    if m:
+        stats['queries'], stats['responses'] = int(m.group(1)), int(m.group(2))
+    m = re.search(r'Latency: (\d+) matched, (\d+) unanswered queries, (\d+) responses without', out)
+    if m:
+        stats['matched'], stats['unanswered'] = int(m.group(1)), int(m.group(2))
+        stats['orphans'] = int(m.group(3))
+    m = re.search(r'NXDOMAIN\s+(\d+)', out)
+    if m:
+        stats['nxdomain'] = int(m.group(1))
+    m = re.search(r'mean ([\d.]+) ms', out)
+    if m:
+        stats['mean_ms'] = float(m.group(1))
+    m = re.search(r'Skipped: (\d+) other frames, (\d+) partial TCP segments, (\d+) malformed', out)
+    if m:
+        stats['skipped'], stats['partial'], stats['malformed'] = (int(g) for g in m.groups())
+    return stats
+
+
+def check_stats(t: Tester, name: str, res, traffic: Traffic):
+    stats = parse_stats(res.stdout)
+    exp = traffic.expected()
+    ok = (res.returncode == 0 and stats.get('queries') == exp['queries'] and
+          stats.get('responses') == exp['responses'] and stats.get('matched') == exp['responses'] and
+          stats.get('unanswered') == exp['unanswered'] and stats.get('orphans') == 0 and
+          stats.get('nxdomain') == exp['nxdomain'] and stats.get('malformed') == 0 and
+          stats.get('partial') == 0 and abs(stats.get('mean_ms', 0) - LATENCY_NS / 1e6) < 0.001)
+    t.check(name, ok, f"{stats} expected {exp}\n{res.stderr}")
+
+
+def file_md5(path: str) -> str:
+    h = hashlib.md5()
+    with open(path, 'rb') as f:
+        for block in iter(lambda: f.read(1 << 20), b''):
+            h.update(block)
+    return h.hexdigest()
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-n", "--queries", type=int, default=20000, help="queries in the small captures")
+    parser.add_argument("--large", type=int, default=700000,
+                        help="queries in the capture split into several regions")
+    args = parser.parse_args()
+
+    t = Tester()
+    with tempfile.TemporaryDirectory() as directory:
+        small = Traffic(args.queries)
+        captures = {
+            'pcap, Ethernet, microseconds': (os.path.join(directory, 'eth.pcap'),
+                                             lambda p: write_pcap(p, small, LINK_ETHERNET, False, False)),
+            'pcap, big endian, raw IP, nanoseconds': (os.path.join(directory, 'raw.pcap'),
+                                                      lambda p: write_pcap(p, small, LINK_RAW, True, True)),
+            'pcap, Linux cooked': (os.path.join(directory, 'sll.pcap'),
+                                   lambda p: write_pcap(p, small, LINK_LINUX_SLL, False, False)),
+            'pcapng, two interfaces': (os.path.join(directory, 'two.pcapng'), lambda p: write_pcapng(p, small)),
+        }
+        records = {}
+        for name, (path, write) in captures.items():
+            write(path)
+            check_stats(t, f"{name} statistics", run_dns(['--pcap', path]), small)
+            out = os.path.join(directory, 'records.txt')
+            res = run_dns(['--pcap', path, '--records', '-o', out])
+            records[name] = file_md5(out) if res.returncode == 0 else None
+        t.check("same records in every format", len(set(records.values())) == 1 and None not in records.values(),
+                str(records))
+
+        with open(out) as f:
+            head = [next(f) for _ in range(3)]
+        t.check("records of a query and its response",
+                head[0].startswith('1700000000.000000 fd00::1.10000 > fd00::53.53 tcp 0 query host0.' + ZONE + '. AAAA') and
+                ' response NXDOMAIN host0.' + ZONE + '. AAAA ' in head[1] and
+                head[2].startswith('1700000000.001000 10.1.0.2.10001 > 10.0.0.53.53 udp 1 query host1.'), ''.join(head))
+
+        res = run_dns(['--pcap', os.path.join(directory, 'missing.pcap')])
+        t.check("missing capture", res.returncode != 0 and 'missing.pcap' in res.stderr, res.stderr)
+        res = run_dns(['--pcap', path, '-s', '127.0.0.1', ZONE])
+        t.check("capture with a server refused", res.returncode != 0, res.stderr)
+
+        # Regions decoded by different threads, pairs across their boundaries still match
+        large = Traffic(args.large)
+        path = os.path.join(directory, 'large.pcap')
+        write_pcap(path, large, LINK_ETHERNET, False, False)
+        print(f"  large capture: {os.path.getsize(path) / 1e6:.0f} MB")
+        outputs = {}
+        for threads in (1, 4):
+            res = run_dns(['--pcap', path, '--threads', str(threads)])
+            check_stats(t, f"large capture, {threads} thread(s)", res, large)
+            outputs[threads] = res.stdout
+            print(f"  {res.stderr.strip()}")
+        t.check("same statistics with 1 and 4 threads", outputs[1] == outputs[4])
+
+        md5s = []
+        for threads in (1, 4):
+            out = os.path.join(directory, f'large{threads}.txt')
+            res = run_dns(['--pcap', path, '--records', '--threads', str(threads), '-o', out])
+            md5s.append(file_md5(out) if res.returncode == 0 else None)
+        t.check("same records in the same order with 1 and 4 threads", md5s[0] == md5s[1] and md5s[0] is not None)
+
+    print(f"\nPassed: {t.passed}, failed: {t.failed}")
+    sys.exit(1 if t.failed else 0)
+
+
+if __name__ == "__main__":
+    main()
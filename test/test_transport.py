@@ -0,0 +1,509 @@
+"""
+@author Vadim Goncearenco (xgonce00)
+
+Runs the dns program against the local responder over UDP, TCP and TLS,
+checks the answers are the same and measures the cost of one query.
+UDP and TCP are run with the poll() and the io_uring backend. DNSSEC
+validation is checked against the signed tree of the responder, change
+detection with --snapshot against a responder restarted with fewer hosts.
+"""
+
+import os
+import random
+import resource
+import subprocess
+import sys
+import tempfile
+import time
+import argparse
+
+DNS_PROGRAM_NAME = './dns'
+RESPONDER = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'responder.py')
+
+PORT = 5354
+LIMITED_PORT = 5355 # Distant server that rate limits
+SIGNED_PORT = 5356 # Signed tree for DNSSEC
+SNAPSHOT_PORT = 5357 # Zone that shrinks between the runs of a snapshot
+LOG_PORT = 5358 # Prints every query it gets
+FORGED_PORT = 5359 # Forged datagrams ahead of every answer
+TLS_PORT = 8853
+DEAD_SERVER = '127.0.0.2' # Nothing listens there
+ZONE = 'example.test'
+
+SUBPROCESS_TIMEOUT = 60
+
+
+class bcolors:
+    OKGREEN = '\033[92m'
+    FAIL = '\033[91m'
+    ENDC = '\033[0m'
+
+
+def make_certificate(directory: str):
+    """Self-signed certificate for 127.0.0.1 and localhost"""
+    cert = os.path.join(directory, 'cert.pem')
+    key = os.path.join(directory, 'key.pem')
+    subprocess.run(['openssl', 'req', '-x509', '-newkey', 'ec', '-pkeyopt', 'ec_paramgen_curve:P-256',
+                    '-nodes', '-keyout', key, '-out', cert, '-days', '1', '-subj', '/CN=localhost',
+                    '-addext', 'subjectAltName=IP:127.0.0.1,DNS:localhost'],
+                   check=True, capture_output=True)
+    return cert, key
+
+
+def start_responder(cert: str, key: str, size: int, max_per_conn: int):
+    proc = subprocess.Popen([sys.executable, RESPONDER, '--port', str(PORT), '--tls-port', str(TLS_PORT),
+                             '--cert', cert, '--key', key, '--size', str(size),
+                             '--max-per-conn', str(max_per_conn)],
+                            stdout=subprocess.PIPE, text=True)
+    proc.stdout.readline() # Wait until it listens
+    return proc
+
+
+def transport_args(transport: str, cert: str):
+    if transport == 'udp':
+        return [], PORT
+    if transport == 'tcp':
+        return ['--tcp'], PORT
+    return ['--tls', '--tls-ca', cert], TLS_PORT
+
+
+def run_dns(args, preexec_fn=None):
+    return subprocess.run([DNS_PROGRAM_NAME] + args, capture_output=True, text=True, timeout=SUBPROCESS_TIMEOUT,
+                          preexec_fn=preexec_fn)
+
+
+class Tester:
+    def __init__(self):
+        self.passed = 0
+        self.failed = 0
+
+    def check(self, name: str, ok: bool, detail: str = ''):
+        if ok:
+            self.passed += 1
+            print(f"{bcolors.OKGREEN}PASSED{bcolors.ENDC} {name}")
+        else:
+            self.failed += 1
+            print(f"{bcolors.FAIL}FAILED{bcolors.ENDC} {name} {detail}")
+
+
+def test_answers(t: Tester, cert: str, list_path: str):
+    outputs = {}
+    for transport in ('udp', 'tcp', 'tls'):
+        extra, port = transport_args(transport, cert)
+        res = run_dns(['-r'] + extra + ['-s', '127.0.0.1', 'host7.' + ZONE, '-p', str(port)])
+        t.check(f"{transport} single query", res.returncode == 0 and '10.0.0.7' in res.stdout, res.stderr)
+
+        res = run_dns(['-r'] + extra + ['-s', '127.0.0.1', '-f', list_path, '-p', str(port)])
+        outputs[transport] = res.stdout
+        t.check(f"{transport} domain list", res.returncode == 0 and res.stderr == '', res.stderr)
+
+    t.check("same answers over every transport", outputs['udp'] == outputs['tcp'] == outputs['tls'])
+
+    # An absolute name is the same name
+    res = run_dns(['-r', '-s', '127.0.0.1', f'host7.{ZONE}.', '-p', str(PORT)])
+    t.check("trailing dot name", res.returncode == 0 and '10.0.0.7' in res.stdout and
+            f'host7.{ZONE}., A, IN' in res.stdout, res.stdout + res.stderr)
+
+    # Only the root label may follow the last dot, the other lines are still answered
+    with tempfile.NamedTemporaryFile('w', suffix='.txt') as f:
+        f.write(f"host7.{ZONE}..\nhost8.{ZONE}.\nhost9.{ZONE} BOGUS\n")
+        f.flush()
+        res = run_dns(['-r', '-s', '127.0.0.1', '-f', f.name, '-p', str(PORT)])
+    t.check("domain list name with two trailing dots and unknown type", res.returncode == 1 and
+            f'Invalid query name host7.{ZONE}.. on line 1' in res.stderr and
+            f'Unknown record type for host9.{ZONE} on line 3' in res.stderr and 'Error' not in res.stdout and
+            '10.0.0.8' in res.stdout and '10.0.0.7' not in res.stdout, res.stdout + res.stderr)
+
+    for transport in ('udp', 'tcp'):
+        extra, port = transport_args(transport, cert)
+        res = run_dns(['-r', '--io-uring'] + extra + ['-s', '127.0.0.1', '-f', list_path, '-p', str(port)])
+        t.check(f"{transport} io_uring domain list", res.returncode == 0 and res.stdout == outputs[transport],
+                res.stderr)
+
+    res = run_dns(['-r', '--io-uring', '--tls', '-s', '127.0.0.1', 'host7.' + ZONE, '-p', str(TLS_PORT)])
+    t.check("io_uring refused with tls", res.returncode != 0 and '--io-uring' in res.stderr, res.stderr)
+
+    # All types of the name in one result, in the order they were asked for
+    for transport in ('udp', 'tcp', 'tls'):
+        extra, port = transport_args(transport, cert)
+        res = run_dns(['-r', '-q', 'MX,A,AAAA'] + extra + ['-s', '127.0.0.1', 'host7.' + ZONE, '-p', str(port)])
+        answers = [line.split(', ')[1] for line in res.stdout.splitlines() if line.startswith('  host7')][3:]
+        t.check(f"{transport} multiple types", res.returncode == 0 and answers == ['MX', 'A', 'AAAA'] and
+                '10 mail.' + ZONE + '.' in res.stdout, res.stdout + res.stderr)
+
+    # Without the certificate the server can not be trusted
+    res = run_dns(['-r', '--tls', '-s', '127.0.0.1', 'host7.' + ZONE, '-p', str(TLS_PORT)])
+    t.check("untrusted certificate refused", res.returncode != 0 and 'verification failed' in res.stderr, res.stderr)
+
+    # The certificate is issued for localhost, not for another name of the server
+    extra, port = transport_args('tls', cert)
+    res = run_dns(['-r'] + extra + ['-s', 'localhost', 'host7.' + ZONE, '-p', str(port)])
+    t.check("host name verified", res.returncode == 0 and '10.0.0.7' in res.stdout, res.stderr)
+
+
+def test_batch(t: Tester, directory: str):
+    # 300 names asked for A and MX in 6000 lines: every name in other spellings,
+    # with and without the trailing dot, the lines in a shuffled order
+    rng = random.Random(27)
+    lines = []
+    for i in range(6000):
+        n = rng.randrange(300)
+        name = rng.choice([f'host{n}.{ZONE}', f'HOST{n}.{ZONE}.', f'Host{n}.Example.Test'])
+        lines.append((name, rng.choice(['', ' MX'])))
+    list_path = os.path.join(directory, 'batch.txt')
+    with open(list_path, 'w') as f:
+        f.write(''.join(f'{name}{qtype}\n' for name, qtype in lines))
+    expected = [f"  {name.lower().rstrip('.')}., {qtype.strip() or 'A'}, IN" for name, qtype in lines]
+
+    proc = subprocess.Popen([sys.executable, RESPONDER, '--port', str(LOG_PORT), '--size', '300', '--log'],
+                            stdout=subprocess.PIPE, text=True)
+    proc.stdout.readline()
+    try:
+        whole = run_dns(['-s', '127.0.0.1', '-f', list_path, '-p', str(LOG_PORT)])
+        # The list is about 150 kB, 12 times that is over 1 MB: it is split into partitions
+        spilled = run_dns(['-s', '127.0.0.1', '-f', list_path, '-p', str(LOG_PORT), '--mem-limit', '1'])
+    finally:
+        proc.terminate()
+        proc.wait()
+    queries = proc.stdout.read().splitlines()
+
+    out = whole.stdout.splitlines()
+    questions = [out[i + 1] for i in range(len(out) - 1) if out[i] == 'Question section (1)']
+    t.check("domain list answered in the order of the lines", whole.returncode == 0 and questions == expected,
+            whole.stderr)
+    t.check("domain list split under --mem-limit gives the same output", spilled.returncode == 0 and
+            spilled.stdout == whole.stdout, spilled.stderr)
+    pairs = len(set(expected))
+    t.check("every (name, type) pair asked once per run", len(queries) == 2 * pairs and len(set(queries)) == pairs,
+            f"{len(queries)} queries, {len(set(queries))} unique of {pairs}")
+
+
+def elapsed_ms(args):
+    start = time.perf_counter()
+    res = run_dns(args)
+    return res, (time.perf_counter() - start) * 1000
+
+
+def test_timeouts(t: Tester, cert: str):
+    # Process start is included, the bounds leave room for it
+    res, ms = elapsed_ms(['--timeout', '50', '--tries', '2', '-s', DEAD_SERVER, 'host7.' + ZONE, '-p', str(PORT)])
+    t.check("dead server, 2 tries of 50 ms", res.returncode != 0 and 95 <= ms < 400, f"{ms:.0f} ms")
+
+    res, ms = elapsed_ms(['--timeout', '50', '--deadline', '30', '-s', DEAD_SERVER, 'host7.' + ZONE, '-p', str(PORT)])
+    t.check("dead server, deadline of 30 ms", res.returncode != 0 and 25 <= ms < 300, f"{ms:.0f} ms")
+
+    for transport in ('udp', 'tcp', 'tls'):
+        extra, port = transport_args(transport, cert)
+        res, ms = elapsed_ms(['--timeout', '50'] + extra + ['-s', f'{DEAD_SERVER},127.0.0.1',
+                                                           'host7.' + ZONE, '-p', str(port)])
+        t.check(f"{transport} failover to the second server", res.returncode == 0 and '10.0.0.7' in res.stdout,
+                res.stderr)
+
+    for transport in ('udp', 'tcp'):
+        extra, port = transport_args(transport, cert)
+        res = run_dns(['--timeout', '50', '--io-uring'] + extra + ['-s', f'{DEAD_SERVER},127.0.0.1',
+                                                                   'host7.' + ZONE, '-p', str(port)])
+        t.check(f"{transport} io_uring failover to the second server",
+                res.returncode == 0 and '10.0.0.7' in res.stdout, res.stderr)
+
+
+def test_forged(t: Tester):
+    # Another ID, source address, source port and question, then the real answer
+    proc = subprocess.Popen([sys.executable, RESPONDER, '--port', str(FORGED_PORT), '--size', '100', '--forge'],
+                            stdout=subprocess.PIPE, text=True)
+    proc.stdout.readline()
+    try:
+        for backend in ([], ['--io-uring']):
+            res = run_dns(backend + ['-s', '127.0.0.1', 'host7.' + ZONE, '-p', str(FORGED_PORT)])
+            t.check(f"forged datagrams dropped{' with io_uring' if backend else ''}", res.returncode == 0 and
+                    f'host7.{ZONE}., A, IN, 300, 10.0.0.7' in res.stdout and 'xost7' not in res.stdout and
+                    'Dropped 4 unmatched datagram(s) (format: 0, id: 1, source: 2, question: 1)' in res.stderr,
+                    res.stdout + res.stderr)
+    finally:
+        proc.terminate()
+        proc.wait()
+
+
+def test_adaptive(t: Tester, list_path: str, queries: int):
+    # 20 ms away and 2000 answers per second, the fixed window of 64 would get
+    # REFUSED for a third of the queries
+    proc = subprocess.Popen([sys.executable, RESPONDER, '--port', str(LIMITED_PORT), '--size', str(queries),
+                             '--delay', '20', '--rate', '2000'], stdout=subprocess.PIPE, text=True)
+    proc.stdout.readline()
+    try:
+        with tempfile.NamedTemporaryFile('w', suffix='.txt') as f:
+            with open(list_path) as names:
+                for _ in range(2000):
+                    f.write(names.readline())
+            f.flush()
+            res, ms = elapsed_ms(['-r', '--adaptive', '-s', '127.0.0.1', '-f', f.name, '-p', str(LIMITED_PORT)])
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    t.check("adaptive window, every query answered despite the rate limit",
+            res.returncode == 0 and 'Error' not in res.stdout, res.stdout[-500:] + res.stderr)
+    t.check("adaptive window summary", 'Window of 127.0.0.1' in res.stderr and 'refused' in res.stderr,
+            res.stderr)
+    print(f"  2000 queries in {ms:.0f} ms, {2000 / ms * 1000:.0f} queries/s against the limit of 2000/s")
+
+
+def test_transfer(t: Tester, cert: str, directory: str, queries: int):
+    # SOA, NS, TXT and the record of the version, then A, AAAA and MX of every host
+    zone_path = os.path.join(directory, 'zone.txt')
+    for transport in ('tcp', 'tls'):
+        extra, port = transport_args(transport, cert)
+        res, ms = elapsed_ms(['--axfr'] + extra + ['-s', '127.0.0.1', ZONE, '-p', str(port), '-o', zone_path])
+        with open(zone_path) as f:
+            lines = f.read().splitlines()
+        t.check(f"{transport} AXFR of {4 + 3 * queries} records", res.returncode == 0 and
+                len(lines) == 4 + 3 * queries and lines[0].startswith(ZONE + '. 300 IN SOA ') and
+                f'host{queries - 1}.{ZONE}. 300 IN MX 10 mail.{ZONE}.' in lines, res.stderr)
+        print(f"  {res.stderr.strip()} ({ms:.0f} ms with the process start)")
+
+    # Without --tcp the transfer still goes over TCP
+    res = run_dns(['--axfr', '-s', '127.0.0.1', ZONE, '-p', str(PORT)])
+    t.check("AXFR over TCP by default", res.returncode == 0 and len(res.stdout.splitlines()) == 4 + 3 * queries,
+            res.stderr)
+
+    res = run_dns(['--ixfr', '8', '-s', '127.0.0.1', ZONE, '-p', str(PORT)])
+    expected = [f'; {ZONE} changes from serial 8',
+                f'-{ZONE}. 300 IN SOA ns.{ZONE}. admin.{ZONE}. 8 3600 600 86400 300',
+                f'-v8.{ZONE}. 300 IN A 192.0.2.8',
+                f'+{ZONE}. 300 IN SOA ns.{ZONE}. admin.{ZONE}. 9 3600 600 86400 300',
+                f'+v9.{ZONE}. 300 IN A 192.0.2.9',
+                f'; {ZONE} changes from serial 9']
+    t.check("IXFR changes", res.returncode == 0 and res.stdout.splitlines()[:6] == expected and
+            len(res.stdout.splitlines()) == 10, res.stdout + res.stderr)
+
+    res = run_dns(['--ixfr', '10', '-s', '127.0.0.1', ZONE, '-p', str(PORT)])
+    t.check("IXFR up to date", res.returncode == 0 and res.stdout == '' and 'up to date' in res.stderr, res.stderr)
+
+    # The zone can not be written, the transfer must not report success
+    res = run_dns(['--axfr', '-s', '127.0.0.1', ZONE, '-p', str(PORT), '-o', '/dev/full'])
+    t.check("AXFR to a full disk", res.returncode != 0 and 'Writing the zone failed' in res.stderr and
+            'records' not in res.stderr, res.stderr)
+
+    res = run_dns(['--axfr', '-s', '127.0.0.1', 'other.test', '-p', str(PORT)])
+    t.check("AXFR of a zone the server does not have", res.returncode != 0 and 'Refused' in res.stderr,
+            res.stderr)
+
+
+def test_snapshot(t: Tester, directory: str):
+    # Hosts 1 to 4 and an MX, host2 twice in another spelling, all valid for 5 s
+    snap_path = os.path.join(directory, 'sweep.snap')
+    sweep_path = os.path.join(directory, 'sweep.txt')
+    with open(sweep_path, 'w') as f:
+        f.write(f"host1.{ZONE}\nhost2.{ZONE}\nhost3.{ZONE}\nHOST2.{ZONE}.\nhost4.{ZONE}\nhost3.{ZONE} MX\n")
+    sweep = ['-s', '127.0.0.1', '-f', sweep_path, '-p', str(SNAPSHOT_PORT), '--snapshot', snap_path]
+
+    def start(size: int):
+        proc = subprocess.Popen([sys.executable, RESPONDER, '--port', str(SNAPSHOT_PORT), '--size', str(size),
+                                 '--ttl', '5'], stdout=subprocess.PIPE, text=True)
+        proc.stdout.readline()
+        return proc
+
+    proc = start(10)
+    try:
+        res = run_dns(sweep)
+        t.check("snapshot first run reports every pair", res.returncode == 0 and
+                'Snapshot: 5 pairs, 5 asked again, 5 changed.' in res.stderr and res.stdout.count('Changed: ') == 5 and
+                f'  + host3.{ZONE}., MX, IN, 5, 10 mail.{ZONE}.' in res.stdout, res.stdout + res.stderr)
+
+        res = run_dns(sweep)
+        t.check("snapshot rerun within the TTL asks nothing", res.returncode == 0 and res.stdout == '' and
+                'Snapshot: 5 pairs, 0 asked again, 0 changed.' in res.stderr, res.stdout + res.stderr)
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    # host4 is gone from the zone, the other answers are the same
+    proc = start(4)
+    try:
+        time.sleep(5.1)
+        res = run_dns(sweep)
+        t.check("snapshot after the TTL prints only the changed pair", res.returncode == 0 and
+                'Snapshot: 5 pairs, 5 asked again, 1 changed.' in res.stderr and
+                res.stdout.splitlines() == [f'Changed: host4.{ZONE}., A',
+                                            '  + Error: Authoritative server: domain name does not exist.',
+                                            f'  - host4.{ZONE}., A, IN, 5, 10.0.0.4'], res.stdout + res.stderr)
+
+        # The new snapshot can not be written, the old one must stay as it was
+        with open(snap_path, 'rb') as f:
+            before = f.read()
+        os.mkdir(snap_path + '.tmp')
+        res = run_dns(sweep)
+        os.rmdir(snap_path + '.tmp')
+        with open(snap_path, 'rb') as f:
+            after = f.read()
+        t.check("failed snapshot run keeps the previous snapshot", res.returncode != 0 and before == after,
+                res.stdout + res.stderr)
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    # Partitions and dozens of sorted runs with few descriptors, the runs are
+    # merged early and the rerun finds every pair in the snapshot. Most of
+    # the names are not in the zone, their answers are the same every time.
+    n = 100000
+    many_path = os.path.join(directory, 'many.txt')
+    with open(many_path, 'w') as f:
+        for i in range(n):
+            f.write(f"host{i}.{ZONE}\n")
+    few_fds = lambda: resource.setrlimit(resource.RLIMIT_NOFILE, (20, resource.getrlimit(resource.RLIMIT_NOFILE)[1]))
+    big_snap = ['-s', '127.0.0.1', '-f', many_path, '-p', str(PORT), '--mem-limit', '1',
+                '--snapshot', os.path.join(directory, 'many.snap')]
+    first = run_dns(big_snap, few_fds)
+    res = run_dns(big_snap, few_fds)
+    t.check("snapshot with a small memory and open file limit", first.returncode == 0 and
+            f'Snapshot: {n} pairs, {n} asked again, {n} changed.' in first.stderr and res.returncode == 0 and
+            res.stdout == '' and f'Snapshot: {n} pairs, 0 asked again, 0 changed.' in res.stderr,
+            first.stderr + res.stderr)
+
+
+def test_dnssec(t: Tester, directory: str, queries: int):
+    anchor = os.path.join(directory, 'anchor.txt')
+    proc = subprocess.Popen([sys.executable, RESPONDER, '--port', str(SIGNED_PORT), '--size', str(queries),
+                             '--dnssec-anchor', anchor], stdout=subprocess.PIPE, text=True)
+    proc.stdout.readline()
+    try:
+        validate = ['--dnssec', '--trust-anchor', anchor]
+        for transport in ('udp', 'tcp'):
+            extra = ['--tcp'] if transport == 'tcp' else []
+            for name, what in ((f'host7.{ZONE}', 'ECDSA P-256'), (f'any.wild.{ZONE}', 'wildcard'),
+                               ('www.ed.test', 'Ed25519 with a SHA-384 DS'), ('www.nsec3.test', 'NSEC3 zone')):
+                res = run_dns(validate + extra + ['-s', '127.0.0.1', name, '-p', str(SIGNED_PORT)])
+                t.check(f"{transport} DNSSEC secure answer ({what})", res.returncode == 0 and
+                        'Authenticated: Yes' in res.stdout and f'{name}., RRSIG, IN' in res.stdout,
+                        res.stdout + res.stderr)
+
+            for name, addr, what in (('www.insecure.test', '192.0.2.80', 'NSEC'),
+                                     ('www.optout.nsec3.test', '192.0.2.81', 'NSEC3 opt-out')):
+                res = run_dns(validate + extra + ['-s', '127.0.0.1', name, '-p', str(SIGNED_PORT)])
+                t.check(f"{transport} DNSSEC insecure delegation ({what})", res.returncode == 0 and
+                        'Authenticated: No' in res.stdout and addr in res.stdout, res.stdout + res.stderr)
+
+            # The answer and the DNSKEY set of nsec3.test do not fit the UDP payload size
+            res = run_dns(validate + extra + ['-q', 'TXT', '-s', '127.0.0.1', f'big.{ZONE}', '-p', str(SIGNED_PORT)])
+            t.check(f"{transport} DNSSEC truncated answer asked again over TCP", res.returncode == 0 and
+                    'Truncated: No, Authenticated: Yes' in res.stdout and res.stdout.count(', TXT, IN, ') == 8,
+                    res.stdout + res.stderr)
+
+            # A missing DS set alone must not downgrade the zone to insecure
+            res = run_dns(validate + extra + ['-s', '127.0.0.1', 'www.unproven.test', '-p', str(SIGNED_PORT)])
+            t.check(f"{transport} DNSSEC unproven DS absence is bogus", res.returncode != 0 and
+                    'no NSEC or NSEC3 record' in res.stderr and '192.0.2.83' not in res.stdout,
+                    res.stdout + res.stderr)
+
+            for name, reason in (('www.bogus.test', 'does not verify'), ('www.expired.test', 'expired')):
+                res = run_dns(validate + extra + ['-s', '127.0.0.1', name, '-p', str(SIGNED_PORT)])
+                t.check(f"{transport} DNSSEC bogus answer ({reason})", res.returncode != 0 and
+                        'Name server failure' in res.stderr and reason in res.stderr and
+                        'Answer section' not in res.stdout, res.stdout + res.stderr)
+
+        # The keys of the zones are fetched once for the whole list
+        list_path = os.path.join(directory, 'signed.txt')
+        with open(list_path, 'w') as f:
+            for i in range(min(queries, 500)):
+                f.write(f"host{i}.{ZONE}\n")
+        res = run_dns(validate + ['-s', '127.0.0.1', '-f', list_path, '-p', str(SIGNED_PORT)])
+        t.check("DNSSEC domain list validated with one chain", res.returncode == 0 and
+                res.stdout.count('Authenticated: Yes') == min(queries, 500) and
+                'DNSSEC: %d secure, 0 insecure, 0 bogus; 2 zones, 3 chain queries' % min(queries, 500)
+                in res.stderr, res.stderr)
+
+        # The built-in root anchor does not match the key of the test root
+        res = run_dns(['--dnssec', '-s', '127.0.0.1', f'host7.{ZONE}', '-p', str(SIGNED_PORT)])
+        t.check("DNSSEC with the built-in root anchor", res.returncode != 0 and 'matches its DS' in res.stderr,
+                res.stderr)
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    res = run_dns(['--dnssec', '--trust-anchor', os.path.join(directory, 'missing.txt'),
+                   '-s', '127.0.0.1', f'host7.{ZONE}', '-p', str(SIGNED_PORT)])
+    t.check("DNSSEC with a missing trust anchor file", res.returncode != 0 and 'Trust anchor' in res.stderr,
+            res.stderr)
+    res = run_dns(['--dnssec', '--io-uring', '-s', '127.0.0.1', f'host7.{ZONE}', '-p', str(SIGNED_PORT)])
+    t.check("DNSSEC with io_uring rejected", res.returncode != 0 and '--dnssec' in res.stderr, res.stderr)
+
+
+def measure(cert: str, list_path: str, queries: int, runs: int):
+    print(f"\nCost of one query, {queries} unique queries, best of {runs} runs")
+    for transport in ('udp', 'tcp', 'tls'):
+        extra, port = transport_args(transport, cert)
+        best = None
+        for _ in range(runs):
+            start = time.perf_counter()
+            run_dns(['-r'] + extra + ['-s', '127.0.0.1', '-f', list_path, '-p', str(port)])
+            elapsed = time.perf_counter() - start
+            best = elapsed if best is None else min(best, elapsed)
+        print(f"  {transport}: {best * 1000:8.1f} ms total, {best / queries * 1e6:6.1f} us/query")
+
+    # The responder shares the machine, on one core the wall clock mostly measures it.
+    # CPU time of the dns process itself compares the backends, the
+    # io_uring one is expected on par with poll(), not faster.
+    print(f"\nCPU time of the client, {queries} unique queries, best of {runs} runs")
+    for transport in ('udp', 'tcp'):
+        extra, port = transport_args(transport, cert)
+        for backend in ([], ['--io-uring']):
+            best = None
+            for _ in range(runs):
+                before = resource.getrusage(resource.RUSAGE_CHILDREN)
+                run_dns(['-r'] + backend + extra + ['-s', '127.0.0.1', '-f', list_path, '-p', str(port)])
+                after = resource.getrusage(resource.RUSAGE_CHILDREN)
+                cpu = (after.ru_utime - before.ru_utime) + (after.ru_stime - before.ru_stime)
+                best = cpu if best is None else min(best, cpu)
+            name = 'io_uring' if backend else 'poll'
+            print(f"  {transport} {name:8}: {best * 1000:8.1f} ms, {best / queries * 1e6:6.2f} us/query, "
+                  f"{queries / best / 1000:6.0f}k queries/s of CPU")
+
+    # One process per query pays the program start and the whole connection setup every time
+    extra, port = transport_args('tls', cert)
+    n = 20
+    start = time.perf_counter()
+    for i in range(n):
+        run_dns(['-r'] + extra + ['-s', '127.0.0.1', f'host{i}.' + ZONE, '-p', str(port)])
+    elapsed = time.perf_counter() - start
+    print(f"  tls, new process and connection per query: {elapsed / n * 1e6:6.1f} us/query")
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-n", "--queries", type=int, default=5000, help="unique names in the domain list")
+    parser.add_argument("-r", "--runs", type=int, default=3, help="runs per transport when measuring")
+    parser.add_argument("--max-per-conn", type=int, default=0,
+                        help="responder closes stream connections after this many answers")
+    parser.add_argument("--no-bench", action='store_true', help="only check the answers")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as directory:
+        cert, key = make_certificate(directory)
+        list_path = os.path.join(directory, 'list.txt')
+        with open(list_path, 'w') as f:
+            for i in range(args.queries):
+                f.write(f"host{i}.{ZONE}\n")
+
+        responder = start_responder(cert, key, args.queries, args.max_per_conn)
+        try:
+            t = Tester()
+            test_answers(t, cert, list_path)
+            test_batch(t, directory)
+            test_timeouts(t, cert)
+            test_forged(t)
+            test_adaptive(t, list_path, args.queries)
+            test_transfer(t, cert, directory, args.queries)
+            test_snapshot(t, directory)
+            test_dnssec(t, directory, args.queries)
+            if not args.no_bench:
+                measure(cert, list_path, args.queries, args.runs)
+        finally:
+            responder.terminate()
+            responder.wait()
+
+    print(f"\nPassed: {t.passed}, failed: {t.failed}")
+    sys.exit(1 if t.failed else 0)
+
+
+if __name__ == "__main__":
+    main()